@@ -1,6 +1,15 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <wchar.h>
 #include <sys/time.h>
 #include <pthread.h>
 
@@ -8,6 +17,12 @@
 #include "threading.h"
 #include "logging.h"
 
+// bounds of the executable image, format strings in there are literals that
+// never go away. anything else (shared libraries, heap, stack) gets copied.
+// not resolved in shared libraries, where everything gets copied
+extern char __executable_start __attribute__((weak));
+extern char edata __attribute__((weak));
+
 namespace {
 
 // Serialize printing logs to prevent mangled output in multithread applications.
@@ -39,43 +54,790 @@ static const char* file_basename(const char* fpath) {
     return &fpath[idx];
 }
 
+static void append_vprintf(std::string* out, const char* fmt, va_list va) {
+    char buf[256];
+    va_list va2;
+    va_copy(va2, va);
+    int n = vsnprintf(buf, sizeof(buf), fmt, va2);
+    va_end(va2);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t) n < sizeof(buf)) {
+        out->append(buf, n);
+    } else {
+        size_t old_size = out->size();
+        out->resize(old_size + n + 1);
+        vsnprintf(&(*out)[old_size], n + 1, fmt, va);
+        out->resize(old_size + n);
+    }
+}
+
+static void append_printf(std::string* out, const char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    append_vprintf(out, fmt, va);
+    va_end(va);
+}
+
+// "I 2014-01-01 12:34:56.789012 file.cc:123 | "
+static void append_prefix(std::string* out, char severity, const struct timeval& tv, const char* file, int line) {
+    struct tm local_calendar;
+    time_t sec = tv.tv_sec;
+    localtime_r(&sec, &local_calendar);
+    char now_str[TIME_NOW_STR_SIZE];
+    strftime(now_str, sizeof(now_str), "%Y-%m-%d %H:%M:%S", &local_calendar);
+    const char* filebase = file_basename(file);
+    if (filebase != nullptr) {
+        append_printf(out, "%c %s.%06d %s:%d | ", severity, now_str, (int) tv.tv_usec, filebase, line);
+    } else {
+        append_printf(out, "%c %s.%06d | ", severity, now_str, (int) tv.tv_usec);
+    }
+}
+
+/**
+ * A printf conversion spec, from '%' to the conversion char. Length is one
+ * of 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't' and 'L'.
+ */
+struct fmt_spec {
+    const char* begin;
+    const char* end;
+    int n_stars;
+    int precision;      // -1 if none
+    bool star_precision; // precision is the last star
+    char length;
+    char conv;
+};
+
+// next spec starting from p, false if there is none
+static bool next_spec(const char* p, fmt_spec* spec) {
+    p = strchr(p, '%');
+    if (p == nullptr) {
+        return false;
+    }
+    spec->begin = p++;
+    spec->n_stars = 0;
+    spec->precision = -1;
+    spec->star_precision = false;
+    spec->length = 0;
+    while (*p != '\0' && strchr("-+ #0'", *p) != nullptr) {
+        p++;
+    }
+    for (int i = 0; i < 2; i++) {
+        // width, then precision
+        if (*p == '*') {
+            spec->n_stars++;
+            spec->star_precision = (i == 1);
+            p++;
+        } else {
+            int v = 0;
+            while (*p >= '0' && *p <= '9') {
+                v = v * 10 + (*p - '0');
+                p++;
+            }
+            if (i == 1) {
+                spec->precision = v;
+            }
+        }
+        if (i == 0 && *p == '.') {
+            p++;
+        } else {
+            break;
+        }
+    }
+    if (*p == 'h' || *p == 'l') {
+        spec->length = *p++;
+        if (*p == spec->length) {
+            spec->length = (*p == 'h') ? 'H' : 'q';
+            p++;
+        }
+    } else if (*p != '\0' && strchr("qjztL", *p) != nullptr) {
+        spec->length = *p++;
+    }
+    if (*p == '\0') {
+        return false;
+    }
+    spec->conv = *p++;
+    spec->end = p;
+    return true;
+}
+
+// conversions formatted right when logging, their result is kept as a string
+static bool is_eager(const fmt_spec& spec) {
+    return spec.conv == 'm' || (spec.length == 'l' && (spec.conv == 's' || spec.conv == 'c'));
+}
+
+/**
+ * Arguments are kept in the order of the format string, each 8 byte
+ * aligned: integers and pointers as 8 bytes, double as 8 bytes, long double
+ * as 16 bytes, strings as <u32 len> followed by the bytes and a '\0'.
+ */
+static void put_raw(std::string* out, const void* p, size_t n) {
+    out->append((const char *) p, n);
+    out->resize((out->size() + 7) & ~7);
+}
+
+static void put_i64(std::string* out, int64_t v) {
+    put_raw(out, &v, sizeof(v));
+}
+
+static void put_str(std::string* out, const char* s, size_t len) {
+    uint32_t n = len;
+    out->append((const char *) &n, sizeof(n));
+    out->append(s, len);
+    out->push_back('\0');
+    out->resize((out->size() + 7) & ~7);
+}
+
+static int64_t get_i64(const char** p) {
+    int64_t v;
+    memcpy(&v, *p, sizeof(v));
+    *p += sizeof(v);
+    return v;
+}
+
+static const char* get_str(const char** p, uint32_t* len) {
+    memcpy(len, *p, sizeof(*len));
+    const char* s = *p + sizeof(*len);
+    *p += (sizeof(*len) + *len + 1 + 7) & ~7;
+    return s;
+}
+
+static int64_t va_arg_signed(char length, va_list& va) {
+    switch (length) {
+    case 'l':
+        return va_arg(va, long);
+    case 'q':
+        return va_arg(va, long long);
+    case 'j':
+        return va_arg(va, intmax_t);
+    case 'z':
+        return va_arg(va, ssize_t);
+    case 't':
+        return va_arg(va, ptrdiff_t);
+    default:
+        return va_arg(va, int);
+    }
+}
+
+static int64_t va_arg_unsigned(char length, va_list& va) {
+    switch (length) {
+    case 'l':
+        return va_arg(va, unsigned long);
+    case 'q':
+        return va_arg(va, unsigned long long);
+    case 'j':
+        return va_arg(va, uintmax_t);
+    case 'z':
+        return va_arg(va, size_t);
+    case 't':
+        return va_arg(va, ptrdiff_t);
+    default:
+        return va_arg(va, unsigned int);
+    }
+}
+
+// copy arguments of fmt out of va
+static void encode_args(const char* fmt, va_list& va, int saved_errno, std::string* out) {
+    fmt_spec spec;
+    const char* p = fmt;
+    while (next_spec(p, &spec)) {
+        p = spec.end;
+        if (spec.conv == '%') {
+            continue;
+        }
+        int stars[2];
+        for (int i = 0; i < spec.n_stars; i++) {
+            stars[i] = va_arg(va, int);
+            put_i64(out, stars[i]);
+        }
+        if (is_eager(spec)) {
+            std::string spec_str(spec.begin, spec.end - spec.begin);
+            std::string formatted;
+            errno = saved_errno;
+            if (spec.conv == 'm') {
+                if (spec.n_stars == 0) {
+                    append_printf(&formatted, spec_str.c_str());
+                } else if (spec.n_stars == 1) {
+                    append_printf(&formatted, spec_str.c_str(), stars[0]);
+                } else {
+                    append_printf(&formatted, spec_str.c_str(), stars[0], stars[1]);
+                }
+            } else if (spec.conv == 's') {
+                const wchar_t* ws = va_arg(va, const wchar_t*);
+                if (spec.n_stars == 0) {
+                    append_printf(&formatted, spec_str.c_str(), ws);
+                } else if (spec.n_stars == 1) {
+                    append_printf(&formatted, spec_str.c_str(), stars[0], ws);
+                } else {
+                    append_printf(&formatted, spec_str.c_str(), stars[0], stars[1], ws);
+                }
+            } else {
+                wint_t wc = va_arg(va, wint_t);
+                if (spec.n_stars == 0) {
+                    append_printf(&formatted, spec_str.c_str(), wc);
+                } else if (spec.n_stars == 1) {
+                    append_printf(&formatted, spec_str.c_str(), stars[0], wc);
+                } else {
+                    append_printf(&formatted, spec_str.c_str(), stars[0], stars[1], wc);
+                }
+            }
+            put_str(out, formatted.data(), formatted.size());
+            continue;
+        }
+        switch (spec.conv) {
+        case 'd': case 'i': case 'c':
+            put_i64(out, va_arg_signed(spec.length, va));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            put_i64(out, va_arg_unsigned(spec.length, va));
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (spec.length == 'L') {
+                long double v = va_arg(va, long double);
+                put_raw(out, &v, sizeof(v));
+            } else {
+                double v = va_arg(va, double);
+                put_raw(out, &v, sizeof(v));
+            }
+            break;
+        case 's': {
+            const char* s = va_arg(va, const char*);
+            if (s == nullptr) {
+                s = "(null)";
+            }
+            // with a precision, s need not be '\0' terminated
+            int precision = spec.star_precision ? stars[spec.n_stars - 1] : spec.precision;
+            put_str(out, s, precision >= 0 ? strnlen(s, precision) : strlen(s));
+            break;
+        }
+        case 'p':
+            put_i64(out, (int64_t) va_arg(va, void*));
+            break;
+        case 'n':
+            // nothing gets written back
+            va_arg(va, void*);
+            break;
+        default:
+            // unknown conversion, printed as is
+            break;
+        }
+    }
+}
+
+template<class T>
+static void append_arg(std::string* out, const char* spec_str, int n_stars, const int* stars, T v) {
+    if (n_stars == 0) {
+        append_printf(out, spec_str, v);
+    } else if (n_stars == 1) {
+        append_printf(out, spec_str, stars[0], v);
+    } else {
+        append_printf(out, spec_str, stars[0], stars[1], v);
+    }
+}
+
+static void append_signed(std::string* out, const char* spec_str, int n_stars, const int* stars,
+                          char length, int64_t v) {
+    switch (length) {
+    case 'l':
+        append_arg(out, spec_str, n_stars, stars, (long) v);
+        break;
+    case 'q':
+        append_arg(out, spec_str, n_stars, stars, (long long) v);
+        break;
+    case 'j':
+        append_arg(out, spec_str, n_stars, stars, (intmax_t) v);
+        break;
+    case 'z':
+        append_arg(out, spec_str, n_stars, stars, (ssize_t) v);
+        break;
+    case 't':
+        append_arg(out, spec_str, n_stars, stars, (ptrdiff_t) v);
+        break;
+    default:
+        append_arg(out, spec_str, n_stars, stars, (int) v);
+    }
+}
+
+static void append_unsigned(std::string* out, const char* spec_str, int n_stars, const int* stars,
+                            char length, int64_t v) {
+    switch (length) {
+    case 'l':
+        append_arg(out, spec_str, n_stars, stars, (unsigned long) v);
+        break;
+    case 'q':
+        append_arg(out, spec_str, n_stars, stars, (unsigned long long) v);
+        break;
+    case 'j':
+        append_arg(out, spec_str, n_stars, stars, (uintmax_t) v);
+        break;
+    case 'z':
+        append_arg(out, spec_str, n_stars, stars, (size_t) v);
+        break;
+    case 't':
+        append_arg(out, spec_str, n_stars, stars, (ptrdiff_t) v);
+        break;
+    default:
+        append_arg(out, spec_str, n_stars, stars, (unsigned int) v);
+    }
+}
+
+// format fmt with arguments saved by encode_args()
+static void decode_args(const char* fmt, const char* args, std::string* out) {
+    fmt_spec spec;
+    const char* p = fmt;
+    while (next_spec(p, &spec)) {
+        out->append(p, spec.begin - p);
+        p = spec.end;
+        if (spec.conv == '%') {
+            out->push_back('%');
+            continue;
+        }
+        int stars[2];
+        for (int i = 0; i < spec.n_stars; i++) {
+            stars[i] = (int) get_i64(&args);
+        }
+        if (is_eager(spec)) {
+            uint32_t len;
+            const char* s = get_str(&args, &len);
+            out->append(s, len);
+            continue;
+        }
+        std::string spec_str(spec.begin, spec.end - spec.begin);
+        switch (spec.conv) {
+        case 'd': case 'i':
+            append_signed(out, spec_str.c_str(), spec.n_stars, stars, spec.length, get_i64(&args));
+            break;
+        case 'c':
+            append_arg(out, spec_str.c_str(), spec.n_stars, stars, (int) get_i64(&args));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            append_unsigned(out, spec_str.c_str(), spec.n_stars, stars, spec.length, get_i64(&args));
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (spec.length == 'L') {
+                long double v;
+                memcpy(&v, args, sizeof(v));
+                args += sizeof(v);
+                append_arg(out, spec_str.c_str(), spec.n_stars, stars, v);
+            } else {
+                double v;
+                memcpy(&v, args, sizeof(v));
+                args += sizeof(v);
+                append_arg(out, spec_str.c_str(), spec.n_stars, stars, v);
+            }
+            break;
+        case 's': {
+            uint32_t len;
+            const char* s = get_str(&args, &len);
+            append_arg(out, spec_str.c_str(), spec.n_stars, stars, s);
+            break;
+        }
+        case 'p':
+            append_arg(out, spec_str.c_str(), spec.n_stars, stars, (void *) get_i64(&args));
+            break;
+        case 'n':
+            break;
+        default:
+            out->append(spec_str);
+        }
+    }
+    out->append(p);
+}
+
+struct log_record {
+    uint32_t size;  // of the whole record, 8 byte aligned
+    char severity;  // 0 for padding at the end of the ring
+    bool fmt_copied;  // fmt follows the header, then the arguments
+    int32_t line;
+    const char* file;
+    const char* fmt;
+    struct timeval tv;
+};
+
+/**
+ * Single producer (the owning thread), single consumer (whoever holds
+ * drain_mutex) ring of log_records.
+ */
+struct log_ring {
+    char* buf;
+    uint64_t capacity;  // power of 2
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    volatile uint64_t dropped;
+    volatile bool orphaned;  // owning thread exited
+
+    bool in_log;  // guards against logging from a signal handler during a log
+    std::string scratch;
+
+    log_ring(size_t size): capacity(8), head(0), tail(0), dropped(0), orphaned(false), in_log(false) {
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        buf = new char[capacity];
+    }
+
+    ~log_ring() {
+        delete[] buf;
+    }
+
+    // false if it does not fit right now
+    bool push(const log_record& hdr, const std::string& body) {
+        uint64_t n = sizeof(hdr) + body.size();
+        uint64_t h = head;
+        uint64_t pos = h & (capacity - 1);
+        uint64_t to_end = capacity - pos;
+        uint64_t need = (to_end < n) ? to_end + n : n;
+        if (capacity - (h - tail) < need) {
+            return false;
+        }
+        if (to_end < n) {
+            log_record* pad = (log_record *) (buf + pos);
+            pad->size = to_end;
+            pad->severity = 0;
+            h += to_end;
+            pos = 0;
+        }
+        memcpy(buf + pos, &hdr, sizeof(hdr));
+        memcpy(buf + pos + sizeof(hdr), body.data(), body.size());
+        __sync_synchronize();
+        head = h + n;
+        return true;
+    }
+
+    uint64_t used() const {
+        return head - tail;
+    }
+};
+
+struct formatted_line {
+    struct timeval tv;
+    std::string text;
+
+    bool operator< (const formatted_line& o) const {
+        return tv.tv_sec < o.tv.tv_sec || (tv.tv_sec == o.tv.tv_sec && tv.tv_usec < o.tv.tv_usec);
+    }
+};
+
+static volatile bool g_async = true;
+static FILE* g_output = nullptr;  // nullptr for stdout
+static size_t g_buffer_size = 128 * 1024;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<log_ring*>* g_rings = nullptr;
+static uint64_t g_dropped_by_gone = 0;  // of freed rings, guarded by rings_mutex
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_dropped_reported = 0;  // guarded by drain_mutex
+
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static volatile bool g_flusher_running = false;
+static bool g_flusher_stopping = false;
+static bool g_shutdown = false;
+static pthread_t g_flusher_th;
+
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread log_ring* t_ring = nullptr;
+
+static void write_out(const std::string& s) {
+    Pthread_mutex_lock(&log_mutex);
+    FILE* fp = (g_output != nullptr) ? g_output : stdout;
+    fwrite(s.data(), 1, s.size(), fp);
+    fflush(fp);
+    Pthread_mutex_unlock(&log_mutex);
+}
+
+static uint64_t total_dropped() {
+    Pthread_mutex_lock(&rings_mutex);
+    uint64_t total = g_dropped_by_gone;
+    if (g_rings != nullptr) {
+        for (auto& r: *g_rings) {
+            total += r->dropped;
+        }
+    }
+    Pthread_mutex_unlock(&rings_mutex);
+    return total;
+}
+
+// format and write out everything in the rings
+static void drain() {
+    Pthread_mutex_lock(&drain_mutex);
+
+    std::vector<log_ring*> rings;
+    Pthread_mutex_lock(&rings_mutex);
+    if (g_rings != nullptr) {
+        rings = *g_rings;
+    }
+    Pthread_mutex_unlock(&rings_mutex);
+
+    std::vector<formatted_line> lines;
+    std::vector<log_ring*> gone;
+    for (auto& r: rings) {
+        // an orphaned ring gets nothing new once the flag is seen
+        bool orphaned = r->orphaned;
+        __sync_synchronize();
+        uint64_t h = r->head;
+        __sync_synchronize();
+        uint64_t t = r->tail;
+        while (t != h) {
+            const log_record* rec = (const log_record *) (r->buf + (t & (r->capacity - 1)));
+            if (rec->severity != 0) {
+                formatted_line fl;
+                fl.tv = rec->tv;
+                append_prefix(&fl.text, rec->severity, rec->tv, rec->file, rec->line);
+                const char* body = (const char *) (rec + 1);
+                const char* fmt = rec->fmt;
+                if (rec->fmt_copied) {
+                    uint32_t len;
+                    fmt = get_str(&body, &len);
+                }
+                decode_args(fmt, body, &fl.text);
+                fl.text.push_back('\n');
+                lines.push_back(fl);
+            }
+            t += rec->size;
+        }
+        __sync_synchronize();
+        r->tail = t;
+        if (orphaned) {
+            gone.push_back(r);
+        }
+    }
+
+    if (!gone.empty()) {
+        Pthread_mutex_lock(&rings_mutex);
+        for (auto& r: gone) {
+            g_rings->erase(std::find(g_rings->begin(), g_rings->end(), r));
+            g_dropped_by_gone += r->dropped;
+        }
+        Pthread_mutex_unlock(&rings_mutex);
+        for (auto& r: gone) {
+            delete r;
+        }
+    }
+
+    std::string out;
+    if (!lines.empty()) {
+        // each ring is in order already, lines of different threads get interleaved
+        std::stable_sort(lines.begin(), lines.end());
+        for (auto& fl: lines) {
+            out += fl.text;
+        }
+    }
+    uint64_t dropped = total_dropped();
+    if (dropped > g_dropped_reported) {
+        struct timeval tv;
+        gettimeofday(&tv, nullptr);
+        append_prefix(&out, 'W', tv, __FILE__, __LINE__);
+        append_printf(&out, "dropped %llu log lines, ring buffers were full\n",
+                      (unsigned long long) (dropped - g_dropped_reported));
+        g_dropped_reported = dropped;
+    }
+    if (!out.empty()) {
+        write_out(out);
+    }
+
+    Pthread_mutex_unlock(&drain_mutex);
+}
+
+static void* flusher_loop(void*) {
+    Pthread_mutex_lock(&flusher_mutex);
+    while (!g_flusher_stopping) {
+        Pthread_mutex_unlock(&flusher_mutex);
+        drain();
+        Pthread_mutex_lock(&flusher_mutex);
+        if (!g_flusher_stopping) {
+            struct timeval now;
+            gettimeofday(&now, nullptr);
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec;
+            deadline.tv_nsec = (now.tv_usec + 10 * 1000) * 1000;
+            if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &deadline);
+        }
+    }
+    Pthread_mutex_unlock(&flusher_mutex);
+    drain();
+    return nullptr;
+}
+
+static void stop_flusher() {
+    Pthread_mutex_lock(&flusher_mutex);
+    g_shutdown = true;
+    if (!g_flusher_running) {
+        Pthread_mutex_unlock(&flusher_mutex);
+        return;
+    }
+    g_flusher_stopping = true;
+    Pthread_cond_signal(&flusher_cond);
+    Pthread_mutex_unlock(&flusher_mutex);
+    Pthread_join(g_flusher_th, nullptr);
+    g_flusher_running = false;
+}
+
+static void after_fork_child() {
+    // only the forking thread is left, and its ring
+    pthread_mutex_init(&rings_mutex, nullptr);
+    pthread_mutex_init(&drain_mutex, nullptr);
+    pthread_mutex_init(&flusher_mutex, nullptr);
+    pthread_cond_init(&flusher_cond, nullptr);
+    if (g_rings != nullptr) {
+        for (auto& r: *g_rings) {
+            if (r != t_ring) {
+                r->orphaned = true;
+            }
+        }
+    }
+    g_flusher_running = false;
+    g_flusher_stopping = false;
+}
+
+// false if logs have to be written in place
+static bool start_flusher() {
+    Pthread_mutex_lock(&flusher_mutex);
+    if (!g_flusher_running && !g_shutdown) {
+        static bool registered = false;
+        if (!registered) {
+            atexit(stop_flusher);
+            pthread_atfork(nullptr, nullptr, after_fork_child);
+            registered = true;
+        }
+        g_flusher_stopping = false;
+        Pthread_create(&g_flusher_th, nullptr, flusher_loop, nullptr);
+        g_flusher_running = true;
+    }
+    bool running = g_flusher_running;
+    Pthread_mutex_unlock(&flusher_mutex);
+    return running;
+}
+
+static void orphan_ring(void* arg) {
+    log_ring* r = (log_ring *) arg;
+    __sync_synchronize();
+    r->orphaned = true;
+    t_ring = nullptr;
+}
+
+static void create_ring_key() {
+    verify(pthread_key_create(&ring_key, orphan_ring) == 0);
+}
+
+static log_ring* my_ring() {
+    if (t_ring == nullptr) {
+        pthread_once(&ring_key_once, create_ring_key);
+        log_ring* r = new log_ring(g_buffer_size);
+        Pthread_mutex_lock(&rings_mutex);
+        if (g_rings == nullptr) {
+            // never freed, threads may still log during exit
+            g_rings = new std::vector<log_ring*>;
+        }
+        g_rings->push_back(r);
+        Pthread_mutex_unlock(&rings_mutex);
+        pthread_setspecific(ring_key, r);
+        t_ring = r;
+    }
+    return t_ring;
+}
+
+// the old way, format and write right here
+static void log_in_place(char severity, const char* file, int line, const char* fmt, va_list va) {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    std::string out;
+    append_prefix(&out, severity, tv, file, line);
+    append_vprintf(&out, fmt, va);
+    out.push_back('\n');
+    write_out(out);
+}
+
+static bool fmt_is_literal(const char* fmt) {
+    return &__executable_start != nullptr && &edata != nullptr
+        && fmt >= &__executable_start && fmt < &edata;
+}
+
 } // namespace
 
 
 namespace base {
 
 Log::~Log() {
-    rep_->ref--;
-    if (rep_->ref == 0) {
-        if (rep_->buf != nullptr) {
-            (*this)("%s", rep_->buf->str().c_str());
-            delete rep_->buf;
+    if (rep_ != nullptr) {
+        rep_->ref--;
+        if (rep_->ref == 0) {
+            (*this)("%s", rep_->buf.str().c_str());
+            delete rep_;
         }
-        delete rep_;
     }
 }
 
 void Log::vlog(const char* fmt, va_list va) {
-    char severity = rep_->lm->severity();
-    const char* filebase = file_basename(rep_->file);
-    char now_str[TIME_NOW_STR_SIZE];
-    time_now_str(now_str);
-
-    pthread_mutex_lock(&log_mutex);
-    if (filebase != nullptr) {
-        printf("%c %s %s:%d | ", severity, now_str, filebase, rep_->line);
-    } else {
-        printf("%c %s | ", severity, now_str);
-    }
-    vprintf(fmt, va);
-    printf("\n");
-    pthread_mutex_unlock(&log_mutex);
+    int saved_errno = errno;
+    char severity = lm_->severity();
 
     if (severity == 'F') {
+        // whatever led to this comes first
+        if (pthread_mutex_trylock(&drain_mutex) == 0) {
+            Pthread_mutex_unlock(&drain_mutex);
+            drain();
+        }
+        log_in_place(severity, file_, line_, fmt, va);
+
         // print stack trace for fatal errors, and abort
         print_stack_trace();
         ::abort();
     }
+
+    log_ring* r = nullptr;
+    if (g_async && (g_flusher_running || start_flusher())) {
+        r = my_ring();
+    }
+    if (r == nullptr || r->in_log) {
+        errno = saved_errno;
+        log_in_place(severity, file_, line_, fmt, va);
+        errno = saved_errno;
+        return;
+    }
+    r->in_log = true;
+
+    log_record hdr;
+    hdr.severity = severity;
+    hdr.line = line_;
+    hdr.file = file_;
+    hdr.fmt = fmt;
+    hdr.fmt_copied = !fmt_is_literal(fmt);
+    gettimeofday(&hdr.tv, nullptr);
+
+    std::string& body = r->scratch;
+    body.clear();
+    if (hdr.fmt_copied) {
+        put_str(&body, fmt, strlen(fmt));
+    }
+    va_list va2;
+    va_copy(va2, va);
+    encode_args(fmt, va2, saved_errno, &body);
+    va_end(va2);
+    hdr.size = sizeof(hdr) + body.size();
+
+    if (hdr.size > r->capacity / 2) {
+        // would never fit
+        errno = saved_errno;
+        log_in_place(severity, file_, line_, fmt, va);
+    } else if (!r->push(hdr, body)) {
+        __sync_fetch_and_add(&r->dropped, 1);
+    } else if (r->used() > r->capacity / 2) {
+        Pthread_cond_signal(&flusher_cond);
+    }
+    if (body.capacity() > 64 * 1024) {
+        std::string().swap(body);
+    }
+
+    r->in_log = false;
+    errno = saved_errno;
 }
 
 void Log::debug(const char* fmt, ...) {
@@ -113,10 +875,35 @@ void Log::fatal(const char* fmt, ...) {
     va_end(va);
 }
 
+void Log::set_async(bool async) {
+    if (!async) {
+        flush();
+    }
+    g_async = async;
+}
+
+void Log::set_output(FILE* fp) {
+    flush();
+    Pthread_mutex_lock(&log_mutex);
+    g_output = fp;
+    Pthread_mutex_unlock(&log_mutex);
+}
+
+void Log::set_buffer_size(size_t size) {
+    g_buffer_size = size;
+}
+
+void Log::flush() {
+    drain();
+}
+
+uint64_t Log::dropped() {
+    return total_dropped();
+}
+
 LogManager LogManager_INFO('I', do_not_create_your_own());
 LogManager LogManager_WARN('W', do_not_create_your_own());
 LogManager LogManager_ERROR('E', do_not_create_your_own());
 LogManager LogManager_FATAL('F', do_not_create_your_own());
 
 } // namespace base
-
@@ -42,28 +42,37 @@ namespace base {
 
 class LogManager;
 
+/**
+ * Log lines are recorded, arguments and all, into a lock-free ring buffer of
+ * the logging thread, and formatted and written out by a background thread.
+ * A thread whose ring is full drops the line instead of waiting, see
+ * dropped(). Fatal logs, and lines logged from a signal handler in the middle
+ * of another log, are written right away.
+ *
+ * Logs still in rings are written out at exit(), but lost on a crash. Use
+ * set_async(false) to format and write each line in place, under a global
+ * lock, when debugging one.
+ */
 class Log {
     void operator= (const Log&) = delete;
 public:
-    Log(LogManager* lm, const char* file, int line, int verbosity) {
-        rep_ = new rep;
-        rep_->lm = lm;
-        rep_->file = file;
-        rep_->line = line;
-        rep_->verbosity = verbosity;
+    Log(LogManager* lm, const char* file, int line, int verbosity)
+        : lm_(lm), file_(file), line_(line), verbosity_(verbosity), rep_(nullptr) {
     }
 
-    Log(const Log& l): rep_(l.rep_) {
-        rep_->ref++;
+    Log(const Log& l): lm_(l.lm_), file_(l.file_), line_(l.line_), verbosity_(l.verbosity_), rep_(l.rep_) {
+        if (rep_ != nullptr) {
+            rep_->ref++;
+        }
     }
 
     ~Log();
 
     std::ostream* stream() {
-        if (rep_->buf == nullptr) {
-            rep_->buf = new std::ostringstream;
+        if (rep_ == nullptr) {
+            rep_ = new rep;
         }
-        return rep_->buf;
+        return &rep_->buf;
     }
 
     Log& operator() (const char* fmt, ...) {
@@ -81,21 +90,36 @@ public:
     static void error(const char* fmt, ...);
     static void fatal(const char* fmt, ...);
 
+    static void set_async(bool async);
+
+    // stdout by default
+    static void set_output(FILE* fp);
+
+    // ring buffer size of threads that log for the first time from now on
+    static void set_buffer_size(size_t size);
+
+    // write out everything logged so far
+    static void flush();
+
+    // number of lines dropped because of full ring buffers
+    static uint64_t dropped();
+
 private:
     void vlog(const char* fmt, va_list va);
 
+    // only for logs written to stream()
     struct rep {
         int ref;
-        LogManager* lm;
-        std::ostringstream* buf;
-        const char* file;
-        int line;
-        int verbosity;
+        std::ostringstream buf;
 
-        rep(): ref(1), lm(nullptr), buf(nullptr), file(nullptr), line(0), verbosity(0) {
+        rep(): ref(1) {
         }
     };
 
+    LogManager* lm_;
+    const char* file_;
+    int line_;
+    int verbosity_;
     rep* rep_;
 };
 
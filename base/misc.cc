@@ -45,6 +45,12 @@ void time_now_str(char* now) {
     now[26] = '\0';
 }
 
+double monotonic_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000.0 / 1000.0 / 1000.0;
+}
+
 int get_ncpu() {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
@@ -32,6 +32,9 @@ inline T clamp(const T& v, const T1& lower, const T2& upper) {
 #define TIME_NOW_STR_SIZE 27
 void time_now_str(char* now);
 
+// seconds since some fixed point in the past, only good for measuring intervals
+double monotonic_time();
+
 int get_ncpu();
 
 const char* get_exec_path();
@@ -1,4 +1,7 @@
 #include <functional>
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
 #include <sys/time.h>
 
 #include "misc.h"
@@ -27,6 +30,26 @@ void SpinLock::lock() {
     }
 }
 
+void* CacheAligned::operator new(size_t size) {
+    void* p;
+    if (posix_memalign(&p, 64, size) != 0) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* CacheAligned::operator new[](size_t size) {
+    return operator new(size);
+}
+
+void CacheAligned::operator delete(void* p) {
+    free(p);
+}
+
+void CacheAligned::operator delete[](void* p) {
+    free(p);
+}
+
 int CondVar::timed_wait(Mutex& m, double sec) {
     int full_sec = (int) sec;
     int nsec = int((sec - full_sec) * 1000 * 1000 * 1000);
@@ -55,10 +78,96 @@ void* ThreadPool::start_thread_pool(void* args) {
     return nullptr;
 }
 
-ThreadPool::ThreadPool(int n /* =... */): n_(n), should_stop_(false) {
+/**
+ * Like Queue, but jobs are taken from the highest priority lane first.
+ */
+class ThreadPool::JobQueue: public NoCopy {
+    std::deque<job_t*> lanes_[N_PRIORITIES];
+    pthread_cond_t not_empty_;
+    pthread_mutex_t m_;
+
+    bool pop_locked(job_t** job, bool steal) {
+        for (int i = 0; i < N_PRIORITIES; i++) {
+            if (!lanes_[i].empty()) {
+                // just don't steal other thread's death pill, otherwise they won't die
+                if (steal && lanes_[i].front() == nullptr) {
+                    return false;
+                }
+                *job = lanes_[i].front();
+                lanes_[i].pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    JobQueue() {
+        Pthread_mutex_init(&m_, nullptr);
+        Pthread_cond_init(&not_empty_, nullptr);
+    }
+
+    ~JobQueue() {
+        Pthread_cond_destroy(&not_empty_);
+        Pthread_mutex_destroy(&m_);
+    }
+
+    void push(job_t* job, int priority) {
+        Pthread_mutex_lock(&m_);
+        lanes_[priority].push_back(job);
+        Pthread_cond_signal(&not_empty_);
+        Pthread_mutex_unlock(&m_);
+    }
+
+    bool try_pop(job_t** job) {
+        Pthread_mutex_lock(&m_);
+        bool ret = pop_locked(job, false);
+        Pthread_mutex_unlock(&m_);
+        return ret;
+    }
+
+    bool try_pop_high(job_t** job) {
+        bool ret = false;
+        Pthread_mutex_lock(&m_);
+        if (!lanes_[PRIORITY_HIGH].empty()) {
+            *job = lanes_[PRIORITY_HIGH].front();
+            lanes_[PRIORITY_HIGH].pop_front();
+            ret = true;
+        }
+        Pthread_mutex_unlock(&m_);
+        return ret;
+    }
+
+    bool try_steal(job_t** job) {
+        Pthread_mutex_lock(&m_);
+        bool ret = pop_locked(job, true);
+        Pthread_mutex_unlock(&m_);
+        return ret;
+    }
+
+    job_t* pop() {
+        job_t* job = nullptr;
+        Pthread_mutex_lock(&m_);
+        while (!pop_locked(&job, false)) {
+            Pthread_cond_wait(&not_empty_, &m_);
+        }
+        Pthread_mutex_unlock(&m_);
+        return job;
+    }
+};
+
+ThreadPool::ThreadPool(int n /* =... */)
+        : n_(n), should_stop_(false), max_queued_(0), delay_target_(0.0), delay_interval_(0.1),
+          first_above_time_(0.0), overloaded_(false) {
     verify(n_ >= 0);
     th_ = new pthread_t[n_];
-    q_ = new Queue<function<void()>*> [n_];
+    q_ = new JobQueue[n_];
+    wait_stats_ = new wait_stats[n_];
+    for (int i = 0; i < n_; i++) {
+        wait_stats_[i].started = 0;
+        wait_stats_[i].total_wait = 0.0;
+        wait_stats_[i].max_wait = 0.0;
+    }
 
     for (int i = 0; i < n_; i++) {
         start_thread_pool_args* args = new start_thread_pool_args();
@@ -71,38 +180,134 @@ ThreadPool::ThreadPool(int n /* =... */): n_(n), should_stop_(false) {
 ThreadPool::~ThreadPool() {
     should_stop_ = true;
     for (int i = 0; i < n_; i++) {
-        q_[i].push(nullptr);  // death pill
+        q_[i].push(nullptr, N_PRIORITIES - 1);  // death pill, after all queued jobs
     }
     for (int i = 0; i < n_; i++) {
         Pthread_join(th_[i], nullptr);
     }
     // check if there's left over jobs
     for (int i = 0; i < n_; i++) {
-        function<void()>* job;
+        job_t* job;
         while (q_[i].try_pop(&job)) {
             if (job != nullptr) {
-                (*job)();
+                job->f();
+                delete job;
             }
         }
     }
     delete[] th_;
     delete[] q_;
+    delete[] wait_stats_;
 }
 
-int ThreadPool::run_async(const std::function<void()>& f, int queuing_channel) {
+int ThreadPool::run_async(const std::function<void()>& f, int queuing_channel /* =? */, int priority /* =? */) {
     if (should_stop_) {
         return EPERM;
     }
+    verify(priority >= 0 && priority < N_PRIORITIES);
+    if (priority != PRIORITY_HIGH) {
+        if (overloaded_) {
+            n_rejected_.next();
+            return EBUSY;
+        }
+        if (n_queued_[priority].next() >= max_queued_ && max_queued_ > 0) {
+            n_queued_[priority].next(-1);
+            n_rejected_.next();
+            return EBUSY;
+        }
+    } else {
+        n_queued_[priority].next();
+    }
     int queue_id;
     if (queuing_channel >= 0) {
         queue_id = queuing_channel % n_;
     } else {
         queue_id = round_robin_.next() % n_;
     }
-    q_[queue_id].push(new function<void()>(f));
+    job_t* job = new job_t;
+    job->f = f;
+    job->enqueue_time = monotonic_time();
+    job->priority = priority;
+    q_[queue_id].push(job, priority);
     return 0;
 }
 
+i64 ThreadPool::queued() const {
+    i64 n = 0;
+    for (int i = 0; i < N_PRIORITIES; i++) {
+        n += n_queued_[i].peek_next();
+    }
+    return n;
+}
+
+ThreadPool::QueueStats ThreadPool::stats() {
+    QueueStats st;
+    st.queued = queued();
+    st.started = 0;
+    st.rejected = n_rejected_.peek_next();
+    st.total_wait = 0.0;
+    st.max_wait = 0.0;
+    for (int i = 0; i < n_; i++) {
+        wait_stats_[i].l.lock();
+        st.started += wait_stats_[i].started;
+        st.total_wait += wait_stats_[i].total_wait;
+        st.max_wait = std::max(st.max_wait, wait_stats_[i].max_wait);
+        wait_stats_[i].max_wait = 0.0;
+        wait_stats_[i].l.unlock();
+    }
+    st.overloaded = overloaded_;
+    return st;
+}
+
+// own queue first, then others, in stealing order
+bool ThreadPool::try_pop_high(int id_in_pool, const int* steal_order, job_t** job) {
+    if (q_[id_in_pool].try_pop_high(job)) {
+        return true;
+    }
+    for (int i = 0; i < n_; i++) {
+        if (steal_order[i] != id_in_pool && q_[steal_order[i]].try_pop_high(job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::job_started(int id_in_pool, job_t* job) {
+    n_queued_[job->priority].next(-1);
+    double now = monotonic_time();
+    double wait = now - job->enqueue_time;
+
+    wait_stats* ws = &wait_stats_[id_in_pool];
+    ws->l.lock();
+    ws->started++;
+    ws->total_wait += wait;
+    if (wait > ws->max_wait) {
+        ws->max_wait = wait;
+    }
+    ws->l.unlock();
+
+    if (delay_target_ <= 0 || job->priority == PRIORITY_HIGH) {
+        return;
+    }
+    delay_l_.lock();
+    if (wait < delay_target_) {
+        first_above_time_ = 0.0;
+        overloaded_ = false;
+    } else if (first_above_time_ == 0.0) {
+        first_above_time_ = now + delay_interval_;
+    } else if (now >= first_above_time_) {
+        overloaded_ = true;
+    }
+    delay_l_.unlock();
+}
+
+void ThreadPool::clear_overloaded() {
+    delay_l_.lock();
+    first_above_time_ = 0.0;
+    overloaded_ = false;
+    delay_l_.unlock();
+}
+
 void ThreadPool::run_thread(int id_in_pool) {
     struct timespec sleep_req;
     const int min_sleep_nsec = 1000;  // 1us
@@ -130,12 +335,15 @@ void ThreadPool::run_thread(int id_in_pool) {
     // succeed: sleep - 1
     // failure: sleep + 10
     for (;;) {
-        function<void()>* job = nullptr;
+        job_t* job = nullptr;
 
         switch(stage) {
         case 0:
         case 2:
-            if (q_[id_in_pool].try_pop(&job)) {
+            if (n_queued_[PRIORITY_HIGH].peek_next() > 0 && try_pop_high(id_in_pool, steal_order, &job)) {
+                // high priority jobs go before anything else, whichever queue they are in
+                stage = 0;
+            } else if (q_[id_in_pool].try_pop(&job)) {
                 stage = 0;
             } else {
                 stage++;
@@ -148,8 +356,7 @@ void ThreadPool::run_thread(int id_in_pool) {
         case 3:
             for (int i = 0; i < n_; i++) {
                 if (steal_order[i] != id_in_pool) {
-                    // just don't steal other thread's death pill, otherwise they won't die
-                    if (q_[steal_order[i]].try_pop_but_ignore(&job, nullptr)) {
+                    if (q_[steal_order[i]].try_steal(&job)) {
                         stage = 0;
                         break;
                     }
@@ -160,6 +367,10 @@ void ThreadPool::run_thread(int id_in_pool) {
             }
             break;
         case 4:
+            // nothing left anywhere, so not overloaded any more
+            if (delay_target_ > 0) {
+                clear_overloaded();
+            }
             job = q_[id_in_pool].pop();
             stage = 0;
             break;
@@ -169,7 +380,8 @@ void ThreadPool::run_thread(int id_in_pool) {
             if (job == nullptr) {
                 break;
             }
-            (*job)();
+            job_started(id_in_pool, job);
+            job->f();
             delete job;
             sleep_req.tv_nsec = clamp(sleep_req.tv_nsec - 1000, min_sleep_nsec, max_sleep_nsec);
         } else {
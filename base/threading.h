@@ -42,6 +42,19 @@ private:
     volatile bool locked_ __attribute__((aligned (64)));
 };
 
+/**
+ * A SpinLock takes a cache line of its own, but plain new does not honor
+ * that alignment before C++17. Classes holding one and allocated with new
+ * inherit this to get cache line aligned memory.
+ */
+class CacheAligned {
+public:
+    static void* operator new(size_t size);
+    static void* operator new[](size_t size);
+    static void operator delete(void* p);
+    static void operator delete[](void* p);
+};
+
 class Mutex: public Lockable {
 public:
     Mutex() {
@@ -168,15 +181,80 @@ public:
     }
 };
 
-class ThreadPool: public RefCounted {
+/**
+ * Worker threads, each with its own job queue, stealing from others when idle.
+ *
+ * Admission control is off by default. With set_max_queued() or
+ * set_queue_delay_target(), run_async() turns down all but high priority jobs
+ * with EBUSY instead of letting the queues, and the time jobs spend in them, grow
+ * without bound.
+ */
+class ThreadPool: public RefCounted, public CacheAligned {
+public:
+    /**
+     * Workers take jobs of higher priority first. A worker done with its job
+     * takes a high priority job from any queue before going on with its own,
+     * and admission control never turns high priority jobs down. Meant for
+     * cheap but important work, like health checks, which should not wait
+     * behind bulk requests. Low priority is for bulk work that may wait.
+     */
+    enum {
+        PRIORITY_HIGH = 0,
+        PRIORITY_NORMAL = 1,
+        PRIORITY_LOW = 2,
+        N_PRIORITIES = 3
+    };
+
+    struct QueueStats {
+        i64 queued;             // jobs waiting to be run
+        i64 started;            // jobs taken by workers so far
+        i64 rejected;           // jobs turned down with EBUSY so far
+        double total_wait;      // seconds spent in queue by the started jobs
+        double max_wait;        // longest time in queue since last stats() call
+        bool overloaded;        // queue delay stayed above target, shedding
+    };
+
+private:
+    struct job_t {
+        std::function<void()> f;
+        double enqueue_time;
+        int priority;
+    };
+
+    // per worker lanes, one for each priority, defined in threading.cc
+    class JobQueue;
+
+    // updated by the worker only, so the lock is hardly ever contended
+    struct wait_stats: public CacheAligned {
+        SpinLock l;
+        i64 started;
+        double total_wait;
+        double max_wait;
+    };
+
     int n_;
     Counter round_robin_;
     pthread_t* th_;
-    Queue<std::function<void()>*>* q_;
+    JobQueue* q_;
     bool should_stop_;
 
+    i64 max_queued_;
+    Counter n_queued_[N_PRIORITIES];
+    Counter n_rejected_;
+    wait_stats* wait_stats_;
+
+    // CoDel state, see set_queue_delay_target()
+    double delay_target_;
+    double delay_interval_;
+    SpinLock delay_l_;
+    double first_above_time_;
+    volatile bool overloaded_;
+
     static void* start_thread_pool(void*);
     void run_thread(int id_in_pool);
+    bool try_pop_high(int id_in_pool, const int* steal_order, job_t** job);
+    void job_started(int id_in_pool, job_t* job);
+    void clear_overloaded();
 
 protected:
     ~ThreadPool();
@@ -184,8 +262,34 @@ protected:
 public:
     ThreadPool(int n = get_ncpu() * 2);
 
-    // return 0 when queuing ok, otherwise EPERM
-    int run_async(const std::function<void()>&, int queuing_channel = -1);
+    /**
+     * Turn down normal or low priority jobs once n jobs of the same priority
+     * are waiting. Set n to 0 for no limit (default).
+     */
+    void set_max_queued(i64 n) {
+        verify(n >= 0);
+        max_queued_ = n;
+    }
+
+    /**
+     * CoDel-style shedding: once jobs keep waiting longer than target seconds
+     * for a whole interval, turn down new ones but high priority, till a job gets
+     * through within target, or workers run out of jobs. Unlike a queue
+     * limit, this adapts to how long jobs actually take.
+     * Set target to 0 to disable (default).
+     */
+    void set_queue_delay_target(double target, double interval = 0.1) {
+        verify(target >= 0 && interval > 0);
+        delay_target_ = target;
+        delay_interval_ = interval;
+    }
+
+    // return 0 when queuing ok, EBUSY if turned down by admission control, otherwise EPERM
+    int run_async(const std::function<void()>&, int queuing_channel = -1, int priority = PRIORITY_NORMAL);
+
+    i64 queued() const;
+
+    QueueStats stats();
 };
 
 class RunLater: public RefCounted {
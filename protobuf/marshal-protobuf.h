@@ -1,25 +1,101 @@
 #pragma once
 
-#include <sstream>
 #include <string>
 #include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream.h>
 
 #include "rpc/marshal.h"
 
 namespace rpc {
 
+/**
+ * Lets protobuf parse the first n bytes of a Marshal right out of its
+ * chunks. Nothing is consumed, discard the bytes after parsing.
+ */
+class MarshalInputStream: public ::google::protobuf::io::ZeroCopyInputStream {
+    const chunk* chnk_;
+    size_t offset_;     // offset in current chunk's content
+    size_t left_;
+    int64_t byte_count_;
+
+public:
+
+    MarshalInputStream(const Marshal& m, size_t n)
+        : chnk_(m.head_), offset_(0), left_(n), byte_count_(0) {
+        verify(m.content_size() >= n);
+    }
+
+    bool Next(const void** data, int* size) {
+        while (left_ > 0 && chnk_ != nullptr) {
+            size_t avail = chnk_->content_size() - offset_;
+            if (avail == 0) {
+                chnk_ = chnk_->next;
+                offset_ = 0;
+                continue;
+            }
+            avail = std::min(avail, std::min(left_, (size_t) std::numeric_limits<int>::max()));
+            *data = chnk_->data->ptr + chnk_->read_idx + offset_;
+            *size = (int) avail;
+            offset_ += avail;
+            left_ -= avail;
+            byte_count_ += avail;
+            return true;
+        }
+        return false;
+    }
+
+    // only called right after Next(), so still within current chunk
+    void BackUp(int count) {
+        assert(count >= 0 && (size_t) count <= offset_);
+        offset_ -= count;
+        left_ += count;
+        byte_count_ -= count;
+    }
+
+    bool Skip(int count) {
+        const void* data;
+        int size;
+        while (count > 0) {
+            if (!Next(&data, &size)) {
+                return false;
+            }
+            if (size > count) {
+                BackUp(size - count);
+                size = count;
+            }
+            count -= size;
+        }
+        return true;
+    }
+
+    int64_t ByteCount() const {
+        return byte_count_;
+    }
+};
+
+// <v64 size> <serialized message>, same as a string holding the message
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const ::google::protobuf::Message& msg) {
-    std::ostringstream ostr;
-    msg.SerializeToOstream(&ostr);
-    m << ostr.str();
+    size_t size = msg.ByteSizeLong();
+    m << v64(size);
+    if (size > 0) {
+        char* p = m.append(size);
+        if (p != nullptr) {
+            msg.SerializeWithCachedSizesToArray((uint8_t *) p);
+        } else {
+            std::string str;
+            msg.SerializePartialToString(&str);
+            verify(m.write(str.data(), str.size()) == size);
+        }
+    }
     return m;
 }
 
 inline rpc::Marshal& operator >>(rpc::Marshal& m, ::google::protobuf::Message& msg) {
-    std::string str;
-    m >> str;
-    std::istringstream istr(str);
-    msg.ParseFromIstream(&istr);
+    v64 size;
+    m >> size;
+    MarshalInputStream istr(m, size.get());
+    msg.ParseFromBoundedZeroCopyStream(&istr, size.get());
+    verify(m.discard(size.get()) == (size_t) size.get());
     return m;
 }
 
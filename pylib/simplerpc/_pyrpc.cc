@@ -494,6 +494,32 @@ static PyObject* _pyrpc_marshal_read_str(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* _pyrpc_marshal_write_marshal(PyObject* self, PyObject* args) {
+    GILHelper gil_helper;
+    unsigned long u;
+    unsigned long u_src;
+    if (!PyArg_ParseTuple(args, "kk", &u, &u_src))
+        return nullptr;
+    Marshal* m = (Marshal *) u;
+    Marshal* m_src = (Marshal *) u_src;
+    if (!m_src->empty()) {
+        m->read_from_marshal(*m_src, m_src->content_size());
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* _pyrpc_marshal_discard(PyObject* self, PyObject* args) {
+    GILHelper gil_helper;
+    unsigned long u;
+    unsigned long n;
+    if (!PyArg_ParseTuple(args, "kk", &u, &n))
+        return nullptr;
+    Marshal* m = (Marshal *) u;
+    return Py_BuildValue("k", m->discard(n));
+}
+
+
 static PyObject* _pyrpc_future_wait(PyObject* self, PyObject* args) {
     GILHelper gil_helper;
 
@@ -600,6 +626,8 @@ static PyMethodDef _pyrpcMethods[] = {
     {"marshal_read_double", _pyrpc_marshal_read_double, METH_VARARGS, nullptr},
     {"marshal_write_str", _pyrpc_marshal_write_str, METH_VARARGS, nullptr},
     {"marshal_read_str", _pyrpc_marshal_read_str, METH_VARARGS, nullptr},
+    {"marshal_write_marshal", _pyrpc_marshal_write_marshal, METH_VARARGS, nullptr},
+    {"marshal_discard", _pyrpc_marshal_discard, METH_VARARGS, nullptr},
 
     {"future_wait", _pyrpc_future_wait, METH_VARARGS, nullptr},
     {"future_timedwait", _pyrpc_future_timedwait, METH_VARARGS, nullptr},
@@ -4,12 +4,12 @@ from simplerpc import _pyrpc
 class Marshal(object):
 
     # class variable
-    structs = {} # typename -> (ctor, [(field_name, field_type)])
+    structs = {} # typename -> (ctor, [(field_name, field_type)], versioned)
 
     @staticmethod
-    def reg_type(type, fields):
+    def reg_type(type, fields, versioned=False):
         ctor = collections.namedtuple(type, [field[0] for field in fields])
-        Marshal.structs[type] = ctor, fields
+        Marshal.structs[type] = ctor, fields, versioned
         return ctor
 
     def __init__(self, id=None, should_release=True):
@@ -74,6 +74,13 @@ class Marshal(object):
     def read_str(self):
         return _pyrpc.marshal_read_str(self.id)
 
+    # move all content of another Marshal object into this one
+    def write_marshal(self, m):
+        _pyrpc.marshal_write_marshal(self.id, m.id)
+
+    def discard(self, n):
+        return _pyrpc.marshal_discard(self.id, n)
+
     @staticmethod
     def template_split(type_str):
         splt = []
@@ -128,8 +135,17 @@ class Marshal(object):
                 self.write_obj(v, val_t)
         else:
             ty = Marshal.structs[obj_t][1]
-            for field in ty:
-                self.write_obj(getattr(o, field[0]), field[1])
+            if Marshal.structs[obj_t][2]:
+                # versioned: <v32 field_count> <v64 body_size> <field1> ... <fieldN>
+                body = Marshal()
+                for field in ty:
+                    body.write_obj(getattr(o, field[0]), field[1])
+                self.write_v32(len(ty))
+                self.write_v64(len(body))
+                self.write_marshal(body)
+            else:
+                for field in ty:
+                    self.write_obj(getattr(o, field[0]), field[1])
 
     # read list/dict/set, tuple will be read as list, pair will be read as tuple
     def read_obj(self, obj_t):
@@ -182,6 +198,41 @@ class Marshal(object):
         else:
             ty = Marshal.structs[obj_t][1]
             field_values = []
-            for field in ty:
-                field_values += self.read_obj(field[1]),
+            if Marshal.structs[obj_t][2]:
+                n_fields = self.read_v32()
+                body_size = self.read_v64()
+                size_before = len(self)
+                for field in ty:
+                    if len(field_values) < n_fields:
+                        field_values += self.read_obj(field[1]),
+                    else:
+                        # not sent by an older writer
+                        field_values += Marshal.default_obj(field[1]),
+                # skip trailing fields from a newer writer
+                self.discard(body_size - (size_before - len(self)))
+            else:
+                for field in ty:
+                    field_values += self.read_obj(field[1]),
             return Marshal.structs[obj_t][0](*field_values)
+
+    # default value of a type, same as what a default constructed C++ object holds
+    @staticmethod
+    def default_obj(obj_t):
+        if obj_t in ["rpc::i8", "i8", "rpc::i16", "i16", "rpc::i32", "i32", "rpc::i64", "i64", "rpc::v32", "v32", "rpc::v64", "v64"]:
+            return 0
+        elif obj_t == "double":
+            return 0.0
+        elif obj_t in ["std::string", "string"]:
+            return ""
+        elif obj_t.startswith("std::pair<"):
+            first_t, second_t = Marshal.template_split(obj_t[obj_t.index("<") + 1:-1])
+            return (Marshal.default_obj(first_t), Marshal.default_obj(second_t))
+        elif obj_t.startswith("std::map<") or obj_t.startswith("std::unordered_map<"):
+            return {}
+        elif obj_t.startswith("std::vector<") or obj_t.startswith("std::list<"):
+            return []
+        elif obj_t.startswith("std::set<") or obj_t.startswith("std::unordered_set<"):
+            return set()
+        else:
+            ty = Marshal.structs[obj_t][1]
+            return Marshal.structs[obj_t][0](*[Marshal.default_obj(field[1]) for field in ty])
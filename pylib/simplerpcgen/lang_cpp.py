@@ -1,12 +1,90 @@
+import re
+
 from simplerpcgen.misc import SourceFile
 
-def emit_struct(struct, f):
+def arena_type(t):
+    # containers deserialized into the request's arena, see rpc/arena.h
+    return re.sub(r"std::(string|vector|list|set|map|unordered_set|unordered_map)\b", r"rpc::arena_\1", t)
+
+def in_arg_type(func, in_arg):
+    if "arena" in func.attrs:
+        return arena_type(in_arg.type)
+    return in_arg.type
+
+# marshal size of types that never change, see rpc::marshal_fixed_size
+fixed_marshal_size = {
+    "rpc::i8": 1,
+    "rpc::i16": 2,
+    "rpc::i32": 4,
+    "rpc::i64": 8,
+    "double": 8,
+}
+
+def struct_fixed_size(struct, fixed_sizes):
+    if len(struct.fields) == 0:
+        return None
+    size = 0
+    for field in struct.fields:
+        if field.type not in fixed_sizes:
+            return None
+        size += fixed_sizes[field.type]
+    return size
+
+def emit_versioned_struct(struct, f):
+    f.writeln("// versioned, new fields may only be appended, see rpc::marshal_versioned()")
+    f.writeln("struct %s {" % struct.name)
+    with f.indent():
+        field_no = 1
+        for field in struct.fields:
+            f.writeln("%s %s; // field %d" % (field.type, field.name, field_no))
+            field_no += 1
+    f.writeln("};")
+    f.writeln()
+    fields = ", ".join(["o.%s" % field.name for field in struct.fields])
+    f.writeln("inline size_t marshal_size(const %s& o) {" % struct.name)
+    with f.indent():
+        f.writeln("return rpc::marshal_size_versioned(%s);" % fields)
+    f.writeln("}")
+    f.writeln()
+    f.writeln("inline rpc::Marshal& operator <<(rpc::Marshal& m, const %s& o) {" % struct.name)
+    with f.indent():
+        f.writeln("return rpc::marshal_versioned(m%s);" % "".join([", o.%s" % field.name for field in struct.fields]))
+    f.writeln("}")
+    f.writeln()
+    f.writeln("inline rpc::Marshal& operator >>(rpc::Marshal& m, %s& o) {" % struct.name)
+    with f.indent():
+        f.writeln("return rpc::unmarshal_versioned(m%s);" % "".join([", o.%s" % field.name for field in struct.fields]))
+    f.writeln("}")
+    f.writeln()
+
+def emit_struct(struct, f, fixed_sizes):
+    if struct.versioned:
+        emit_versioned_struct(struct, f)
+        return
     f.writeln("struct %s {" % struct.name)
     with f.indent():
         for field in struct.fields:
             f.writeln("%s %s;" % (field.type, field.name))
     f.writeln("};")
     f.writeln()
+    fixed_size = struct_fixed_size(struct, fixed_sizes)
+    if fixed_size != None:
+        fixed_sizes[struct.name] = fixed_size
+        f.writeln("inline constexpr size_t marshal_fixed_size(const %s*) {" % struct.name)
+        with f.indent():
+            f.writeln("return %d;" % fixed_size)
+        f.writeln("}")
+        f.writeln()
+        f.writeln("inline constexpr size_t marshal_size(const %s&) {" % struct.name)
+        with f.indent():
+            f.writeln("return %d;" % fixed_size)
+        f.writeln("}")
+    else:
+        f.writeln("inline size_t marshal_size(const %s& o) {" % struct.name)
+        with f.indent():
+            f.writeln("return rpc::marshal_size_of(%s);" % ", ".join(["o.%s" % field.name for field in struct.fields]))
+        f.writeln("}")
+    f.writeln()
     f.writeln("inline rpc::Marshal& operator <<(rpc::Marshal& m, const %s& o) {" % struct.name)
     with f.indent():
         for field in struct.fields:
@@ -22,6 +100,74 @@ def emit_struct(struct, f):
     f.writeln("}")
     f.writeln()
 
+def emit_stream_proxy(service, func, f, async_func_params, async_call_params, sync_out_params):
+    # open_xxx() starts the RPC, then read/write frames on the stream, and collect results with finish_xxx()
+    f.writeln("rpc::ClientStream* open_%s(%sconst rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {" % (func.name, ", ".join(async_func_params + [""])))
+    with f.indent():
+        f.writeln("rpc::Future* __fu__ = __cl__->begin_request(%sService::%s, __fu_attr__, rpc::marshal_size_of(%s));" % (service.name, func.name.upper(), ", ".join(async_call_params)))
+        f.writeln("rpc::ClientStream* __st__ = nullptr;")
+        f.writeln("if (__fu__ != nullptr) {")
+        with f.indent():
+            for param in async_call_params:
+                f.writeln("*__cl__ << %s;" % param)
+            f.writeln("__st__ = __cl__->open_stream(__fu__);")
+        f.writeln("}")
+        f.writeln("__cl__->end_request();")
+        f.writeln("return __st__;")
+    f.writeln("}")
+    finish_params = ["rpc::ClientStream* __st__"]
+    out_counter = 0
+    for out_arg in func.output:
+        finish_params += "%s* %s" % (out_arg.type, sync_out_params[out_counter]),
+        out_counter += 1
+    f.writeln("rpc::i32 finish_%s(%s) {" % (func.name, ", ".join(finish_params)))
+    with f.indent():
+        f.writeln("if (__st__ == nullptr) {")
+        with f.indent():
+            f.writeln("return ENOTCONN;")
+        f.writeln("}")
+        f.writeln("rpc::Future* __fu__ = __st__->finish();")
+        f.writeln("rpc::i32 __ret__ = __fu__->get_error_code();")
+        if len(sync_out_params) > 0:
+            f.writeln("if (__ret__ == 0) {")
+            with f.indent():
+                for param in sync_out_params:
+                    f.writeln("__fu__->get_reply() >> *%s;" % param)
+            f.writeln("}")
+        f.writeln("__st__->release();")
+        f.writeln("return __ret__;")
+    f.writeln("}")
+
+def emit_udp_call_proxy(service, func, f, async_func_params, async_call_params):
+    # udp function with a reply, falls back to tcp if the arguments do not fit in a datagram
+    f.writeln("rpc::Future* async_%s(%sconst rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) /* UDP */ {" % (func.name, ", ".join(async_func_params + [""])))
+    with f.indent():
+        f.writeln("size_t __args_size__ = rpc::marshal_size_of(%s);" % ", ".join(async_call_params))
+        f.writeln("rpc::Future* __fu__;")
+        f.writeln("if (rpc::Client::udp_call_fits(__args_size__)) {")
+        with f.indent():
+            f.writeln("__fu__ = __cl__->begin_udp_call(%sService::%s, __fu_attr__, __args_size__);" % (service.name, func.name.upper()))
+            if len(async_call_params) > 0:
+                f.writeln("if (__fu__ != nullptr) {")
+                with f.indent():
+                    for param in async_call_params:
+                        f.writeln("__cl__->udp_request() << %s;" % param)
+                f.writeln("}")
+            f.writeln("__cl__->end_udp_call();")
+        f.writeln("} else {")
+        with f.indent():
+            f.writeln("__fu__ = __cl__->begin_request(%sService::%s, __fu_attr__, __args_size__);" % (service.name, func.name.upper()))
+            if len(async_call_params) > 0:
+                f.writeln("if (__fu__ != nullptr) {")
+                with f.indent():
+                    for param in async_call_params:
+                        f.writeln("*__cl__ << %s;" % param)
+                f.writeln("}")
+            f.writeln("__cl__->end_request();")
+        f.writeln("}")
+        f.writeln("return __fu__;")
+    f.writeln("}")
+
 def emit_service_and_proxy(service, f, rpc_table):
     f.writeln("class %sService: public rpc::Service {" % service.name)
     f.writeln("public:")
@@ -40,10 +186,16 @@ def emit_service_and_proxy(service, f, rpc_table):
                 if "udp" in func.attrs and not udp_enabled:
                     f.writeln("svr->enable_udp();")
                     udp_enabled = True
+                if "high" in func.attrs:
+                    priority = ", rpc::ThreadPool::PRIORITY_HIGH"
+                elif "low" in func.attrs:
+                    priority = ", rpc::ThreadPool::PRIORITY_LOW"
+                else:
+                    priority = ""
                 if "raw" in func.attrs:
-                    f.writeln("if ((ret = svr->reg(%s, this, &%sService::%s)) != 0) {" % (func.name.upper(), service.name, func.name))
+                    f.writeln("if ((ret = svr->reg(%s, this, &%sService::%s%s)) != 0) {" % (func.name.upper(), service.name, func.name, priority))
                 else:
-                    f.writeln("if ((ret = svr->reg(%s, this, &%sService::__%s__wrapper__)) != 0) {" % (func.name.upper(), service.name, func.name))
+                    f.writeln("if ((ret = svr->reg(%s, this, &%sService::__%s__wrapper__%s)) != 0) {" % (func.name.upper(), service.name, func.name, priority))
                 with f.indent():
                     f.writeln("goto err;")
                 f.writeln("}")
@@ -55,7 +207,7 @@ def emit_service_and_proxy(service, f, rpc_table):
             f.writeln("return ret;")
         f.writeln("}")
         f.writeln("// these RPC handler functions need to be implemented by user")
-        f.writeln("// for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job")
+        f.writeln("// for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails")
         for func in service.functions:
             if service.abstract or func.abstract:
                 postfix = " = 0"
@@ -67,9 +219,9 @@ def emit_service_and_proxy(service, f, rpc_table):
                 func_args = []
                 for in_arg in func.input:
                     if in_arg.name != None:
-                        func_args += "const %s& %s" % (in_arg.type, in_arg.name),
+                        func_args += "const %s& %s" % (in_arg_type(func, in_arg), in_arg.name),
                     else:
-                        func_args += "const %s&" % in_arg.type,
+                        func_args += "const %s&" % in_arg_type(func, in_arg),
                 for out_arg in func.output:
                     if out_arg.name != None:
                         func_args += "%s* %s" % (out_arg.type, out_arg.name),
@@ -77,6 +229,8 @@ def emit_service_and_proxy(service, f, rpc_table):
                         func_args += "%s*" % out_arg.type,
                 if "defer" in func.attrs:
                     func_args += "rpc::DeferredReply* defer",
+                if "stream" in func.attrs:
+                    func_args += "rpc::ServerStream* stream",
                 f.writeln("virtual void %s(%s)%s;" % (func.name, ", ".join(func_args), postfix))
     f.writeln("private:")
     with f.indent():
@@ -89,13 +243,21 @@ def emit_service_and_proxy(service, f, rpc_table):
                     invoke_with = []
                     in_counter = 0
                     out_counter = 0
+                    if "arena" in func.attrs:
+                        f.writeln("rpc::ArenaScope __arena__(&req->arena);")
                     for in_arg in func.input:
-                        f.writeln("%s* in_%d = new %s;" % (in_arg.type, in_counter, in_arg.type))
+                        if "arena" in func.attrs:
+                            f.writeln("%s* in_%d = req->arena.create<%s>();" % (in_arg_type(func, in_arg), in_counter, in_arg_type(func, in_arg)))
+                        else:
+                            f.writeln("%s* in_%d = new %s;" % (in_arg.type, in_counter, in_arg.type))
                         f.writeln("req->m >> *in_%d;" % in_counter)
                         invoke_with += "*in_%d" % in_counter,
                         in_counter += 1
                     for out_arg in func.output:
-                        f.writeln("%s* out_%d = new %s;" % (out_arg.type, out_counter, out_arg.type))
+                        if "arena" in func.attrs:
+                            f.writeln("%s* out_%d = req->arena.create<%s>();" % (out_arg.type, out_counter, out_arg.type))
+                        else:
+                            f.writeln("%s* out_%d = new %s;" % (out_arg.type, out_counter, out_arg.type))
                         invoke_with += "out_%d" % out_counter,
                         out_counter += 1
                     f.writeln("auto __marshal_reply__ = [=] {");
@@ -109,25 +271,50 @@ def emit_service_and_proxy(service, f, rpc_table):
                     with f.indent():
                         in_counter = 0
                         out_counter = 0
+                        if "arena" in func.attrs:
+                            # memory goes away with req->arena, only run destructors
+                            release = "rpc::Arena::destroy(%s);"
+                        else:
+                            release = "delete %s;"
                         for in_arg in func.input:
-                            f.writeln("delete in_%d;" % in_counter)
+                            f.writeln(release % ("in_%d" % in_counter))
                             in_counter += 1
                         for out_arg in func.output:
-                            f.writeln("delete out_%d;" % out_counter)
+                            f.writeln(release % ("out_%d" % out_counter))
                             out_counter += 1
                     f.writeln("};");
                     f.writeln("rpc::DeferredReply* __defer__ = new rpc::DeferredReply(req, sconn, __marshal_reply__, __cleanup__);")
                     invoke_with += "__defer__",
                     f.writeln("this->%s(%s);" % (func.name, ", ".join(invoke_with)))
                 else: # normal and fast rpc
+                    if "stream" in func.attrs:
+                        # opened in poll thread, so frames right after the request are not missed
+                        f.writeln("rpc::ServerStream* __stream__ = sconn->open_stream(req->xid);")
+                        f.writeln("if (__stream__ == nullptr) {")
+                        with f.indent():
+                            f.writeln("sconn->begin_reply(req, EINVAL);")
+                            f.writeln("sconn->end_reply();")
+                            f.writeln("delete req;")
+                            f.writeln("sconn->release();")
+                            f.writeln("return;")
+                        f.writeln("}")
                     if "fast" not in func.attrs:
                         f.writeln("auto f = [=] {")
                         f.incr_indent()
+                        # end of queue wait
+                        f.writeln("req->start_time = base::monotonic_time();")
+                        # outgoing calls of the handler join the trace of req
+                        f.writeln("rpc::TraceScope __trace__(req->trace);")
+                    if "arena" in func.attrs:
+                        # arguments must be destroyed before req (and its arena) is deleted
+                        f.writeln("{")
+                        f.incr_indent()
+                        f.writeln("rpc::ArenaScope __arena__(&req->arena);")
                     invoke_with = []
                     in_counter = 0
                     out_counter = 0
                     for in_arg in func.input:
-                        f.writeln("%s in_%d;" % (in_arg.type, in_counter))
+                        f.writeln("%s in_%d;" % (in_arg_type(func, in_arg), in_counter))
                         f.writeln("req->m >> in_%d;" % in_counter)
                         invoke_with += "in_%d" % in_counter,
                         in_counter += 1
@@ -135,18 +322,39 @@ def emit_service_and_proxy(service, f, rpc_table):
                         f.writeln("%s out_%d;" % (out_arg.type, out_counter))
                         invoke_with += "&out_%d" % out_counter,
                         out_counter += 1
+                    if "stream" in func.attrs:
+                        invoke_with += "__stream__",
                     f.writeln("this->%s(%s);" % (func.name, ", ".join(invoke_with)))
-                    if "udp" not in func.attrs:
-                        f.writeln("sconn->begin_reply(req);")
+                    if "stream" in func.attrs:
+                        f.writeln("sconn->close_stream(__stream__);")
+                        f.writeln("__stream__->release();")
+                    # one-way udp functions have no reply
+                    if "udp" not in func.attrs or len(func.output) > 0:
+                        f.writeln("sconn->begin_reply(req, 0, rpc::marshal_size_of(%s));" % ", ".join(["out_%d" % i for i in range(out_counter)]))
                         for i in range(out_counter):
                             f.writeln("*sconn << out_%d;" % i)
                         f.writeln("sconn->end_reply();")
+                    if "arena" in func.attrs:
+                        f.decr_indent()
+                        f.writeln("}")
                     f.writeln("delete req;")
                     f.writeln("sconn->release();")
                     if "fast" not in func.attrs:
                         f.decr_indent()
                         f.writeln("};")
-                        f.writeln("sconn->run_async(f);")
+                        f.writeln("int __ret__ = sconn->run_async(f, -1, req->priority);")
+                        f.writeln("if (__ret__ != 0) {")
+                        with f.indent():
+                            # turned down by admission control, f never runs
+                            if "stream" in func.attrs:
+                                f.writeln("sconn->close_stream(__stream__);")
+                                f.writeln("__stream__->release();")
+                            if "udp" not in func.attrs or len(func.output) > 0:
+                                f.writeln("sconn->begin_reply(req, __ret__);")
+                                f.writeln("sconn->end_reply();")
+                            f.writeln("delete req;")
+                            f.writeln("sconn->release();")
+                        f.writeln("}")
             f.writeln("}")
     f.writeln("};")
     f.writeln()
@@ -183,28 +391,35 @@ def emit_service_and_proxy(service, f, rpc_table):
                     sync_out_params += "out_%d" % out_counter,
                 out_counter += 1
 
-            if "udp" in func.attrs:
+            if "udp" in func.attrs and len(func.output) == 0:
                 f.writeln("int %s(%s) /* UDP */ {" % (func.name, ", ".join(sync_func_params)))
                 with f.indent():
-                    f.writeln("__cl__->begin_udp_request(%sService::%s);" % (service.name, func.name.upper()))
+                    f.writeln("__cl__->begin_udp_request(%sService::%s, rpc::marshal_size_of(%s));" % (service.name, func.name.upper(), ", ".join(async_call_params)))
                     for param in async_call_params:
                         f.writeln("__cl__->udp_request() << %s;" % param)
                     f.writeln("return __cl__->end_udp_request();")
                 f.writeln("}")
                 continue
 
-            f.writeln("rpc::Future* async_%s(%sconst rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {" % (func.name, ", ".join(async_func_params + [""])))
-            with f.indent():
-                f.writeln("rpc::Future* __fu__ = __cl__->begin_request(%sService::%s, __fu_attr__);" % (service.name, func.name.upper()))
-                if len(async_call_params) > 0:
-                    f.writeln("if (__fu__ != nullptr) {")
-                    with f.indent():
-                        for param in async_call_params:
-                            f.writeln("*__cl__ << %s;" % param)
-                    f.writeln("}")
-                f.writeln("__cl__->end_request();")
-                f.writeln("return __fu__;")
-            f.writeln("}")
+            if "stream" in func.attrs:
+                emit_stream_proxy(service, func, f, async_func_params, async_call_params, sync_out_params)
+                continue
+
+            if "udp" in func.attrs:
+                emit_udp_call_proxy(service, func, f, async_func_params, async_call_params)
+            else:
+                f.writeln("rpc::Future* async_%s(%sconst rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {" % (func.name, ", ".join(async_func_params + [""])))
+                with f.indent():
+                    f.writeln("rpc::Future* __fu__ = __cl__->begin_request(%sService::%s, __fu_attr__, rpc::marshal_size_of(%s));" % (service.name, func.name.upper(), ", ".join(async_call_params)))
+                    if len(async_call_params) > 0:
+                        f.writeln("if (__fu__ != nullptr) {")
+                        with f.indent():
+                            for param in async_call_params:
+                                f.writeln("*__cl__ << %s;" % param)
+                        f.writeln("}")
+                    f.writeln("__cl__->end_request();")
+                    f.writeln("return __fu__;")
+                f.writeln("}")
             f.writeln("rpc::i32 %s(%s) {" % (func.name, ", ".join(sync_func_params)))
             with f.indent():
                 f.writeln("rpc::Future* __fu__ = this->async_%s(%s);" % (func.name, ", ".join(async_call_params)))
@@ -243,8 +458,9 @@ def emit_rpc_source_cpp(rpc_source, rpc_table, fpath, cpp_header, cpp_footer):
             f.writeln(" ".join(map(lambda x:"namespace %s {" % x, rpc_source.namespace)))
             f.writeln()
 
+        fixed_sizes = dict(fixed_marshal_size)
         for struct in rpc_source.structs:
-            emit_struct(struct, f)
+            emit_struct(struct, f, fixed_sizes)
 
         for service in rpc_source.services:
             emit_service_and_proxy(service, f, rpc_table)
@@ -1,8 +1,12 @@
 from simplerpcgen.misc import SourceFile
 
 def emit_struct_python(struct, f):
-    f.writeln("%s = Marshal.reg_type('%s', [%s])" % (
-        struct.name, struct.name, ", ".join(["('%s', '%s')" % (field.name, field.type) for field in struct.fields])))
+    if struct.versioned:
+        versioned = ", versioned=True"
+    else:
+        versioned = ""
+    f.writeln("%s = Marshal.reg_type('%s', [%s]%s)" % (
+        struct.name, struct.name, ", ".join(["('%s', '%s')" % (field.name, field.type) for field in struct.fields]), versioned))
     f.writeln()
 
 
@@ -36,6 +40,9 @@ def emit_service_and_proxy_python(service, f, rpc_table):
         with f.indent():
             udp_enabled = False
             for func in service.functions:
+                if "stream" in func.attrs:
+                    # streams are only supported by C++ code
+                    continue
                 if "udp" in func.attrs and not udp_enabled:
                     f.writeln("server.enable_udp()")
                     udp_enabled = True
@@ -46,6 +53,8 @@ def emit_service_and_proxy_python(service, f, rpc_table):
             if len(service.functions) == 0:
                 f.writeln("pass")
         for func in service.functions:
+            if "stream" in func.attrs:
+                continue
             f.writeln()
             in_params_decl = ""
             for i in range(len(func.input)):
@@ -66,7 +75,8 @@ def emit_service_and_proxy_python(service, f, rpc_table):
             f.writeln("self.__clnt__ = clnt")
 
         for func in service.functions:
-            if "udp" in func.attrs:
+            # udp functions with a reply go over tcp, python clients do not retransmit
+            if ("udp" in func.attrs and len(func.output) == 0) or "stream" in func.attrs:
                 continue
             f.writeln()
             in_params_decl = ""
@@ -85,7 +95,8 @@ def emit_service_and_proxy_python(service, f, rpc_table):
                     service.name, func.name.upper(), in_params_decl, service.name, func.name, service.name, func.name))
 
         for func in service.functions:
-            if "udp" in func.attrs:
+            # udp functions with a reply go over tcp, python clients do not retransmit
+            if ("udp" in func.attrs and len(func.output) == 0) or "stream" in func.attrs:
                 continue
             f.writeln()
             in_params_decl = ""
@@ -113,7 +124,7 @@ def emit_service_and_proxy_python(service, f, rpc_table):
                     f.writeln("return __result__[1]")
 
         for func in service.functions:
-            if "udp" not in func.attrs:
+            if "udp" not in func.attrs or len(func.output) > 0:
                 continue
             f.writeln()
             in_params_decl = ""
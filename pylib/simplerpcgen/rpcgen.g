@@ -30,15 +30,19 @@ def forbid_reserved_names(name):
 
 def check_rpc_func(attrs, output):
     if ("defer" in attrs) and ("udp" in attrs):
-        raise Exception("udp functions does not have return value, cannot provide deferred return values")
+        raise Exception("udp functions cannot provide deferred return values")
     if ("raw" in attrs) and ("defer" in attrs):
         raise Exception("cannot generate deferred return code stub for raw RPC handler")
     if ("raw" in attrs) and ("fast" in attrs):
         raise Exception("cannot generate fast RPC code stub for raw RPC handler")
     if ("fast" in attrs) and ("defer" in attrs):
         raise Exception("cannot mark an RPC as both doing fast return and deferred return")
-    if ("udp" in attrs) and len(output) > 0:
-        raise Exception("udp RPC handler cannot have return value")
+    if ("raw" in attrs) and ("arena" in attrs):
+        raise Exception("raw RPC handler deserializes by itself, cannot use arena")
+    if ("stream" in attrs) and len(set(["raw", "fast", "defer", "udp"]) & attrs) > 0:
+        raise Exception("stream RPC handler blocks on the stream, cannot be raw, fast, defer or udp")
+    if ("high" in attrs) and ("low" in attrs):
+        raise Exception("cannot mark an RPC as both high and low priority")
 
 %%
 
@@ -63,9 +67,9 @@ parser Rpc:
         (struct_decl {{ structs += struct_decl, }} | service_decl {{ services += service_decl, }})*
             {{ return pack(structs=structs, services=services) }}
 
-    rule struct_decl:
-        "struct" SYMBOL "{" struct_fields "}"
-            {{ return pack(name=SYMBOL, fields=struct_fields) }}
+    rule struct_decl: {{ versioned = False }}
+        "struct" SYMBOL ["\[" "versioned" "\]" {{ versioned = True }}] "{" struct_fields "}"
+            {{ return pack(name=SYMBOL, versioned=versioned, fields=struct_fields) }}
 
     rule struct_fields: {{ fields = [] }}
         (struct_field {{ fields += struct_field, }})*
@@ -114,6 +118,10 @@ parser Rpc:
         | "raw" {{ return "raw" }}
         | "defer" {{ return "defer" }}
         | "udp" {{ return "udp" }}
+        | "arena" {{ return "arena" }}
+        | "stream" {{ return "stream" }}
+        | "high" {{ return "high" }}
+        | "low" {{ return "low" }}
 
     rule func_arg_list: {{ args = [] }}
         (| func_arg {{ args = [func_arg] }} ("," func_arg {{ args += func_arg, }})*)
@@ -30,15 +30,19 @@ def forbid_reserved_names(name):
 
 def check_rpc_func(attrs, output):
     if ("defer" in attrs) and ("udp" in attrs):
-        raise Exception("udp functions does not have return value, cannot provide deferred return values")
+        raise Exception("udp functions cannot provide deferred return values")
     if ("raw" in attrs) and ("defer" in attrs):
         raise Exception("cannot generate deferred return code stub for raw RPC handler")
     if ("raw" in attrs) and ("fast" in attrs):
         raise Exception("cannot generate fast RPC code stub for raw RPC handler")
     if ("fast" in attrs) and ("defer" in attrs):
         raise Exception("cannot mark an RPC as both doing fast return and deferred return")
-    if ("udp" in attrs) and len(output) > 0:
-        raise Exception("udp RPC handler cannot have return value")
+    if ("raw" in attrs) and ("arena" in attrs):
+        raise Exception("raw RPC handler deserializes by itself, cannot use arena")
+    if ("stream" in attrs) and len(set(["raw", "fast", "defer", "udp"]) & attrs) > 0:
+        raise Exception("stream RPC handler blocks on the stream, cannot be raw, fast, defer or udp")
+    if ("high" in attrs) and ("low" in attrs):
+        raise Exception("cannot mark an RPC as both high and low priority")
 
 
 # Begin -- grammar generated by Yapps
@@ -47,6 +51,10 @@ from yapps import runtime
 
 class RpcScanner(runtime.Scanner):
     patterns = [
+        ('"low"', re.compile('low')),
+        ('"high"', re.compile('high')),
+        ('"stream"', re.compile('stream')),
+        ('"arena"', re.compile('arena')),
         ('"udp"', re.compile('udp')),
         ('"defer"', re.compile('defer')),
         ('"raw"', re.compile('raw')),
@@ -73,6 +81,9 @@ class RpcScanner(runtime.Scanner):
         ('"i8"', re.compile('i8')),
         ('"}"', re.compile('}')),
         ('"{"', re.compile('{')),
+        ('"\\]"', re.compile('\\]')),
+        ('"versioned"', re.compile('versioned')),
+        ('"\\["', re.compile('\\[')),
         ('"struct"', re.compile('struct')),
         ('"::"', re.compile('::')),
         ('"namespace"', re.compile('namespace')),
@@ -123,12 +134,18 @@ class Rpc(runtime.Parser):
 
     def struct_decl(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'struct_decl', [])
+        versioned = False
         self._scan('"struct"', context=_context)
         SYMBOL = self._scan('SYMBOL', context=_context)
+        if self._peek('"\\["', '"{"', context=_context) == '"\\["':
+            self._scan('"\\["', context=_context)
+            self._scan('"versioned"', context=_context)
+            self._scan('"\\]"', context=_context)
+            versioned = True
         self._scan('"{"', context=_context)
         struct_fields = self.struct_fields(_context)
         self._scan('"}"', context=_context)
-        return pack(name=SYMBOL, fields=struct_fields)
+        return pack(name=SYMBOL, versioned=versioned, fields=struct_fields)
 
     def struct_fields(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'struct_fields', [])
@@ -221,7 +238,7 @@ class Rpc(runtime.Parser):
     def service_functions(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'service_functions', [])
         functions = []
-        while self._peek('SYMBOL', '"}"', '"fast"', '"raw"', '"defer"', '"udp"', context=_context) != '"}"':
+        while self._peek('SYMBOL', '"}"', '"fast"', '"raw"', '"defer"', '"udp"', '"arena"', '"stream"', '"high"', '"low"', context=_context) != '"}"':
             service_function = self.service_function(_context)
             functions += service_function,
         return functions
@@ -240,7 +257,7 @@ class Rpc(runtime.Parser):
             func_arg_list = self.func_arg_list(_context)
             output = func_arg_list
         self._scan('"\\)"', context=_context)
-        if self._peek('"="', 'SYMBOL', '"}"', '"fast"', '"raw"', '"defer"', '"udp"', context=_context) == '"="':
+        if self._peek('"="', 'SYMBOL', '"}"', '"fast"', '"raw"', '"defer"', '"udp"', '"arena"', '"stream"', '"high"', '"low"', context=_context) == '"="':
             self._scan('"="', context=_context)
             self._scan('"0"', context=_context)
             abstract = True
@@ -250,14 +267,14 @@ class Rpc(runtime.Parser):
     def func_attrs(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'func_attrs', [])
         attrs = set()
-        while self._peek('"fast"', '"raw"', '"defer"', '"udp"', 'SYMBOL', context=_context) != 'SYMBOL':
+        while self._peek('"fast"', '"raw"', '"defer"', '"udp"', '"arena"', '"stream"', '"high"', '"low"', 'SYMBOL', context=_context) != 'SYMBOL':
             func_attr = self.func_attr(_context)
             attrs.add(func_attr,)
         return attrs
 
     def func_attr(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'func_attr', [])
-        _token = self._peek('"fast"', '"raw"', '"defer"', '"udp"', context=_context)
+        _token = self._peek('"fast"', '"raw"', '"defer"', '"udp"', '"arena"', '"stream"', '"high"', '"low"', context=_context)
         if _token == '"fast"':
             self._scan('"fast"', context=_context)
             return "fast"
@@ -267,9 +284,21 @@ class Rpc(runtime.Parser):
         elif _token == '"defer"':
             self._scan('"defer"', context=_context)
             return "defer"
-        else: # == '"udp"'
+        elif _token == '"udp"':
             self._scan('"udp"', context=_context)
             return "udp"
+        elif _token == '"arena"':
+            self._scan('"arena"', context=_context)
+            return "arena"
+        elif _token == '"stream"':
+            self._scan('"stream"', context=_context)
+            return "stream"
+        elif _token == '"high"':
+            self._scan('"high"', context=_context)
+            return "high"
+        else: # == '"low"'
+            self._scan('"low"', context=_context)
+            return "low"
 
     def func_arg_list(self, _parent=None):
         _context = self.Context(_parent, self._scanner, 'func_arg_list', [])
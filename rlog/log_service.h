@@ -8,33 +8,65 @@
 
 namespace rlog {
 
+struct log_entry {
+    rpc::i32 level;
+    rpc::i64 msg_id;
+    std::string message;
+};
+
+inline size_t marshal_size(const log_entry& o) {
+    return rpc::marshal_size_of(o.level, o.msg_id, o.message);
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const log_entry& o) {
+    m << o.level;
+    m << o.msg_id;
+    m << o.message;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, log_entry& o) {
+    m >> o.level;
+    m >> o.msg_id;
+    m >> o.message;
+    return m;
+}
+
 class RLogService: public rpc::Service {
 public:
     enum {
-        LOG = 0x57982f30,
-        AGGREGATE_QPS = 0x5d6a8636,
+        LOG = 0x394e4b9e,
+        LOG_BATCH = 0x1b99aad7,
+        AGGREGATE_QPS = 0x49d69569,
     };
     int __reg_to__(rpc::Server* svr) {
         int ret = 0;
         if ((ret = svr->reg(LOG, this, &RLogService::__log__wrapper__)) != 0) {
             goto err;
         }
+        if ((ret = svr->reg(LOG_BATCH, this, &RLogService::__log_batch__wrapper__)) != 0) {
+            goto err;
+        }
         if ((ret = svr->reg(AGGREGATE_QPS, this, &RLogService::__aggregate_qps__wrapper__)) != 0) {
             goto err;
         }
         return 0;
     err:
         svr->unreg(LOG);
+        svr->unreg(LOG_BATCH);
         svr->unreg(AGGREGATE_QPS);
         return ret;
     }
     // these RPC handler functions need to be implemented by user
-    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
     virtual void log(const rpc::i32& level, const std::string& source, const rpc::i64& msg_id, const std::string& message) = 0;
+    virtual void log_batch(const std::string& source, const std::vector<log_entry>& entries) = 0;
     virtual void aggregate_qps(const std::string& metric_name, const rpc::i32& increment) = 0;
 private:
     void __log__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             rpc::i32 in_0;
             req->m >> in_0;
             std::string in_1;
@@ -44,26 +76,62 @@ private:
             std::string in_3;
             req->m >> in_3;
             this->log(in_0, in_1, in_2, in_3);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __log_batch__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            std::string in_0;
+            req->m >> in_0;
+            std::vector<log_entry> in_1;
+            req->m >> in_1;
+            this->log_batch(in_0, in_1);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __aggregate_qps__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             std::string in_0;
             req->m >> in_0;
             rpc::i32 in_1;
             req->m >> in_1;
             this->aggregate_qps(in_0, in_1);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
 };
 
@@ -73,7 +141,7 @@ protected:
 public:
     RLogProxy(rpc::Client* cl): __cl__(cl) { }
     rpc::Future* async_log(const rpc::i32& level, const std::string& source, const rpc::i64& msg_id, const std::string& message, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(RLogService::LOG, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(RLogService::LOG, __fu_attr__, rpc::marshal_size_of(level, source, msg_id, message));
         if (__fu__ != nullptr) {
             *__cl__ << level;
             *__cl__ << source;
@@ -92,8 +160,26 @@ public:
         __fu__->release();
         return __ret__;
     }
+    rpc::Future* async_log_batch(const std::string& source, const std::vector<log_entry>& entries, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(RLogService::LOG_BATCH, __fu_attr__, rpc::marshal_size_of(source, entries));
+        if (__fu__ != nullptr) {
+            *__cl__ << source;
+            *__cl__ << entries;
+        }
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 log_batch(const std::string& source, const std::vector<log_entry>& entries) {
+        rpc::Future* __fu__ = this->async_log_batch(source, entries);
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        __fu__->release();
+        return __ret__;
+    }
     rpc::Future* async_aggregate_qps(const std::string& metric_name, const rpc::i32& increment, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(RLogService::AGGREGATE_QPS, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(RLogService::AGGREGATE_QPS, __fu_attr__, rpc::marshal_size_of(metric_name, increment));
         if (__fu__ != nullptr) {
             *__cl__ << metric_name;
             *__cl__ << increment;
@@ -1,5 +1,6 @@
 #include <string>
 #include <sstream>
+#include <algorithm>
 
 #include <time.h>
 #include <sys/time.h>
@@ -21,77 +22,121 @@ RLogServiceImpl::RLogServiceImpl() {
     }
 }
 
-void RLogServiceImpl::log(const i32& level, const std::string& source, const i64& msg_id, const std::string& message) {
-    log_piece piece;
-    piece.msg_id = msg_id;
-    piece.level = level;
-    piece.message = message;
+bool reorder_ring::insert(i64 msg_id, i32 level, const std::string& message) {
+    if (msg_id <= done_ || msg_id - done_ > max_ahead) {
+        return false;
+    }
+    while (msg_id - done_ > (i64) slots_.size()) {
+        // too far ahead, double the ring
+        std::vector<log_piece> bigger(slots_.size() * 2);
+        for (auto& p: slots_) {
+            if (p.msg_id >= 0) {
+                bigger[p.msg_id & (bigger.size() - 1)].msg_id = p.msg_id;
+                bigger[p.msg_id & (bigger.size() - 1)].level = p.level;
+                bigger[p.msg_id & (bigger.size() - 1)].message.swap(p.message);
+            }
+        }
+        slots_.swap(bigger);
+    }
+    log_piece* p = &slots_[msg_id & (slots_.size() - 1)];
+    p->msg_id = msg_id;
+    p->level = level;
+    p->message = message;
+    return true;
+}
+
+void qps_counter::add(double now, i64 increment) {
+    i64 tick = (i64) (now * 1000) / bucket_ms;
+    bucket* b = &buckets_[tick % n_buckets];
+    if (b->tick != tick) {
+        b->tick = tick;
+        b->count = 0;
+    }
+    b->count += increment;
+}
+
+double qps_counter::qps(double now, int seconds) const {
+    i64 tick = (i64) (now * 1000) / bucket_ms;
+    i64 n = std::min((i64) n_buckets, (i64) seconds * 1000 / bucket_ms);
+    i64 sum = 0;
+    for (i64 t = tick - n + 1; t <= tick; t++) {
+        const bucket* b = &buckets_[t % n_buckets];
+        if (b->tick == t) {
+            sum += b->count;
+        }
+    }
+    return (double) sum / seconds;
+}
 
+void RLogServiceImpl::log(const i32& level, const std::string& source, const i64& msg_id, const std::string& message) {
     char tm_str[TIME_NOW_STR_SIZE];
     base::time_now_str(tm_str);
 
-    l_.lock();
-
-    set<log_piece>& buffer = buffer_[source];
-    buffer.insert(piece);
+    log_shard* shard = &log_shards_[shard_of(source)];
+    shard->l.lock();
+    reorder_ring* ring = &shard->sources[source];
+    if (!ring->insert(msg_id, level, message)) {
+        // late or duplicate, print as is
+        LOG_INFO("level=%d %s %s: %s", level, tm_str, source.c_str(), message.c_str());
+    }
+    print_in_order(source, ring, tm_str);
+    shard->l.unlock();
+}
 
-    i64& done = done_[source];
+void RLogServiceImpl::log_batch(const std::string& source, const std::vector<log_entry>& entries) {
+    char tm_str[TIME_NOW_STR_SIZE];
+    base::time_now_str(tm_str);
 
-    while (!buffer.empty() && buffer.begin()->msg_id <= done + 1) {
-        LOG_INFO("level=%d %s %s: %s", buffer.begin()->level, tm_str, source.c_str(), buffer.begin()->message.c_str());
-        done = max(done, buffer.begin()->msg_id);
-        buffer.erase(buffer.begin());
+    log_shard* shard = &log_shards_[shard_of(source)];
+    shard->l.lock();
+    reorder_ring* ring = &shard->sources[source];
+    for (auto& e: entries) {
+        if (!ring->insert(e.msg_id, e.level, e.message)) {
+            LOG_INFO("level=%d %s %s: %s", e.level, tm_str, source.c_str(), e.message.c_str());
+        }
     }
+    print_in_order(source, ring, tm_str);
+    shard->l.unlock();
+}
 
-    l_.unlock();
+void RLogServiceImpl::print_in_order(const std::string& source, reorder_ring* ring, const char* tm_str) {
+    log_piece* p;
+    while ((p = ring->next_ready()) != nullptr) {
+        LOG_INFO("level=%d %s %s: %s", p->level, tm_str, source.c_str(), p->message.c_str());
+        ring->pop(p);
+    }
 }
 
 void RLogServiceImpl::aggregate_qps(const std::string& metric_name, const rpc::i32& incr) {
-    agg_qps_l_.lock();
-    list<agg_qps_record>& records = agg_qps_[metric_name];
-    agg_qps_record new_rec;
     timeval tv;
     gettimeofday(&tv, nullptr);
     double now = tv.tv_sec + tv.tv_usec / 1000.0 / 1000.0;
-    new_rec.tm = now;
-    if (records.empty()) {
-        new_rec.agg_count = incr;
-    } else {
-        new_rec.agg_count = records.back().agg_count + incr;
-    }
-    records.push_back(new_rec);
 
-    // only keep 5min qps info
-    while (now - records.front().tm > 5 * 60) {
-        records.erase(records.begin());
+    qps_shard* shard = &qps_shards_[shard_of(metric_name)];
+    shard->l.lock();
+    qps_counter*& counter = shard->metrics[metric_name];
+    if (counter == nullptr) {
+        counter = new qps_counter;
     }
+    counter->add(now, incr);
 
     // report aggregate qps every 1sec
-    if (now - last_qps_tm_[metric_name] >= qps_interval_) {
+    if (now - counter->last_report_ >= qps_interval_) {
         const int report_intervals[] = {1, 5, 15, 30, 60};
         ostringstream qps_ostr;
         for (size_t i = 0; i < arraysize(report_intervals); i++) {
-            double increment = -1;
-            const int report_interval = report_intervals[i];
-            for (list<agg_qps_record>::reverse_iterator it = records.rbegin(); it != records.rend(); ++it) {
-                if (now - it->tm < report_interval) {
-                    increment = records.back().agg_count - it->agg_count;
-                } else {
-                    break;
-                }
-            }
-            if (increment > 0) {
-                double qps = increment / report_interval;
-                qps_ostr << " " << report_interval << ":" << qps;
+            double qps = counter->qps(now, report_intervals[i]);
+            if (qps > 0) {
+                qps_ostr << " " << report_intervals[i] << ":" << qps;
             }
         }
-        last_qps_tm_[metric_name] = now;
+        counter->last_report_ = now;
         if (qps_ostr.str().length() > 0) {
             Log_info("qps '%s':%s", metric_name.c_str(), qps_ostr.str().c_str());
         }
     }
 
-    agg_qps_l_.unlock();
+    shard->l.unlock();
 }
 
 } // namespace rlog
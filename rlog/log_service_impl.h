@@ -1,8 +1,8 @@
 #pragma once
 
-#include <map>
-#include <set>
 #include <string>
+#include <vector>
+#include <unordered_map>
 
 #include "rpc/server.h"
 #include "rpc/client.h"
@@ -12,41 +12,121 @@
 namespace rlog {
 
 struct log_piece {
-    rpc::i64 msg_id;
+    rpc::i64 msg_id;  // -1 if the slot is empty
     rpc::i32 level;
     std::string message;
 
-    bool operator< (const log_piece& another) const {
-        return msg_id < another.msg_id;
+    log_piece(): msg_id(-1), level(0) { }
+};
+
+/**
+ * Messages of one source that arrived ahead of their turn, in a ring indexed
+ * by msg_id. Grows if a message is further ahead than the ring is long, up
+ * to max_ahead.
+ */
+class reorder_ring {
+    std::vector<log_piece> slots_;
+    rpc::i64 done_;  // highest msg_id printed, RLog numbers from 0
+
+public:
+    static const rpc::i64 max_ahead = 1 << 20;
+
+    reorder_ring(): slots_(64), done_(-1) { }
+
+    rpc::i64 done() const {
+        return done_;
+    }
+
+    // false if msg_id is done already, or too far ahead to wait for
+    bool insert(rpc::i64 msg_id, rpc::i32 level, const std::string& message);
+
+    // next message in order, if it has arrived
+    log_piece* next_ready() {
+        log_piece* p = &slots_[(done_ + 1) & (slots_.size() - 1)];
+        return p->msg_id == done_ + 1 ? p : nullptr;
+    }
+
+    void pop(log_piece* p) {
+        done_ = p->msg_id;
+        p->msg_id = -1;
+        p->message.clear();
     }
 };
 
-struct agg_qps_record {
-    rpc::i64 agg_count;
-    double tm;
+/**
+ * Increments of a metric over the last minute, in 100ms buckets. Reporting
+ * the rate of an interval costs at most one pass over the buckets, however
+ * many increments there were.
+ */
+class qps_counter {
+public:
+    static const int bucket_ms = 100;
+    static const int n_buckets = 600;
 
-    bool operator <(const agg_qps_record& another) const {
-        return tm < another.tm;
+    qps_counter(): last_report_(0.0) {
+        for (int i = 0; i < n_buckets; i++) {
+            buckets_[i].tick = -1;
+            buckets_[i].count = 0;
+        }
     }
+
+    void add(double now, rpc::i64 increment);
+
+    // average rate over the last seconds, seconds <= 60
+    double qps(double now, int seconds) const;
+
+    double last_report_;
+
+private:
+    struct bucket {
+        rpc::i64 tick;  // time / bucket_ms
+        rpc::i64 count;
+    };
+    bucket buckets_[n_buckets];
 };
 
+/**
+ * Sources and metrics are sharded by name, so requests of different sources
+ * go through in parallel.
+ */
 class RLogServiceImpl: public RLogService {
 public:
+    static const int n_shards = 16;
+
     RLogServiceImpl();
 
     void log(const rpc::i32& level, const std::string& source, const rpc::i64& msg_id, const std::string& message);
+    void log_batch(const std::string& source, const std::vector<log_entry>& entries);
     void aggregate_qps(const std::string& metric_name, const rpc::i32& increment);
 
 private:
-    std::map<std::string, rpc::i64> done_;
-    std::map<std::string, std::set<log_piece> > buffer_;
-    std::map<std::string, std::list<agg_qps_record> > agg_qps_;
-    std::map<std::string, double> last_qps_tm_;
+    struct log_shard {
+        rpc::Mutex l;
+        std::unordered_map<std::string, reorder_ring> sources;
+    };
+
+    struct qps_shard {
+        rpc::Mutex l;
+        std::unordered_map<std::string, qps_counter*> metrics;
+
+        ~qps_shard() {
+            for (auto& it: metrics) {
+                delete it.second;
+            }
+        }
+    };
+
+    log_shard log_shards_[n_shards];
+    qps_shard qps_shards_[n_shards];
 
     double qps_interval_;
 
-    rpc::Mutex l_;
-    rpc::Mutex agg_qps_l_;
+    static int shard_of(const std::string& name) {
+        return std::hash<std::string>()(name) % n_shards;
+    }
+
+    // print whatever is in order, must hold the shard lock
+    static void print_in_order(const std::string& source, reorder_ring* ring, const char* tm_str);
 };
 
 }
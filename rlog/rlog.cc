@@ -1,6 +1,9 @@
 #include <string>
+#include <algorithm>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "rlog.h"
 
@@ -13,11 +16,48 @@ namespace rlog {
 char* RLog::my_ident_s = nullptr;
 RLogProxy* RLog::rp_s = nullptr;
 Client* RLog::cl_s = nullptr;
-char* RLog::buf_s = nullptr;
-int RLog::buf_len_s = -1;
 PollMgr* RLog::poll_s = nullptr;
 rpc::Counter RLog::msg_counter_s;
 
+size_t RLog::batch_size_s = 256;
+double RLog::max_latency_s = 0.05;
+size_t RLog::max_buffered_s = 1024 * 1024;
+
+volatile bool RLog::remote_s = false;
+rpc::Counter RLog::dropped_s;
+
+pthread_mutex_t RLog::bufs_mutex_s = PTHREAD_MUTEX_INITIALIZER;
+std::list<RLog::thread_buf*> RLog::bufs_s;
+pthread_key_t RLog::buf_key_s;
+__thread RLog::thread_buf* RLog::buf_t = nullptr;
+
+pthread_t RLog::flusher_th_s;
+bool RLog::flusher_running_s = false;
+bool RLog::flusher_stopping_s = false;
+
+pthread_mutex_t RLog::flusher_mutex_s = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t RLog::flusher_cond_s = PTHREAD_COND_INITIALIZER;
+int RLog::in_flight_s = 0;
+
+// batches on the way to the log server, before messages start to pile up
+static const int max_in_flight = 16;
+
+static pthread_once_t buf_key_once = PTHREAD_ONCE_INIT;
+
+// wait at most 10 seconds for in_flight_s to drop to n, must hold flusher_mutex_s
+void RLog::wait_in_flight(int n) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + 10;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    while (in_flight_s > n) {
+        if (pthread_cond_timedwait(&flusher_cond_s, &flusher_mutex_s, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+}
+
 // no static Mutex class, use pthread_mutex_t and PTHREAD_MUTEX_INITIALIZER instead
 pthread_mutex_t RLog::mutex_s = PTHREAD_MUTEX_INITIALIZER;
 
@@ -52,6 +92,10 @@ void RLog::init(const char* my_ident /* =? */, const char* rlog_addr /* =? */) {
         } else {
             rp_s = new RLogProxy(cl_s);
             msg_counter_s.reset(0);
+            remote_s = true;
+            flusher_stopping_s = false;
+            Pthread_create(&flusher_th_s, nullptr, flusher_loop, nullptr);
+            flusher_running_s = true;
         }
     } else {
         Log_warn("called RLog::init() multiple times without calling RLog::finalize() first");
@@ -59,6 +103,39 @@ void RLog::init(const char* my_ident /* =? */, const char* rlog_addr /* =? */) {
     Pthread_mutex_unlock(&mutex_s);
 }
 
+void RLog::finalize() {
+    Pthread_mutex_lock(&mutex_s);
+    bool flusher_running = flusher_running_s;
+    flusher_running_s = false;
+    Pthread_mutex_unlock(&mutex_s);
+
+    if (flusher_running) {
+        // ships what is left on the way out
+        Pthread_mutex_lock(&flusher_mutex_s);
+        flusher_stopping_s = true;
+        Pthread_cond_signal(&flusher_cond_s);
+        Pthread_mutex_unlock(&flusher_mutex_s);
+        Pthread_join(flusher_th_s, nullptr);
+
+        // give the last batches a chance to get there
+        Pthread_mutex_lock(&flusher_mutex_s);
+        wait_in_flight(0);
+        Pthread_mutex_unlock(&flusher_mutex_s);
+    }
+
+    Pthread_mutex_lock(&mutex_s);
+    remote_s = false;
+    do_finalize();
+    Pthread_mutex_unlock(&mutex_s);
+}
+
+void RLog::set_batching(size_t batch_size, double max_latency, size_t max_buffered) {
+    verify(batch_size > 0 && max_latency > 0);
+    batch_size_s = batch_size;
+    max_latency_s = max_latency;
+    max_buffered_s = max_buffered;
+}
+
 
 // function called while holding lock on RLog
 void RLog::do_finalize() {
@@ -74,57 +151,207 @@ void RLog::do_finalize() {
         delete rp_s;
         rp_s = nullptr;
     }
-    if (buf_s) {
-        free(buf_s);
-        buf_s = nullptr;
-    }
     if (poll_s) {
         poll_s->release();
         poll_s = nullptr;
     }
 }
 
+RLog::thread_buf* RLog::my_buf() {
+    if (buf_t == nullptr) {
+        pthread_once(&buf_key_once, [] {
+            verify(pthread_key_create(&buf_key_s, orphan_buf) == 0);
+        });
+        thread_buf* tb = new thread_buf;
+        Pthread_mutex_lock(&bufs_mutex_s);
+        bufs_s.push_back(tb);
+        Pthread_mutex_unlock(&bufs_mutex_s);
+        pthread_setspecific(buf_key_s, tb);
+        buf_t = tb;
+    }
+    return buf_t;
+}
+
+// the flusher frees it once shipped
+void RLog::orphan_buf(void* arg) {
+    thread_buf* tb = (thread_buf *) arg;
+    tb->l.lock();
+    tb->orphaned = true;
+    tb->l.unlock();
+    buf_t = nullptr;
+}
+
 void RLog::log_v(int level, const char* fmt, va_list args) {
-    Pthread_mutex_lock(&mutex_s);
-    if (buf_s == nullptr) {
-        buf_len_s = 8192;
-        buf_s = (char *) malloc(buf_len_s);
-        memset(buf_s, 0, buf_len_s);
-    }
-    int cnt = vsnprintf(buf_s, buf_len_s - 1, fmt, args);
-    if (cnt >= buf_len_s - 1) {
-        buf_len_s = cnt + 16;
-        buf_s = (char *) realloc(buf_s, buf_len_s);
-        cnt = vsnprintf(buf_s, buf_len_s - 1, fmt, args);
-        verify(cnt < buf_len_s - 1);
-    }
-    buf_s[cnt] = '\0';
+    char buf[1024];
+    string message;
+    va_list args2;
+    va_copy(args2, args);
+    int cnt = vsnprintf(buf, sizeof(buf), fmt, args2);
+    va_end(args2);
+    if (cnt < 0) {
+        return;
+    }
+    if ((size_t) cnt < sizeof(buf)) {
+        message.assign(buf, cnt);
+    } else {
+        message.resize(cnt + 1);
+        vsnprintf(&message[0], cnt + 1, fmt, args);
+        message.resize(cnt);
+    }
     // TODO update remote logging
-    LOG_INFO("level=%d, %s", level, buf_s);
-    if (rp_s) {
-        // always use async rpc
-        string message = buf_s;
-        Future* fu = rp_s->async_log(level, my_ident_s, msg_counter_s.next(), message);
+    LOG_INFO("level=%d, %s", level, message.c_str());
+
+    if (!remote_s) {
+        return;
+    }
+    thread_buf* tb = my_buf();
+    size_t bytes = sizeof(log_entry) + message.size();
+    tb->l.lock();
+    if (tb->bytes + bytes > max_buffered_s) {
+        tb->l.unlock();
+        dropped_s.next();
+        return;
+    }
+    log_entry entry;
+    entry.level = level;
+    entry.msg_id = 0;  // given when shipped, so dropped messages leave no gaps
+    tb->entries.push_back(entry);
+    tb->entries.back().message.swap(message);
+    tb->bytes += bytes;
+    bool full = tb->entries.size() >= batch_size_s;
+    tb->l.unlock();
+
+    if (full) {
+        Pthread_cond_signal(&flusher_cond_s);
+    }
+}
+
+void* RLog::flusher_loop(void*) {
+    Pthread_mutex_lock(&flusher_mutex_s);
+    while (!flusher_stopping_s) {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        double deadline = now.tv_sec + now.tv_usec / 1000.0 / 1000.0 + max_latency_s;
+        struct timespec ts;
+        ts.tv_sec = (time_t) deadline;
+        ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1000 * 1000 * 1000);
+        pthread_cond_timedwait(&flusher_cond_s, &flusher_mutex_s, &ts);
+
+        Pthread_mutex_unlock(&flusher_mutex_s);
+        ship();
+        Pthread_mutex_lock(&flusher_mutex_s);
+    }
+    Pthread_mutex_unlock(&flusher_mutex_s);
+    ship();
+    return nullptr;
+}
+
+void RLog::ship() {
+    // wait for the log server to catch up, meanwhile messages pile up in
+    // thread buffers, and get dropped once those are full
+    Pthread_mutex_lock(&flusher_mutex_s);
+    wait_in_flight(max_in_flight - 1);
+    bool can_ship = in_flight_s < max_in_flight;
+    Pthread_mutex_unlock(&flusher_mutex_s);
+    if (!can_ship) {
+        return;
+    }
+
+    vector<log_entry> entries;
+    list<thread_buf*> gone;
+    Pthread_mutex_lock(&bufs_mutex_s);
+    for (auto& tb: bufs_s) {
+        tb->l.lock();
+        bool orphaned = tb->orphaned;
+        if (entries.empty()) {
+            entries.swap(tb->entries);
+        } else {
+            std::move(tb->entries.begin(), tb->entries.end(), std::back_inserter(entries));
+            tb->entries.clear();
+        }
+        tb->bytes = 0;
+        tb->l.unlock();
+        if (orphaned) {
+            gone.push_back(tb);
+        }
+    }
+    for (auto& tb: gone) {
+        bufs_s.remove(tb);
+        delete tb;
+    }
+    Pthread_mutex_unlock(&bufs_mutex_s);
+
+    if (entries.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < entries.size(); i += batch_size_s) {
+        // every batch waits for a spot, what does not get one is dropped
+        Pthread_mutex_lock(&flusher_mutex_s);
+        wait_in_flight(max_in_flight - 1);
+        bool got_spot = in_flight_s < max_in_flight;
+        if (got_spot) {
+            in_flight_s++;
+        }
+        Pthread_mutex_unlock(&flusher_mutex_s);
+        if (!got_spot) {
+            dropped_s.next(entries.size() - i);
+            break;
+        }
+
+        Pthread_mutex_lock(&mutex_s);
+        if (rp_s == nullptr || !remote_s) {
+            Pthread_mutex_unlock(&mutex_s);
+            Pthread_mutex_lock(&flusher_mutex_s);
+            in_flight_s--;
+            Pthread_mutex_unlock(&flusher_mutex_s);
+            break;
+        }
+        size_t batch_end = std::min(entries.size(), i + batch_size_s);
+        vector<log_entry> batch(entries.begin() + i, entries.begin() + batch_end);
+        // one connection, so batches arrive in msg_id order
+        for (auto& e: batch) {
+            e.msg_id = msg_counter_s.next();
+        }
+
+        i64 n_msgs = batch.size();
+        FutureAttr fu_attr([n_msgs] (Future* fu) {
+            if (fu->get_error_code() != 0) {
+                dropped_s.next(n_msgs);
+            }
+            Pthread_mutex_lock(&flusher_mutex_s);
+            in_flight_s--;
+            Pthread_cond_signal(&flusher_cond_s);
+            Pthread_mutex_unlock(&flusher_mutex_s);
+        });
+        Future* fu = rp_s->async_log_batch(my_ident_s, batch, fu_attr);
         if (fu != nullptr) {
             fu->release();
         } else {
+            Pthread_mutex_lock(&flusher_mutex_s);
+            in_flight_s--;
+            Pthread_mutex_unlock(&flusher_mutex_s);
+            dropped_s.next(entries.size() - i);
             Log_error("RLog connection failed, fall back to local mode");
-            do_finalize();
+            remote_s = false;
+        }
+        Pthread_mutex_unlock(&mutex_s);
+        if (fu == nullptr) {
+            break;
         }
     }
-    Pthread_mutex_unlock(&mutex_s);
 }
 
 void RLog::aggregate_qps(const std::string& metric_name, const rpc::i32 increment) {
     Pthread_mutex_lock(&mutex_s);
-    if (rp_s) {
+    if (rp_s && remote_s) {
         // always use async rpc
         Future* fu = rp_s->async_aggregate_qps(metric_name, increment);
         if (fu != nullptr) {
             fu->release();
         } else {
             Log_error("RLog connection failed, cannot report qps");
-            do_finalize();
+            remote_s = false;
         }
     }
     Pthread_mutex_unlock(&mutex_s);
@@ -13,10 +13,24 @@ class RLog {
 public:
     static void init(const char* my_ident = nullptr, const char* rlog_addr = nullptr);
 
-    static void finalize() {
-        Pthread_mutex_lock(&mutex_s);
-        do_finalize();
-        Pthread_mutex_unlock(&mutex_s);
+    // ships whatever is still buffered before disconnecting
+    static void finalize();
+
+    /**
+     * Messages are buffered per thread, and shipped to the log server in
+     * batches of up to batch_size, at most max_latency seconds after being
+     * logged. Each thread buffers at most max_buffered bytes, further
+     * messages are dropped (see dropped()) till the log server catches up.
+     * Should be called before init().
+     *
+     * Default: 256 messages, 50ms, 1mb.
+     */
+    static void set_batching(size_t batch_size, double max_latency, size_t max_buffered);
+
+    // number of messages not shipped to the log server because buffers were
+    // full, or too many batches stayed on the way for too long
+    static rpc::i64 dropped() {
+        return dropped_s.peek_next();
     }
 
     static void log(int level, const char* fmt, ...) {
@@ -76,14 +90,53 @@ private:
 
     static void do_finalize();
 
+    // messages of one thread, waiting to be shipped
+    struct thread_buf: public rpc::CacheAligned {
+        rpc::SpinLock l;
+        std::vector<log_entry> entries;
+        size_t bytes;
+        volatile bool orphaned;  // thread exited
+
+        thread_buf(): bytes(0), orphaned(false) { }
+    };
+
+    static thread_buf* my_buf();
+    static void orphan_buf(void* arg);
+    static void* flusher_loop(void*);
+
+    // send out buffered messages, waits if too many batches are on the way
+    static void ship();
+    static void wait_in_flight(int n);
+
     static char* my_ident_s;
     static RLogProxy* rp_s;
     static rpc::Client* cl_s;
-    static char* buf_s;
-    static int buf_len_s;
     static rpc::PollMgr* poll_s;
     static rpc::Counter msg_counter_s;
 
+    static size_t batch_size_s;
+    static double max_latency_s;
+    static size_t max_buffered_s;
+
+    // buffer messages only when connected
+    static volatile bool remote_s;
+    static rpc::Counter dropped_s;
+
+    // guards bufs_s
+    static pthread_mutex_t bufs_mutex_s;
+    static std::list<thread_buf*> bufs_s;
+    static pthread_key_t buf_key_s;
+    static __thread thread_buf* buf_t;
+
+    static pthread_t flusher_th_s;
+    static bool flusher_running_s;
+    static bool flusher_stopping_s;
+
+    // guards flusher_stopping_s and in_flight_s
+    static pthread_mutex_t flusher_mutex_s;
+    static pthread_cond_t flusher_cond_s;
+    static int in_flight_s;
+
     // no static Mutex class, use pthread_mutex_t and PTHREAD_MUTEX_INITIALIZER instead
     static pthread_mutex_t mutex_s;
 };
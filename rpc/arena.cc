@@ -0,0 +1,53 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+using namespace std;
+
+namespace rpc {
+
+const size_t Arena::min_block_size = 4096;
+
+static __thread Arena* current_arena_s = nullptr;
+
+Arena* Arena::current() {
+    return current_arena_s;
+}
+
+void Arena::set_current(Arena* arena) {
+    current_arena_s = arena;
+}
+
+void* Arena::allocate_slow(size_t n, size_t align) {
+    // leave room for aligning the first object in the block
+    size_t data_size = std::max(n + align, min_block_size);
+    block* blk = (block *) malloc(sizeof(block) + data_size);
+    verify(blk != nullptr);
+    blk->next = head_;
+    blk->size = data_size;
+    head_ = blk;
+    bytes_allocated_ += data_size;
+
+    ptr_ = (char *) (blk + 1);
+    end_ = ptr_ + data_size;
+
+    char* p = (char *) (((uintptr_t) ptr_ + align - 1) & ~(uintptr_t) (align - 1));
+    verify(p + n <= end_);
+    ptr_ = p + n;
+    return p;
+}
+
+void Arena::reset() {
+    block* blk = head_;
+    while (blk != nullptr) {
+        block* next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    head_ = nullptr;
+    ptr_ = nullptr;
+    end_ = nullptr;
+    bytes_allocated_ = 0;
+}
+
+} // namespace rpc
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <new>
+
+#include <stddef.h>
+
+#include "utils.h"
+
+namespace rpc {
+
+/**
+ * Bump pointer memory region. Nothing allocated from an Arena is freed
+ * individually, everything goes away at once when the Arena is destroyed
+ * (or reset). Every Request carries one, so containers deserialized for a
+ * single RPC do a handful of block allocations instead of one malloc per
+ * element.
+ *
+ * not thread safe, for better performance
+ */
+class Arena: public NoCopy {
+    struct block {
+        block* next;
+        size_t size;
+    };
+
+    block* head_;
+    char* ptr_;
+    char* end_;
+    size_t bytes_allocated_;
+
+    void* allocate_slow(size_t n, size_t align);
+
+public:
+
+    // 4kb minimum block size
+    static const size_t min_block_size;
+
+    Arena(): head_(nullptr), ptr_(nullptr), end_(nullptr), bytes_allocated_(0) { }
+    ~Arena() {
+        reset();
+    }
+
+    void* allocate(size_t n, size_t align = alignof(max_align_t)) {
+        if (ptr_ != nullptr) {
+            char* p = (char *) (((uintptr_t) ptr_ + align - 1) & ~(uintptr_t) (align - 1));
+            if (p + n <= end_) {
+                ptr_ = p + n;
+                return p;
+            }
+        }
+        return allocate_slow(n, align);
+    }
+
+    // free all blocks
+    void reset();
+
+    // total size of blocks held by the arena
+    size_t bytes_allocated() const {
+        return bytes_allocated_;
+    }
+
+    template<class T>
+    T* create() {
+        return new (allocate(sizeof(T), alignof(T))) T;
+    }
+
+    // only runs the destructor, memory is returned with the arena
+    template<class T>
+    static void destroy(T* p) {
+        p->~T();
+    }
+
+    // arena used by default constructed ArenaAllocator on current thread, could be nullptr
+    static Arena* current();
+
+private:
+    friend class ArenaScope;
+    static void set_current(Arena* arena);
+};
+
+/**
+ * Make an Arena the default for ArenaAllocator on current thread, till
+ * the scope ends. Used by rpcgen generated code for 'arena' functions, so
+ * that elements created while deserializing nested containers end up in
+ * the Request's arena.
+ */
+class ArenaScope: public NoCopy {
+    Arena* saved_;
+public:
+    explicit ArenaScope(Arena* arena): saved_(Arena::current()) {
+        Arena::set_current(arena);
+    }
+    ~ArenaScope() {
+        Arena::set_current(saved_);
+    }
+};
+
+/**
+ * STL allocator backed by an Arena. A default constructed allocator picks
+ * up Arena::current(), and falls back to the heap if there is none.
+ *
+ * NOTE: containers using ArenaAllocator must not outlive the arena. Copy
+ *       data into std containers if it needs to stay after the request.
+ */
+template<class T>
+class ArenaAllocator {
+    template<class U> friend class ArenaAllocator;
+
+    Arena* arena_;
+
+public:
+    typedef T value_type;
+
+    ArenaAllocator(): arena_(Arena::current()) { }
+    ArenaAllocator(Arena* arena): arena_(arena) { }
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other): arena_(other.arena_) { }
+
+    Arena* arena() const {
+        return arena_;
+    }
+
+    T* allocate(size_t n) {
+        if (arena_ != nullptr) {
+            return (T *) arena_->allocate(n * sizeof(T), alignof(T));
+        }
+        return (T *) ::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (arena_ == nullptr) {
+            ::operator delete(p);
+        }
+    }
+
+    template<class U>
+    bool operator ==(const ArenaAllocator<U>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template<class U>
+    bool operator !=(const ArenaAllocator<U>& other) const {
+        return arena_ != other.arena_;
+    }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> arena_string;
+
+template<class T>
+using arena_vector = std::vector<T, ArenaAllocator<T>>;
+
+template<class T>
+using arena_list = std::list<T, ArenaAllocator<T>>;
+
+template<class T>
+using arena_set = std::set<T, std::less<T>, ArenaAllocator<T>>;
+
+template<class K, class V>
+using arena_map = std::map<K, V, std::less<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+// std::hash is not provided for strings with custom allocators
+template<class T>
+struct arena_hash: public std::hash<T> {
+};
+
+template<>
+struct arena_hash<arena_string> {
+    size_t operator ()(const arena_string& s) const {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < s.size(); i++) {
+            h ^= (unsigned char) s[i];
+            h *= 1099511628211ULL;
+        }
+        return (size_t) h;
+    }
+};
+
+template<class T>
+using arena_unordered_set = std::unordered_set<T, arena_hash<T>, std::equal_to<T>, ArenaAllocator<T>>;
+
+template<class K, class V>
+using arena_unordered_map = std::unordered_map<K, V, arena_hash<K>, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+} // namespace rpc
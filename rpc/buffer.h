@@ -62,6 +62,7 @@ public:
     chunk* next;
 
     chunk(): data(new raw_bytes), read_idx(0), write_idx(0), next(nullptr) {}
+    explicit chunk(size_t capacity): data(new raw_bytes(capacity)), read_idx(0), write_idx(0), next(nullptr) {}
     chunk(const void* p, size_t n): data(new raw_bytes(p, n)), read_idx(0), write_idx(n), next(nullptr) {}
     ~chunk() { data->release(); }
 
@@ -1,14 +1,32 @@
 #include <string>
 
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 
 #include "client.h"
+#include "shm.h"
 
 using namespace std;
 
 namespace rpc {
 
+bool Future::spin_till_ready(double sec) {
+    double until = base::monotonic_time() + sec;
+    do {
+        // ready_ is set under ready_m_, good enough to peek at without it
+        if (__atomic_load_n(&ready_, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    } while (base::monotonic_time() < until);
+    return false;
+}
+
 void Future::wait() {
+    if (spin_sec_ > 0 && spin_till_ready(spin_sec_)) {
+        return;
+    }
     Pthread_mutex_lock(&ready_m_);
     while (!ready_ && !timed_out_) {
         Pthread_cond_wait(&ready_cond_, &ready_m_);
@@ -17,19 +35,25 @@ void Future::wait() {
 }
 
 void Future::timed_wait(double sec) {
+    // the deadline is taken once, so neither spinning nor spurious wakeups
+    // push it back
+    int full_sec = (int) sec;
+    int nsec = int((sec - full_sec) * 1000 * 1000 * 1000);
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    timespec abstime;
+    abstime.tv_sec = tv.tv_sec + full_sec;
+    abstime.tv_nsec = tv.tv_usec * 1000 + nsec;
+    if (abstime.tv_nsec >= 1000 * 1000 * 1000) {
+        abstime.tv_nsec -= 1000 * 1000 * 1000;
+        abstime.tv_sec += 1;
+    }
+
+    if (spin_sec_ > 0 && spin_till_ready(std::min(spin_sec_, sec))) {
+        return;
+    }
     Pthread_mutex_lock(&ready_m_);
     while (!ready_ && !timed_out_) {
-        int full_sec = (int) sec;
-        int nsec = int((sec - full_sec) * 1000 * 1000 * 1000);
-        struct timeval tv;
-        gettimeofday(&tv, nullptr);
-        timespec abstime;
-        abstime.tv_sec = tv.tv_sec + full_sec;
-        abstime.tv_nsec = tv.tv_usec * 1000 + nsec;
-        if (abstime.tv_nsec > 1000 * 1000 * 1000) {
-            abstime.tv_nsec -= 1000 * 1000 * 1000;
-            abstime.tv_sec += 1;
-        }
         Log::debug("wait for %lf", sec);
         int ret = pthread_cond_timedwait(&ready_cond_, &ready_m_, &abstime);
         if (ret == ETIMEDOUT) {
@@ -59,11 +83,85 @@ void Future::notify_ready() {
     }
 }
 
+/**
+ * The udp socket, retransmit timer or reconnect timer of a client, polled
+ * for reads. Holds a reference to the client till removed in its close().
+ */
+class ClientFdPollable: public Pollable {
+    RefCounted* cl_;
+    int fd_;
+    std::function<void()> on_read_;
+
+protected:
+
+    ~ClientFdPollable() {
+        cl_->release();
+    }
+
+public:
+
+    ClientFdPollable(RefCounted* cl, int fd, const std::function<void()>& on_read)
+        : cl_(cl->ref_copy()), fd_(fd), on_read_(on_read) { }
+
+    int fd() {
+        return fd_;
+    }
+    int poll_mode() {
+        return Pollable::READ;
+    }
+    void handle_read() {
+        on_read_();
+    }
+    void handle_write() { }
+    void handle_error() {
+        // neither breaks, lost udp calls are timed out
+    }
+};
+
+Counter Client::udp_client_ids_s;
+
+Client::Client(PollMgr* pollmgr)
+        : udp_sock_(-1), udp_sa_(nullptr), udp_client_id_(udp_client_ids_s.next()),
+          udp_rto_(0.05), udp_max_sends_(5), udp_reader_(nullptr), udp_timer_(nullptr),
+          udp_timer_fd_(-1), udp_timer_armed_(false), udp_in_buf_(nullptr), udp_started_(false),
+          pollmgr_(pollmgr), sock_(-1), connecting_(false), status_(NEW), shm_(nullptr), next_addr_(0), reconnect_min_(0.0),
+          reconnect_max_(0.0), reconnect_backoff_(0.0), reconnect_timer_(nullptr), reconnect_timer_fd_(-1),
+          bmark_(nullptr), request_size_(-1), compress_threshold_(0), compression_asked_(false), req_out_(&out_),
+          req_fu_(nullptr), req_out_before_(0), out_high_watermark_(0), out_low_watermark_(0), out_full_(false),
+          n_pending_(0) {
+    Pthread_mutex_init(&out_drained_m_, nullptr);
+    Pthread_cond_init(&out_drained_cond_, nullptr);
+}
+
 Client::~Client() {
     if (udp_sa_ != nullptr) {
         free(udp_sa_);
     }
+    if (udp_sock_ != -1) {
+        ::close(udp_sock_);
+    }
+    if (udp_timer_fd_ != -1) {
+        ::close(udp_timer_fd_);
+    }
+    if (reconnect_timer_fd_ != -1) {
+        ::close(reconnect_timer_fd_);
+    }
+    delete shm_;
+    for (auto& shm: old_shms_) {
+        delete shm;
+    }
+    delete[] udp_in_buf_;
+    for (auto& it: udp_threads_) {
+        delete it.second;
+    }
     invalidate_pending_futures();
+    Pthread_mutex_destroy(&out_drained_m_);
+    Pthread_cond_destroy(&out_drained_cond_);
+}
+
+void Client::record_call(Future* fu, size_t reply_size) {
+    i64 rtt_ns = (i64) ((base::monotonic_time() - fu->start_time_) * 1e9);
+    metrics_.record_call(fu->rpc_id_, fu->error_code_, reply_size, fu->request_size_, &rtt_ns, 1);
 }
 
 void Client::invalidate_pending_futures() {
@@ -73,42 +171,185 @@ void Client::invalidate_pending_futures() {
         futures.push_back(it.second);
     }
     pending_fu_.clear();
+    n_pending_ = pending_fu_.size();
+    udp_calls_.clear();
     pending_fu_l_.unlock();
 
     for (auto& fu: futures) {
         if (fu != nullptr) {
             fu->error_code_ = ENOTCONN;
+            record_call(fu, 0);
             fu->notify_ready();
 
             // since we removed it from pending_fu_
             fu->release();
         }
     }
+
+    list<ClientStream*> streams;
+    pending_fu_l_.lock();
+    for (auto& it: streams_) {
+        streams.push_back(it.second);
+    }
+    streams_.clear();
+    pending_fu_l_.unlock();
+
+    for (auto& st: streams) {
+        st->on_close();
+        st->release();
+    }
+}
+
+bool Client::cancel(Future* fu) {
+    pending_fu_l_.lock();
+    unordered_map<i64, Future*>::iterator it = pending_fu_.find(fu->xid_);
+    bool found = (it != pending_fu_.end() && it->second == fu);
+    ClientStream* st = nullptr;
+    if (found) {
+        pending_fu_.erase(it);
+        n_pending_ = pending_fu_.size();
+        udp_calls_.erase(fu->xid_);
+        unordered_map<i64, ClientStream*>::iterator st_it = streams_.find(fu->xid_);
+        if (st_it != streams_.end()) {
+            st = st_it->second;
+            streams_.erase(st_it);
+        }
+    }
+    pending_fu_l_.unlock();
+
+    if (found) {
+        fu->error_code_ = ECANCELED;
+        record_call(fu, 0);
+        fu->notify_ready();
+
+        // since we removed it from pending_fu_
+        fu->release();
+
+        if (st != nullptr) {
+            st->on_close();
+            st->release();
+        }
+    }
+    return found;
+}
+
+ClientStream::ClientStream(Client* cl, Future* fu)
+        : Stream(fu->xid_), cl_((Client *) cl->ref_copy()), fu_(fu), write_closed_(false) {
+}
+
+ClientStream::~ClientStream() {
+    fu_->release();
+    cl_->release();
+}
+
+int ClientStream::send_data(Marshal& payload) {
+    return cl_->write_stream_frame(xid_, STREAM_DATA, &payload);
+}
+
+void ClientStream::send_end() {
+    if (!write_closed_) {
+        write_closed_ = true;
+        cl_->write_stream_frame(xid_, STREAM_END, nullptr);
+    }
+}
+
+void ClientStream::send_credit(size_t n_bytes) {
+    Marshal m;
+    m << v64(n_bytes);
+    cl_->write_stream_frame(xid_, STREAM_CREDIT, &m);
+}
+
+Future* ClientStream::finish() {
+    close_write();
+    Marshal* frame;
+    while ((frame = read_frame()) != nullptr) {
+        delete frame;
+    }
+    fu_->wait();
+    return fu_;
 }
 
 void Client::close() {
+    sock_l_.lock();
     if (status_ == CONNECTED) {
         pollmgr_->remove(this);
-        ::close(sock_);
+        if (sock_ != -1) {
+            ::close(sock_);
+        }
     }
     status_ = CLOSED;
+    if (reconnect_timer_ != nullptr) {
+        pollmgr_->remove(reconnect_timer_);
+        reconnect_timer_->release();
+        reconnect_timer_ = nullptr;
+    }
+    sock_l_.unlock();
+
+    udp_l_.lock();
+    if (udp_reader_ != nullptr) {
+        pollmgr_->remove(udp_reader_);
+        pollmgr_->remove(udp_timer_);
+        udp_reader_->release();
+        udp_timer_->release();
+        udp_reader_ = nullptr;
+        udp_timer_ = nullptr;
+    }
+    udp_l_.unlock();
+
+    // wake up requests blocked on full output buffer
+    Pthread_mutex_lock(&out_drained_m_);
+    Pthread_cond_broadcast(&out_drained_cond_);
+    Pthread_mutex_unlock(&out_drained_m_);
+
     invalidate_pending_futures();
 }
 
+int Client::open_sock(bool nonblocking, bool* in_progress) {
+    *in_progress = false;
+    const char* path = unix_path(addr_.c_str());
+    if (path != nullptr) {
+        return unix_connect(path);
+    }
+    const char* shm_name = ShmChannel::addr_name(addr_.c_str());
+    if (shm_name == nullptr) {
+        *in_progress = nonblocking;
+        next_addr_ = 0;
+        return tcp_connect(addr_.c_str(), nonblocking, &next_addr_);
+    }
+
+    // same host, connected right away either way
+    ShmChannel* shm = ShmChannel::connect(shm_name);
+    if (shm == nullptr) {
+        return -1;
+    }
+    if (shm_ != nullptr) {
+        old_shms_.push_back(shm_);
+    }
+    shm_ = shm;
+    return shm_->fd();
+}
+
+void Client::reset_fd_table() {
+    FdTable* fdt = new FdTable;
+    in_.set_fd_table(fdt);
+    out_.set_fd_table(fdt);
+    packet_.set_fd_table(fdt);
+    fdt->release();
+}
+
 int Client::connect(const char* addr) {
     verify(status_ != CONNECTED);
+    addr_ = addr;
 
-    sock_ = tcp_connect(addr);
+    bool in_progress;
+    sock_ = open_sock(false, &in_progress);
     if (sock_ == -1) {
         Log_error("rpc::Client: connect(%s): %s", addr, strerror(errno));
-        goto err_out;
+        return ENOTCONN;
     }
     verify(set_nonblocking(sock_, true) == 0);
-
-    udp_sock_ = udp_connect(addr, &udp_sa_, &udp_salen_);
-    if (udp_sock_ == -1) {
-        Log_error("rpc::Client: connect(%s): %s (UDP)", addr, strerror(errno));
-        goto err_out;
+    if (unix_path(addr) != nullptr) {
+        reset_fd_table();
     }
 
     Log_debug("rpc::Client: connected to %s", addr);
@@ -116,20 +357,172 @@ int Client::connect(const char* addr) {
     pollmgr_->add(this);
 
     return 0;
+}
 
-err_out:
+int Client::async_connect(const char* addr) {
+    verify(status_ != CONNECTED);
+    addr_ = addr;
 
-    if (sock_ != -1) {
-        ::close(sock_);
+    bool in_progress;
+    sock_ = open_sock(true, &in_progress);
+    if (sock_ == -1) {
+        Log_error("rpc::Client: connect(%s): %s", addr, strerror(errno));
+        return ENOTCONN;
     }
-    if (udp_sock_ != -1) {
-        ::close(udp_sock_);
+    verify(set_nonblocking(sock_, true) == 0);
+    if (unix_path(addr) != nullptr) {
+        reset_fd_table();
+    }
+
+    // finished in handle_write()
+    connecting_ = in_progress;
+    status_ = CONNECTED;
+    pollmgr_->add(this);
+
+    return 0;
+}
+
+void Client::set_reconnect(double min_backoff, double max_backoff) {
+    verify(min_backoff > 0 && max_backoff >= min_backoff);
+    reconnect_min_ = min_backoff;
+    reconnect_max_ = max_backoff;
+    reconnect_backoff_ = min_backoff;
+}
+
+void Client::arm_reconnect_timer() {
+    if (reconnect_timer_ == nullptr) {
+        reconnect_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        verify(reconnect_timer_fd_ != -1);
+        reconnect_timer_ = new ClientFdPollable(this, reconnect_timer_fd_, [this] {
+            uint64_t n_expirations;
+            if (read(reconnect_timer_fd_, &n_expirations, sizeof(n_expirations)) > 0) {
+                reconnect();
+            }
+        });
+        pollmgr_->add(reconnect_timer_);
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t) reconnect_backoff_;
+    its.it_value.tv_nsec = (long) ((reconnect_backoff_ - its.it_value.tv_sec) * 1e9);
+    verify(timerfd_settime(reconnect_timer_fd_, 0, &its, nullptr) == 0);
+    Log_info("rpc::Client: reconnecting to %s in %.3lf sec", addr_.c_str(), reconnect_backoff_);
+    reconnect_backoff_ = std::min(2 * reconnect_backoff_, reconnect_max_);
+}
+
+void Client::reconnect_later() {
+    sock_l_.lock();
+    if (status_ != CONNECTED || sock_ == -1) {
+        // closed, or already waiting to reconnect
+        sock_l_.unlock();
+        return;
+    }
+    pollmgr_->remove(this);
+    ::close(sock_);
+
+    // whatever was not sent belongs to calls failed below
+    out_l_.lock();
+    sock_ = -1;
+    connecting_ = true;
+    out_.discard(out_.content_size());
+    in_.discard(in_.content_size());
+    if (in_.fd_table() != nullptr) {
+        // fds are numbered anew on the next connection
+        reset_fd_table();
+    }
+    out_l_.unlock();
+
+    arm_reconnect_timer();
+    sock_l_.unlock();
+
+    // wake up requests blocked on full output buffer
+    Pthread_mutex_lock(&out_drained_m_);
+    Pthread_cond_broadcast(&out_drained_cond_);
+    Pthread_mutex_unlock(&out_drained_m_);
+
+    invalidate_pending_futures();
+}
+
+void Client::reconnect() {
+    sock_l_.lock();
+    if (status_ == CONNECTED && sock_ == -1) {
+        bool in_progress;
+        int sock = open_sock(true, &in_progress);
+        if (sock == -1) {
+            arm_reconnect_timer();
+        } else {
+            verify(set_nonblocking(sock, true) == 0);
+            out_l_.lock();
+            sock_ = sock;
+            if (!in_progress) {
+                connecting_ = false;
+                reconnect_backoff_ = reconnect_min_;
+            }
+            out_l_.unlock();
+            pollmgr_->add(this);
+        }
+    }
+    sock_l_.unlock();
+}
+
+int Client::connect_status() {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock_, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+        return errno;
+    }
+    if (err != 0) {
+        return err;
     }
-    return ENOTCONN;
+    struct pollfd pfd;
+    pfd.fd = sock_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) != 1) {
+        return EINPROGRESS;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+        // failed right after SO_ERROR was read
+        if (getsockopt(sock_, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err == 0) {
+            err = ECONNREFUSED;
+        }
+        return err;
+    }
+    return 0;
+}
+
+bool Client::connect_next_addr() {
+    bool ok = false;
+    sock_l_.lock();
+    if (status_ == CONNECTED && connecting_ && sock_ != -1 && shm_ == nullptr) {
+        int sock = tcp_connect(addr_.c_str(), true, &next_addr_);
+        if (sock != -1) {
+            pollmgr_->remove(this);
+            ::close(sock_);
+            out_l_.lock();
+            sock_ = sock;
+            out_l_.unlock();
+            pollmgr_->add(this);
+            ok = true;
+        }
+    }
+    sock_l_.unlock();
+    return ok;
 }
 
 void Client::handle_error() {
-    close();
+    if (connecting_ && sock_ != -1) {
+        // the error might be of a socket connect_next_addr() has replaced
+        // already, handle_write() tells
+        handle_write();
+        return;
+    }
+    if (reconnect_min_ > 0) {
+        reconnect_later();
+    } else {
+        close();
+    }
 }
 
 void Client::handle_write() {
@@ -138,20 +531,65 @@ void Client::handle_write() {
     }
 
     out_l_.lock();
-    out_.write_to_fd(sock_);
+    if (connecting_) {
+        if (sock_ == -1) {
+            // waiting to reconnect
+            out_l_.unlock();
+            return;
+        }
+        int err = connect_status();
+        if (err == EINPROGRESS) {
+            out_l_.unlock();
+            return;
+        }
+        if (err != 0) {
+            out_l_.unlock();
+            Log_error("rpc::Client: connect(%s): %s", addr_.c_str(), strerror(err));
+            if (connect_next_addr()) {
+                return;
+            }
+            if (reconnect_min_ > 0) {
+                reconnect_later();
+            } else {
+                close();
+            }
+            return;
+        }
+        connecting_ = false;
+        reconnect_backoff_ = reconnect_min_;
+        Log_debug("rpc::Client: connected to %s", addr_.c_str());
+    }
+    if (shm_ != nullptr) {
+        shm_->write_from(&out_);
+    } else {
+        out_.write_to_fd(sock_);
+    }
 
     if (out_.empty()) {
         pollmgr_->update_mode(this, Pollable::READ);
     }
+    if (out_full_ && out_.content_size() <= out_low_watermark_) {
+        out_full_ = false;
+        Pthread_mutex_lock(&out_drained_m_);
+        Pthread_cond_broadcast(&out_drained_cond_);
+        Pthread_mutex_unlock(&out_drained_m_);
+    }
     out_l_.unlock();
 }
 
 void Client::handle_read() {
-    if (status_ != CONNECTED) {
+    if (status_ != CONNECTED || connecting_) {
         return;
     }
 
-    int bytes_read = in_.read_from_fd(sock_);
+    int bytes_read;
+    if (shm_ != nullptr) {
+        // the doorbell might as well be telling there is room for more output
+        handle_write();
+        bytes_read = shm_->read_into(&in_);
+    } else {
+        bytes_read = in_.read_from_fd(sock_);
+    }
     if (bytes_read == 0) {
         return;
     }
@@ -159,14 +597,36 @@ void Client::handle_read() {
     for (;;) {
         i32 packet_size;
         int n_peek = in_.peek(&packet_size, sizeof(i32));
-        if (n_peek == sizeof(i32) && in_.content_size() >= packet_size + sizeof(i32)) {
+        if (n_peek == sizeof(i32) && in_.content_size() >= (packet_size & PACKET_SIZE_MASK) + sizeof(i32)) {
             // consume the packet size
             verify(in_.read(&packet_size, sizeof(i32)) == sizeof(i32));
 
+            Marshal unpacked;
+            Marshal* pkt = &in_;
+            if (packet_size & PACKET_COMPRESSED) {
+                ssize_t raw_size = -1;
+                if (compression_asked_) {
+                    raw_size = read_compressed_packet(in_, packet_size & PACKET_SIZE_MASK, &unpacked);
+                }
+                if (raw_size < 0) {
+                    Log_error("rpc::Client: bad compressed packet from %s, closing", addr_.c_str());
+                    handle_error();
+                    return;
+                }
+                packet_size = raw_size;
+                pkt = &unpacked;
+            }
+
             v64 v_reply_xid;
             v32 v_error_code;
 
-            in_ >> v_reply_xid >> v_error_code;
+            *pkt >> v_reply_xid >> v_error_code;
+            size_t reply_size = packet_size - v_reply_xid.val_size() - v_error_code.val_size();
+
+            if (v_error_code.get() == STREAM_REPLY_DATA || v_error_code.get() == STREAM_REPLY_CREDIT) {
+                handle_stream_frame(*pkt, v_reply_xid.get(), v_error_code.get(), reply_size);
+                continue;
+            }
 
             pending_fu_l_.lock();
             unordered_map<i64, Future*>::iterator it = pending_fu_.find(v_reply_xid.get());
@@ -174,18 +634,38 @@ void Client::handle_read() {
                 Future* fu = it->second;
                 verify(fu->xid_ == v_reply_xid.get());
                 pending_fu_.erase(it);
+                n_pending_ = pending_fu_.size();
+
+                // reply of a 'stream' RPC also ends the stream
+                ClientStream* st = nullptr;
+                if (!streams_.empty()) {
+                    unordered_map<i64, ClientStream*>::iterator st_it = streams_.find(v_reply_xid.get());
+                    if (st_it != streams_.end()) {
+                        st = st_it->second;
+                        streams_.erase(st_it);
+                    }
+                }
                 pending_fu_l_.unlock();
 
                 fu->error_code_ = v_error_code.get();
-                fu->reply_.read_from_marshal(in_, packet_size - v_reply_xid.val_size() - v_error_code.val_size());
+                if (reply_size > 0) {
+                    fu->reply_.read_from_marshal(*pkt, reply_size);
+                }
+                record_call(fu, sizeof(i32) + packet_size);
 
                 fu->notify_ready();
 
                 // since we removed it from pending_fu_
                 fu->release();
+
+                if (st != nullptr) {
+                    st->on_close();
+                    st->release();
+                }
             } else {
                 // the future might timed out
                 pending_fu_l_.unlock();
+                pkt->discard(reply_size);
             }
 
         } else {
@@ -195,26 +675,157 @@ void Client::handle_read() {
     }
 }
 
+void Client::handle_stream_frame(Marshal& in, i64 xid, i32 frame_type, size_t frame_size) {
+    ClientStream* st = nullptr;
+    pending_fu_l_.lock();
+    unordered_map<i64, ClientStream*>::iterator it = streams_.find(xid);
+    if (it != streams_.end()) {
+        st = (ClientStream *) it->second->ref_copy();
+    }
+    pending_fu_l_.unlock();
+
+    if (st == nullptr) {
+        // stream already finished
+        in.discard(frame_size);
+        return;
+    }
+
+    if (frame_type == STREAM_REPLY_DATA) {
+        Marshal* frame = new Marshal;
+        if (frame_size > 0) {
+            frame->read_from_marshal(in, frame_size);
+        }
+        st->on_data(frame);
+    } else {
+        size_t size_before = in.content_size();
+        v64 n_bytes;
+        in >> n_bytes;
+        in.discard(frame_size - (size_before - in.content_size()));
+        st->on_credit(n_bytes.get());
+    }
+    st->release();
+}
+
+// <size> <xid> <frame_type> <payload>
+int Client::write_stream_frame(i64 xid, i32 frame_type, Marshal* payload) {
+    out_l_.lock();
+    if (status_ != CONNECTED) {
+        out_l_.unlock();
+        return ENOTCONN;
+    }
+
+    v64 v_xid = xid;
+    size_t payload_size = (payload != nullptr) ? payload->content_size() : 0;
+    if (compress_threshold_ > 0 && payload_size >= compress_threshold_) {
+        Marshal packet;
+        packet << v_xid << frame_type;
+        packet.read_from_marshal(*payload, payload_size);
+        write_packet(&out_, packet, compress_threshold_);
+    } else {
+        i32 frame_size = v_xid.val_size() + sizeof(i32) + payload_size;
+        out_ << frame_size << v_xid << frame_type;
+        if (payload_size > 0) {
+            out_.read_from_marshal(*payload, payload_size);
+        }
+    }
+    out_.get_and_reset_write_cnt();
+
+    pollmgr_->update_mode(this, Pollable::READ | Pollable::WRITE);
+    out_l_.unlock();
+    return 0;
+}
+
+ClientStream* Client::open_stream(Future* fu) {
+    ClientStream* st = new ClientStream(this, fu);
+    pending_fu_l_.lock();
+    streams_[fu->xid_] = (ClientStream *) st->ref_copy();
+    pending_fu_l_.unlock();
+    return st;
+}
+
+int Client::enable_compression(size_t threshold) {
+    verify(threshold > 0);
+    i32 v_threshold = std::min(threshold, (size_t) PACKET_SIZE_MASK);
+    // the server may compress replies as soon as it has agreed
+    compression_asked_ = true;
+    Future* fu = begin_request(COMPRESSION_NEGOTIATE, FutureAttr(), marshal_size(v_threshold));
+    if (fu != nullptr) {
+        *this << v_threshold;
+    }
+    end_request();
+    if (fu == nullptr) {
+        return ENOTCONN;
+    }
+
+    int ret = fu->get_error_code();
+    fu->release();
+    if (ret == 0) {
+        out_l_.lock();
+        compress_threshold_ = v_threshold;
+        out_l_.unlock();
+    }
+    return ret;
+}
+
+// must hold out_l_, which is released while waiting
+void Client::wait_for_output_drained() {
+    while (status_ == CONNECTED && out_high_watermark_ > 0 && out_.content_size() > out_low_watermark_) {
+        out_full_ = true;
+        // handle_write() signals with out_l_ held, and close() changes status_
+        // before signaling, so no wakeup is lost
+        Pthread_mutex_lock(&out_drained_m_);
+        out_l_.unlock();
+        if (status_ == CONNECTED) {
+            Pthread_cond_wait(&out_drained_cond_, &out_drained_m_);
+        }
+        Pthread_mutex_unlock(&out_drained_m_);
+        out_l_.lock();
+    }
+}
+
+void Client::set_output_watermarks(size_t high, size_t low) {
+    verify(high == 0 || low < high);
+    out_l_.lock();
+    out_high_watermark_ = high;
+    out_low_watermark_ = low;
+    out_l_.unlock();
+}
+
+size_t Client::output_buffer_size() {
+    out_l_.lock();
+    size_t sz = out_.content_size();
+    out_l_.unlock();
+    return sz;
+}
+
 int Client::poll_mode() {
     int mode = Pollable::READ;
     out_l_.lock();
-    if (!out_.empty()) {
+    if (connecting_ || !out_.empty()) {
         mode |= Pollable::WRITE;
     }
     out_l_.unlock();
     return mode;
 }
 
-Future* Client::begin_request(i32 rpc_id, const FutureAttr& attr /* =... */) {
+Future* Client::begin_request(i32 rpc_id, const FutureAttr& attr /* =... */, size_t args_size /* =... */) {
     out_l_.lock();
 
+    if (out_high_watermark_ > 0 && out_.content_size() > out_high_watermark_) {
+        wait_for_output_drained();
+    }
+
     if (status_ != CONNECTED) {
         return nullptr;
     }
 
     Future* fu = new Future(xid_counter_.next(), attr);
+    fu->rpc_id_ = rpc_id;
+    fu->spin_sec_ = pollmgr_->future_spin_sec();
+    fu->start_time_ = base::monotonic_time();
     pending_fu_l_.lock();
     pending_fu_[fu->xid_] = fu;
+    n_pending_ = pending_fu_.size();
     pending_fu_l_.unlock();
 
     // check if the client gets closed in the meantime
@@ -224,16 +835,40 @@ Future* Client::begin_request(i32 rpc_id, const FutureAttr& attr /* =... */) {
         if (it != pending_fu_.end()) {
             it->second->release();
             pending_fu_.erase(it);
+            n_pending_ = pending_fu_.size();
         }
         pending_fu_l_.unlock();
 
         return nullptr;
     }
 
-    bmark_ = out_.set_bookmark(sizeof(i32)); // will fill packet size later
+    metrics_.record_start(rpc_id);
+    req_fu_ = fu;
+    req_out_before_ = out_.content_size();
+
+    // calls made within a traced request join its trace
+    const TraceContext& trace = current_trace();
+    size_t header_size = sizeof(i32) + (trace.traced() ? TRACE_HEADER_SIZE : 0);
 
-    *this << v64(fu->xid_);
-    *this << rpc_id;
+    v64 v_xid = fu->xid_;
+    if (compress_threshold_ > 0 && (args_size == marshal_size_unknown || args_size >= compress_threshold_)) {
+        // packet size is written in end_request()
+        req_out_ = &packet_;
+    } else if (args_size != marshal_size_unknown) {
+        request_size_ = v_xid.val_size() + header_size + args_size;
+        out_.reserve(sizeof(i32) + request_size_);
+        *this << request_size_;
+    } else {
+        bmark_ = out_.set_bookmark(sizeof(i32)); // will fill packet size later
+    }
+
+    *this << v_xid;
+    if (trace.traced()) {
+        i8 flags = trace.sampled ? TRACE_SAMPLED : 0;
+        *this << (rpc_id | RPC_ID_TRACED) << trace.trace_id << trace.span_id << flags;
+    } else {
+        *this << rpc_id;
+    }
 
     // one ref is already in pending_fu_
     return (Future *) fu->ref_copy();
@@ -241,11 +876,32 @@ Future* Client::begin_request(i32 rpc_id, const FutureAttr& attr /* =... */) {
 
 void Client::end_request() {
     // set reply size in packet
-    if (bmark_ != nullptr) {
+    if (req_out_ == &packet_) {
+        if (status_ == CONNECTED) {
+            write_packet(&out_, packet_, compress_threshold_);
+            out_.get_and_reset_write_cnt();
+        }
+        packet_.discard(packet_.content_size());
+        packet_.get_and_reset_write_cnt();
+        req_out_ = &out_;
+    } else if (bmark_ != nullptr) {
         i32 request_size = out_.get_and_reset_write_cnt();
         out_.write_bookmark(bmark_, &request_size);
         delete bmark_;
         bmark_ = nullptr;
+    } else if (request_size_ >= 0) {
+        // packet size already written, make sure it was right (nothing gets written if closed)
+        i32 write_cnt = out_.get_and_reset_write_cnt();
+        verify(status_ != CONNECTED || write_cnt == (i32) sizeof(i32) + request_size_);
+        request_size_ = -1;
+    }
+
+    if (req_fu_ != nullptr) {
+        // a reply cannot come back before the request is out of out_l_
+        if (status_ == CONNECTED) {
+            req_fu_->request_size_ = out_.content_size() - req_out_before_;
+        }
+        req_fu_ = nullptr;
     }
 
     // always enable write events since the code above gauranteed there
@@ -255,37 +911,558 @@ void Client::end_request() {
     out_l_.unlock();
 }
 
-// <size> <rpc_id> <arg1> <arg2> ... <argN>
-void Client::begin_udp_request(i32 rpc_id) {
+Client::udp_thread* Client::udp_local() {
+    // client ids are never reused, so entries of deleted clients never match
+    static thread_local i64 t_last_client = -1;
+    static thread_local udp_thread* t_last = nullptr;
+    if (t_last_client == udp_client_id_) {
+        return t_last;
+    }
+
+    static Counter thread_ids;
+    static thread_local i64 t_thread_id = -1;
+    static thread_local unordered_map<i64, udp_thread*> t_clients;
+    if (t_thread_id == -1) {
+        t_thread_id = thread_ids.next();
+    }
+    udp_thread* ut;
+    unordered_map<i64, udp_thread*>::iterator it = t_clients.find(udp_client_id_);
+    if (it != t_clients.end()) {
+        ut = it->second;
+    } else {
+        udp_l_.lock();
+        udp_thread*& slot = udp_threads_[t_thread_id];
+        if (slot == nullptr) {
+            slot = new udp_thread;
+        }
+        ut = slot;
+        udp_l_.unlock();
+        if (t_clients.size() >= 1024) {
+            // mostly clients gone by now
+            t_clients.clear();
+        }
+        t_clients[udp_client_id_] = ut;
+    }
+    t_last_client = udp_client_id_;
+    t_last = ut;
+    return ut;
+}
+
+// payload_size excludes <size> itself
+void Client::begin_udp_datagram(udp_thread* ut, size_t payload_size) {
+    Marshal& m = ut->buf.base();
+    if (payload_size != marshal_size_unknown && sizeof(i32) + payload_size <= UdpBuffer::max_udp_packet_size_s) {
+        // in one piece, sent straight from the buffer
+        ut->size = sizeof(i32) + payload_size;
+        m.reserve(ut->size);
+        m << (i32) payload_size;
+    } else {
+        ut->size = 0;
+        ut->bmark = m.set_bookmark(sizeof(i32)); // will fill packet size later
+    }
+}
+
+size_t Client::end_udp_datagram(udp_thread* ut) {
+    Marshal& m = ut->buf.base();
+    i32 write_cnt = m.get_and_reset_write_cnt();
+    if (ut->bmark != nullptr) {
+        m.write_bookmark(ut->bmark, &write_cnt);
+        delete ut->bmark;
+        ut->bmark = nullptr;
+        return sizeof(i32) + write_cnt;
+    }
+    // packet size already written, make sure it was right
+    verify(write_cnt == (i32) ut->size);
+    return ut->size;
+}
+
+int Client::open_udp_socket() {
     udp_l_.lock();
-    udp_bmark_ = udp_.base().set_bookmark(sizeof(i32)); // will fill packet size later
-    udp_ << rpc_id;
+    if (udp_sock_ == -1) {
+        int sock = udp_connect(addr_.c_str(), &udp_sa_, &udp_salen_);
+        if (sock == -1) {
+            Log_error("rpc::Client: connect(%s): %s (UDP)", addr_.c_str(), strerror(errno));
+        }
+        // udp_sa_ is set before the socket is seen
+        __sync_synchronize();
+        udp_sock_ = sock;
+    }
+    udp_l_.unlock();
+    return (udp_sock_ == -1) ? ENOTCONN : 0;
 }
 
-int Client::end_udp_request() {
-    i32 payload_size = udp_.base().get_and_reset_write_cnt();
-    if (udp_bmark_ != nullptr) {
-        udp_.base().write_bookmark(udp_bmark_, &payload_size);
-        delete udp_bmark_;
-        udp_bmark_ = nullptr;
+// <size> <rpc_id> <arg1> <arg2> ... <argN>
+void Client::begin_udp_request(i32 rpc_id, size_t args_size /* =? */) {
+    if (udp_sock_ == -1) {
+        // on failure the datagram is dropped by end_udp_request()
+        open_udp_socket();
     }
+    udp_thread* ut = udp_local();
+    begin_udp_datagram(ut, (args_size == marshal_size_unknown) ? args_size : sizeof(i32) + args_size);
+    ut->buf << rpc_id;
+}
+
+int Client::end_udp_request() {
+    udp_thread* ut = udp_local();
+    size_t size = end_udp_datagram(ut);
 
     int ret = 0;
-    size_t size = 0;
-    bool overflow = false;
-    char* buf = udp_.get_buf(&size, &overflow);
-    if (overflow) {
+    if (size > UdpBuffer::max_udp_packet_size_s) {
+        // send whatever was queued ahead of it, then drop it
+        send_udp_batch(ut);
+        ut->buf.base().discard(size);
         ret = E2BIG;
     } else {
-        sendto(udp_sock_, buf, size, 0, udp_sa_, udp_salen_);
+        ut->batch_sizes.push_back(size);
+        if (ut->batch_depth == 0 || ut->batch_sizes.size() >= max_udp_batch_s) {
+            ret = send_udp_batch(ut);
+        }
     }
-    udp_l_.unlock();
     return ret;
 }
 
+void Client::begin_udp_batch() {
+    udp_local()->batch_depth++;
+}
+
+int Client::end_udp_batch() {
+    udp_thread* ut = udp_local();
+    verify(ut->batch_depth > 0);
+    ut->batch_depth--;
+    if (ut->batch_depth == 0) {
+        return send_udp_batch(ut);
+    }
+    return 0;
+}
+
+int Client::send_udp_batch(udp_thread* ut) {
+    size_t n_msgs = ut->batch_sizes.size();
+    if (n_msgs == 0) {
+        return 0;
+    }
+    size_t total = 0;
+    for (auto& size: ut->batch_sizes) {
+        total += size;
+    }
+
+    // point straight into the buffer's chunks, split at datagram boundaries
+    ut->iov.clear();
+    verify(ut->buf.base().peek_iovecs(total, &ut->iov) == total);
+    ut->msg_iov.clear();
+    ut->msgs.resize(n_msgs);
+    size_t k = 0, offset = 0;
+    for (size_t i = 0; i < n_msgs; i++) {
+        memset(&ut->msgs[i], 0, sizeof(struct mmsghdr));
+        ut->msgs[i].msg_hdr.msg_iovlen = ut->msg_iov.size();  // first iovec, fixed up below
+        for (size_t left = ut->batch_sizes[i]; left > 0; ) {
+            struct iovec v;
+            v.iov_base = (char *) ut->iov[k].iov_base + offset;
+            v.iov_len = std::min(ut->iov[k].iov_len - offset, left);
+            ut->msg_iov.push_back(v);
+            left -= v.iov_len;
+            offset += v.iov_len;
+            if (offset == ut->iov[k].iov_len) {
+                k++;
+                offset = 0;
+            }
+        }
+    }
+    for (size_t i = 0; i < n_msgs; i++) {
+        struct msghdr* hdr = &ut->msgs[i].msg_hdr;
+        size_t first = hdr->msg_iovlen;
+        size_t last = (i + 1 < n_msgs) ? ut->msgs[i + 1].msg_hdr.msg_iovlen : ut->msg_iov.size();
+        hdr->msg_name = udp_sa_;
+        hdr->msg_namelen = udp_salen_;
+        hdr->msg_iov = &ut->msg_iov[first];
+        hdr->msg_iovlen = last - first;
+    }
+
+    int ret = 0;
+    size_t n_sent = 0;
+    while (n_sent < n_msgs) {
+        int cnt = sendmmsg(udp_sock_, &ut->msgs[n_sent], n_msgs - n_sent, 0);
+        if (cnt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // lossy anyway, the rest of the batch is dropped
+            ret = errno;
+            break;
+        }
+        n_sent += cnt;
+    }
+
+    ut->buf.base().discard(total);
+    ut->batch_sizes.clear();
+    return ret;
+}
+
+void Client::start_udp_calls() {
+    udp_l_.lock();
+    // close() changes status_ before removing them, so none is added after
+    if (!udp_started_ && status_ == CONNECTED) {
+        udp_in_buf_ = new char[UdpBuffer::max_udp_packet_size_s];
+        udp_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        verify(udp_timer_fd_ != -1);
+        udp_reader_ = new ClientFdPollable(this, udp_sock_, [this] {
+            handle_udp_read();
+        });
+        udp_timer_ = new ClientFdPollable(this, udp_timer_fd_, [this] {
+            uint64_t n_expirations;
+            if (read(udp_timer_fd_, &n_expirations, sizeof(n_expirations)) > 0) {
+                resend_udp_calls();
+            }
+        });
+        pollmgr_->add(udp_reader_);
+        pollmgr_->add(udp_timer_);
+        __sync_synchronize();
+        udp_started_ = true;
+    }
+    udp_l_.unlock();
+}
+
+void Client::arm_udp_timer(bool on) {
+    if (udp_timer_fd_ == -1 || on == udp_timer_armed_) {
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        // fine enough to resend close to rto
+        double tick = std::max(udp_rto_ / 4, 0.001);
+        its.it_value.tv_sec = (time_t) tick;
+        its.it_value.tv_nsec = (long) ((tick - its.it_value.tv_sec) * 1000 * 1000 * 1000);
+        its.it_interval = its.it_value;
+    }
+    verify(timerfd_settime(udp_timer_fd_, 0, &its, nullptr) == 0);
+    udp_timer_armed_ = on;
+}
+
+void Client::set_udp_retransmit(double rto, int max_sends) {
+    verify(rto > 0 && max_sends > 0);
+    pending_fu_l_.lock();
+    udp_rto_ = rto;
+    udp_max_sends_ = max_sends;
+    if (udp_timer_armed_) {
+        arm_udp_timer(false);
+        arm_udp_timer(true);
+    }
+    pending_fu_l_.unlock();
+}
+
+// <size> <rpc_id | reply_flag_s> <xid> <arg1> <arg2> ... <argN>
+Future* Client::begin_udp_call(i32 rpc_id, const FutureAttr& attr /* =... */, size_t args_size /* =... */) {
+    if (status_ != CONNECTED) {
+        return nullptr;
+    }
+    if (udp_sock_ == -1 && open_udp_socket() != 0) {
+        return nullptr;
+    }
+    if (!udp_started_) {
+        start_udp_calls();
+    }
+    udp_thread* ut = udp_local();
+
+    // queued requests of a batch go first, so the buffer holds only the call
+    send_udp_batch(ut);
+
+    Future* fu = new Future(xid_counter_.next(), attr);
+    fu->rpc_id_ = rpc_id;
+    fu->spin_sec_ = pollmgr_->future_spin_sec();
+    fu->start_time_ = base::monotonic_time();
+    pending_fu_l_.lock();
+    pending_fu_[fu->xid_] = fu;
+    n_pending_ = pending_fu_.size();
+    pending_fu_l_.unlock();
+
+    // check if the client gets closed in the meantime
+    if (status_ != CONNECTED) {
+        pending_fu_l_.lock();
+        unordered_map<i64, Future*>::iterator it = pending_fu_.find(fu->xid_);
+        if (it != pending_fu_.end()) {
+            it->second->release();
+            pending_fu_.erase(it);
+            n_pending_ = pending_fu_.size();
+        }
+        pending_fu_l_.unlock();
+        return nullptr;
+    }
+    metrics_.record_start(rpc_id);
+
+    ut->fu = fu;
+    size_t header_size = sizeof(i32) + sizeof(i64);
+    begin_udp_datagram(ut, (args_size == marshal_size_unknown) ? args_size : header_size + args_size);
+    ut->buf << (rpc_id | UdpBuffer::reply_flag_s) << fu->xid_;
+
+    // one ref is already in pending_fu_
+    return (Future *) fu->ref_copy();
+}
+
+void Client::end_udp_call() {
+    udp_thread* ut = udp_local();
+    Future* fu = ut->fu;
+    if (fu == nullptr) {
+        return;
+    }
+    ut->fu = nullptr;
+
+    size_t size = end_udp_datagram(ut);
+    if (size > UdpBuffer::max_udp_packet_size_s) {
+        ut->buf.base().discard(size);
+
+        pending_fu_l_.lock();
+        unordered_map<i64, Future*>::iterator it = pending_fu_.find(fu->xid_);
+        bool pending = (it != pending_fu_.end());
+        if (pending) {
+            pending_fu_.erase(it);
+            n_pending_ = pending_fu_.size();
+        }
+        pending_fu_l_.unlock();
+        if (pending) {
+            fu->error_code_ = E2BIG;
+            record_call(fu, 0);
+            fu->notify_ready();
+            fu->release();
+        }
+        return;
+    }
+
+    // kept for retransmission
+    string datagram(size, '\0');
+    verify(ut->buf.base().read(&datagram[0], size) == size);
+    fu->request_size_ = size;
+
+    pending_fu_l_.lock();
+    if (pending_fu_.find(fu->xid_) != pending_fu_.end()) {
+        udp_call& call = udp_calls_[fu->xid_];
+        call.datagram = datagram;
+        call.rto = udp_rto_;
+        call.resend_at = base::monotonic_time() + call.rto;
+        call.n_sends = 1;
+        arm_udp_timer(true);
+    }
+    pending_fu_l_.unlock();
+
+    sendto(udp_sock_, datagram.data(), datagram.size(), 0, udp_sa_, udp_salen_);
+}
+
+// <size> <xid> <error_code> <ret1> <ret2> ... <retN>
+void Client::handle_udp_read() {
+    const size_t header_size = 2 * sizeof(i32) + sizeof(i64);
+    for (;;) {
+        ssize_t cnt = recv(udp_sock_, udp_in_buf_, UdpBuffer::max_udp_packet_size_s, MSG_DONTWAIT);
+        if (cnt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (status_ != CONNECTED) {
+            break;
+        }
+        if ((size_t) cnt < header_size) {
+            continue;
+        }
+        i32 packet_size;
+        i64 xid;
+        i32 error_code;
+        memcpy(&packet_size, udp_in_buf_, sizeof(i32));
+        memcpy(&xid, udp_in_buf_ + sizeof(i32), sizeof(i64));
+        memcpy(&error_code, udp_in_buf_ + sizeof(i32) + sizeof(i64), sizeof(i32));
+        if ((size_t) packet_size + sizeof(i32) != (size_t) cnt) {
+            continue;
+        }
+
+        Future* fu = nullptr;
+        pending_fu_l_.lock();
+        unordered_map<i64, Future*>::iterator it = pending_fu_.find(xid);
+        if (it != pending_fu_.end()) {
+            fu = it->second;
+            pending_fu_.erase(it);
+            n_pending_ = pending_fu_.size();
+            udp_calls_.erase(xid);
+        }
+        pending_fu_l_.unlock();
+        if (fu == nullptr) {
+            // answer to a retransmission, or the call timed out
+            continue;
+        }
+
+        fu->error_code_ = error_code;
+        if ((size_t) cnt > header_size) {
+            fu->reply_.write(udp_in_buf_ + header_size, cnt - header_size);
+        }
+        record_call(fu, cnt);
+        fu->notify_ready();
+
+        // since we removed it from pending_fu_
+        fu->release();
+    }
+}
+
+void Client::resend_udp_calls() {
+    double now = base::monotonic_time();
+    list<string> resend;
+    list<Future*> timed_out;
+    pending_fu_l_.lock();
+    for (unordered_map<i64, udp_call>::iterator it = udp_calls_.begin(); it != udp_calls_.end(); ) {
+        udp_call& call = it->second;
+        if (call.resend_at > now) {
+            ++it;
+            continue;
+        }
+        if (call.n_sends >= udp_max_sends_) {
+            unordered_map<i64, Future*>::iterator fu_it = pending_fu_.find(it->first);
+            if (fu_it != pending_fu_.end()) {
+                timed_out.push_back(fu_it->second);
+                pending_fu_.erase(fu_it);
+                n_pending_ = pending_fu_.size();
+            }
+            it = udp_calls_.erase(it);
+            continue;
+        }
+        call.rto *= 2;
+        call.resend_at = now + call.rto;
+        call.n_sends++;
+        resend.push_back(call.datagram);
+        ++it;
+    }
+    if (udp_calls_.empty()) {
+        arm_udp_timer(false);
+    }
+    pending_fu_l_.unlock();
+
+    for (auto& datagram: resend) {
+        sendto(udp_sock_, datagram.data(), datagram.size(), 0, udp_sa_, udp_salen_);
+    }
+    for (auto& fu: timed_out) {
+        fu->error_code_ = ETIMEDOUT;
+        record_call(fu, 0);
+        fu->notify_ready();
+        fu->release();
+    }
+}
+
+
+ScatterGather::~ScatterGather() {
+    cancel_rest();
+
+    // callbacks running in poll threads still use this
+    l_.lock();
+    while (n_done_ < (int) calls_.size()) {
+        wake_at_ok_ = INT_MAX;
+        cv_.wait(l_);
+    }
+    l_.unlock();
+    for (auto& c : calls_) {
+        Future::safe_release(c.fu);
+    }
+}
+
+bool ScatterGather::add(Client* cl, const call_t& make_call) {
+    if (cl == nullptr) {
+        return false;
+    }
+    l_.lock();
+    size_t i = calls_.size();
+    calls_.push_back({cl, nullptr, false});
+    l_.unlock();
+
+    Future* fu = make_call(cl, FutureAttr([this, i] (Future* done_fu) {
+        on_done(i, done_fu);
+    }));
+
+    l_.lock();
+    calls_[i].fu = fu;
+    if (fu == nullptr && !calls_[i].done) {
+        calls_[i].done = true;
+        n_done_++;
+    }
+    l_.unlock();
+    return fu != nullptr;
+}
+
+void ScatterGather::on_done(size_t i, Future* fu) {
+    l_.lock();
+    calls_[i].done = true;
+    n_done_++;
+    if (fu->get_error_code() == 0) {
+        succeeded_.push_back(fu);
+    }
+    if ((int) succeeded_.size() >= wake_at_ok_ || n_done_ == (int) calls_.size()) {
+        cv_.signal();
+    }
+    l_.unlock();
+}
+
+int ScatterGather::wait(int n, double timeout /* =? */) {
+    double deadline = base::monotonic_time() + timeout;
+    l_.lock();
+    while ((int) succeeded_.size() < n && n_done_ < (int) calls_.size()) {
+        wake_at_ok_ = n;
+        if (timeout < 0) {
+            cv_.wait(l_);
+        } else {
+            double left = deadline - base::monotonic_time();
+            if (left <= 0) {
+                break;
+            }
+            cv_.timed_wait(l_, left);
+        }
+    }
+    wake_at_ok_ = 0;
+    int n_ok = succeeded_.size();
+    l_.unlock();
+    return n_ok;
+}
+
+void ScatterGather::cancel_rest() {
+    vector<call> rest;
+    l_.lock();
+    for (auto& c : calls_) {
+        if (!c.done && c.fu != nullptr) {
+            rest.push_back(c);
+        }
+    }
+    l_.unlock();
+
+    // callbacks take l_
+    for (auto& c : rest) {
+        c.cl->cancel(c.fu);
+    }
+}
+
+int ScatterGather::size() {
+    l_.lock();
+    int n = calls_.size();
+    l_.unlock();
+    return n;
+}
+
+int ScatterGather::n_done() {
+    l_.lock();
+    int n = n_done_;
+    l_.unlock();
+    return n;
+}
+
+Future* ScatterGather::future(int i) {
+    l_.lock();
+    Future* fu = calls_[i].fu;
+    l_.unlock();
+    return fu;
+}
+
+vector<Future*> ScatterGather::succeeded() {
+    l_.lock();
+    vector<Future*> ok = succeeded_;
+    l_.unlock();
+    return ok;
+}
 
 ClientPool::ClientPool(PollMgr* pollmgr /* =? */, int parallel_connections /* =? */)
-        : parallel_connections_(parallel_connections) {
+        : parallel_connections_(parallel_connections), cache_(new cache_map),
+          hedge_percentile_(95.0), hedge_budget_(0.05), hedge_tokens_(0.0) {
 
     verify(parallel_connections_ > 0);
     if (pollmgr == nullptr) {
@@ -296,46 +1473,262 @@ ClientPool::ClientPool(PollMgr* pollmgr /* =? */, int parallel_connections /* =?
 }
 
 ClientPool::~ClientPool() {
-    for (auto& it : cache_) {
+    for (auto& it : *cache_) {
+        connections* conns = it.second;
         for (int i = 0; i < parallel_connections_; i++) {
-            it.second[i]->close_and_release();
+            conns->clients[i]->close_and_release();
         }
-        delete[] it.second;
+        for (auto& r : conns->closed) {
+            r.cl->close_and_release();
+        }
+        delete[] conns->clients;
+        delete conns;
+    }
+    delete cache_;
+    for (auto& cache : old_caches_) {
+        delete cache;
     }
     pollmgr_->release();
 }
 
 Client* ClientPool::get_client(const string& addr) {
-    Client* cl = nullptr;
+    cache_map* cache = cache_;
+    cache_map::iterator it = cache->find(addr);
+    if (it != cache->end()) {
+        return pick(addr, it->second);
+    }
+
+    // resolving addr might block for long, so connect before taking l_,
+    // which would stall all other callers meanwhile
+    Client** parallel_clients = new Client*[parallel_connections_];
+    int i;
+    bool ok = true;
+    for (i = 0; i < parallel_connections_; i++) {
+        parallel_clients[i] = new Client(this->pollmgr_);
+        if (parallel_clients[i]->async_connect(addr.c_str()) != 0) {
+            ok = false;
+            break;
+        }
+    }
+    if (!ok) {
+        // close connections
+        while (i >= 0) {
+            parallel_clients[i]->close_and_release();
+            i--;
+        }
+        delete[] parallel_clients;
+        return nullptr;
+    }
+
+    connections* conns = nullptr;
     l_.lock();
-    map<string, Client**>::iterator it = cache_.find(addr);
-    if (it != cache_.end()) {
-        cl = it->second[rand_() % parallel_connections_];
+    cache = cache_;
+    it = cache->find(addr);
+    if (it != cache->end()) {
+        // another thread got there first
+        conns = it->second;
     } else {
-        Client** parallel_clients = new Client*[parallel_connections_];
-        int i;
-        bool ok = true;
+        conns = new connections;
+        conns->clients = parallel_clients;
+        parallel_clients = nullptr;
+        cache_map* updated = new cache_map(*cache);
+        insert_into_map(*updated, addr, conns);
+        old_caches_.push_back(cache);
+        __sync_synchronize();
+        cache_ = updated;
+    }
+    l_.unlock();
+
+    if (parallel_clients != nullptr) {
         for (i = 0; i < parallel_connections_; i++) {
-            parallel_clients[i] = new Client(this->pollmgr_);
-            if (parallel_clients[i]->connect(addr.c_str()) != 0) {
-                ok = false;
-                break;
+            parallel_clients[i]->close_and_release();
+        }
+        delete[] parallel_clients;
+    }
+    return pick(addr, conns);
+}
+
+Client* ClientPool::pick(const string& addr, connections* conns) {
+    static thread_local Rand rand;
+
+    // power of two choices, a closed client loses to anything
+    int i = rand.next(0, parallel_connections_);
+    Client* cl = conns->clients[i];
+    if (parallel_connections_ > 1) {
+        int j = rand.next(0, parallel_connections_ - 1);
+        if (j >= i) {
+            j++;
+        }
+        Client* other = conns->clients[j];
+        if (cl->closed() || (!other->closed() && other->n_pending() < cl->n_pending())) {
+            i = j;
+            cl = other;
+        }
+    }
+    if (!cl->closed()) {
+        return cl;
+    }
+
+    cl = reconnect(addr, conns, i);
+    if (cl == nullptr) {
+        // server might be down, any client still connected will do
+        for (int k = 0; k < parallel_connections_; k++) {
+            if (!conns->clients[k]->closed()) {
+                return conns->clients[k];
             }
         }
-        if (ok) {
-            cl = parallel_clients[rand_() % parallel_connections_];
-            insert_into_map(cache_, addr, parallel_clients);
+    }
+    return cl;
+}
+
+void ClientPool::sweep_closed(connections* conns, double now) {
+    list<retired>::iterator it = conns->closed.begin();
+    while (it != conns->closed.end()) {
+        if (now - it->since > retire_grace_s && it->cl->n_pending() == 0) {
+            it->cl->close_and_release();
+            it = conns->closed.erase(it);
         } else {
-            // close connections
-            while (i >= 0) {
-                parallel_clients[i]->close_and_release();
-                i--;
-            }
-            delete[] parallel_clients;
+            ++it;
         }
     }
-    l_.unlock();
+}
+
+Client* ClientPool::reconnect(const string& addr, connections* conns, int i) {
+    Client* cl;
+    conns->l.lock();
+    if (!conns->clients[i]->closed()) {
+        // done by another thread already
+        cl = conns->clients[i];
+    } else {
+        double now = base::monotonic_time();
+        sweep_closed(conns, now);
+        cl = new Client(pollmgr_);
+        if (cl->async_connect(addr.c_str()) == 0) {
+            retired r;
+            r.cl = (Client *) conns->clients[i];
+            r.since = now;
+            conns->closed.push_back(r);
+            __sync_synchronize();
+            conns->clients[i] = cl;
+        } else {
+            cl->close_and_release();
+            cl = nullptr;
+        }
+    }
+    conns->l.unlock();
     return cl;
 }
 
+void ClientPool::round_trips(const vector<string>& addrs, i32 rpc_id, Histogram* h) {
+    // replaced clients are released under conns->l, so hold on to them,
+    // and merge their metrics without the lock
+    vector<Client*> clients;
+    cache_map* cache = cache_;
+    for (auto& addr : addrs) {
+        cache_map::iterator it = cache->find(addr);
+        if (it == cache->end()) {
+            continue;
+        }
+        connections* conns = it->second;
+        conns->l.lock();
+        for (int i = 0; i < parallel_connections_; i++) {
+            clients.push_back((Client *) conns->clients[i]->ref_copy());
+        }
+        for (auto& r : conns->closed) {
+            clients.push_back((Client *) r.cl->ref_copy());
+        }
+        conns->l.unlock();
+    }
+    for (auto& cl : clients) {
+        RpcMetrics::Stats stats;
+        cl->metrics()->snapshot(rpc_id, &stats);
+        h->merge(stats.phases[0]);
+        // only the ref taken above, not close_and_release()
+        static_cast<RefCounted *>(cl)->release();
+    }
+}
+
+void ClientPool::refresh_hedge_delay(const vector<string>& addrs, i32 rpc_id, double percentile) {
+    Histogram now;
+    round_trips(addrs, rpc_id, &now);
+    Histogram recent = now;
+
+    hedge_l_.lock();
+    hedge_state& state = hedge_state_[rpc_id];
+    if (now.count() >= state.seen.count()) {
+        recent.subtract(state.seen);
+    }
+    // otherwise clients went away, and all that is left counts
+    if (recent.count() >= hedge_refresh_s / 2) {
+        state.hedge_after_ns = recent.percentile(percentile);
+        state.seen = now;
+        state.next_refresh = state.n_calls + hedge_refresh_s;
+    }
+    hedge_l_.unlock();
+}
+
+void ClientPool::set_hedging(double percentile, double budget) {
+    verify(percentile > 0 && percentile <= 100 && budget >= 0);
+    hedge_l_.lock();
+    hedge_percentile_ = percentile;
+    hedge_budget_ = budget;
+    hedge_l_.unlock();
+}
+
+Future* ClientPool::hedged_call(const vector<string>& addrs, i32 rpc_id, const ScatterGather::call_t& call) {
+    verify(!addrs.empty());
+    Client* primary = get_client(addrs[0]);
+    ScatterGather sg;
+    if (!sg.add(primary, call)) {
+        return nullptr;
+    }
+
+    hedge_l_.lock();
+    hedge_state& state = hedge_state_[rpc_id];
+    state.n_calls++;
+    bool refresh = state.n_calls >= state.next_refresh;
+    if (refresh) {
+        // pushed back further by a refresh that finds enough calls
+        state.next_refresh = state.n_calls + hedge_retry_s;
+    }
+    i64 hedge_after_ns = state.hedge_after_ns;
+    double percentile = hedge_percentile_;
+    hedge_tokens_ = std::min(hedge_tokens_ + hedge_budget_, (double) max_hedge_burst_s);
+    hedge_l_.unlock();
+
+    if (refresh) {
+        refresh_hedge_delay(addrs, rpc_id, percentile);
+    }
+
+    if (hedge_after_ns >= 0 && sg.wait(1, hedge_after_ns / 1e9) == 0 && sg.n_done() == 0) {
+        bool hedge = false;
+        hedge_l_.lock();
+        if (hedge_tokens_ >= 1.0) {
+            hedge_tokens_ -= 1.0;
+            hedge = true;
+        }
+        hedge_l_.unlock();
+
+        // a different connection, the slow one might be stuck behind others
+        Client* other = nullptr;
+        for (size_t i = 1; hedge && other == nullptr && i <= addrs.size(); i++) {
+            Client* cl = get_client(addrs[i % addrs.size()]);
+            if (cl != primary) {
+                other = cl;
+            }
+        }
+        if (other != nullptr && sg.add(other, call)) {
+            n_hedged_.next();
+        }
+    }
+    int n_ok = sg.wait(1);
+
+    Future* fu = (n_ok > 0) ? sg.succeeded()[0] : sg.future(0);
+
+    // the loser gets cancelled with sg
+    fu->ref_copy();
+    return fu;
 }
+
+}
+
@@ -1,14 +1,23 @@
 #pragma once
 
+#include <list>
+#include <string>
 #include <unordered_map>
 
+#include <sys/socket.h>
+
 #include "marshal.h"
 #include "polling.h"
+#include "stream.h"
+#include "compress.h"
+#include "metrics.h"
+#include "trace.h"
 
 namespace rpc {
 
 class Future;
 class Client;
+class ShmChannel;
 
 struct FutureAttr {
     FutureAttr(const std::function<void(Future*)>& cb = std::function<void(Future*)>()) : callback(cb) { }
@@ -19,10 +28,16 @@ struct FutureAttr {
 
 class Future: public RefCounted {
     friend class Client;
+    friend class ClientStream;
 
     i64 xid_;
     i32 error_code_;
 
+    // for Client::metrics()
+    i32 rpc_id_;
+    double start_time_;
+    size_t request_size_;
+
     FutureAttr attr_;
     Marshal reply_;
 
@@ -31,8 +46,14 @@ class Future: public RefCounted {
     pthread_cond_t ready_cond_;
     pthread_mutex_t ready_m_;
 
+    // PollMgr::future_spin_sec() of the client
+    double spin_sec_;
+
     void notify_ready();
 
+    // spin up to sec for the reply, true if it came
+    bool spin_till_ready(double sec);
+
 protected:
 
     // protected destructor as required by RefCounted.
@@ -44,7 +65,8 @@ protected:
 public:
 
     Future(i64 xid, const FutureAttr& attr = FutureAttr())
-            : xid_(xid), error_code_(0), attr_(attr), ready_(false), timed_out_(false) {
+            : xid_(xid), error_code_(0), rpc_id_(0), start_time_(0.0), request_size_(0),
+              attr_(attr), ready_(false), timed_out_(false), spin_sec_(0.0) {
         Pthread_mutex_init(&ready_m_, nullptr);
         Pthread_cond_init(&ready_cond_, nullptr);
     }
@@ -105,31 +127,284 @@ public:
     }
 };
 
-class Client: public Pollable {
+/**
+ * One call made to many clients and waited for together: till n of them
+ * succeed, all are done, or a timeout. Calls count down a shared counter from
+ * their Future callbacks, and the waiter is woken only once its count is
+ * reached, not for every reply. Calls left over can be cancelled, the
+ * destructor cancels them too. Clients must outlive the ScatterGather.
+ *
+ *   ScatterGather sg;
+ *   for (auto& addr : addrs) {
+ *       sg.add(pool->get_client(addr), [] (Client* cl, const FutureAttr& attr) {
+ *           return BenchmarkProxy(cl).async_ping(attr);
+ *       });
+ *   }
+ *   sg.wait(2, 0.1);  // a quorum of 2, or 100ms
+ *   sg.cancel_rest();
+ *
+ * More calls can be added after waiting, e.g. to hedge on another replica
+ * if nothing came back within a delay.
+ */
+class ScatterGather: public NoCopy {
+public:
+    // make the call on cl with attr, return its Future
+    typedef std::function<Future*(Client*, const FutureAttr&)> call_t;
+
+    ScatterGather(): n_done_(0), wake_at_ok_(0) { }
+    ~ScatterGather();
+
+    // false if the call could not be made, cl nullptr or closed
+    bool add(Client* cl, const call_t& make_call);
+
+    // till n calls succeeded or cannot anymore, timeout < 0 for none.
+    // returns the number of calls succeeded.
+    int wait(int n, double timeout = -1);
+
+    int wait_all(double timeout = -1) {
+        return wait(size(), timeout);
+    }
+
+    // calls not done yet fail with ECANCELED
+    void cancel_rest();
+
+    int size();
+    int n_done();
+
+    // Future of the i-th call added, nullptr if it could not be made
+    Future* future(int i);
+
+    // calls succeeded, in the order the replies came
+    std::vector<Future*> succeeded();
+
+private:
+    struct call {
+        Client* cl;
+        Future* fu;
+        bool done;
+    };
+
+    Mutex l_;
+    CondVar cv_;
+    std::vector<call> calls_;
+    std::vector<Future*> succeeded_;
+    int n_done_;
+    int wake_at_ok_;
+
+    void on_done(size_t i, Future* fu);
+};
+
+/**
+ * Client side of a 'stream' RPC, created by rpcgen generated Proxy.
+ */
+class ClientStream: public Stream {
+    friend class Client;
+
+    Client* cl_;
+    Future* fu_;
+    bool write_closed_;
+
+protected:
+
+    int send_data(Marshal& payload);
+    void send_end();
+    void send_credit(size_t n_bytes);
+
+    // protected destructor as required by RefCounted.
+    ~ClientStream();
+
+public:
+
+    // takes over the reference of fu
+    ClientStream(Client* cl, Future* fu);
+
+    Future* future() {
+        return fu_;
+    }
+
+    /**
+     * Close our side, drop unread frames, and wait for reply of the RPC.
+     * The returned Future goes away with the stream.
+     */
+    Future* finish();
+};
+
+class Client: public Pollable, public CacheAligned {
+    friend class ClientStream;
+
     Marshal in_, out_;
 
+    // only for setting up udp calls, sending takes no shared lock
     SpinLock udp_l_;
-    int udp_sock_;
-    UdpBuffer udp_;
+
+    // opened on the first udp request or call
+    volatile int udp_sock_;
     socklen_t udp_salen_;
     struct sockaddr *udp_sa_;
-    bookmark* udp_bmark_;
+    int open_udp_socket();
+
+    /**
+     * Udp requests are encoded and sent by each thread on its own, from
+     * begin_udp_request() till end_udp_request(). A batch queues datagrams
+     * in buf, sent together by send_udp_batch().
+     */
+    struct udp_thread {
+        UdpBuffer buf;
+        bookmark* bmark;
+        size_t size;  // of the datagram being written if known, otherwise 0
+
+        // udp call being written, from begin_udp_call() till end_udp_call()
+        Future* fu;
+
+        int batch_depth;
+        std::vector<size_t> batch_sizes;
+        std::vector<struct iovec> iov;
+        std::vector<struct iovec> msg_iov;
+        std::vector<struct mmsghdr> msgs;
+
+        udp_thread(): bmark(nullptr), size(0), fu(nullptr), batch_depth(0) { }
+    };
+
+    // tells clients apart in each thread's cache of udp_thread
+    static Counter udp_client_ids_s;
+    i64 udp_client_id_;
+
+    // udp_thread of every thread that sent through this client, by thread id.
+    // kept till the client is gone, even if the thread exits.
+    std::unordered_map<i64, udp_thread*> udp_threads_;
+
+    udp_thread* udp_local();
+
+    void begin_udp_datagram(udp_thread* ut, size_t payload_size);
+    size_t end_udp_datagram(udp_thread* ut);
+    int send_udp_batch(udp_thread* ut);
+
+    // udp calls waiting for a reply, resent every rto (doubling) till
+    // max_sends are out. guarded by pending_fu_l_, futures are in pending_fu_.
+    struct udp_call {
+        std::string datagram;
+        double resend_at;
+        double rto;
+        int n_sends;
+    };
+    std::unordered_map<i64, udp_call> udp_calls_;
+    double udp_rto_;
+    int udp_max_sends_;
+
+    // read replies and fire the retransmit timer, added on the first udp call
+    Pollable* udp_reader_;
+    Pollable* udp_timer_;
+    int udp_timer_fd_;
+    bool udp_timer_armed_;
+    char* udp_in_buf_;
+    volatile bool udp_started_;
+
+    void start_udp_calls();
+
+    // must hold pending_fu_l_
+    void arm_udp_timer(bool on);
+
+    void handle_udp_read();
+    void resend_udp_calls();
 
     /**
      * NOT a refcopy! This is intended to avoid circular reference, which prevents everything from being released correctly.
      */
     PollMgr* pollmgr_;
 
+    std::string addr_;
+
+    // CONNECTED once connecting is under way, requests queue up in out_
+    // till the socket gets connected
     int sock_;
+    volatile bool connecting_;
     enum {
         NEW, CONNECTED, CLOSED
     } status_;
 
+    // guards changes to sock_ after connected, taken before out_l_
+    Mutex sock_l_;
+
+    // for "shm://name" addresses, packets go through shm_ and sock_ is its
+    // doorbell. channels replaced by reconnecting are kept till the client
+    // is gone, the poll thread might still be using them.
+    ShmChannel* shm_;
+    std::list<ShmChannel*> old_shms_;
+
+    // a socket for addr_, -1 on errors. *in_progress if connecting goes on
+    // after returning, only for nonblocking TCP.
+    int open_sock(bool nonblocking, bool* in_progress);
+
+    // nonblocking TCP connects go on with the address after this one if
+    // they fail, see connect_next_addr()
+    size_t next_addr_;
+
+    // 0 once connected, EINPROGRESS if not yet, otherwise why it failed
+    int connect_status();
+
+    // replace a socket whose connect failed with one to the next address of
+    // addr_, false if there is none left
+    bool connect_next_addr();
+
+    // for unix: addresses, must hold out_l_ once connected
+    void reset_fd_table();
+
+    // instead of closing on errors, a new socket is connected after backoff
+    // seconds, doubling from reconnect_min_ to reconnect_max_
+    double reconnect_min_;
+    double reconnect_max_;
+    double reconnect_backoff_;
+    Pollable* reconnect_timer_;
+    int reconnect_timer_fd_;
+
+    void reconnect_later();
+    void reconnect();
+
+    // must hold sock_l_
+    void arm_reconnect_timer();
+
     bookmark* bmark_;
 
+    // size of current request if known in begin_request(), otherwise -1
+    i32 request_size_;
+
+    // 0 if compression is not enabled, guarded by out_l_
+    size_t compress_threshold_;
+
+    // compressed replies are accepted once enable_compression() was called
+    volatile bool compression_asked_;
+
+    // current request goes to packet_ instead of out_ if it might get compressed
+    Marshal packet_;
+    Marshal* req_out_;
+
+    // current request, guarded by out_l_
+    Future* req_fu_;
+    size_t req_out_before_;
+
+    RpcMetrics metrics_;
+
+    // the call is over, with a reply of reply_size bytes or not
+    void record_call(Future* fu, size_t reply_size);
+
+    // begin_request() blocks while out_ is above high watermark, guarded by out_l_
+    size_t out_high_watermark_;
+    size_t out_low_watermark_;
+    bool out_full_;
+    pthread_mutex_t out_drained_m_;
+    pthread_cond_t out_drained_cond_;
+
+    void wait_for_output_drained();
+
     Counter xid_counter_;
     std::unordered_map<i64, Future*> pending_fu_;
 
+    // size of pending_fu_, updated with it, read without pending_fu_l_
+    volatile size_t n_pending_;
+
+    // also guarded by pending_fu_l_
+    std::unordered_map<i64, ClientStream*> streams_;
+
     SpinLock pending_fu_l_;
     SpinLock out_l_;
 
@@ -138,6 +413,9 @@ class Client: public Pollable {
 
     void invalidate_pending_futures();
 
+    void handle_stream_frame(Marshal& in, i64 xid, i32 frame_type, size_t frame_size);
+    int write_stream_frame(i64 xid, i32 frame_type, Marshal* payload);
+
     // prevent direct usage, use close_and_release() instead
     using RefCounted::release;
 
@@ -147,27 +425,122 @@ protected:
 
 public:
 
-    Client(PollMgr* pollmgr): udp_sock_(-1), udp_sa_(nullptr), udp_bmark_(nullptr), pollmgr_(pollmgr), sock_(-1), status_(NEW), bmark_(nullptr) { }
+    Client(PollMgr* pollmgr);
 
     /**
      * Start a new request. Must be paired with end_request(), even if nullptr returned.
      *
      * The request packet format is: <size> <xid> <rpc_id> <arg1> <arg2> ... <argN>
+     *
+     * If the calling thread is within a trace (see current_trace()), a tracing
+     * header follows <rpc_id>.
+     *
+     * If args_size (marshal size of <arg1>..<argN>) is given, <size> is written
+     * up front and output is reserved in one go. rpcgen generated proxies
+     * always provide it.
      */
-    Future* begin_request(i32 rpc_id, const FutureAttr& attr = FutureAttr());
+    Future* begin_request(i32 rpc_id, const FutureAttr& attr = FutureAttr(), size_t args_size = marshal_size_unknown);
 
     void end_request();
 
-    void begin_udp_request(i32 rpc_id);
+    /**
+     * Turn the request into a stream, must be called between begin_request()
+     * and end_request(). Takes over the reference of fu.
+     */
+    ClientStream* open_stream(Future* fu);
+
+    /**
+     * Ask the server to compress packets of at least threshold bytes both
+     * ways. Blocks till the server answers. Returns 0 on success, ENOENT if
+     * the server does not support compression, or ENOTCONN.
+     */
+    int enable_compression(size_t threshold);
+
+    /**
+     * Bound the output buffer. Once more than high bytes of requests are
+     * waiting to be sent, begin_request() blocks till the buffer drains to
+     * low bytes, or the connection is closed. Set high to 0 for no limit
+     * (the default).
+     *
+     * NOTE: do not start requests from Future callbacks on such a client,
+     *       they run in the poll thread which does the draining.
+     */
+    void set_output_watermarks(size_t high, size_t low);
+
+    // bytes of requests waiting to be sent
+    size_t output_buffer_size();
+
+    /**
+     * Always on per rpc_id metrics: calls started and finished (so in-flight
+     * count too), error codes, bytes, and round trip latency from
+     * begin_request() to the reply being read, as phase 0. Calls that never
+     * get a reply count as ENOTCONN once the connection is closed.
+     * Compare with the server's to tell network delay from server delay.
+     */
+    RpcMetrics* metrics() {
+        return &metrics_;
+    }
+
+    /**
+     * A one-way udp request, lost if the network drops it:
+     * <size> <rpc_id> <arg1> <arg2> ... <argN>
+     *
+     * Arguments go to udp_request(), a buffer of the calling thread, so
+     * threads sending through one client do not wait for each other. If
+     * args_size is given, the datagram is reserved in one piece and <size>
+     * written up front, rpcgen generated proxies always provide it.
+     */
+    void begin_udp_request(i32 rpc_id, size_t args_size = marshal_size_unknown);
     UdpBuffer& udp_request() {
-        return udp_;
+        return udp_local()->buf;
     }
     int end_udp_request();
 
+    static const size_t max_udp_batch_s = 64;
+
+    /**
+     * Between begin_udp_batch() and end_udp_batch(), udp requests of the
+     * calling thread are queued and sent with a single sendmmsg() for up to
+     * max_udp_batch_s datagrams, instead of one sendto() each. Batches may
+     * nest, the outermost
+     * end_udp_batch() sends whatever is left and returns its error, if any.
+     */
+    void begin_udp_batch();
+    int end_udp_batch();
+
+    /**
+     * A udp request that gets a reply, for small idempotent calls that should
+     * not wait behind other requests on the TCP connection. Must be paired
+     * with end_udp_call(), even if nullptr returned. Arguments go to
+     * udp_request().
+     *
+     * The request packet format is: <size> <rpc_id | reply_flag_s> <xid> <arg1> ... <argN>
+     * and the reply: <size> <xid> <error_code> <ret1> ... <retN>
+     *
+     * Lost requests or replies are retransmitted, see set_udp_retransmit(),
+     * the server answers duplicates from a cache of recent replies. Calls
+     * fail with E2BIG if they do not fit in a datagram, rpcgen generated
+     * proxies send those over TCP instead (see udp_call_fits()).
+     */
+    Future* begin_udp_call(i32 rpc_id, const FutureAttr& attr = FutureAttr(), size_t args_size = marshal_size_unknown);
+    void end_udp_call();
+
+    static bool udp_call_fits(size_t args_size) {
+        return args_size != marshal_size_unknown
+            && UdpBuffer::call_header_size_s + args_size <= UdpBuffer::max_udp_packet_size_s;
+    }
+
+    /**
+     * Resend a udp call if there is no reply after rto seconds, doubling it
+     * each time. The call fails with ETIMEDOUT after max_sends went out
+     * unanswered. Defaults to 0.05 sec and 5 sends.
+     */
+    void set_udp_retransmit(double rto, int max_sends);
+
     template<class T>
     Client& operator <<(const T& v) {
         if (status_ == CONNECTED) {
-            this->out_ << v;
+            *this->req_out_ << v;
         }
         return *this;
     }
@@ -175,13 +548,52 @@ public:
     // NOTE: this function is used *internally* by Python extension
     Client& operator <<(Marshal& m) {
         if (status_ == CONNECTED) {
-            this->out_.read_from_marshal(m, m.content_size());
+            this->req_out_->read_from_marshal(m, m.content_size());
         }
         return *this;
     }
 
+    /**
+     * addr is host:port, unix:/path for a unix socket, or shm://name for a
+     * server on the same host started on the same address, see ShmChannel.
+     * Only unix: connections can pass fds as FileDesc arguments.
+     */
     int connect(const char* addr);
 
+    /**
+     * Start connecting without waiting for it, driven by the poll thread.
+     * Requests can be made right away, they are sent once connected. If
+     * connecting fails, they fail with ENOTCONN and the client gets closed,
+     * or reconnects if set_reconnect() was used. Returns ENOTCONN only if no
+     * socket could be opened for addr.
+     */
+    int async_connect(const char* addr);
+
+    /**
+     * Reconnect instead of closing when the connection breaks or cannot be
+     * made, first after min_backoff seconds, doubling up to max_backoff.
+     * Calls waiting for a reply fail with ENOTCONN, since they might have
+     * been handled or not. Requests made in the meantime are queued.
+     * Call before connecting.
+     */
+    void set_reconnect(double min_backoff, double max_backoff);
+
+    /**
+     * Give up waiting for the reply of fu, which fails with ECANCELED. The
+     * server still handles the call, its reply gets dropped. Returns false if
+     * fu is done already.
+     */
+    bool cancel(Future* fu);
+
+    // calls waiting for a reply, tells how loaded the connection is
+    size_t n_pending() const {
+        return n_pending_;
+    }
+
+    bool closed() const {
+        return status_ == CLOSED;
+    }
+
     void close_and_release() {
         close();
         release();
@@ -198,16 +610,78 @@ public:
 
 };
 
-class ClientPool: public NoCopy {
-    rpc::Rand rand_;
-
+/**
+ * Keeps parallel_connections clients to each address. get_client() picks the
+ * less loaded of two random clients, the one with fewer calls waiting for a
+ * reply, and reconnects clients that got closed. Addresses already cached are
+ * looked up without locking. Clients connect asynchronously, so a client
+ * returned might still be connecting, calls made on it are queued.
+ */
+class ClientPool: public NoCopy, public CacheAligned {
     // refcopy
     rpc::PollMgr* pollmgr_;
+    int parallel_connections_;
+
+    // a replaced client, callers might still be using it for a while
+    struct retired {
+        rpc::Client* cl;
+        double since;
+    };
 
-    // guard cache_
+    struct connections {
+        // only for reconnecting
+        Mutex l;
+        rpc::Client* volatile* clients;
+
+        std::list<retired> closed;
+    };
+
+    // seconds a replaced client is kept around, at least
+    static constexpr double retire_grace_s = 10.0;
+
+    // cache_ is never changed, but replaced by an updated copy under l_.
+    // older copies stay till the pool is gone, readers might still hold them.
+    typedef std::map<std::string, connections*> cache_map;
     SpinLock l_;
-    std::map<std::string, rpc::Client**> cache_;
-    int parallel_connections_;
+    cache_map* volatile cache_;
+    std::list<cache_map*> old_caches_;
+
+    rpc::Client* pick(const std::string& addr, connections* conns);
+
+    // hedged_call() delay by rpc_id, hedge_after_ns is -1 till enough calls.
+    // seen is the round trips of the clients at the last refresh, so the
+    // delay follows only what came after
+    struct hedge_state {
+        i64 n_calls;
+        i64 next_refresh;
+        i64 hedge_after_ns;
+        Histogram seen;
+
+        hedge_state(): n_calls(0), next_refresh(hedge_refresh_s), hedge_after_ns(-1) { }
+    };
+    SpinLock hedge_l_;
+    std::unordered_map<i32, hedge_state> hedge_state_;
+    double hedge_percentile_;
+    double hedge_budget_;
+    double hedge_tokens_;
+    Counter n_hedged_;
+
+    static const int hedge_refresh_s = 256;
+    static const int hedge_retry_s = 16;
+    static const int max_hedge_burst_s = 10;
+
+    // round trips of rpc_id by Client::metrics() of the clients to addrs
+    void round_trips(const std::vector<std::string>& addrs, i32 rpc_id, Histogram* h);
+
+    // hedge_after_ns of rpc_id from the calls since the last refresh, if at
+    // least hedge_refresh_s / 2, otherwise tried again hedge_retry_s calls later
+    void refresh_hedge_delay(const std::vector<std::string>& addrs, i32 rpc_id, double percentile);
+
+    // a new client in place of the closed one at clients[i], nullptr if no socket for addr
+    rpc::Client* reconnect(const std::string& addr, connections* conns, int i);
+
+    // release replaced clients past retire_grace_s with no calls waiting, must hold conns->l
+    void sweep_closed(connections* conns, double now);
 
 public:
 
@@ -218,6 +692,29 @@ public:
     // on error, return nullptr
     rpc::Client* get_client(const std::string& addr);
 
+    /**
+     * Make call on addrs[0], and if no reply came within the percentile
+     * latency of rpc_id, the same call on another client, of the next address
+     * or else another connection to addrs[0]. The first reply wins, the other
+     * call is cancelled. Blocks till then, and returns the Future of the
+     * winner, or of the first call if all failed, nullptr if none could be
+     * made. Release it when done.
+     *
+     * The latency is that of the calls of rpc_id by the clients to addrs
+     * since the last look at their metrics(), taken every hedge_refresh_s
+     * hedged calls. Nothing is hedged before the first hedge_refresh_s calls.
+     * Hedges are capped at budget times the calls made, so they cannot
+     * double the load.
+     */
+    rpc::Future* hedged_call(const std::vector<std::string>& addrs, i32 rpc_id, const ScatterGather::call_t& call);
+
+    // defaults to p95 and 5% more calls
+    void set_hedging(double percentile, double budget);
+
+    i64 n_hedged() const {
+        return n_hedged_.peek_next();
+    }
+
 };
 
 }
@@ -0,0 +1,282 @@
+#include <string>
+#include <algorithm>
+
+#include <string.h>
+
+#include "compress.h"
+
+using namespace std;
+
+namespace rpc {
+
+// lz4 block format constants
+static const size_t min_match = 4;
+static const size_t last_literals = 5;  // block always ends with literals
+static const size_t match_safe_distance = 12;  // last match starts at least this far from end
+static const size_t max_offset = 65535;
+static const int hash_log = 12;
+
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - hash_log);
+}
+
+// 15 in the token, and the rest as a run of 255s
+static inline uint8_t* write_length(uint8_t* op, size_t len) {
+    len -= 15;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static inline bool read_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+size_t lz_compress_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+size_t lz_compress(const char* src, size_t n, char* dst, size_t dst_size) {
+    const uint8_t* base = (const uint8_t *) src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* iend = base + n;
+    uint8_t* op = (uint8_t *) dst;
+    uint8_t* oend = op + dst_size;
+
+    if (n > match_safe_distance) {
+        const uint8_t* match_limit = iend - match_safe_distance;
+        const uint8_t* extend_limit = iend - last_literals;
+
+        // positions relative to base, any stale entry is caught by comparing content
+        uint32_t table[1 << hash_log];
+        memset(table, 0, sizeof(table));
+
+        size_t misses = 0;
+        while (ip < match_limit) {
+            uint32_t seq = load32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = ip - base;
+
+            if (ref >= ip || (size_t) (ip - ref) > max_offset || load32(ref) != seq) {
+                // skip faster through incompressible data
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* p = ip + min_match;
+            const uint8_t* q = ref + min_match;
+            while (p + sizeof(uint64_t) <= extend_limit) {
+                uint64_t a, b;
+                memcpy(&a, p, sizeof(a));
+                memcpy(&b, q, sizeof(b));
+                if (a != b) {
+                    // little endian, first differing byte is at the lowest set bit
+                    size_t n_same = __builtin_ctzll(a ^ b) / 8;
+                    p += n_same;
+                    q += n_same;
+                    break;
+                }
+                p += sizeof(uint64_t);
+                q += sizeof(uint64_t);
+            }
+            if (p + sizeof(uint64_t) > extend_limit) {
+                while (p < extend_limit && *p == *q) {
+                    p++;
+                    q++;
+                }
+            }
+
+            size_t lit_len = ip - anchor;
+            size_t match_len = p - ip - min_match;
+            if ((size_t) (oend - op) < 1 + lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1) {
+                return 0;
+            }
+
+            uint8_t* token = op++;
+            *token = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+            if (lit_len >= 15) {
+                op = write_length(op, lit_len);
+            }
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            size_t offset = ip - ref;
+            *op++ = (uint8_t) (offset & 0xff);
+            *op++ = (uint8_t) (offset >> 8);
+
+            *token |= (uint8_t) (match_len >= 15 ? 15 : match_len);
+            if (match_len >= 15) {
+                op = write_length(op, match_len);
+            }
+
+            ip = p;
+            anchor = ip;
+            table[lz_hash(load32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    size_t lit_len = iend - anchor;
+    if ((size_t) (oend - op) < 1 + lit_len + lit_len / 255 + 1) {
+        return 0;
+    }
+    *op++ = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) {
+        op = write_length(op, lit_len);
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - (uint8_t *) dst;
+}
+
+ssize_t lz_decompress(const char* src, size_t n, char* dst, size_t dst_size) {
+    const uint8_t* ip = (const uint8_t *) src;
+    const uint8_t* iend = ip + n;
+    uint8_t* op = (uint8_t *) dst;
+    uint8_t* oend = op + dst_size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(&ip, iend, &lit_len)) {
+            return -1;
+        }
+        if (lit_len > (size_t) (iend - ip) || lit_len > (size_t) (oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) {
+            // last sequence has no match
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (uint8_t *) dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&ip, iend, &match_len)) {
+            return -1;
+        }
+        match_len += min_match;
+        if (match_len > (size_t) (oend - op)) {
+            return -1;
+        }
+
+        const uint8_t* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+        } else {
+            // overlapping match repeats the last offset bytes. copy whole
+            // periods from ref, doubling what is available each round.
+            size_t copied = 0;
+            while (copied < match_len) {
+                size_t n_copy = std::min(copied + offset, match_len - copied);
+                memcpy(op + copied, ref, n_copy);
+                copied += n_copy;
+            }
+        }
+        op += match_len;
+    }
+
+    return op - (uint8_t *) dst;
+}
+
+void write_packet(Marshal* out, Marshal& packet, size_t compress_threshold) {
+    size_t n = packet.content_size();
+    verify(n <= (size_t) PACKET_SIZE_MASK);
+
+    if (compress_threshold == 0 || n < compress_threshold) {
+        *out << (i32) n;
+        out->read_from_marshal(packet, n);
+        return;
+    }
+
+    string raw(n, '\0');
+    verify(packet.read(&raw[0], n) == n);
+
+    string block(lz_compress_bound(n), '\0');
+    size_t block_size = lz_compress(raw.data(), n, &block[0], block.size());
+    v32 v_raw_size = n;
+    if (block_size > 0 && v_raw_size.val_size() + block_size < n) {
+        i32 size = (i32) (v_raw_size.val_size() + block_size) | PACKET_COMPRESSED;
+        *out << size << v_raw_size;
+        out->write(block.data(), block_size);
+    } else {
+        // does not shrink, send as is
+        *out << (i32) n;
+        out->write(raw.data(), n);
+    }
+}
+
+ssize_t read_compressed_packet(Marshal& in, size_t size, Marshal* packet) {
+    // the varint must fit in the packet, and in an i32, before it is decoded
+    char byte0;
+    if (size == 0 || in.peek(&byte0, 1) != 1) {
+        return -1;
+    }
+    size_t header_size = base::SparseInt::buf_size(byte0);
+    if (header_size > size || header_size > 5 || in.content_size() < header_size) {
+        return -1;
+    }
+    v32 v_raw_size;
+    in >> v_raw_size;
+    size_t block_size = size - header_size;
+
+    // the lz format expands by 255x at most, so raw_size is bounded by what
+    // was actually received
+    size_t raw_size = v_raw_size.get();
+    if (v_raw_size.get() <= 0 || raw_size > (size_t) PACKET_SIZE_MASK || raw_size > block_size * 255) {
+        return -1;
+    }
+
+    string block(block_size, '\0');
+    if (in.read(&block[0], block_size) != block_size) {
+        return -1;
+    }
+
+    if (in.fd_table() != nullptr) {
+        packet->set_fd_table(in.fd_table());
+    }
+    char* p = packet->append(raw_size);
+    verify(p != nullptr);
+    if (lz_decompress(block.data(), block_size, p, raw_size) != (ssize_t) raw_size) {
+        return -1;
+    }
+    return raw_size;
+}
+
+} // namespace rpc
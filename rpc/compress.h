@@ -0,0 +1,60 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "marshal.h"
+
+namespace rpc {
+
+/**
+ * Per-connection compression of large packets.
+ *
+ * A client asks for it with a COMPRESSION_NEGOTIATE request carrying
+ * <i32 threshold>. If the server agrees (error_code 0), both sides compress
+ * packets of at least threshold bytes from then on. Older servers reply
+ * ENOENT, and nothing gets compressed.
+ *
+ * Packet sizes never reach 1gb, so the high bits of <size> are used as
+ * flags. A compressed packet looks like:
+ *
+ * <size | PACKET_COMPRESSED> <v32 raw_size> <lz block of (xid..payload)>
+ *
+ * Compressed packets are accepted once negotiated: by the server after
+ * the COMPRESSION_NEGOTIATE request, by the client after sending it. So a
+ * peer may start compressing as soon as it has agreed.
+ */
+enum {
+    // 0x1 - 0x3 are used by streams, see stream.h
+    COMPRESSION_NEGOTIATE = 0x4,
+};
+
+const i32 PACKET_COMPRESSED = 0x40000000;
+const i32 PACKET_SIZE_MASK = 0x3fffffff;
+
+/**
+ * LZ77 codec producing the LZ4 block format. Favours speed over ratio,
+ * text-like payloads still shrink several times.
+ */
+size_t lz_compress_bound(size_t n);
+
+// returns compressed size, or 0 if dst is too small
+size_t lz_compress(const char* src, size_t n, char* dst, size_t dst_size);
+
+// returns decompressed size, or -1 if src is corrupted or dst is too small
+ssize_t lz_decompress(const char* src, size_t n, char* dst, size_t dst_size);
+
+/**
+ * Move packet content (<xid>..<payload>) into out, prefixed by <size>.
+ * Compressed if compress_threshold > 0, content is at least that large,
+ * and it actually shrinks.
+ */
+void write_packet(Marshal* out, Marshal& packet, size_t compress_threshold);
+
+/**
+ * Take a compressed packet of size bytes (flags stripped) off in, and put
+ * the original content into packet. Returns size of the content, or -1 if
+ * the packet is corrupted, in which case the connection should be closed.
+ */
+ssize_t read_compressed_packet(Marshal& in, size_t size, Marshal* packet);
+
+} // namespace rpc
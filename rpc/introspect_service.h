@@ -0,0 +1,284 @@
+#pragma once
+
+#include "rpc/server.h"
+#include "rpc/client.h"
+
+#include <errno.h>
+
+
+namespace rpc {
+
+struct latency_stats {
+    rpc::i64 count;
+    rpc::i64 mean;
+    rpc::i64 p50;
+    rpc::i64 p90;
+    rpc::i64 p99;
+    rpc::i64 p999;
+    rpc::i64 max;
+};
+
+inline constexpr size_t marshal_fixed_size(const latency_stats*) {
+    return 56;
+}
+
+inline constexpr size_t marshal_size(const latency_stats&) {
+    return 56;
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const latency_stats& o) {
+    m << o.count;
+    m << o.mean;
+    m << o.p50;
+    m << o.p90;
+    m << o.p99;
+    m << o.p999;
+    m << o.max;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, latency_stats& o) {
+    m >> o.count;
+    m >> o.mean;
+    m >> o.p50;
+    m >> o.p90;
+    m >> o.p99;
+    m >> o.p999;
+    m >> o.max;
+    return m;
+}
+
+struct rpc_stats {
+    rpc::i32 rpc_id;
+    rpc::i64 n_requests;
+    rpc::i64 bytes_in;
+    rpc::i64 bytes_out;
+    std::map<rpc::i32, rpc::i64> error_codes;
+    latency_stats queue_wait;
+    latency_stats handler;
+    latency_stats serialize;
+    latency_stats write;
+};
+
+inline size_t marshal_size(const rpc_stats& o) {
+    return rpc::marshal_size_of(o.rpc_id, o.n_requests, o.bytes_in, o.bytes_out, o.error_codes, o.queue_wait, o.handler, o.serialize, o.write);
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const rpc_stats& o) {
+    m << o.rpc_id;
+    m << o.n_requests;
+    m << o.bytes_in;
+    m << o.bytes_out;
+    m << o.error_codes;
+    m << o.queue_wait;
+    m << o.handler;
+    m << o.serialize;
+    m << o.write;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, rpc_stats& o) {
+    m >> o.rpc_id;
+    m >> o.n_requests;
+    m >> o.bytes_in;
+    m >> o.bytes_out;
+    m >> o.error_codes;
+    m >> o.queue_wait;
+    m >> o.handler;
+    m >> o.serialize;
+    m >> o.write;
+    return m;
+}
+
+struct thread_pool_stats {
+    rpc::i64 queued;
+    rpc::i64 started;
+    rpc::i64 rejected;
+    double total_wait;
+    double max_wait;
+    rpc::i8 overloaded;
+};
+
+inline constexpr size_t marshal_fixed_size(const thread_pool_stats*) {
+    return 41;
+}
+
+inline constexpr size_t marshal_size(const thread_pool_stats&) {
+    return 41;
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const thread_pool_stats& o) {
+    m << o.queued;
+    m << o.started;
+    m << o.rejected;
+    m << o.total_wait;
+    m << o.max_wait;
+    m << o.overloaded;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, thread_pool_stats& o) {
+    m >> o.queued;
+    m >> o.started;
+    m >> o.rejected;
+    m >> o.total_wait;
+    m >> o.max_wait;
+    m >> o.overloaded;
+    return m;
+}
+
+class IntrospectService: public rpc::Service {
+public:
+    enum {
+        METRICS = 0x6fda1e2d,
+        THREAD_POOL = 0x4d33c10f,
+        TRACES = 0x2bcdb6cd,
+    };
+    int __reg_to__(rpc::Server* svr) {
+        int ret = 0;
+        if ((ret = svr->reg(METRICS, this, &IntrospectService::__metrics__wrapper__, rpc::ThreadPool::PRIORITY_HIGH)) != 0) {
+            goto err;
+        }
+        if ((ret = svr->reg(THREAD_POOL, this, &IntrospectService::__thread_pool__wrapper__, rpc::ThreadPool::PRIORITY_HIGH)) != 0) {
+            goto err;
+        }
+        if ((ret = svr->reg(TRACES, this, &IntrospectService::__traces__wrapper__, rpc::ThreadPool::PRIORITY_HIGH)) != 0) {
+            goto err;
+        }
+        return 0;
+    err:
+        svr->unreg(METRICS);
+        svr->unreg(THREAD_POOL);
+        svr->unreg(TRACES);
+        return ret;
+    }
+    // these RPC handler functions need to be implemented by user
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
+    virtual void metrics(std::vector<rpc_stats>* rpcs) = 0;
+    virtual void thread_pool(thread_pool_stats* stats) = 0;
+    virtual void traces(std::string* json) = 0;
+private:
+    void __metrics__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            std::vector<rpc_stats> out_0;
+            this->metrics(&out_0);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __thread_pool__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            thread_pool_stats out_0;
+            this->thread_pool(&out_0);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __traces__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            std::string out_0;
+            this->traces(&out_0);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+};
+
+class IntrospectProxy {
+protected:
+    rpc::Client* __cl__;
+public:
+    IntrospectProxy(rpc::Client* cl): __cl__(cl) { }
+    rpc::Future* async_metrics(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(IntrospectService::METRICS, __fu_attr__, rpc::marshal_size_of());
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 metrics(std::vector<rpc_stats>* rpcs) {
+        rpc::Future* __fu__ = this->async_metrics();
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *rpcs;
+        }
+        __fu__->release();
+        return __ret__;
+    }
+    rpc::Future* async_thread_pool(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(IntrospectService::THREAD_POOL, __fu_attr__, rpc::marshal_size_of());
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 thread_pool(thread_pool_stats* stats) {
+        rpc::Future* __fu__ = this->async_thread_pool();
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *stats;
+        }
+        __fu__->release();
+        return __ret__;
+    }
+    rpc::Future* async_traces(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(IntrospectService::TRACES, __fu_attr__, rpc::marshal_size_of());
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 traces(std::string* json) {
+        rpc::Future* __fu__ = this->async_traces();
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *json;
+        }
+        __fu__->release();
+        return __ret__;
+    }
+};
+
+} // namespace rpc
+
+
+
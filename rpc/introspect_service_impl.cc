@@ -0,0 +1,52 @@
+#include "introspect_service_impl.h"
+
+using namespace std;
+
+namespace rpc {
+
+static void summarize(const Histogram& h, latency_stats* ls) {
+    ls->count = h.count();
+    ls->mean = h.mean();
+    ls->p50 = h.percentile(50);
+    ls->p90 = h.percentile(90);
+    ls->p99 = h.percentile(99);
+    ls->p999 = h.percentile(99.9);
+    ls->max = h.max();
+}
+
+void IntrospectServiceImpl::metrics(std::vector<rpc_stats>* rpcs) {
+    map<i32, RpcMetrics::Stats> stats;
+    svr_->metrics()->snapshot(&stats);
+    rpcs->clear();
+    rpcs->reserve(stats.size());
+    for (auto& it: stats) {
+        const RpcMetrics::Stats& st = it.second;
+        rpc_stats rs;
+        rs.rpc_id = it.first;
+        rs.n_requests = st.count;
+        rs.bytes_in = st.bytes_in;
+        rs.bytes_out = st.bytes_out;
+        rs.error_codes = st.errors;
+        summarize(st.phases[Server::PHASE_QUEUE_WAIT], &rs.queue_wait);
+        summarize(st.phases[Server::PHASE_HANDLER], &rs.handler);
+        summarize(st.phases[Server::PHASE_SERIALIZE], &rs.serialize);
+        summarize(st.phases[Server::PHASE_WRITE], &rs.write);
+        rpcs->push_back(rs);
+    }
+}
+
+void IntrospectServiceImpl::thread_pool(thread_pool_stats* stats) {
+    ThreadPool::QueueStats qs = svr_->threadpool()->stats();
+    stats->queued = qs.queued;
+    stats->started = qs.started;
+    stats->rejected = qs.rejected;
+    stats->total_wait = qs.total_wait;
+    stats->max_wait = qs.max_wait;
+    stats->overloaded = qs.overloaded ? 1 : 0;
+}
+
+void IntrospectServiceImpl::traces(std::string* json) {
+    *json = svr_->spans()->to_json();
+}
+
+} // namespace rpc
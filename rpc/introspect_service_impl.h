@@ -0,0 +1,21 @@
+#pragma once
+
+#include "introspect_service.h"
+
+namespace rpc {
+
+/**
+ * Built into every Server, so any client can find out which RPC is slow.
+ */
+class IntrospectServiceImpl: public IntrospectService {
+    Server* svr_;
+
+public:
+    IntrospectServiceImpl(Server* svr): svr_(svr) { }
+
+    void metrics(std::vector<rpc_stats>* rpcs);
+    void thread_pool(thread_pool_stats* stats);
+    void traces(std::string* json);
+};
+
+} // namespace rpc
@@ -1,4 +1,7 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 
 #include "marshal.h"
 
@@ -7,6 +10,9 @@ using namespace std;
 namespace rpc {
 
 Marshal::~Marshal() {
+    if (fdt_ != nullptr) {
+        fdt_->release();
+    }
     chunk* chnk = head_;
     while (chnk != nullptr) {
         chunk* next = chnk->next;
@@ -56,6 +62,51 @@ size_t Marshal::write(const void* p, size_t n) {
     return n;
 }
 
+void Marshal::reserve(size_t n) {
+    assert(tail_ == nullptr || tail_->next == nullptr);
+
+    if (head_ == nullptr) {
+        assert(tail_ == nullptr);
+        head_ = new chunk(n);
+        tail_ = head_;
+        return;
+    }
+    if (tail_->data->size - tail_->write_idx >= n) {
+        // already enough room
+        return;
+    }
+    if (tail_->data->ref_count() > 1) {
+        // shared with another Marshal (see read_from_marshal), leave it alone
+        return;
+    }
+    if (tail_->content_size() == 0) {
+        // nothing in it yet, swap in a bigger buffer
+        tail_->data->release();
+        tail_->data = new raw_bytes(n);
+        tail_->read_idx = 0;
+        tail_->write_idx = 0;
+    } else {
+        // seal the tail, so that it becomes fully_written(), and start a new one
+        tail_->data->size = tail_->write_idx;
+        tail_->next = new chunk(n);
+        tail_ = tail_->next;
+    }
+    assert(content_size_ == content_size_slow());
+}
+
+char* Marshal::append(size_t n) {
+    reserve(n);
+    if (tail_->data->size - tail_->write_idx < n) {
+        return nullptr;
+    }
+    char* p = tail_->data->ptr + tail_->write_idx;
+    tail_->write_idx += n;
+    write_cnt_ += n;
+    content_size_ += n;
+    assert(content_size_ == content_size_slow());
+    return p;
+}
+
 size_t Marshal::read(void* p, size_t n) {
     assert(tail_ == nullptr || tail_->next == nullptr);
     assert(empty() || (head_ != nullptr && !head_->fully_read()));
@@ -90,6 +141,35 @@ size_t Marshal::read(void* p, size_t n) {
     return n_read;
 }
 
+size_t Marshal::discard(size_t n) {
+    assert(tail_ == nullptr || tail_->next == nullptr);
+    assert(empty() || (head_ != nullptr && !head_->fully_read()));
+
+    size_t n_discard = 0;
+    while (n_discard < n && head_ != nullptr && head_->content_size() > 0) {
+        size_t cnt = head_->discard(n - n_discard);
+        if (head_->fully_read()) {
+            if (tail_ == head_) {
+                // deleted the only chunk
+                tail_ = nullptr;
+            }
+            chunk* chnk = head_;
+            head_ = head_->next;
+            delete chnk;
+        }
+        n_discard += cnt;
+    }
+    assert(content_size_ >= n_discard);
+    content_size_ -= n_discard;
+    assert(content_size_ == content_size_slow());
+
+    assert(n_discard <= n);
+    assert(tail_ == nullptr || tail_->next == nullptr);
+    assert(empty() || (head_ != nullptr && !head_->fully_read()));
+
+    return n_discard;
+}
+
 size_t Marshal::peek(void* p, size_t n) const {
     assert(tail_ == nullptr || tail_->next == nullptr);
     assert(empty() || (head_ != nullptr && !head_->fully_read()));
@@ -113,6 +193,58 @@ size_t Marshal::peek(void* p, size_t n) const {
     return n_peek;
 }
 
+size_t Marshal::peek_iovecs(size_t n, std::vector<struct iovec>* iov) const {
+    size_t n_peek = 0;
+    for (chunk* chnk = head_; chnk != nullptr && n_peek < n; chnk = chnk->next) {
+        size_t cnt = std::min(chnk->content_size(), n - n_peek);
+        if (cnt == 0) {
+            continue;
+        }
+        struct iovec v;
+        v.iov_base = chnk->data->ptr + chnk->read_idx;
+        v.iov_len = cnt;
+        iov->push_back(v);
+        n_peek += cnt;
+    }
+    return n_peek;
+}
+
+// like chunk::read_from_fd(), filing fds received along into fdt
+static int recv_with_fds(int fd, chunk* chnk, FdTable* fdt) {
+    if (chnk->write_idx == chnk->data->size) {
+        return 0;
+    }
+    struct iovec iov;
+    iov.iov_base = chnk->data->ptr + chnk->write_idx;
+    iov.iov_len = chnk->data->size - chnk->write_idx;
+    char ctrl[CMSG_SPACE(FdTable::max_fds_per_msg_s * sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    int cnt = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (cnt <= 0) {
+        return cnt;
+    }
+    chnk->write_idx += cnt;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int fds[FdTable::max_fds_per_msg_s];
+            memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+            fdt->received(fds, n_fds);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        Log_error("rpc::Marshal: fds dropped, more than %d in one message", FdTable::max_fds_per_msg_s);
+    }
+    return cnt;
+}
+
 size_t Marshal::read_from_fd(int fd) {
     assert(empty() || (head_ != nullptr && !head_->fully_read()));
 
@@ -125,7 +257,7 @@ size_t Marshal::read_from_fd(int fd) {
             tail_->next = new chunk;
             tail_ = tail_->next;
         }
-        int r = tail_->read_from_fd(fd);
+        int r = (fdt_ != nullptr) ? recv_with_fds(fd, tail_, fdt_) : tail_->read_from_fd(fd);
         if (r <= 0) {
             break;
         }
@@ -143,6 +275,10 @@ size_t Marshal::read_from_marshal(Marshal& m, size_t n) {
     assert(m.content_size() >= n);   // require m.content_size() >= n > 0
     size_t n_fetch = 0;
 
+    if (fdt_ == nullptr && m.fdt_ != nullptr) {
+        set_fd_table(m.fdt_);
+    }
+
     if ((head_ == nullptr && tail_ == nullptr) || tail_->fully_written()) {
         // efficiently copy data by only copying pointers
         while (n_fetch < n) {
@@ -203,6 +339,13 @@ size_t Marshal::read_from_marshal(Marshal& m, size_t n) {
 
 size_t Marshal::write_to_fd(int fd) {
     size_t n_write = 0;
+    if (fdt_ != nullptr && fdt_->has_queued()) {
+        n_write = fdt_->send_queued(fd, this);
+        if (fdt_->has_queued()) {
+            // bytes must not get ahead of their fds
+            return n_write;
+        }
+    }
     while (!empty()) {
         int cnt = head_->write_to_fd(fd);
         if (head_->fully_read()) {
@@ -247,4 +390,97 @@ bookmark* Marshal::set_bookmark(size_t n) {
     return bm;
 }
 
+void Marshal::set_fd_table(FdTable* fdt) {
+    if (fdt != nullptr) {
+        fdt->ref_copy();
+    }
+    if (fdt_ != nullptr) {
+        fdt_->release();
+    }
+    fdt_ = fdt;
+}
+
+FdTable::~FdTable() {
+    for (auto& fd: queued_) {
+        ::close(fd);
+    }
+    for (auto& it: received_) {
+        ::close(it.second);
+    }
+}
+
+i64 FdTable::queue(int fd) {
+    int dup_fd = (fd >= 0) ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (dup_fd == -1) {
+        return -1;
+    }
+    ScopedLock sl(&l_);
+    queued_.push_back(dup_fd);
+    return n_queued_++;
+}
+
+int FdTable::take(i64 seq) {
+    ScopedLock sl(&l_);
+    unordered_map<i64, int>::iterator it = received_.find(seq);
+    if (it == received_.end()) {
+        return -1;
+    }
+    int fd = it->second;
+    received_.erase(it);
+    return fd;
+}
+
+void FdTable::received(const int* fds, size_t n) {
+    ScopedLock sl(&l_);
+    for (size_t i = 0; i < n; i++) {
+        received_[n_received_++] = fds[i];
+    }
+}
+
+size_t FdTable::send_queued(int sock, Marshal* out) {
+    size_t n_sent = 0;
+    vector<struct iovec> iov;
+    ScopedLock sl(&l_);
+    while (!queued_.empty() && !out->empty()) {
+        size_t n_fds = std::min(queued_.size(), (size_t) max_fds_per_msg_s);
+
+        // leave a byte for each batch after this one
+        size_t n_later = (queued_.size() - 1) / max_fds_per_msg_s;
+        if (out->content_size() <= n_later) {
+            break;
+        }
+        iov.clear();
+        out->peek_iovecs(std::min(out->content_size() - n_later, (size_t) 64 * 1024), &iov);
+        char ctrl[CMSG_SPACE(max_fds_per_msg_s * sizeof(int))];
+        memset(ctrl, 0, sizeof(ctrl));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[0];
+        msg.msg_iovlen = iov.size();
+        msg.msg_control = ctrl;
+        msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &queued_[0], n_fds * sizeof(int));
+
+        ssize_t cnt = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (cnt <= 0) {
+            // try again when writable, or the connection is broken
+            break;
+        }
+        out->discard(cnt);
+        n_sent += cnt;
+
+        // the peer has its own copies now
+        for (size_t i = 0; i < n_fds; i++) {
+            ::close(queued_[i]);
+        }
+        queued_.erase(queued_.begin(), queued_.begin() + n_fds);
+    }
+    return n_sent;
+}
+
 } // namespace rpc
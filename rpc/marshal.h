@@ -8,29 +8,40 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <limits>
+#include <iterator>
 
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "utils.h"
 #include "buffer.h"
+#include "arena.h"
 
 namespace rpc {
 
+class FdTable;
 
 // not thread safe, for better performance
 class Marshal: public NoCopy {
+    // reads chunks in place, see protobuf/marshal-protobuf.h
+    friend class MarshalInputStream;
+
     chunk* head_;
     chunk* tail_;
     i32 write_cnt_;
     size_t content_size_;
 
+    // refcopy, for FileDesc content, nullptr if fds cannot be passed
+    FdTable* fdt_;
+
     // for debugging purpose
     size_t content_size_slow() const;
 
 public:
 
-    Marshal(): head_(nullptr), tail_(nullptr), write_cnt_(0), content_size_(0) { }
+    Marshal(): head_(nullptr), tail_(nullptr), write_cnt_(0), content_size_(0), fdt_(nullptr) { }
     ~Marshal();
 
     bool empty() const {
@@ -46,16 +57,38 @@ public:
     size_t read(void* p, size_t n);
     size_t peek(void* p, size_t n) const;
 
+    // point iovecs at the first n bytes of content in place, so they can be
+    // sent without copying. returns the number of bytes covered.
+    size_t peek_iovecs(size_t n, std::vector<struct iovec>* iov) const;
+
+    // drop n bytes of content without copying them out
+    size_t discard(size_t n);
+
+    // with an FdTable, fds received along are filed into it
     size_t read_from_fd(int fd);
 
+    // make sure the next n bytes written go into a single chunk
+    void reserve(size_t n);
+
+    // append n bytes of space in a single chunk, and return where to fill them in.
+    // returns nullptr if the tail chunk is shared with another Marshal.
+    char* append(size_t n);
+
     // NOTE: This function is only used *internally* to chop a slice of marshal object.
     // Use case 1: In C++ server io thread, when a compelete packet is received, read it off
     //             into a Marshal object and hand over to worker threads.
     // Use case 2: In Python extension, buffer message in Marshal object, and send to network.
+    // the FdTable of m comes along, if this Marshal has none
     size_t read_from_marshal(Marshal& m, size_t n);
 
+    // with an FdTable, fds queued in it go out first
     size_t write_to_fd(int fd);
 
+    FdTable* fd_table() const {
+        return fdt_;
+    }
+    void set_fd_table(FdTable* fdt);
+
     bookmark* set_bookmark(size_t n);
     void write_bookmark(bookmark* bm, const void* p) {
         const char* pc = (const char *) p;
@@ -72,6 +105,320 @@ public:
     }
 };
 
+/**
+ * File descriptors passed over a unix: connection with SCM_RIGHTS, shared by
+ * the connection's Marshals and the requests or replies read off it.
+ *
+ * A FileDesc written to such a Marshal is dup()ed and queued, and goes out
+ * along with the next bytes written to the socket, so never behind the
+ * packet it is in. Its place in the packet holds its sequence number on the
+ * connection. The peer files fds by sequence number as they arrive, and
+ * reading the FileDesc takes it from there. Fds never taken are closed
+ * with the table.
+ */
+class FdTable: public RefCounted, public CacheAligned {
+    SpinLock l_;
+    std::vector<int> queued_;
+    i64 n_queued_;
+    std::unordered_map<i64, int> received_;
+    i64 n_received_;
+
+protected:
+
+    // RefCounted class requires protected destructor
+    ~FdTable();
+
+public:
+
+    // at most this many fds go with each sendmsg()
+    static const int max_fds_per_msg_s = 253;
+
+    FdTable(): n_queued_(0), n_received_(0) { }
+
+    // dup() fd to be sent, returns its sequence number, or -1 if fd is bad
+    i64 queue(int fd);
+
+    // the fd received as seq, -1 if there is none
+    int take(i64 seq);
+
+    void received(const int* fds, size_t n);
+
+    bool has_queued() {
+        ScopedLock sl(&l_);
+        return !queued_.empty();
+    }
+
+    // send queued fds along with the first bytes of out, returns bytes sent
+    size_t send_queued(int sock, Marshal* out);
+};
+
+/**
+ * A file descriptor as RPC argument or return value, e.g. 'rpc::FileDesc fd'
+ * in .rpc files. Owns the fd, which is closed with it unless release()d,
+ * and copies dup() it.
+ *
+ * Only unix: connections can pass fds, anywhere else (TCP, shm://, UDP,
+ * stream frames) the peer gets -1.
+ */
+class FileDesc {
+    int fd_;
+
+public:
+
+    explicit FileDesc(int fd = -1): fd_(fd) { }
+    FileDesc(const FileDesc& other): fd_(other.fd_ >= 0 ? dup(other.fd_) : -1) { }
+    FileDesc(FileDesc&& other): fd_(other.fd_) {
+        other.fd_ = -1;
+    }
+    ~FileDesc() {
+        reset();
+    }
+
+    FileDesc& operator =(const FileDesc& other) {
+        if (this != &other) {
+            reset(other.fd_ >= 0 ? dup(other.fd_) : -1);
+        }
+        return *this;
+    }
+    FileDesc& operator =(FileDesc&& other) {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    int get() const {
+        return fd_;
+    }
+
+    // give up ownership
+    int release() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+
+    void reset(int fd = -1) {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        fd_ = fd;
+    }
+};
+
+
+/**
+ * marshal_size(v) tells how many bytes 'm << v' is going to write, so that
+ * the output can be reserved once and packet size written up front instead
+ * of patched later through a bookmark. Types without an overload report
+ * marshal_size_unknown, and callers fall back to bookmarks.
+ *
+ * marshal_fixed_size((const T*) nullptr) is a compile time constant for types
+ * that always marshal into the same number of bytes, and 0 otherwise.
+ * rpcgen generates both for structs.
+ */
+const size_t marshal_size_unknown = (size_t) -1;
+
+template<class T>
+inline constexpr size_t marshal_fixed_size(const T*) {
+    return 0;
+}
+
+inline constexpr size_t marshal_fixed_size(const rpc::i8*) {
+    return sizeof(rpc::i8);
+}
+
+inline constexpr size_t marshal_fixed_size(const rpc::i16*) {
+    return sizeof(rpc::i16);
+}
+
+inline constexpr size_t marshal_fixed_size(const rpc::i32*) {
+    return sizeof(rpc::i32);
+}
+
+inline constexpr size_t marshal_fixed_size(const rpc::i64*) {
+    return sizeof(rpc::i64);
+}
+
+inline constexpr size_t marshal_fixed_size(const uint8_t*) {
+    return sizeof(uint8_t);
+}
+
+inline constexpr size_t marshal_fixed_size(const uint16_t*) {
+    return sizeof(uint16_t);
+}
+
+inline constexpr size_t marshal_fixed_size(const uint32_t*) {
+    return sizeof(uint32_t);
+}
+
+inline constexpr size_t marshal_fixed_size(const uint64_t*) {
+    return sizeof(uint64_t);
+}
+
+inline constexpr size_t marshal_fixed_size(const double*) {
+    return sizeof(double);
+}
+
+template<class T1, class T2>
+inline constexpr size_t marshal_fixed_size(const std::pair<T1, T2>*) {
+    return (marshal_fixed_size((const T1*) nullptr) > 0 && marshal_fixed_size((const T2*) nullptr) > 0)
+        ? marshal_fixed_size((const T1*) nullptr) + marshal_fixed_size((const T2*) nullptr) : 0;
+}
+
+template<class T>
+inline size_t marshal_size(const T&) {
+    return marshal_size_unknown;
+}
+
+inline constexpr size_t marshal_size(const rpc::i8&) {
+    return sizeof(rpc::i8);
+}
+
+inline constexpr size_t marshal_size(const rpc::i16&) {
+    return sizeof(rpc::i16);
+}
+
+inline constexpr size_t marshal_size(const rpc::i32&) {
+    return sizeof(rpc::i32);
+}
+
+inline constexpr size_t marshal_size(const rpc::i64&) {
+    return sizeof(rpc::i64);
+}
+
+inline size_t marshal_size(const rpc::v32& v) {
+    return v.val_size();
+}
+
+inline size_t marshal_size(const rpc::v64& v) {
+    return v.val_size();
+}
+
+inline constexpr size_t marshal_size(const uint8_t&) {
+    return sizeof(uint8_t);
+}
+
+inline constexpr size_t marshal_size(const uint16_t&) {
+    return sizeof(uint16_t);
+}
+
+inline constexpr size_t marshal_size(const uint32_t&) {
+    return sizeof(uint32_t);
+}
+
+inline constexpr size_t marshal_size(const uint64_t&) {
+    return sizeof(uint64_t);
+}
+
+inline constexpr size_t marshal_size(const double&) {
+    return sizeof(double);
+}
+
+inline constexpr size_t marshal_fixed_size(const rpc::FileDesc*) {
+    return sizeof(rpc::i64);
+}
+
+inline constexpr size_t marshal_size(const rpc::FileDesc&) {
+    return sizeof(rpc::i64);
+}
+
+template<class A>
+inline size_t marshal_size(const std::basic_string<char, std::char_traits<char>, A>& v) {
+    return base::SparseInt::val_size(v.length()) + v.length();
+}
+
+// containers could be nested in any order, so declare them all first
+template<class T1, class T2>
+size_t marshal_size(const std::pair<T1, T2>& v);
+
+template<class T, class A>
+size_t marshal_size(const std::vector<T, A>& v);
+
+template<class T, class A>
+size_t marshal_size(const std::list<T, A>& v);
+
+template<class T, class C, class A>
+size_t marshal_size(const std::set<T, C, A>& v);
+
+template<class K, class V, class C, class A>
+size_t marshal_size(const std::map<K, V, C, A>& v);
+
+template<class T, class H, class E, class A>
+size_t marshal_size(const std::unordered_set<T, H, E, A>& v);
+
+template<class K, class V, class H, class E, class A>
+size_t marshal_size(const std::unordered_map<K, V, H, E, A>& v);
+
+inline size_t marshal_size_of() {
+    return 0;
+}
+
+// total marshal size of all the arguments
+template<class T, class... Args>
+inline size_t marshal_size_of(const T& v, const Args&... args) {
+    size_t sz = marshal_size(v);
+    size_t rest = marshal_size_of(args...);
+    if (sz == marshal_size_unknown || rest == marshal_size_unknown) {
+        return marshal_size_unknown;
+    }
+    return sz + rest;
+}
+
+// <v64 n> <elem1> ... <elemN>, O(1) if elements have fixed size
+template<class Iter>
+inline size_t marshal_size_of_range(Iter first, Iter last, size_t n) {
+    typedef typename std::iterator_traits<Iter>::value_type value_type;
+    size_t sz = base::SparseInt::val_size(n);
+    size_t fixed = marshal_fixed_size((const value_type*) nullptr);
+    if (fixed > 0) {
+        return sz + n * fixed;
+    }
+    for (; first != last; ++first) {
+        size_t elem_size = marshal_size(*first);
+        if (elem_size == marshal_size_unknown) {
+            return marshal_size_unknown;
+        }
+        sz += elem_size;
+    }
+    return sz;
+}
+
+template<class T1, class T2>
+inline size_t marshal_size(const std::pair<T1, T2>& v) {
+    return marshal_size_of(v.first, v.second);
+}
+
+template<class T, class A>
+inline size_t marshal_size(const std::vector<T, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
+template<class T, class A>
+inline size_t marshal_size(const std::list<T, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
+template<class T, class C, class A>
+inline size_t marshal_size(const std::set<T, C, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
+template<class K, class V, class C, class A>
+inline size_t marshal_size(const std::map<K, V, C, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
+template<class T, class H, class E, class A>
+inline size_t marshal_size(const std::unordered_set<T, H, E, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
+template<class K, class V, class H, class E, class A>
+inline size_t marshal_size(const std::unordered_map<K, V, H, E, A>& v) {
+    return marshal_size_of_range(v.begin(), v.end(), v.size());
+}
+
 
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const rpc::i8& v) {
     verify(m.write(&v, sizeof(v)) == sizeof(v));
@@ -132,6 +479,13 @@ inline rpc::Marshal& operator <<(rpc::Marshal& m, const double& v) {
     return m;
 }
 
+// <i64 seq>, -1 if fds cannot be passed, see FdTable
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const rpc::FileDesc& v) {
+    rpc::i64 seq = (m.fd_table() != nullptr) ? m.fd_table()->queue(v.get()) : -1;
+    verify(m.write(&seq, sizeof(seq)) == sizeof(seq));
+    return m;
+}
+
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::string& v) {
     v64 v_len = v.length();
     m << v_len;
@@ -141,6 +495,17 @@ inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::string& v) {
     return m;
 }
 
+// strings with other allocators, e.g. rpc::arena_string
+template<class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::basic_string<char, std::char_traits<char>, A>& v) {
+    v64 v_len = v.length();
+    m << v_len;
+    if (v_len.get() > 0) {
+        verify(m.write(v.c_str(), v_len.get()) == (size_t) v_len.get());
+    }
+    return m;
+}
+
 template<class T1, class T2>
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::pair<T1, T2>& v) {
     m << v.first;
@@ -148,61 +513,61 @@ inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::pair<T1, T2>& v) {
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::vector<T>& v) {
+template<class T, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::vector<T, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::vector<T>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::vector<T, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << *it;
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::list<T>& v) {
+template<class T, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::list<T, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::list<T>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::list<T, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << *it;
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::set<T>& v) {
+template<class T, class C, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::set<T, C, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::set<T>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::set<T, C, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << *it;
     }
     return m;
 }
 
-template<class K, class V>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::map<K, V>& v) {
+template<class K, class V, class C, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::map<K, V, C, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::map<K, V>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::map<K, V, C, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << it->first << it->second;
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::unordered_set<T>& v) {
+template<class T, class H, class E, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::unordered_set<T, H, E, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::unordered_set<T>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::unordered_set<T, H, E, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << *it;
     }
     return m;
 }
 
-template<class K, class V>
-inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::unordered_map<K, V>& v) {
+template<class K, class V, class H, class E, class A>
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const std::unordered_map<K, V, H, E, A>& v) {
     v64 v_len = v.size();
     m << v_len;
-    for (typename std::unordered_map<K, V>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    for (typename std::unordered_map<K, V, H, E, A>::const_iterator it = v.begin(); it != v.end(); ++it) {
         m << it->first << it->second;
     }
     return m;
@@ -275,6 +640,13 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, double& v) {
     return m;
 }
 
+inline rpc::Marshal& operator >>(rpc::Marshal& m, rpc::FileDesc& v) {
+    rpc::i64 seq;
+    verify(m.read(&seq, sizeof(seq)) == sizeof(seq));
+    v.reset((seq >= 0 && m.fd_table() != nullptr) ? m.fd_table()->take(seq) : -1);
+    return m;
+}
+
 inline rpc::Marshal& operator >>(rpc::Marshal& m, std::string& v) {
     v64 v_len;
     m >> v_len;
@@ -285,6 +657,17 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::string& v) {
     return m;
 }
 
+template<class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::basic_string<char, std::char_traits<char>, A>& v) {
+    v64 v_len;
+    m >> v_len;
+    v.resize(v_len.get());
+    if (v_len.get() > 0) {
+        verify(m.read(&v[0], v_len.get()) == (size_t) v_len.get());
+    }
+    return m;
+}
+
 template<class T1, class T2>
 inline rpc::Marshal& operator >>(rpc::Marshal& m, std::pair<T1, T2>& v) {
     m >> v.first;
@@ -292,8 +675,8 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::pair<T1, T2>& v) {
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::vector<T>& v) {
+template<class T, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::vector<T, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
@@ -301,39 +684,39 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::vector<T>& v) {
     for (int i = 0; i < v_len.get(); i++) {
         T elem;
         m >> elem;
-        v.push_back(elem);
+        v.push_back(std::move(elem));
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::list<T>& v) {
+template<class T, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::list<T, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
     for (int i = 0; i < v_len.get(); i++) {
         T elem;
         m >> elem;
-        v.push_back(elem);
+        v.push_back(std::move(elem));
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::set<T>& v) {
+template<class T, class C, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::set<T, C, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
     for (int i = 0; i < v_len.get(); i++) {
         T elem;
         m >> elem;
-        v.insert(elem);
+        v.insert(std::move(elem));
     }
     return m;
 }
 
-template<class K, class V>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::map<K, V>& v) {
+template<class K, class V, class C, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::map<K, V, C, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
@@ -341,26 +724,26 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::map<K, V>& v) {
         K key;
         V value;
         m >> key >> value;
-        insert_into_map(v, key, value);
+        v.insert(std::make_pair(std::move(key), std::move(value)));
     }
     return m;
 }
 
-template<class T>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_set<T>& v) {
+template<class T, class H, class E, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_set<T, H, E, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
     for (int i = 0; i < v_len.get(); i++) {
         T elem;
         m >> elem;
-        v.insert(elem);
+        v.insert(std::move(elem));
     }
     return m;
 }
 
-template<class K, class V>
-inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_map<K, V>& v) {
+template<class K, class V, class H, class E, class A>
+inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_map<K, V, H, E, A>& v) {
     v64 v_len;
     m >> v_len;
     v.clear();
@@ -368,7 +751,81 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_map<K, V>& v) {
         K key;
         V value;
         m >> key >> value;
-        insert_into_map(v, key, value);
+        v.insert(std::make_pair(std::move(key), std::move(value)));
+    }
+    return m;
+}
+
+
+/**
+ * Wire format of rpcgen structs marked [versioned]:
+ *   <v32 field_count> <v64 body_size> <field1> ... <fieldN>
+ *
+ * Fields are numbered by declaration order, and new fields may only be
+ * appended. A reader fills in the fields it knows about, resets the ones an
+ * older writer did not send, and skips trailing fields from a newer writer.
+ */
+inline void marshal_fields(rpc::Marshal& m) { }
+
+template<class T, class... Args>
+inline void marshal_fields(rpc::Marshal& m, const T& v, const Args&... rest) {
+    m << v;
+    marshal_fields(m, rest...);
+}
+
+inline void unmarshal_fields(rpc::Marshal& m, i32 n_fields) { }
+
+template<class T, class... Args>
+inline void unmarshal_fields(rpc::Marshal& m, i32 n_fields, T& v, Args&... rest) {
+    if (n_fields > 0) {
+        m >> v;
+    } else {
+        v = T();
+    }
+    unmarshal_fields(m, n_fields - 1, rest...);
+}
+
+template<class... Args>
+inline size_t marshal_size_versioned(const Args&... fields) {
+    size_t body_size = marshal_size_of(fields...);
+    if (body_size == marshal_size_unknown) {
+        return marshal_size_unknown;
+    }
+    return base::SparseInt::val_size(sizeof...(Args)) + base::SparseInt::val_size(body_size) + body_size;
+}
+
+template<class... Args>
+inline rpc::Marshal& marshal_versioned(rpc::Marshal& m, const Args&... fields) {
+    m << v32(sizeof...(Args));
+    size_t body_size = marshal_size_of(fields...);
+    if (body_size != marshal_size_unknown) {
+        m << v64(body_size);
+        marshal_fields(m, fields...);
+    } else {
+        // cannot tell body size in advance, marshal it aside
+        Marshal body;
+        marshal_fields(body, fields...);
+        m << v64(body.content_size());
+        if (!body.empty()) {
+            m.read_from_marshal(body, body.content_size());
+        }
+    }
+    return m;
+}
+
+template<class... Args>
+inline rpc::Marshal& unmarshal_versioned(rpc::Marshal& m, Args&... fields) {
+    v32 n_fields;
+    v64 body_size;
+    m >> n_fields >> body_size;
+    size_t size_before = m.content_size();
+    verify(size_before >= (size_t) body_size.get());
+    unmarshal_fields(m, n_fields.get(), fields...);
+    size_t n_read = size_before - m.content_size();
+    verify(n_read <= (size_t) body_size.get());
+    if (n_read < (size_t) body_size.get()) {
+        // trailing fields from a newer writer
+        m.discard(body_size.get() - n_read);
     }
     return m;
 }
@@ -376,31 +833,17 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, std::unordered_map<K, V>& v) {
 
 class UdpBuffer {
     Marshal m_;
-    char* buf_;
 
 public:
     static const size_t max_udp_packet_size_s = 65507;
 
-    UdpBuffer() {
-        buf_ = new char[max_udp_packet_size_s];
-    }
-    ~UdpBuffer() {
-        delete[] buf_;
-    }
-    char* get_buf(size_t* size, bool* overflow) {
-        *overflow = false;
-        *size = 0;
-        if (!m_.empty()) {
-            if (m_.content_size() > max_udp_packet_size_s) {
-                *overflow = true;
-                *size = max_udp_packet_size_s;
-                return nullptr;
-            } else {
-                *size = m_.read(buf_, m_.content_size());
-            }
-        }
-        return buf_;
-    }
+    // set in rpc_id of a request that wants a reply, an i64 xid follows it.
+    // udp requests carry no tracing context, so it reuses RPC_ID_TRACED's bit.
+    static const i32 reply_flag_s = (i32) 0x80000000;
+
+    // <size> <rpc_id> <xid> of such requests
+    static const size_t call_header_size_s = 2 * sizeof(i32) + sizeof(i64);
+
     Marshal& base() {
         return m_;
     }
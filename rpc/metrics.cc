@@ -0,0 +1,308 @@
+#include <algorithm>
+
+#include <string.h>
+
+#include "metrics.h"
+
+using namespace std;
+
+namespace rpc {
+
+int Histogram::bucket_of(i64 ns) {
+    if (ns < (1 << sub_bits)) {
+        return (int) ns;
+    }
+    if (ns >= (1LL << max_bits)) {
+        return n_buckets - 1;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    return ((e - sub_bits + 1) << sub_bits) + (int) ((ns >> (e - sub_bits)) & ((1 << sub_bits) - 1));
+}
+
+i64 Histogram::bucket_upper(int idx) {
+    if (idx < (1 << sub_bits)) {
+        return idx;
+    }
+    int e = (idx >> sub_bits) + sub_bits - 1;
+    i64 sub = idx & ((1 << sub_bits) - 1);
+    i64 width = 1LL << (e - sub_bits);
+    return (((1LL << sub_bits) + sub) << (e - sub_bits)) + width - 1;
+}
+
+void Histogram::merge(const Histogram& other) {
+    for (int i = 0; i < n_buckets; i++) {
+        buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+}
+
+void Histogram::subtract(const Histogram& earlier) {
+    count_ = 0;
+    for (int i = 0; i < n_buckets; i++) {
+        buckets_[i] = std::max(buckets_[i] - earlier.buckets_[i], (i64) 0);
+        count_ += buckets_[i];
+    }
+    sum_ = std::max(sum_ - earlier.sum_, (i64) 0);
+}
+
+void Histogram::reset() {
+    memset(buckets_, 0, sizeof(buckets_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+i64 Histogram::percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    i64 rank = (i64) (p / 100.0 * count_ + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    i64 seen = 0;
+    for (int i = 0; i < n_buckets; i++) {
+        seen += buckets_[i];
+        if (seen >= rank) {
+            // last bucket also holds the clamped values
+            return i == n_buckets - 1 ? max_ : std::min(bucket_upper(i), max_);
+        }
+    }
+    return max_;
+}
+
+RpcMetrics::Phases::Phases() {
+    for (int i = 0; i < max_phases; i++) {
+        h_[i] = nullptr;
+    }
+}
+
+RpcMetrics::Phases::Phases(const Phases& other) {
+    for (int i = 0; i < max_phases; i++) {
+        h_[i] = (other.h_[i] == nullptr) ? nullptr : new Histogram(*other.h_[i]);
+    }
+}
+
+RpcMetrics::Phases::~Phases() {
+    for (int i = 0; i < max_phases; i++) {
+        delete h_[i];
+    }
+}
+
+RpcMetrics::Phases& RpcMetrics::Phases::operator =(const Phases& other) {
+    for (int i = 0; i < max_phases && this != &other; i++) {
+        if (other.h_[i] == nullptr) {
+            delete h_[i];
+            h_[i] = nullptr;
+        } else if (h_[i] == nullptr) {
+            h_[i] = new Histogram(*other.h_[i]);
+        } else {
+            *h_[i] = *other.h_[i];
+        }
+    }
+    return *this;
+}
+
+const Histogram& RpcMetrics::Phases::operator [](int phase) const {
+    static const Histogram empty;
+    return (h_[phase] == nullptr) ? empty : *h_[phase];
+}
+
+void RpcMetrics::Phases::record(int phase, i64 ns) {
+    if (h_[phase] == nullptr) {
+        h_[phase] = new Histogram;
+    }
+    h_[phase]->record(ns);
+}
+
+void RpcMetrics::Phases::merge(const Phases& other) {
+    for (int i = 0; i < max_phases; i++) {
+        if (other.h_[i] == nullptr) {
+            continue;
+        }
+        if (h_[i] == nullptr) {
+            h_[i] = new Histogram(*other.h_[i]);
+        } else {
+            h_[i]->merge(*other.h_[i]);
+        }
+    }
+}
+
+void RpcMetrics::Stats::merge(const Stats& other) {
+    started += other.started;
+    count += other.count;
+    bytes_in += other.bytes_in;
+    bytes_out += other.bytes_out;
+    for (auto& it: other.errors) {
+        errors[it.first] += it.second;
+    }
+    phases.merge(other.phases);
+}
+
+// ids start at 1, 0 marks an empty cache entry
+static Counter g_metrics_id(1);
+
+// slots this thread used last, by id of RpcMetrics, slot_cache_ways of
+// them for each id % slot_cache_sets. ids are never reused, so entries of
+// destroyed instances are simply never hit again, and get replaced in time.
+// Clients of a pool get ids in sequence, so a thread calling all of them
+// spreads over the sets
+static const int slot_cache_sets = 64;
+static const int slot_cache_ways = 4;
+struct slot_cache_set {
+    i64 id[slot_cache_ways];
+    void* s[slot_cache_ways];
+    int next;  // way replaced on the next miss
+};
+static thread_local slot_cache_set t_slot_cache[slot_cache_sets];
+
+RpcMetrics::RpcMetrics(): id_(g_metrics_id.next()) {
+    memset((void *) started_, 0, sizeof(started_));
+}
+
+RpcMetrics::~RpcMetrics() {
+    for (auto& ts: slots_) {
+        delete ts.second;
+    }
+}
+
+RpcMetrics::slot* RpcMetrics::my_slot() {
+    slot_cache_set* set = &t_slot_cache[id_ % slot_cache_sets];
+    for (int i = 0; i < slot_cache_ways; i++) {
+        if (set->id[i] == id_) {
+            return (slot *) set->s[i];
+        }
+    }
+    slots_l_.lock();
+    slot*& s = slots_[pthread_self()];
+    if (s == nullptr) {
+        s = new slot;
+    }
+    slot* found = s;
+    slots_l_.unlock();
+    int i = set->next;
+    set->next = (i + 1) % slot_cache_ways;
+    set->id[i] = id_;
+    set->s[i] = found;
+    return found;
+}
+
+RpcMetrics::started_counter* RpcMetrics::started_of(i32 rpc_id, bool add) {
+    i64 key = (i64) (uint32_t) rpc_id | started_key_bit_s;
+    // counters are never given back, so a free one ends the search
+    for (int i = 0; i < started_slots_s; i++) {
+        started_counter* c = &started_[((uint32_t) rpc_id + i) % started_slots_s];
+        i64 k = c->key;
+        if (k == 0) {
+            if (!add) {
+                return nullptr;
+            }
+            k = __sync_val_compare_and_swap(&c->key, 0, key);
+            if (k == 0) {
+                return c;
+            }
+        }
+        if (k == key) {
+            return c;
+        }
+    }
+    return nullptr;
+}
+
+void RpcMetrics::record_start(i32 rpc_id) {
+    started_counter* c = started_of(rpc_id, true);
+    if (c != nullptr) {
+        __sync_fetch_and_add(&c->n, 1);
+        return;
+    }
+    slot* s = my_slot();
+    s->l.lock();
+    s->stats[rpc_id].started++;
+    s->l.unlock();
+}
+
+void RpcMetrics::record_call(i32 rpc_id, i32 error_code, size_t bytes_in, size_t bytes_out,
+                             const i64* phase_ns, int n_phases) {
+    slot* s = my_slot();
+    s->l.lock();
+    Stats& st = s->stats[rpc_id];
+    st.count++;
+    st.bytes_in += bytes_in;
+    st.bytes_out += bytes_out;
+    if (error_code != 0) {
+        st.errors[error_code]++;
+    }
+    for (int i = 0; i < n_phases; i++) {
+        st.phases.record(i, phase_ns[i]);
+    }
+    s->l.unlock();
+}
+
+void RpcMetrics::record_phase(i32 rpc_id, int phase, i64 ns) {
+    slot* s = my_slot();
+    s->l.lock();
+    s->stats[rpc_id].phases.record(phase, ns);
+    s->l.unlock();
+}
+
+void RpcMetrics::snapshot(std::map<i32, Stats>* stats) {
+    stats->clear();
+    slots_l_.lock();
+    for (auto& ts: slots_) {
+        slot* s = ts.second;
+        s->l.lock();
+        for (auto& it: s->stats) {
+            (*stats)[it.first].merge(it.second);
+        }
+        s->l.unlock();
+    }
+    slots_l_.unlock();
+    snapshot_started(stats);
+}
+
+void RpcMetrics::snapshot_started(std::map<i32, Stats>* stats) {
+    for (int i = 0; i < started_slots_s; i++) {
+        i64 key = started_[i].key;
+        if (key != 0 && started_[i].n != 0) {
+            (*stats)[(i32) (key & (started_key_bit_s - 1))].started += started_[i].n;
+        }
+    }
+}
+
+void RpcMetrics::snapshot(i32 rpc_id, Stats* stats) {
+    slots_l_.lock();
+    for (auto& ts: slots_) {
+        slot* s = ts.second;
+        s->l.lock();
+        unordered_map<i32, Stats>::iterator it = s->stats.find(rpc_id);
+        if (it != s->stats.end()) {
+            stats->merge(it->second);
+        }
+        s->l.unlock();
+    }
+    slots_l_.unlock();
+    started_counter* c = started_of(rpc_id, false);
+    if (c != nullptr) {
+        stats->started += c->n;
+    }
+}
+
+void RpcMetrics::reset() {
+    slots_l_.lock();
+    for (auto& ts: slots_) {
+        slot* s = ts.second;
+        s->l.lock();
+        s->stats.clear();
+        s->l.unlock();
+    }
+    slots_l_.unlock();
+    for (int i = 0; i < started_slots_s; i++) {
+        started_[i].n = 0;
+    }
+}
+
+} // namespace rpc
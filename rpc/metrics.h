@@ -0,0 +1,173 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <unordered_map>
+
+#include "utils.h"
+
+namespace rpc {
+
+/**
+ * HDR-style latency histogram over nanoseconds. Values below 8ns are exact,
+ * above that every power of two is split into 8 buckets, so a percentile is
+ * off by at most 12.5%. Not thread safe.
+ */
+class Histogram {
+public:
+    static const int sub_bits = 3;
+    static const int max_bits = 40;  // about 18 minutes, larger values are clamped
+    static const int n_buckets = (max_bits - sub_bits + 1) << sub_bits;
+
+    Histogram() {
+        reset();
+    }
+
+    void record(i64 ns) {
+        if (ns < 0) {
+            ns = 0;
+        }
+        buckets_[bucket_of(ns)]++;
+        count_++;
+        sum_ += ns;
+        if (ns > max_) {
+            max_ = ns;
+        }
+    }
+
+    void merge(const Histogram& other);
+
+    // takes out what an earlier copy of this one held, max() stays as is
+    void subtract(const Histogram& earlier);
+
+    void reset();
+
+    i64 count() const {
+        return count_;
+    }
+    i64 sum() const {
+        return sum_;
+    }
+    i64 max() const {
+        return max_;
+    }
+    i64 mean() const {
+        return count_ == 0 ? 0 : sum_ / count_;
+    }
+
+    // highest value in the bucket holding the p-th percentile, p in [0, 100]
+    i64 percentile(double p) const;
+
+private:
+    i64 buckets_[n_buckets];
+    i64 count_;
+    i64 sum_;
+    i64 max_;
+
+    static int bucket_of(i64 ns);
+    static i64 bucket_upper(int idx);
+};
+
+/**
+ * Per rpc_id call counts, bytes, error codes and latency histograms of up to
+ * max_phases phases of a call.
+ *
+ * Each thread records into a slot of its own, so the lock taken is hardly
+ * ever contended, and cheap enough to be always on. snapshot() merges all
+ * slots on demand. Slots outlive their threads, so nothing recorded gets
+ * lost. Calls started are counted apart, without any lock, since callers
+ * record them from all their threads.
+ */
+class RpcMetrics: public NoCopy {
+public:
+    static const int max_phases = 4;
+
+    // a histogram for each phase, allocated once the phase gets recorded
+    class Phases {
+    public:
+        Phases();
+        Phases(const Phases& other);
+        ~Phases();
+        Phases& operator =(const Phases& other);
+
+        // empty for a phase never recorded
+        const Histogram& operator [](int phase) const;
+
+        void record(int phase, i64 ns);
+        void merge(const Phases& other);
+
+    private:
+        Histogram* h_[max_phases];
+    };
+
+    struct Stats {
+        i64 started;  // only if record_start() is used
+        i64 count;
+        i64 bytes_in;
+        i64 bytes_out;
+        std::map<i32, i64> errors;  // error_code -> count, 0 is not counted
+        Phases phases;
+
+        Stats(): started(0), count(0), bytes_in(0), bytes_out(0) { }
+        void merge(const Stats& other);
+
+        i64 in_flight() const {
+            return started - count;
+        }
+    };
+
+    RpcMetrics();
+    ~RpcMetrics();
+
+    // a call is on the way, for in_flight()
+    void record_start(i32 rpc_id);
+
+    // one finished call, phase_ns has n_phases latencies
+    void record_call(i32 rpc_id, i32 error_code, size_t bytes_in, size_t bytes_out,
+                     const i64* phase_ns, int n_phases);
+
+    // a phase that finishes after the call was recorded
+    void record_phase(i32 rpc_id, int phase, i64 ns);
+
+    // merge of all threads
+    void snapshot(std::map<i32, Stats>* stats);
+
+    // merge of all threads for one rpc_id, added to stats
+    void snapshot(i32 rpc_id, Stats* stats);
+
+    void reset();
+
+private:
+    struct slot: public CacheAligned {
+        SpinLock l;
+        std::unordered_map<i32, Stats> stats;
+    };
+
+    // record_start() counters, key is rpc_id | started_key_bit_s once taken,
+    // 0 while free. rpc_ids beyond started_slots_s go to the thread slots
+    struct started_counter {
+        volatile i64 key;
+        volatile i64 n;
+    };
+    static const int started_slots_s = 64;
+    static const i64 started_key_bit_s = 1LL << 32;
+    started_counter started_[started_slots_s];
+
+    // tells apart instances in per thread slot lookup, never reused
+    i64 id_;
+
+    // slot of each thread, a thread id reused after a thread exits gets
+    // the same slot again
+    SpinLock slots_l_;
+    std::unordered_map<pthread_t, slot*> slots_;
+
+    slot* my_slot();
+
+    // counter of rpc_id, taking a free one if needed, nullptr if all taken
+    started_counter* started_of(i32 rpc_id, bool add);
+
+    // started_ counts into stats
+    void snapshot_started(std::map<i32, Stats>* stats);
+};
+
+} // namespace rpc
@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "utils.h"
 #include "polling.h"
@@ -22,7 +23,7 @@ using namespace std;
 
 namespace rpc {
 
-class PollMgr::PollThread {
+class PollMgr::PollThread: public CacheAligned {
 
     friend class PollMgr;
 
@@ -83,7 +84,8 @@ public:
     void update_mode(Pollable*, int new_mode);
 };
 
-PollMgr::PollMgr(int n_threads /* =... */): n_threads_(n_threads) {
+PollMgr::PollMgr(int n_threads /* =... */)
+        : n_threads_(n_threads), busy_poll_(false), future_spin_sec_(0.0), sock_busy_poll_usec_(0) {
     verify(n_threads_ > 0);
     poll_threads_ = new PollThread[n_threads_];
     for (int i = 0; i < n_threads_; i++) {
@@ -107,6 +109,10 @@ void PollMgr::PollThread::poll_loop() {
         timeout.tv_sec = 0;
         timeout.tv_nsec = 50 * 1000 * 1000; // 0.05 sec
 
+        if (poll_mgr_->busy_poll_) {
+            timeout.tv_nsec = 0;
+        }
+
         int nev = kevent(poll_fd_, nullptr, 0, evlist, max_nev, &timeout);
 
         for (int i = 0; i < nev; i++) {
@@ -130,6 +136,9 @@ void PollMgr::PollThread::poll_loop() {
 
         struct epoll_event evlist[max_nev];
         int timeout = 50; // milli, 0.05 sec
+        if (poll_mgr_->busy_poll_) {
+            timeout = 0;
+        }
 
         int nev = epoll_wait(poll_fd_, evlist, max_nev, timeout);
 
@@ -365,8 +374,22 @@ static inline uint32_t hash_fd(uint32_t h) {
     return h;
 }
 
+void PollMgr::set_busy_poll(bool enabled, double future_spin_sec /* =? */, int sock_busy_poll_usec /* =? */) {
+    verify(future_spin_sec >= 0 && sock_busy_poll_usec >= 0);
+    future_spin_sec_ = future_spin_sec;
+    sock_busy_poll_usec_ = enabled ? sock_busy_poll_usec : 0;
+    busy_poll_ = enabled;
+}
+
 void PollMgr::add(Pollable* poll) {
     int fd = poll->fd();
+#ifdef SO_BUSY_POLL
+    int usec = sock_busy_poll_usec_;
+    if (fd >= 0 && usec > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0
+            && errno != ENOTSOCK) {
+        Log_info("rpc::PollMgr: SO_BUSY_POLL on fd=%d: %s", fd, strerror(errno));
+    }
+#endif
     if (fd >= 0) {
         int tid = hash_fd(fd) % n_threads_;
         poll_threads_[tid].add(poll);
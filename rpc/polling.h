@@ -34,6 +34,11 @@ class PollMgr: public RefCounted {
     PollThread* poll_threads_;
     const int n_threads_;
 
+    // see set_busy_poll()
+    volatile bool busy_poll_;
+    double future_spin_sec_;
+    int sock_busy_poll_usec_;
+
 protected:
 
     // RefCounted object uses protected dtor to prevent accidental deletion
@@ -46,6 +51,30 @@ public:
     void add(Pollable*);
     void remove(Pollable*);
     void update_mode(Pollable*, int new_mode);
+
+    /**
+     * Busy polling, for latency critical processes with cores to spare: the
+     * poll threads spin on epoll_wait() without ever going to sleep in it,
+     * and Future::wait() of calls made by clients on this PollMgr spins up
+     * to future_spin_sec for the reply before sleeping. Each poll thread
+     * takes a core to itself while enabled.
+     *
+     * sock_busy_poll_usec > 0 also sets SO_BUSY_POLL on sockets added from
+     * then on, so the kernel polls the device queue on reads and polls
+     * instead of waiting for interrupts. Raising it above the
+     * net.core.busy_read sysctl needs CAP_NET_ADMIN, and it is skipped
+     * (logged) without.
+     */
+    void set_busy_poll(bool enabled, double future_spin_sec = 0.0001, int sock_busy_poll_usec = 0);
+
+    bool busy_poll() const {
+        return busy_poll_;
+    }
+
+    // how long Future::wait() spins, 0 if not busy polling
+    double future_spin_sec() const {
+        return busy_poll_ ? future_spin_sec_ : 0.0;
+    }
 };
 
 }
@@ -1,5 +1,6 @@
 #include <string>
 #include <sstream>
+#include <algorithm>
 
 #include <sys/select.h>
 #include <errno.h>
@@ -8,8 +9,13 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "server.h"
+#include "shm.h"
+#include "introspect_service_impl.h"
 
 using namespace std;
 
@@ -81,14 +87,63 @@ static void stat_server_rpc_counting(i32 rpc_id) {
 
 
 
-int ServerConnection::run_async(const std::function<void()>& f, int queuing_channel /* =? */) {
-    return server_->threadpool_->run_async(f, queuing_channel);
+int ServerConnection::run_async(const std::function<void()>& f, int queuing_channel /* =? */, int priority /* =? */) {
+    return server_->threadpool_->run_async(f, queuing_channel, priority);
 }
 
 
 
+// a request over udp that wants a reply, by client address and xid
+struct udp_xid {
+    uint64_t peer;
+    i64 xid;
+
+    bool operator ==(const udp_xid& o) const {
+        return peer == o.peer && xid == o.xid;
+    }
+};
+
+struct udp_xid_hash {
+    size_t operator ()(const udp_xid& k) const {
+        return std::hash<uint64_t>()(k.peer * 0x9e3779b97f4a7c15ULL ^ (uint64_t) k.xid);
+    }
+};
+
 class ServerUdpConnection: public ServerConnection {
+    // datagrams taken per recvmmsg(), each into a buffer of its own
+    static const int recv_batch_s = 16;
+
+    // requests remembered for duplicate suppression
+    static const size_t max_recent_s = 4096;
+
     char* udp_buffer_;
+    struct iovec iov_[recv_batch_s];
+    struct mmsghdr msgs_[recv_batch_s];
+    struct sockaddr_in peers_[recv_batch_s];
+
+    // replies of recent requests, so a retransmitted request is answered
+    // again instead of being handled twice. nullptr while it is being handled.
+    SpinLock recent_l_;
+    unordered_map<udp_xid, string*, udp_xid_hash> recent_;
+    list<udp_xid> recent_order_;
+
+    // the reply being written, from begin_reply() till end_reply()
+    SpinLock reply_l_;
+    Marshal reply_;
+    bool reply_wanted_;
+    udp_xid reply_key_;
+    struct sockaddr_in reply_peer_;
+
+    void parse_datagram(const char* buf, size_t size, const struct sockaddr_in& peer,
+                        list<Request*>* complete_requests);
+    void dispatch(list<Request*>& complete_requests);
+
+    // false if xid from peer was seen already, answers it again if the reply is ready
+    bool admit(const udp_xid& key, const struct sockaddr_in& peer);
+
+    static uint64_t peer_of(const struct sockaddr_in& addr) {
+        return ((uint64_t) addr.sin_addr.s_addr << 16) | addr.sin_port;
+    }
 
     virtual void close() {
         // will not be called
@@ -96,17 +151,26 @@ class ServerUdpConnection: public ServerConnection {
     }
 
     virtual Marshal* output_buffer() {
-        // will not be called
-        verify(0);
-        return nullptr;
+        return &reply_;
     }
 
 public:
-    ServerUdpConnection(Server* svr, int udp_sock): ServerConnection(svr, udp_sock) {
-        udp_buffer_ = new char[UdpBuffer::max_udp_packet_size_s];
+    ServerUdpConnection(Server* svr, int udp_sock): ServerConnection(svr, udp_sock), reply_wanted_(false) {
+        udp_buffer_ = new char[recv_batch_s * UdpBuffer::max_udp_packet_size_s];
+        memset(msgs_, 0, sizeof(msgs_));
+        for (int i = 0; i < recv_batch_s; i++) {
+            iov_[i].iov_base = udp_buffer_ + i * UdpBuffer::max_udp_packet_size_s;
+            iov_[i].iov_len = UdpBuffer::max_udp_packet_size_s;
+            msgs_[i].msg_hdr.msg_iov = &iov_[i];
+            msgs_[i].msg_hdr.msg_iovlen = 1;
+            msgs_[i].msg_hdr.msg_name = &peers_[i];
+        }
     }
     ~ServerUdpConnection() {
         delete[] udp_buffer_;
+        for (auto& it: recent_) {
+            delete it.second;
+        }
     }
     virtual int poll_mode() {
         return Pollable::READ;  // always read only
@@ -120,59 +184,113 @@ public:
         ::close(sock_);
     }
 
-    virtual void begin_reply(Request* req, i32 error_code = 0) {
-        // no reply, should not be called
-        verify(0);
-    }
-
-    virtual void end_reply() {
-        // no reply, should not be called
-        verify(0);
-    }
+    // replies go back in a single datagram, if the request asked for one
+    virtual void begin_reply(Request* req, i32 error_code = 0, size_t rets_size = marshal_size_unknown);
+    virtual void end_reply();
 };
 
 
-// <size> <rpc_id> <arg1> <arg2> ... <argN>
-void ServerUdpConnection::handle_read() {
-    int cnt = recvfrom(sock_, udp_buffer_, UdpBuffer::max_udp_packet_size_s, MSG_WAITALL, nullptr, nullptr);
-    Marshal m_in;
-    m_in.write(udp_buffer_, cnt);
-
-    list<Request*> complete_requests;
-
-    for (;;) {
+// <size> <rpc_id> <arg1> <arg2> ... <argN>, or if the rpc_id has reply_flag_s
+// <size> <rpc_id> <xid> <arg1> <arg2> ... <argN>, possibly several in a datagram
+void ServerUdpConnection::parse_datagram(const char* buf, size_t size, const struct sockaddr_in& peer,
+                                         list<Request*>* complete_requests) {
+    while (size >= sizeof(i32)) {
         i32 packet_size;
-        int n_peek = m_in.peek(&packet_size, sizeof(i32));
-        if (n_peek == sizeof(i32) && m_in.content_size() >= packet_size + sizeof(i32)) {
-            // consume the packet size
-            verify(m_in.read(&packet_size, sizeof(i32)) == sizeof(i32));
+        memcpy(&packet_size, buf, sizeof(i32));
+        if (packet_size < (i32) sizeof(i32) || size - sizeof(i32) < (size_t) packet_size) {
+            // truncated packet, discard the rest
+            break;
+        }
+        const char* p = buf + sizeof(i32);
+        size_t args_size = packet_size - sizeof(i32);
+        buf += sizeof(i32) + packet_size;
+        size -= sizeof(i32) + packet_size;
 
-            Request* req = new Request;
-            verify(req->m.read_from_marshal(m_in, packet_size) == (size_t) packet_size);
+        i32 rpc_id;
+        memcpy(&rpc_id, p, sizeof(i32));
+        p += sizeof(i32);
+        i64 xid = -1;  // no reply
+        if (rpc_id & UdpBuffer::reply_flag_s) {
+            if (args_size < sizeof(i64)) {
+                break;
+            }
+            rpc_id &= ~UdpBuffer::reply_flag_s;
+            memcpy(&xid, p, sizeof(i64));
+            p += sizeof(i64);
+            args_size -= sizeof(i64);
+            if (!admit(udp_xid{peer_of(peer), xid}, peer)) {
+                continue;
+            }
+        }
 
-            req->xid = -1;  // UDP packets does not have valid xid
-            complete_requests.push_back(req);
+        Request* req = new Request;
+        req->m.write(p, args_size);
+        req->xid = xid;
+        req->rpc_id = rpc_id;
+        req->udp_peer = peer;
+        complete_requests->push_back(req);
+    }
+}
 
-        } else {
-            // packet not complete or there's no more packet to process
+bool ServerUdpConnection::admit(const udp_xid& key, const struct sockaddr_in& peer) {
+    string* reply = nullptr;
+    recent_l_.lock();
+    auto it = recent_.find(key);
+    if (it != recent_.end()) {
+        if (it->second != nullptr) {
+            reply = new string(*it->second);
+        }
+        recent_l_.unlock();
+        if (reply != nullptr) {
+            // the reply got lost
+            sendto(sock_, reply->data(), reply->size(), 0, (const struct sockaddr *) &peer, sizeof(peer));
+            delete reply;
+        }
+        return false;
+    }
+    recent_[key] = nullptr;
+    recent_order_.push_back(key);
+    while (recent_order_.size() > max_recent_s) {
+        it = recent_.find(recent_order_.front());
+        if (it != recent_.end()) {
+            delete it->second;
+            recent_.erase(it);
+        }
+        recent_order_.pop_front();
+    }
+    recent_l_.unlock();
+    return true;
+}
+
+void ServerUdpConnection::handle_read() {
+    // edge triggered, so drain the socket, or queued datagrams wait for the next one to arrive
+    for (;;) {
+        for (int i = 0; i < recv_batch_s; i++) {
+            msgs_[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        int n_msgs = recvmmsg(sock_, msgs_, recv_batch_s, MSG_DONTWAIT, nullptr);
+        if (n_msgs <= 0) {
+            break;
+        }
+        list<Request*> complete_requests;
+        for (int i = 0; i < n_msgs; i++) {
+            parse_datagram(udp_buffer_ + i * UdpBuffer::max_udp_packet_size_s, msgs_[i].msg_len,
+                           peers_[i], &complete_requests);
+        }
+        dispatch(complete_requests);
+        if (n_msgs < recv_batch_s) {
             break;
         }
     }
+}
 
+void ServerUdpConnection::dispatch(list<Request*>& complete_requests) {
 #ifdef RPC_STATISTICS
     stat_server_batching(complete_requests.size());
 #endif // RPC_STATISTICS
 
     for (auto& req: complete_requests) {
-
-        if (req->m.content_size() < sizeof(i32)) {
-            // rpc id not provided, discard
-            delete req;
-            continue;
-        }
-
-        i32 rpc_id;
-        req->m >> rpc_id;
+        i32 rpc_id = req->rpc_id;
 
 #ifdef RPC_STATISTICS
         stat_server_rpc_counting(rpc_id);
@@ -180,15 +298,63 @@ void ServerUdpConnection::handle_read() {
 
         auto it = server_->handlers_.find(rpc_id);
         if (it != server_->handlers_.end()) {
+            req->priority = server_->priority_of(rpc_id);
             // the handler should delete req, and release server_connection refcopy.
             it->second(req, (ServerUdpConnection *) this->ref_copy());
         } else {
             Log_error("rpc::ServerConnection: no handler for rpc_id=0x%08x", rpc_id);
+            begin_reply(req, ENOENT);
+            end_reply();
             delete req;
         }
     }
 }
 
+// <size> <xid> <error_code> <ret1> <ret2> ... <retN>
+void ServerUdpConnection::begin_reply(Request* req, i32 error_code /* =? */, size_t rets_size /* =? */) {
+    reply_l_.lock();
+    reply_wanted_ = (req->xid != -1);
+    reply_key_ = udp_xid{peer_of(req->udp_peer), req->xid};
+    reply_peer_ = req->udp_peer;
+    reply_ << req->xid << error_code;
+}
+
+void ServerUdpConnection::end_reply() {
+    size_t size = reply_.content_size();
+    if (!reply_wanted_) {
+        reply_.discard(size);
+        reply_.get_and_reset_write_cnt();
+        reply_l_.unlock();
+        return;
+    }
+
+    if (sizeof(i32) + size > UdpBuffer::max_udp_packet_size_s) {
+        // does not fit in a datagram, tell the client instead
+        i64 xid;
+        reply_.read(&xid, sizeof(i64));
+        reply_.discard(size - sizeof(i64));
+        reply_ << xid << (i32) E2BIG;
+        size = reply_.content_size();
+    }
+    string* datagram = new string(sizeof(i32) + size, '\0');
+    i32 packet_size = size;
+    memcpy(&(*datagram)[0], &packet_size, sizeof(i32));
+    reply_.read(&(*datagram)[sizeof(i32)], size);
+    reply_.get_and_reset_write_cnt();
+
+    sendto(sock_, datagram->data(), datagram->size(), 0, (const struct sockaddr *) &reply_peer_, sizeof(reply_peer_));
+
+    recent_l_.lock();
+    auto it = recent_.find(reply_key_);
+    if (it != recent_.end() && it->second == nullptr) {
+        it->second = datagram;
+        datagram = nullptr;
+    }
+    recent_l_.unlock();
+    delete datagram;
+    reply_l_.unlock();
+}
+
 
 
 class ServerTcpConnection: public ServerConnection {
@@ -198,15 +364,64 @@ class ServerTcpConnection: public ServerConnection {
     Marshal in_, out_;
     SpinLock out_l_;
 
+    // for shm:// servers, packets go through shm_ and sock_ is its doorbell
+    ShmChannel* shm_;
+
     bookmark* bmark_;
 
+    // size of current reply if known in begin_reply(), otherwise -1
+    i32 reply_size_;
+
+    // 0 if client has not asked for compression, guarded by out_l_
+    size_t compress_threshold_;
+
+    // current reply goes to packet_ instead of out_ if it might get compressed
+    Marshal packet_;
+    Marshal* reply_out_;
+
+    // stopped reading requests because out_ is above high watermark, guarded by out_l_
+    bool read_paused_;
+
+    // current reply, for metrics
+    i32 reply_rpc_id_;
+    i32 reply_error_code_;
+    size_t reply_bytes_in_;
+    size_t reply_out_before_;
+    double reply_begin_time_;
+    i64 reply_phase_ns_[RpcMetrics::max_phases];
+    TraceContext reply_trace_;
+    double reply_recv_time_;
+
+    // replies not fully written yet, ordered by the byte count at which they are
+    struct pending_write {
+        i64 written_mark;
+        i32 rpc_id;
+        double end_reply_time;
+    };
+    std::deque<pending_write> pending_writes_;
+    i64 bytes_written_;
+
+    // update poll mode after out_ changed, must hold out_l_
+    void update_poll_mode();
+
+    // <i64 trace_id> <i64 parent_span_id> <i8 flags>, false if malformed
+    bool read_trace_header(Request* req);
+
+    // span of the current reply, must hold out_l_
+    void record_span(double now);
+
+    SpinLock streams_l_;
+    std::unordered_map<i64, ServerStream*> streams_;
+
+    void handle_stream_frame(Request* req, i32 frame_type);
+
     enum {
         CONNECTED, CLOSED
     } status_;
 
 
     virtual Marshal* output_buffer() {
-        return &out_;
+        return reply_out_;
     }
 
     /**
@@ -227,7 +442,8 @@ protected:
 
 public:
 
-    ServerTcpConnection(Server* server, int socket);
+    // takes over shm
+    ServerTcpConnection(Server* server, int socket, ShmChannel* shm = nullptr);
 
     /**
      * Start a reply message. Must be paired with end_reply().
@@ -236,17 +452,29 @@ public:
      * <size> <xid> <error_code> <ret1> <ret2> ... <retN>
      * NOTE: size does not include size itself (<xid>..<retN>).
      *
-     * User only need to fill <ret1>..<retN>.
+     * User only need to fill <ret1>..<retN>. If rets_size (marshal size of
+     * <ret1>..<retN>) is given, <size> is written up front instead of being
+     * patched in end_reply().
      *
      * Currently used errno:
      * 0: everything is fine
      * ENOENT: method not found
      * EINVAL: invalid packet (field missing)
+     * EBUSY: server overloaded, request turned down without running
+     * EPERM: server shutting down
      */
-    void begin_reply(Request* req, i32 error_code = 0);
+    void begin_reply(Request* req, i32 error_code = 0, size_t rets_size = marshal_size_unknown);
 
     void end_reply();
 
+    ServerStream* open_stream(i64 xid);
+    void close_stream(ServerStream* st);
+
+    size_t output_buffer_size();
+
+    // <size> <xid> <frame_type> <payload>
+    int write_stream_frame(i64 xid, i32 frame_type, Marshal* payload);
+
     int poll_mode();
     void handle_write();
     void handle_read();
@@ -254,28 +482,90 @@ public:
 };
 
 
+class ServerTcpStream: public ServerStream {
+    ServerTcpConnection* sconn_;
+
+protected:
+
+    int send_data(Marshal& payload) {
+        return sconn_->write_stream_frame(xid_, STREAM_REPLY_DATA, &payload);
+    }
+
+    void send_end() {
+        // nothing to do, reply of the RPC ends the stream
+    }
+
+    void send_credit(size_t n_bytes) {
+        Marshal m;
+        m << v64(n_bytes);
+        sconn_->write_stream_frame(xid_, STREAM_REPLY_CREDIT, &m);
+    }
+
+    ~ServerTcpStream() {
+        sconn_->release();
+    }
+
+public:
+
+    ServerTcpStream(ServerTcpConnection* sconn, i64 xid)
+        : ServerStream(xid), sconn_((ServerTcpConnection *) sconn->ref_copy()) { }
+};
+
+
 std::unordered_set<i32> ServerTcpConnection::rpc_id_missing_s;
 SpinLock ServerTcpConnection::rpc_id_missing_l_s;
 
 
-ServerTcpConnection::ServerTcpConnection(Server* server, int socket)
-        : ServerConnection(server, socket), bmark_(nullptr), status_(CONNECTED) {
+ServerTcpConnection::ServerTcpConnection(Server* server, int socket, ShmChannel* shm /* =? */)
+        : ServerConnection(server, socket), shm_(shm), bmark_(nullptr), reply_size_(-1),
+          compress_threshold_(0), reply_out_(&out_), read_paused_(false), reply_rpc_id_(0),
+          reply_error_code_(0), reply_bytes_in_(0), reply_out_before_(0), reply_begin_time_(0.0),
+          reply_recv_time_(0.0), bytes_written_(0), status_(CONNECTED) {
     // increase number of open connections
+    if (server_->unix_) {
+        FdTable* fdt = new FdTable;
+        in_.set_fd_table(fdt);
+        out_.set_fd_table(fdt);
+        packet_.set_fd_table(fdt);
+        fdt->release();
+    }
+
     server_->sconns_ctr_.next(1);
 }
 
 ServerTcpConnection::~ServerTcpConnection() {
+    delete shm_;
     // decrease number of open connections
     server_->sconns_ctr_.next(-1);
 }
 
 
-void ServerTcpConnection::begin_reply(Request* req, i32 error_code /* =... */) {
+void ServerTcpConnection::begin_reply(Request* req, i32 error_code /* =... */, size_t rets_size /* =... */) {
+    double now = base::monotonic_time();
     out_l_.lock();
+    reply_rpc_id_ = req->rpc_id;
+    reply_error_code_ = error_code;
+    reply_bytes_in_ = req->packet_size;
+    reply_out_before_ = out_.content_size();
+    reply_begin_time_ = now;
+    reply_phase_ns_[Server::PHASE_QUEUE_WAIT] = (i64) ((req->start_time - req->recv_time) * 1e9);
+    reply_phase_ns_[Server::PHASE_HANDLER] = (i64) ((now - req->start_time) * 1e9);
+    reply_trace_ = req->trace;
+    reply_recv_time_ = req->recv_time;
+
     v32 v_error_code = error_code;
     v64 v_reply_xid = req->xid;
 
-    bmark_ = this->out_.set_bookmark(sizeof(i32)); // will write reply size later
+    if (compress_threshold_ > 0 && (rets_size == marshal_size_unknown || rets_size >= compress_threshold_)) {
+        // packet size is written in end_reply()
+        reply_out_ = &packet_;
+    } else if (rets_size != marshal_size_unknown) {
+        reply_size_ = v_reply_xid.val_size() + v_error_code.val_size() + rets_size;
+        out_.reserve(sizeof(i32) + reply_size_);
+        *this << reply_size_;
+    } else {
+        bmark_ = this->out_.set_bookmark(sizeof(i32)); // will write reply size later
+    }
 
     *this << v_reply_xid;
     *this << v_error_code;
@@ -283,41 +573,247 @@ void ServerTcpConnection::begin_reply(Request* req, i32 error_code /* =... */) {
 
 void ServerTcpConnection::end_reply() {
     // set reply size in packet
-    if (bmark_ != nullptr) {
+    if (reply_out_ == &packet_) {
+        write_packet(&out_, packet_, compress_threshold_);
+        out_.get_and_reset_write_cnt();
+        packet_.get_and_reset_write_cnt();
+        reply_out_ = &out_;
+    } else if (bmark_ != nullptr) {
         i32 reply_size = out_.get_and_reset_write_cnt();
         out_.write_bookmark(bmark_, &reply_size);
         delete bmark_;
         bmark_ = nullptr;
+    } else if (reply_size_ >= 0) {
+        // reply size already written, make sure it was right
+        i32 write_cnt = out_.get_and_reset_write_cnt();
+        verify(write_cnt == (i32) sizeof(i32) + reply_size_);
+        reply_size_ = -1;
+    }
+
+    double now = base::monotonic_time();
+    reply_phase_ns_[Server::PHASE_SERIALIZE] = (i64) ((now - reply_begin_time_) * 1e9);
+    server_->metrics_.record_call(reply_rpc_id_, reply_error_code_, reply_bytes_in_,
+                                  out_.content_size() - reply_out_before_, reply_phase_ns_, Server::PHASE_WRITE);
+    pending_write pw;
+    pw.written_mark = bytes_written_ + out_.content_size();
+    pw.rpc_id = reply_rpc_id_;
+    pw.end_reply_time = now;
+    pending_writes_.push_back(pw);
+
+    if (reply_trace_.sampled) {
+        record_span(now);
     }
 
-    // always enable write events since the code above gauranteed there
-    // will be some data to send
-    server_->pollmgr_->update_mode(this, Pollable::READ | Pollable::WRITE);
+    update_poll_mode();
 
     out_l_.unlock();
 }
 
+void ServerTcpConnection::update_poll_mode() {
+    size_t out_size = out_.content_size();
+    if (!read_paused_ && server_->out_high_watermark_ > 0 && out_size > server_->out_high_watermark_) {
+        // peer is not taking replies fast enough, stop reading more requests
+        read_paused_ = true;
+    } else if (read_paused_ && out_size <= server_->out_low_watermark_) {
+        read_paused_ = false;
+    }
+
+    // the doorbell of a shm:// connection is always writable, so WRITE never
+    // fires again, the client tells there is room in the ring by ringing it
+    int mode = (read_paused_ && shm_ == nullptr) ? 0 : Pollable::READ;
+    if (out_size > 0) {
+        mode |= Pollable::WRITE;
+    }
+    server_->pollmgr_->update_mode(this, mode);
+}
+
+bool ServerTcpConnection::read_trace_header(Request* req) {
+    if (req->m.content_size() < TRACE_HEADER_SIZE) {
+        return false;
+    }
+    TraceContext parent;
+    i8 flags;
+    req->m >> parent.trace_id >> parent.span_id >> flags;
+    parent.sampled = (flags & TRACE_SAMPLED) != 0;
+    if (!parent.traced()) {
+        return false;
+    }
+    req->trace = parent.child();
+    return true;
+}
+
+void ServerTcpConnection::record_span(double now) {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    double ago = now - reply_recv_time_;
+
+    Span span;
+    span.trace_id = reply_trace_.trace_id;
+    span.span_id = reply_trace_.span_id;
+    span.parent_span_id = reply_trace_.parent_span_id;
+    span.rpc_id = reply_rpc_id_;
+    span.error_code = reply_error_code_;
+    span.start_us = tv.tv_sec * 1000000LL + tv.tv_usec - (i64) (ago * 1e6);
+    span.duration_ns = (i64) (ago * 1e9);
+    server_->spans_.record(span);
+}
+
+size_t ServerTcpConnection::output_buffer_size() {
+    out_l_.lock();
+    size_t sz = out_.content_size();
+    out_l_.unlock();
+    return sz;
+}
+
+ServerStream* ServerTcpConnection::open_stream(i64 xid) {
+    streams_l_.lock();
+    if (streams_.find(xid) != streams_.end()) {
+        // xid is chosen by the peer
+        streams_l_.unlock();
+        Log_error("rpc::ServerConnection: stream of xid=%ld already open", (long) xid);
+        return nullptr;
+    }
+    ServerStream* st = new ServerTcpStream(this, xid);
+    streams_[xid] = (ServerStream *) st->ref_copy();
+    streams_l_.unlock();
+    return st;
+}
+
+void ServerTcpConnection::close_stream(ServerStream* st) {
+    bool found = false;
+    streams_l_.lock();
+    unordered_map<i64, ServerStream*>::iterator it = streams_.find(st->xid());
+    if (it != streams_.end() && it->second == st) {
+        streams_.erase(it);
+        found = true;
+    }
+    streams_l_.unlock();
+
+    st->on_close();
+    if (found) {
+        // since we removed it from streams_
+        st->release();
+    }
+}
+
+int ServerTcpConnection::write_stream_frame(i64 xid, i32 frame_type, Marshal* payload) {
+    out_l_.lock();
+    if (status_ != CONNECTED) {
+        out_l_.unlock();
+        return ENOTCONN;
+    }
+
+    v64 v_xid = xid;
+    v32 v_frame_type = frame_type;
+    size_t payload_size = payload->content_size();
+    if (compress_threshold_ > 0 && payload_size >= compress_threshold_) {
+        Marshal packet;
+        packet << v_xid << v_frame_type;
+        packet.read_from_marshal(*payload, payload_size);
+        write_packet(&out_, packet, compress_threshold_);
+    } else {
+        i32 frame_size = v_xid.val_size() + v_frame_type.val_size() + payload_size;
+        out_ << frame_size << v_xid << v_frame_type;
+        if (payload_size > 0) {
+            out_.read_from_marshal(*payload, payload_size);
+        }
+    }
+    out_.get_and_reset_write_cnt();
+
+    update_poll_mode();
+    out_l_.unlock();
+    return 0;
+}
+
+void ServerTcpConnection::handle_stream_frame(Request* req, i32 frame_type) {
+    ServerStream* st = nullptr;
+    streams_l_.lock();
+    unordered_map<i64, ServerStream*>::iterator it = streams_.find(req->xid);
+    if (it != streams_.end()) {
+        st = (ServerStream *) it->second->ref_copy();
+    }
+    streams_l_.unlock();
+
+    // otherwise the stream is already closed, drop the frame
+    if (st != nullptr) {
+        if (frame_type == STREAM_DATA) {
+            Marshal* frame = new Marshal;
+            size_t frame_size = req->m.content_size();
+            if (frame_size > 0) {
+                frame->read_from_marshal(req->m, frame_size);
+            }
+            st->on_data(frame);
+        } else if (frame_type == STREAM_END) {
+            st->on_end();
+        } else {
+            v64 n_bytes;
+            req->m >> n_bytes;
+            st->on_credit(n_bytes.get());
+        }
+        st->release();
+    }
+    delete req;
+}
+
 void ServerTcpConnection::handle_read() {
     if (status_ == CLOSED) {
         return;
     }
 
-    int bytes_read = in_.read_from_fd(sock_);
+    out_l_.lock();
+    bool paused = read_paused_;
+    out_l_.unlock();
+    if (paused) {
+        if (shm_ != nullptr) {
+            // requests stay in the ring, but the doorbell is telling there
+            // is room for more replies
+            shm_->drain_doorbell();
+            handle_write();
+        }
+        // leave requests in socket buffer, READ gets enabled again once replies drain
+        return;
+    }
+
+    int bytes_read;
+    if (shm_ != nullptr) {
+        // the doorbell might as well be telling there is room for more replies
+        handle_write();
+        bytes_read = shm_->read_into(&in_);
+    } else {
+        bytes_read = in_.read_from_fd(sock_);
+    }
     if (bytes_read == 0) {
         return;
     }
+    double now = base::monotonic_time();
 
     list<Request*> complete_requests;
 
     for (;;) {
         i32 packet_size;
         int n_peek = in_.peek(&packet_size, sizeof(i32));
-        if (n_peek == sizeof(i32) && in_.content_size() >= packet_size + sizeof(i32)) {
+        if (n_peek == sizeof(i32) && in_.content_size() >= (packet_size & PACKET_SIZE_MASK) + sizeof(i32)) {
             // consume the packet size
             verify(in_.read(&packet_size, sizeof(i32)) == sizeof(i32));
 
             Request* req = new Request;
-            verify(req->m.read_from_marshal(in_, packet_size) == (size_t) packet_size);
+            req->packet_size = sizeof(i32) + (packet_size & PACKET_SIZE_MASK);
+            req->recv_time = now;
+            if (packet_size & PACKET_COMPRESSED) {
+                // compress_threshold_ is only set by this thread
+                if (compress_threshold_ == 0
+                        || read_compressed_packet(in_, packet_size & PACKET_SIZE_MASK, &req->m) < 0) {
+                    Log_error("rpc::ServerConnection: bad compressed packet on fd=%d, closing", sock_);
+                    delete req;
+                    for (auto& it: complete_requests) {
+                        delete it;
+                    }
+                    handle_error();
+                    return;
+                }
+            } else {
+                verify(req->m.read_from_marshal(in_, packet_size) == (size_t) packet_size);
+            }
 
             v64 v_xid;
             req->m >> v_xid;
@@ -334,10 +830,21 @@ void ServerTcpConnection::handle_read() {
     stat_server_batching(complete_requests.size());
 #endif // RPC_STATISTICS
 
+    if (!server_->priorities_.empty() && complete_requests.size() > 1) {
+        // high priority requests skip ahead of the batch. the rest stay in
+        // socket order, so stream frames never overtake their stream
+        std::stable_partition(complete_requests.begin(), complete_requests.end(), [this] (Request* req) {
+            i32 rpc_id;
+            return req->m.peek(&rpc_id, sizeof(i32)) == sizeof(i32)
+                && server_->priority_of(rpc_id & ~RPC_ID_TRACED) == ThreadPool::PRIORITY_HIGH;
+        });
+    }
+
     for (auto& req: complete_requests) {
 
         if (req->m.content_size() < sizeof(i32)) {
             // rpc id not provided
+            req->start_time = req->recv_time;
             begin_reply(req, EINVAL);
             end_reply();
             delete req;
@@ -346,6 +853,42 @@ void ServerTcpConnection::handle_read() {
 
         i32 rpc_id;
         req->m >> rpc_id;
+        if (rpc_id & RPC_ID_TRACED) {
+            rpc_id &= ~RPC_ID_TRACED;
+            if (!read_trace_header(req)) {
+                req->rpc_id = rpc_id;
+                req->start_time = req->recv_time;
+                begin_reply(req, EINVAL);
+                end_reply();
+                delete req;
+                continue;
+            }
+        }
+        req->rpc_id = rpc_id;
+
+        if (rpc_id == STREAM_DATA || rpc_id == STREAM_END || rpc_id == STREAM_CREDIT) {
+            handle_stream_frame(req, rpc_id);
+            continue;
+        }
+
+        // handlers run right here, or overwrite it once they get a thread
+        req->start_time = base::monotonic_time();
+
+        if (rpc_id == COMPRESSION_NEGOTIATE) {
+            i32 threshold = 0;
+            if (req->m.content_size() >= sizeof(i32)) {
+                req->m >> threshold;
+            }
+            begin_reply(req, threshold > 0 ? 0 : EINVAL);
+            end_reply();
+            if (threshold > 0) {
+                out_l_.lock();
+                compress_threshold_ = threshold;
+                out_l_.unlock();
+            }
+            delete req;
+            continue;
+        }
 
 #ifdef RPC_STATISTICS
         stat_server_rpc_counting(rpc_id);
@@ -353,6 +896,10 @@ void ServerTcpConnection::handle_read() {
 
         auto it = server_->handlers_.find(rpc_id);
         if (it != server_->handlers_.end()) {
+            req->priority = server_->priority_of(rpc_id);
+            // handlers that run right here are within the trace, rpcgen
+            // generated ones also enter it once they get a thread
+            TraceScope trace_scope(req->trace);
             // the handler should delete req, and release server_connection refcopy.
             it->second(req, (ServerConnection *) this->ref_copy());
         } else {
@@ -380,11 +927,31 @@ void ServerTcpConnection::handle_write() {
     }
 
     out_l_.lock();
-    out_.write_to_fd(sock_);
-    if (out_.empty()) {
-        server_->pollmgr_->update_mode(this, Pollable::READ);
+    if (shm_ != nullptr) {
+        bytes_written_ += shm_->write_from(&out_);
+    } else {
+        bytes_written_ += out_.write_to_fd(sock_);
+    }
+    if (!pending_writes_.empty() && pending_writes_.front().written_mark <= bytes_written_) {
+        double now = base::monotonic_time();
+        while (!pending_writes_.empty() && pending_writes_.front().written_mark <= bytes_written_) {
+            const pending_write& pw = pending_writes_.front();
+            server_->metrics_.record_phase(pw.rpc_id, Server::PHASE_WRITE, (i64) ((now - pw.end_reply_time) * 1e9));
+            pending_writes_.pop_front();
+        }
+    }
+    bool resumed = false;
+    if (out_.empty() || read_paused_) {
+        bool paused = read_paused_;
+        update_poll_mode();
+        resumed = paused && !read_paused_;
     }
     out_l_.unlock();
+
+    if (resumed && shm_ != nullptr) {
+        // the client does not ring again for requests already in the ring
+        handle_read();
+    }
 }
 
 void ServerTcpConnection::handle_error() {
@@ -414,6 +981,19 @@ void ServerTcpConnection::close() {
 
         status_ = CLOSED;
         ::close(sock_);
+
+        // wake up handlers blocked on streams
+        list<ServerStream*> streams;
+        streams_l_.lock();
+        for (auto& kv: streams_) {
+            streams.push_back(kv.second);
+        }
+        streams_.clear();
+        streams_l_.unlock();
+        for (auto& st: streams) {
+            st->on_close();
+            st->release();
+        }
     }
 
     // this call might actually DELETE this object, so we put it at the end of function
@@ -423,8 +1003,8 @@ void ServerTcpConnection::close() {
 }
 
 int ServerTcpConnection::poll_mode() {
-    int mode = Pollable::READ;
     out_l_.lock();
+    int mode = read_paused_ ? 0 : Pollable::READ;
     if (!out_.empty()) {
         mode |= Pollable::WRITE;
     }
@@ -433,7 +1013,8 @@ int ServerTcpConnection::poll_mode() {
 }
 
 Server::Server(PollMgr* pollmgr /* =... */, ThreadPool* thrpool /* =? */)
-        : server_sock_(-1), udp_(false), udp_sock_(-1), udp_conn_(nullptr), status_(NEW) {
+        : server_sock_(-1), unix_(false), shm_(false), udp_(false), udp_sock_(-1), udp_conn_(nullptr),
+          out_high_watermark_(32 * 1024 * 1024), out_low_watermark_(8 * 1024 * 1024), status_(NEW) {
 
     // get rid of eclipse warning
     memset(&loop_th_, 0, sizeof(loop_th_));
@@ -449,6 +1030,9 @@ Server::Server(PollMgr* pollmgr /* =... */, ThreadPool* thrpool /* =? */)
     } else {
         threadpool_ = (ThreadPool *) thrpool->ref_copy();
     }
+
+    introspect_svc_ = new IntrospectServiceImpl(this);
+    verify(reg(introspect_svc_) == 0);
 }
 
 Server::~Server() {
@@ -494,6 +1078,7 @@ Server::~Server() {
 
     threadpool_->release();
     pollmgr_->release();
+    delete introspect_svc_;
 
     //Log_debug("rpc::Server: destroyed");
 }
@@ -509,7 +1094,9 @@ void* Server::start_server_loop(void* arg) {
 
     start_server_loop_args->server->server_loop(start_server_loop_args->svr_addr);
 
-    freeaddrinfo(start_server_loop_args->gai_result);
+    if (start_server_loop_args->gai_result != nullptr) {
+        freeaddrinfo(start_server_loop_args->gai_result);
+    }
     delete start_server_loop_args;
 
     pthread_exit(nullptr);
@@ -541,13 +1128,27 @@ void Server::server_loop(struct addrinfo* svr_addr) {
             break;
         }
 
-        int clnt_socket = accept(server_sock_, svr_addr->ai_addr, &svr_addr->ai_addrlen);
+        int clnt_socket;
+        if (svr_addr == nullptr) {
+            clnt_socket = accept(server_sock_, nullptr, nullptr);
+        } else {
+            clnt_socket = accept(server_sock_, svr_addr->ai_addr, &svr_addr->ai_addrlen);
+        }
         if (clnt_socket >= 0 && status_ == RUNNING) {
             Log_debug("rpc::Server: got new client, fd=%d", clnt_socket);
+            ShmChannel* shm = nullptr;
+            if (shm_) {
+                // the client waits for its shared memory before anything else
+                shm = ShmChannel::accept(clnt_socket);
+                if (shm == nullptr) {
+                    close(clnt_socket);
+                    continue;
+                }
+            }
             verify(set_nonblocking(clnt_socket, true) == 0);
 
             sconns_l_.lock();
-            ServerConnection* sconn = new ServerTcpConnection(this, clnt_socket);
+            ServerConnection* sconn = new ServerTcpConnection(this, clnt_socket, shm);
             sconns_.insert(sconn);
             pollmgr_->add(sconn);
             sconns_l_.unlock();
@@ -556,6 +1157,9 @@ void Server::server_loop(struct addrinfo* svr_addr) {
 
     close(server_sock_);
     server_sock_ = -1;
+    if (!unix_path_.empty()) {
+        unlink(unix_path_.c_str());
+    }
     if (udp_) {
         close(udp_sock_);
         udp_sock_ = -1;
@@ -564,6 +1168,17 @@ void Server::server_loop(struct addrinfo* svr_addr) {
 }
 
 int Server::start(const char* bind_addr) {
+    const char* shm_name = ShmChannel::addr_name(bind_addr);
+    if (shm_name != nullptr) {
+        shm_ = true;
+        return start_unix(bind_addr, ShmChannel::listen_path(shm_name));
+    }
+    const char* path = unix_path(bind_addr);
+    if (path != nullptr) {
+        unix_ = true;
+        return start_unix(bind_addr, path);
+    }
+
     string addr(bind_addr);
     size_t idx = addr.find(":");
     if (idx == string::npos) {
@@ -629,31 +1244,83 @@ int Server::start(const char* bind_addr) {
         }
     }
 
+    start_loop(bind_addr, result, rp);
+    return 0;
+}
+
+int Server::start_unix(const char* bind_addr, const std::string& path) {
+    if (udp_) {
+        // udp calls of unix: and shm:// clients fail with ENOTCONN
+        Log_info("rpc::Server: no UDP on %s", bind_addr);
+        udp_ = false;
+    }
+    struct stat st;
+    if (path[0] != '@' && stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        // only a socket nobody listens on was left over by a server that did
+        // not stop cleanly, anything else might still be in use
+        int sock = unix_connect(path.c_str());
+        if (sock != -1 || errno != ECONNREFUSED) {
+            if (sock != -1) {
+                close(sock);
+            }
+            Log_error("rpc::Server: %s is in use", bind_addr);
+            return EADDRINUSE;
+        }
+        unlink(path.c_str());
+    }
+    server_sock_ = unix_listen(path.c_str());
+    if (server_sock_ == -1) {
+        Log_error("rpc::Server: bind(%s): %s", bind_addr, strerror(errno));
+        return EINVAL;
+    }
+    verify(set_nonblocking(server_sock_, true) == 0);
+    if (path[0] != '@') {
+        unix_path_ = path;
+    }
+
+    start_loop(bind_addr, nullptr, nullptr);
+    return 0;
+}
+
+void Server::start_loop(const char* bind_addr, struct addrinfo* gai_result, struct addrinfo* svr_addr) {
     status_ = RUNNING;
     Log_info("rpc::Server: started on %s", bind_addr);
 
     start_server_loop_args_type* start_server_loop_args = new start_server_loop_args_type();
     start_server_loop_args->server = this;
-    start_server_loop_args->gai_result = result;
-    start_server_loop_args->svr_addr = rp;
+    start_server_loop_args->gai_result = gai_result;
+    start_server_loop_args->svr_addr = svr_addr;
     Pthread_create(&loop_th_, nullptr, Server::start_server_loop, start_server_loop_args);
-
-    return 0;
 }
 
-int Server::reg(i32 rpc_id, const std::function<void(Request*, ServerConnection*)>& func) {
+int Server::reg(i32 rpc_id, const std::function<void(Request*, ServerConnection*)>& func,
+                int priority /* =? */) {
     // disallow duplicate rpc_id
     if (handlers_.find(rpc_id) != handlers_.end()) {
         return EEXIST;
     }
 
     handlers_[rpc_id] = func;
+    if (priority != ThreadPool::PRIORITY_NORMAL) {
+        set_priority(rpc_id, priority);
+    }
 
     return 0;
 }
 
 void Server::unreg(i32 rpc_id) {
     handlers_.erase(rpc_id);
+    priorities_.erase(rpc_id);
+}
+
+size_t Server::output_buffer_size() {
+    size_t sz = 0;
+    sconns_l_.lock();
+    for (auto& sconn: sconns_) {
+        sz += sconn->output_buffer_size();
+    }
+    sconns_l_.unlock();
+    return sz;
 }
 
 }
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <pthread.h>
+#include <netinet/in.h>
 
 #include "marshal.h"
 #include "polling.h"
+#include "stream.h"
+#include "compress.h"
+#include "metrics.h"
+#include "trace.h"
 
 // for getaddrinfo() used in Server::start()
 struct addrinfo;
@@ -14,6 +20,7 @@ struct addrinfo;
 namespace rpc {
 
 class Server;
+class IntrospectServiceImpl;
 
 /**
  * The raw packet sent from client will be like this:
@@ -22,10 +29,39 @@ class Server;
  *
  * For the request object, the marshal only contains <arg1>..<argN>,
  * other fields are already consumed.
+ *
+ * The arena lives as long as the request, 'arena' functions generated by
+ * rpcgen deserialize their arguments into it.
+ *
+ * priority is the ThreadPool lane the handler should run in, see
+ * Server::set_priority().
+ *
+ * packet_size, recv_time and start_time (from base::monotonic_time()) feed
+ * Server::metrics(). start_time is when the handler got a thread to run on.
+ *
+ * trace is the request's own span if the caller sent a tracing context,
+ * handlers run within it (see current_trace()).
+ *
+ * Requests over UDP have an xid only if the client waits for a reply, which
+ * goes back to udp_peer.
  */
 struct Request {
     Marshal m;
     i64 xid;
+    i32 rpc_id;
+    Arena arena;
+    int priority;
+
+    size_t packet_size;
+    double recv_time;
+    double start_time;
+
+    TraceContext trace;
+
+    struct sockaddr_in udp_peer;
+
+    Request(): xid(-1), rpc_id(0), priority(ThreadPool::PRIORITY_NORMAL),
+               packet_size(0), recv_time(0.0), start_time(0.0), udp_peer() { }
 };
 
 class Service {
@@ -34,7 +70,7 @@ public:
     virtual int __reg_to__(Server*) = 0;
 };
 
-class ServerConnection: public Pollable {
+class ServerConnection: public Pollable, public CacheAligned {
     friend class Server;
 
     virtual Marshal* output_buffer() = 0;
@@ -53,12 +89,33 @@ public:
     }
 
     // helper function, do some work in background
-    int run_async(const std::function<void()>& f, int queuing_channel = -1);
+    // returns EBUSY if the server is overloaded, see ThreadPool::run_async()
+    int run_async(const std::function<void()>& f, int queuing_channel = -1,
+                  int priority = ThreadPool::PRIORITY_NORMAL);
 
-    virtual void begin_reply(Request* req, i32 error_code = 0) = 0;
+    // rets_size is marshal size of reply content, if known
+    virtual void begin_reply(Request* req, i32 error_code = 0, size_t rets_size = marshal_size_unknown) = 0;
 
     virtual void end_reply() = 0;
 
+    /**
+     * Stream of a 'stream' RPC, keyed by xid of the request. Opened while the
+     * request is dispatched in the poll thread, so no frame gets missed.
+     * Returns nullptr if streaming is not supported (UDP), or a stream of
+     * xid is already open.
+     */
+    virtual ServerStream* open_stream(i64 xid) {
+        return nullptr;
+    }
+
+    // stop taking frames for the stream, before replying the RPC
+    virtual void close_stream(ServerStream* st) { }
+
+    // bytes of replies waiting to be sent
+    virtual size_t output_buffer_size() {
+        return 0;
+    }
+
     void write_marshal(Marshal& m) {
         Marshal* buf = this->output_buffer();
         buf->read_from_marshal(m, m.content_size());
@@ -106,17 +163,24 @@ public:
 
 class ServerUdpConnection;
 
-class Server: public NoCopy {
+class Server: public NoCopy, public CacheAligned {
 
     friend class ServerConnection;
     friend class ServerTcpConnection;
     friend class ServerUdpConnection;
 
     std::unordered_map<i32, std::function<void(Request*, ServerConnection*)>> handlers_;
+    std::unordered_map<i32, int> priorities_;
     PollMgr* pollmgr_;
     ThreadPool* threadpool_;
     int server_sock_;
 
+    // listening on a unix socket for unix: or shm:// clients, and unix_path_
+    // is removed once stopped if it is not in the abstract namespace
+    bool unix_;
+    bool shm_;
+    std::string unix_path_;
+
     bool udp_;
     int udp_sock_;
 
@@ -127,6 +191,14 @@ class Server: public NoCopy {
     SpinLock sconns_l_;
     std::unordered_set<ServerConnection*> sconns_;
 
+    size_t out_high_watermark_;
+    size_t out_low_watermark_;
+
+    RpcMetrics metrics_;
+    IntrospectServiceImpl* introspect_svc_;
+
+    SpanBuffer spans_;
+
     enum {
         NEW, RUNNING, STOPPING, STOPPED
     } status_;
@@ -134,10 +206,35 @@ class Server: public NoCopy {
     pthread_t loop_th_;
 
     static void* start_server_loop(void* arg);
+
+    // svr_addr is nullptr for unix sockets
     void server_loop(struct addrinfo* svr_addr);
 
+    int start_unix(const char* bind_addr, const std::string& path);
+    void start_loop(const char* bind_addr, struct addrinfo* gai_result, struct addrinfo* svr_addr);
+
+    int priority_of(i32 rpc_id) {
+        if (priorities_.empty()) {
+            return ThreadPool::PRIORITY_NORMAL;
+        }
+        auto it = priorities_.find(rpc_id);
+        return it == priorities_.end() ? ThreadPool::PRIORITY_NORMAL : it->second;
+    }
+
 public:
 
+    /**
+     * Phases of a request in metrics(): waiting for a thread, running the
+     * handler, from begin_reply() to end_reply(), and waiting to be written
+     * to the socket.
+     */
+    enum {
+        PHASE_QUEUE_WAIT = 0,
+        PHASE_HANDLER = 1,
+        PHASE_SERIALIZE = 2,
+        PHASE_WRITE = 3
+    };
+
     Server(PollMgr* pollmgr = nullptr, ThreadPool* thrpool = nullptr);
     virtual ~Server();
 
@@ -145,6 +242,64 @@ public:
         udp_ = true;
     }
 
+    /**
+     * Bound the output buffer of each connection. Once more than high bytes
+     * of replies are waiting to be sent, the server stops reading requests
+     * from that connection, till the peer drains it to low bytes.
+     * Set high to 0 for no limit. Should be called before start().
+     *
+     * Default: 32mb / 8mb.
+     */
+    void set_output_watermarks(size_t high, size_t low) {
+        verify(high == 0 || low < high);
+        out_high_watermark_ = high;
+        out_low_watermark_ = low;
+    }
+
+    // total bytes of replies waiting to be sent, on all connections
+    size_t output_buffer_size();
+
+    /**
+     * Run handlers of rpc_id in the given ThreadPool lane. With
+     * ThreadPool::PRIORITY_HIGH, requests like health checks skip ahead of
+     * bulk work, and are never turned down when the server is overloaded.
+     * Requests read off a connection in one go are also dispatched in
+     * priority order. Should be called before start(), rpcgen does it in
+     * reg() for functions marked 'high' or 'low'.
+     */
+    void set_priority(i32 rpc_id, int priority) {
+        verify(priority >= 0 && priority < ThreadPool::N_PRIORITIES);
+        priorities_[rpc_id] = priority;
+    }
+
+    ThreadPool* threadpool() {
+        return threadpool_;
+    }
+
+    /**
+     * Always on per rpc_id metrics, of every request replied on TCP. Clients
+     * can pull them through the built-in IntrospectService.
+     */
+    RpcMetrics* metrics() {
+        return &metrics_;
+    }
+
+    /**
+     * Latest sampled spans of traced requests replied on TCP. Also exported
+     * as JSON through the built-in IntrospectService.
+     */
+    SpanBuffer* spans() {
+        return &spans_;
+    }
+
+    /**
+     * bind_addr is host:port, unix:/path for a unix socket, or shm://name to
+     * serve clients on the same host through shared memory (see
+     * ShmChannel). UDP is only served on host:port. unix: connections can
+     * pass fds as FileDesc arguments and return values. A unix: socket file
+     * left over by a server that is gone gets replaced, EADDRINUSE if another
+     * one still listens on it.
+     */
     int start(const char* bind_addr);
 
     int reg(Service* svc) {
@@ -168,10 +323,12 @@ public:
      *     server_connection->release();
      *  }
      */
-    int reg(i32 rpc_id, const std::function<void(Request*, ServerConnection*)>& func);
+    int reg(i32 rpc_id, const std::function<void(Request*, ServerConnection*)>& func,
+            int priority = ThreadPool::PRIORITY_NORMAL);
 
     template<class S>
-    int reg(i32 rpc_id, S* svc, void (S::*svc_func)(Request*, ServerConnection*)) {
+    int reg(i32 rpc_id, S* svc, void (S::*svc_func)(Request*, ServerConnection*),
+            int priority = ThreadPool::PRIORITY_NORMAL) {
 
         // disallow duplicate rpc_id
         if (handlers_.find(rpc_id) != handlers_.end()) {
@@ -181,6 +338,9 @@ public:
         handlers_[rpc_id] = [svc, svc_func] (Request* req, ServerConnection* sconn) {
             (svc->*svc_func)(req, sconn);
         };
+        if (priority != ThreadPool::PRIORITY_NORMAL) {
+            set_priority(rpc_id, priority);
+        }
 
         return 0;
     }
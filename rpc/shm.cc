@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "shm.h"
+
+using namespace std;
+
+namespace rpc {
+
+double ShmChannel::spin_sec_s = 0.0;
+
+void ShmChannel::set_spin(double sec) {
+    spin_sec_s = sec;
+}
+
+const char* ShmChannel::addr_name(const char* addr) {
+    static const char prefix[] = "shm://";
+    if (strncmp(addr, prefix, sizeof(prefix) - 1) != 0) {
+        return nullptr;
+    }
+    return addr + sizeof(prefix) - 1;
+}
+
+std::string ShmChannel::listen_path(const std::string& name) {
+    return "@simplerpc-shm/" + name;
+}
+
+ShmChannel::ShmChannel(int sock, layout* shm, bool server): sock_(sock), shm_(shm), broken_(false) {
+    int r_in = server ? 0 : 1;
+    in_ = &shm_->rings[r_in];
+    out_ = &shm_->rings[1 - r_in];
+    in_data_ = shm_->data[r_in];
+    out_data_ = shm_->data[1 - r_in];
+}
+
+ShmChannel::~ShmChannel() {
+    munmap(shm_, sizeof(layout));
+}
+
+ShmChannel* ShmChannel::connect(const std::string& name) {
+    int sock = unix_connect(listen_path(name).c_str());
+    if (sock == -1) {
+        return nullptr;
+    }
+    int memfd = recv_fd(sock);
+    struct stat st;
+    if (memfd == -1 || fstat(memfd, &st) != 0 || (size_t) st.st_size != sizeof(layout)) {
+        Log_error("rpc::ShmChannel: no shared memory from %s: %s", name.c_str(), strerror(errno));
+        if (memfd != -1) {
+            ::close(memfd);
+        }
+        ::close(sock);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    ::close(memfd);
+    if (p == MAP_FAILED) {
+        Log_error("rpc::ShmChannel: mmap(): %s", strerror(errno));
+        ::close(sock);
+        return nullptr;
+    }
+    verify(set_nonblocking(sock, true) != -1);
+    return new ShmChannel(sock, (layout *) p, false);
+}
+
+ShmChannel* ShmChannel::accept(int sock) {
+    int memfd = memfd_create("simplerpc-shm", MFD_CLOEXEC);
+    if (memfd == -1) {
+        Log_error("rpc::ShmChannel: memfd_create(): %s", strerror(errno));
+        return nullptr;
+    }
+    void* p = MAP_FAILED;
+    if (ftruncate(memfd, sizeof(layout)) == 0) {
+        p = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    if (p == MAP_FAILED) {
+        Log_error("rpc::ShmChannel: cannot map %lu bytes: %s", sizeof(layout), strerror(errno));
+        ::close(memfd);
+        return nullptr;
+    }
+
+    // a new memfd is all zeros, only readers start asleep, so the first
+    // packet each way rings the doorbell
+    layout* shm = (layout *) p;
+    shm->rings[0].reader_waiting = 1;
+    shm->rings[1].reader_waiting = 1;
+    __sync_synchronize();
+
+    int r = send_fd(sock, memfd);
+    ::close(memfd);
+    if (r != 0) {
+        Log_error("rpc::ShmChannel: cannot pass shared memory: %s", strerror(errno));
+        munmap(p, sizeof(layout));
+        return nullptr;
+    }
+    return new ShmChannel(sock, shm, true);
+}
+
+void ShmChannel::ring_doorbell() {
+    // EAGAIN means doorbells are piling up unread, the peer is woken anyway
+    char c = 0;
+    ssize_t r = send(sock_, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void) r;
+}
+
+void ShmChannel::drain_doorbell() {
+    char buf[64];
+    while (read(sock_, buf, sizeof(buf)) > 0) {
+        // EOF or errors are left to the poll thread, by EPOLLRDHUP
+    }
+}
+
+void ShmChannel::set_broken() {
+    Log_error("rpc::ShmChannel: ring counters corrupted, closing fd=%d", sock_);
+    broken_ = true;
+    // the poll thread sees the hangup and closes the connection
+    ::shutdown(sock_, SHUT_RDWR);
+}
+
+size_t ShmChannel::write_from(Marshal* out) {
+    size_t n_written = 0;
+    vector<struct iovec> iov;
+    while (!broken_) {
+        uint64_t tail = out_->tail;
+        uint64_t head = out_->head;
+        __sync_synchronize();
+        if (tail - head > ring_size_s) {
+            set_broken();
+            break;
+        }
+        size_t n = std::min(ring_size_s - (size_t) (tail - head), out->content_size());
+        if (n == 0) {
+            if (out->empty()) {
+                break;
+            }
+            // ring full, have the reader ring once it made room
+            out_->writer_waiting = 1;
+            __sync_synchronize();
+            if (out_->head != head) {
+                out_->writer_waiting = 0;
+                continue;
+            }
+            break;
+        }
+
+        iov.clear();
+        verify(out->peek_iovecs(n, &iov) == n);
+        size_t idx = tail % ring_size_s;
+        for (auto& v: iov) {
+            const char* p = (const char *) v.iov_base;
+            size_t first = std::min(v.iov_len, ring_size_s - idx);
+            memcpy(out_data_ + idx, p, first);
+            memcpy(out_data_, p + first, v.iov_len - first);
+            idx = (idx + v.iov_len) % ring_size_s;
+        }
+        __sync_synchronize();
+        out_->tail = tail + n;
+        out->discard(n);
+        n_written += n;
+    }
+
+    if (n_written > 0) {
+        __sync_synchronize();
+        if (out_->reader_waiting) {
+            out_->reader_waiting = 0;
+            ring_doorbell();
+        }
+    }
+    return n_written;
+}
+
+size_t ShmChannel::read_into(Marshal* in) {
+    drain_doorbell();
+
+    size_t n_read = 0;
+    double spin_until = -1.0;
+    while (!broken_) {
+        uint64_t head = in_->head;
+        uint64_t tail = in_->tail;
+        __sync_synchronize();
+        if (tail - head > ring_size_s) {
+            set_broken();
+            break;
+        }
+        size_t n = (size_t) (tail - head);
+        if (n == 0) {
+            // spin only for the first bytes, what was read is handled right away
+            if (spin_sec_s > 0 && n_read == 0) {
+                double now = base::monotonic_time();
+                if (spin_until < 0) {
+                    spin_until = now + spin_sec_s;
+                }
+                if (now < spin_until) {
+                    continue;
+                }
+            }
+            // go to sleep, unless the writer got in before it could see us
+            in_->reader_waiting = 1;
+            __sync_synchronize();
+            if (in_->tail != tail) {
+                in_->reader_waiting = 0;
+                continue;
+            }
+            break;
+        }
+
+        size_t idx = head % ring_size_s;
+        size_t first = std::min(n, ring_size_s - idx);
+        in->write(in_data_ + idx, first);
+        if (n > first) {
+            in->write(in_data_, n - first);
+        }
+        __sync_synchronize();
+        in_->head = head + n;
+        n_read += n;
+
+        __sync_synchronize();
+        if (in_->writer_waiting) {
+            in_->writer_waiting = 0;
+            ring_doorbell();
+        }
+    }
+    return n_read;
+}
+
+} // namespace rpc
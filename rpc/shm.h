@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+
+#include "marshal.h"
+
+namespace rpc {
+
+/**
+ * Same-host transport for "shm://name" addresses, used by Client and Server
+ * in place of a TCP socket, with the same packets.
+ *
+ * Packets flow through two single-producer single-consumer rings, one each
+ * way, in a memfd mapped by both peers. The server listens on the unix
+ * socket "@simplerpc-shm/name" (abstract namespace), and hands each client
+ * that connects a memfd of its own over it with SCM_RIGHTS.
+ *
+ * The unix socket stays open as the doorbell: a peer writes a byte to it
+ * only if the other side went to sleep on an empty ring (reader_waiting),
+ * or a full one (writer_waiting). So the poll thread is woken by the socket
+ * like for TCP, and sees the connection break once the peer is gone.
+ *
+ * Writing is done under the connection's out_l_, reading by its poll
+ * thread, so each ring has a single producer and a single consumer.
+ */
+class ShmChannel: public NoCopy {
+public:
+
+    static const size_t ring_size_s = 1024 * 1024;
+
+    // nullptr if nobody listens on name
+    static ShmChannel* connect(const std::string& name);
+
+    // server side of a socket accepted on listen_path(), nullptr on errors
+    static ShmChannel* accept(int sock);
+
+    // name of a "shm://name" address, nullptr for other addresses
+    static const char* addr_name(const char* addr);
+
+    // unix socket for name, see unix_listen()
+    static std::string listen_path(const std::string& name);
+
+    /**
+     * Before going to sleep on an empty ring, the reader spins up to sec
+     * seconds for more data, saving the doorbell round trip at the cost of
+     * cpu. 0 (the default) for never.
+     */
+    static void set_spin(double sec);
+
+    ~ShmChannel();
+
+    // the doorbell socket, closed by the connection, not the channel
+    int fd() const {
+        return sock_;
+    }
+
+    // move as much of out as fits into the ring, returns bytes moved
+    size_t write_from(Marshal* out);
+
+    // move whatever is in the ring into in, returns bytes moved
+    size_t read_into(Marshal* in);
+
+    // consume doorbell rings without reading the ring, for a reader that
+    // holds back but still has to notice room for its own writes
+    void drain_doorbell();
+
+private:
+
+    struct ring {
+        // free running byte counters, index is counter % ring_size_s
+        volatile uint64_t head __attribute__((aligned(64)));
+        volatile uint64_t tail __attribute__((aligned(64)));
+        volatile int reader_waiting __attribute__((aligned(64)));
+        volatile int writer_waiting __attribute__((aligned(64)));
+    };
+
+    // both rings' headers, then their data
+    struct layout {
+        ring rings[2];
+        char data[2][ring_size_s];
+    };
+
+    static double spin_sec_s;
+
+    int sock_;
+    layout* shm_;
+    ring* in_;
+    ring* out_;
+    char* in_data_;
+    char* out_data_;
+
+    // set once the peer left the ring counters out of bounds, the doorbell
+    // socket is then shut down and nothing more gets moved
+    bool broken_;
+
+    // the server writes on rings[1]
+    ShmChannel(int sock, layout* shm, bool server);
+
+    void ring_doorbell();
+    void set_broken();
+};
+
+} // namespace rpc
@@ -0,0 +1,102 @@
+#include <errno.h>
+
+#include "stream.h"
+
+using namespace std;
+
+namespace rpc {
+
+const size_t Stream::window_size = 1024 * 1024;
+
+Stream::Stream(i64 xid)
+        : consumed_(0), in_flight_(0), eof_(false), closed_(false), xid_(xid) {
+    Pthread_mutex_init(&m_, nullptr);
+    Pthread_cond_init(&cond_, nullptr);
+}
+
+Stream::~Stream() {
+    for (auto& frame : frames_) {
+        delete frame;
+    }
+    Pthread_mutex_destroy(&m_);
+    Pthread_cond_destroy(&cond_);
+}
+
+int Stream::write_frame(Marshal& payload) {
+    size_t n = payload.content_size();
+    Pthread_mutex_lock(&m_);
+    while (!closed_ && in_flight_ >= window_size) {
+        Pthread_cond_wait(&cond_, &m_);
+    }
+    if (closed_) {
+        Pthread_mutex_unlock(&m_);
+        return EPIPE;
+    }
+    in_flight_ += n;
+    Pthread_mutex_unlock(&m_);
+    return send_data(payload);
+}
+
+Marshal* Stream::read_frame() {
+    Pthread_mutex_lock(&m_);
+    while (frames_.empty() && !eof_) {
+        Pthread_cond_wait(&cond_, &m_);
+    }
+    if (frames_.empty()) {
+        Pthread_mutex_unlock(&m_);
+        return nullptr;
+    }
+    Marshal* frame = frames_.front();
+    frames_.pop_front();
+
+    // once half a window is consumed, give it back to the writer. writer only
+    // blocks with a full window in flight, so this never leaves it stuck.
+    size_t credit = 0;
+    consumed_ += frame->content_size();
+    if (consumed_ >= window_size / 2 && !eof_) {
+        credit = consumed_;
+        consumed_ = 0;
+    }
+    Pthread_mutex_unlock(&m_);
+
+    if (credit > 0) {
+        send_credit(credit);
+    }
+    return frame;
+}
+
+void Stream::on_data(Marshal* frame) {
+    Pthread_mutex_lock(&m_);
+    if (eof_) {
+        // too late
+        delete frame;
+    } else {
+        frames_.push_back(frame);
+        Pthread_cond_broadcast(&cond_);
+    }
+    Pthread_mutex_unlock(&m_);
+}
+
+void Stream::on_end() {
+    Pthread_mutex_lock(&m_);
+    eof_ = true;
+    Pthread_cond_broadcast(&cond_);
+    Pthread_mutex_unlock(&m_);
+}
+
+void Stream::on_credit(size_t n_bytes) {
+    Pthread_mutex_lock(&m_);
+    in_flight_ -= std::min(n_bytes, in_flight_);
+    Pthread_cond_broadcast(&cond_);
+    Pthread_mutex_unlock(&m_);
+}
+
+void Stream::on_close() {
+    Pthread_mutex_lock(&m_);
+    eof_ = true;
+    closed_ = true;
+    Pthread_cond_broadcast(&cond_);
+    Pthread_mutex_unlock(&m_);
+}
+
+} // namespace rpc
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <list>
+
+#include <pthread.h>
+
+#include "marshal.h"
+
+namespace rpc {
+
+/**
+ * Stream frames ride on normal packets, keyed by xid of the RPC that
+ * opened the stream.
+ *
+ * client -> server: <size> <xid> <rpc_id=STREAM_DATA> <payload>
+ *                   <size> <xid> <rpc_id=STREAM_END>
+ *                   <size> <xid> <rpc_id=STREAM_CREDIT> <v64 n_bytes>
+ * server -> client: <size> <xid> <error_code=STREAM_REPLY_DATA> <payload>
+ *                   <size> <xid> <error_code=STREAM_REPLY_CREDIT> <v64 n_bytes>
+ *
+ * The normal reply of the RPC ends the stream in both directions.
+ */
+enum {
+    // rpcgen generated rpc_ids are much larger than these
+    STREAM_DATA = 0x1,
+    STREAM_END = 0x2,
+    STREAM_CREDIT = 0x3,
+
+    // errno values are positive, and -1 is used by the Python extension
+    STREAM_REPLY_DATA = -0x100,
+    STREAM_REPLY_CREDIT = -0x101,
+};
+
+/**
+ * A sequence of frames flowing each way along with an RPC, so that bulk
+ * transfers are not limited by packet size, and need not be buffered as a
+ * whole on either side.
+ *
+ * Flow control is credit based: a writer blocks once window_size bytes are
+ * in flight, and the reader hands back credit as it consumes frames. So at
+ * most window_size bytes (plus the last frame) are buffered per direction.
+ *
+ * One reader thread and one writer thread at most.
+ */
+class Stream: public RefCounted {
+    pthread_mutex_t m_;
+    pthread_cond_t cond_;
+
+    std::list<Marshal*> frames_;
+    size_t consumed_;   // bytes read since last credit sent
+    size_t in_flight_;  // bytes sent and not credited back
+    bool eof_;          // no more frames from peer
+    bool closed_;       // peer takes no more frames
+
+protected:
+
+    i64 xid_;
+
+    // send out a frame, or give back credit to peer
+    virtual int send_data(Marshal& payload) = 0;
+    virtual void send_end() = 0;
+    virtual void send_credit(size_t n_bytes) = 0;
+
+    // protected destructor as required by RefCounted.
+    virtual ~Stream();
+
+public:
+
+    // 1mb
+    static const size_t window_size;
+
+    Stream(i64 xid);
+
+    i64 xid() const {
+        return xid_;
+    }
+
+    /**
+     * Blocks if too much is in flight.
+     * Returns 0 on success, or EPIPE if peer no longer takes frames.
+     */
+    int write_frame(Marshal& payload);
+
+    template<class T>
+    int write(const T& v) {
+        Marshal m;
+        m << v;
+        return write_frame(m);
+    }
+
+    // tell peer no more frames will be written
+    void close_write() {
+        send_end();
+    }
+
+    /**
+     * Blocks till a frame arrives. Returns nullptr if peer finished writing
+     * or the connection is gone. Caller should delete the returned frame.
+     */
+    Marshal* read_frame();
+
+    template<class T>
+    bool read(T* v) {
+        Marshal* m = read_frame();
+        if (m == nullptr) {
+            return false;
+        }
+        *m >> *v;
+        delete m;
+        return true;
+    }
+
+    // used *internally* by poll threads
+    void on_data(Marshal* frame);
+    void on_end();
+    void on_credit(size_t n_bytes);
+    void on_close();
+};
+
+/**
+ * Handed to handlers of 'stream' RPCs generated by rpcgen. Only valid
+ * till the handler returns.
+ */
+class ServerStream: public Stream {
+protected:
+    virtual ~ServerStream() {}
+public:
+    ServerStream(i64 xid): Stream(xid) {}
+};
+
+} // namespace rpc
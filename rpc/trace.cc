@@ -0,0 +1,110 @@
+#include <random>
+#include <sstream>
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+using namespace std;
+
+namespace rpc {
+
+static thread_local TraceContext t_current_trace;
+
+static i64 new_id() {
+    static thread_local std::mt19937_64 rand(base::rdtsc() ^ (uint64_t) pthread_self());
+    i64 id;
+    do {
+        id = (i64) rand();
+    } while (id == 0);
+    return id;
+}
+
+TraceContext TraceContext::start(double sample_rate /* =? */) {
+    TraceContext ctx;
+    ctx.trace_id = new_id();
+    ctx.span_id = new_id();
+    ctx.sampled = sample_rate >= 1.0 || (uint64_t) new_id() % 1000000 < sample_rate * 1000000;
+    return ctx;
+}
+
+TraceContext TraceContext::child() const {
+    TraceContext ctx;
+    ctx.trace_id = trace_id;
+    ctx.span_id = new_id();
+    ctx.parent_span_id = span_id;
+    ctx.sampled = sampled;
+    return ctx;
+}
+
+const TraceContext& current_trace() {
+    return t_current_trace;
+}
+
+TraceScope::TraceScope(const TraceContext& ctx): saved_(t_current_trace) {
+    t_current_trace = ctx;
+}
+
+TraceScope::~TraceScope() {
+    t_current_trace = saved_;
+}
+
+SpanBuffer::SpanBuffer(size_t capacity /* =? */): capacity_(capacity) {
+    verify(capacity_ > 0);
+    slots_ = new slot[capacity_];
+    for (size_t i = 0; i < capacity_; i++) {
+        slots_[i].seq = -1;
+    }
+}
+
+SpanBuffer::~SpanBuffer() {
+    delete[] slots_;
+}
+
+void SpanBuffer::record(const Span& span) {
+    i64 idx = next_.next();
+    slot* s = &slots_[idx % capacity_];
+    s->seq = -1;
+    __sync_synchronize();
+    s->span = span;
+    __sync_synchronize();
+    s->seq = idx;
+}
+
+void SpanBuffer::snapshot(std::vector<Span>* spans) const {
+    spans->clear();
+    i64 end = next_.peek_next();
+    i64 begin = std::max((i64) 0, end - (i64) capacity_);
+    for (i64 idx = begin; idx < end; idx++) {
+        const slot* s = &slots_[idx % capacity_];
+        i64 seq = s->seq;
+        __sync_synchronize();
+        Span span = s->span;
+        __sync_synchronize();
+        if (seq == idx && s->seq == idx) {
+            spans->push_back(span);
+        }
+    }
+}
+
+std::string SpanBuffer::to_json() const {
+    vector<Span> spans;
+    snapshot(&spans);
+    ostringstream o;
+    o << "[";
+    char buf[256];
+    for (size_t i = 0; i < spans.size(); i++) {
+        const Span& sp = spans[i];
+        snprintf(buf, sizeof(buf),
+                 "%s{\"trace_id\":\"%016lx\",\"span_id\":\"%016lx\",\"parent_span_id\":\"%016lx\","
+                 "\"rpc_id\":%d,\"error_code\":%d,\"start_us\":%ld,\"duration_ns\":%ld}",
+                 i == 0 ? "" : ",", (uint64_t) sp.trace_id, (uint64_t) sp.span_id, (uint64_t) sp.parent_span_id,
+                 sp.rpc_id, sp.error_code, sp.start_us, sp.duration_ns);
+        o << buf;
+    }
+    o << "]";
+    return o.str();
+}
+
+} // namespace rpc
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace rpc {
+
+/**
+ * Tracing context of a request. Optional in the request header: if the high
+ * bit of <rpc_id> is set, the header is followed by
+ *
+ * <i64 trace_id> <i64 parent_span_id> <i8 flags>
+ *
+ * parent_span_id is the span of the caller, if any. A server gives each
+ * traced request a span of its own. Replies are not affected.
+ *
+ * NOTE: servers older than this would answer a traced request with ENOENT.
+ */
+const i32 RPC_ID_TRACED = (i32) 0x80000000;
+
+const i8 TRACE_SAMPLED = 0x1;
+
+const size_t TRACE_HEADER_SIZE = 2 * sizeof(i64) + sizeof(i8);
+
+struct TraceContext {
+    i64 trace_id;  // 0 if not traced
+    i64 span_id;
+    i64 parent_span_id;
+    bool sampled;
+
+    TraceContext(): trace_id(0), span_id(0), parent_span_id(0), sampled(false) { }
+
+    bool traced() const {
+        return trace_id != 0;
+    }
+
+    // a new trace, sampled with given probability
+    static TraceContext start(double sample_rate = 1.0);
+
+    // a new span in the same trace, child of this one
+    TraceContext child() const;
+};
+
+/**
+ * Tracing context of the calling thread. rpcgen generated handlers run within
+ * the context of their request, and Client::begin_request() passes it on, so
+ * calls made from handlers (e.g. through ClientPool) join the trace.
+ */
+const TraceContext& current_trace();
+
+// sets current_trace() for its lifetime
+class TraceScope: public NoCopy {
+    TraceContext saved_;
+public:
+    explicit TraceScope(const TraceContext& ctx);
+    ~TraceScope();
+};
+
+struct Span {
+    i64 trace_id;
+    i64 span_id;
+    i64 parent_span_id;
+    i32 rpc_id;
+    i32 error_code;
+    i64 start_us;  // wall clock, microseconds since epoch
+    i64 duration_ns;
+};
+
+/**
+ * Fixed size ring of the latest sampled spans. Writers never block or take a
+ * lock: a slot is claimed with an atomic increment, and guarded by a sequence
+ * number so readers skip slots being overwritten.
+ */
+class SpanBuffer: public NoCopy {
+    struct slot {
+        volatile i64 seq;  // index of the span in it, -1 while being written
+        Span span;
+    };
+
+    size_t capacity_;
+    slot* slots_;
+    Counter next_;
+
+public:
+    SpanBuffer(size_t capacity = 4096);
+    ~SpanBuffer();
+
+    void record(const Span& span);
+
+    // latest spans, oldest first
+    void snapshot(std::vector<Span>* spans) const;
+
+    /**
+     * JSON array of the latest spans, to pull locally or ship elsewhere,
+     * e.g. through rlog. IDs are hex strings, since they do not fit in a
+     * JSON number.
+     */
+    std::string to_json() const;
+};
+
+} // namespace rpc
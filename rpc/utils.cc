@@ -1,9 +1,13 @@
 #include <utility>
+#include <vector>
 
 #include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -30,9 +34,84 @@ int set_nonblocking(int fd, bool nonblocking) {
     return ret;
 }
 
+namespace {
+
+struct resolved_addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+struct resolved {
+    double expire_at;
+    vector<resolved_addr> addrs;
+};
+
+}
+
+static const double dns_cache_ttl = 60.0;
+
+// getaddrinfo() results by host, port and hints
+static SpinLock dns_l;
+static map<string, resolved> dns_cache;
+
+// getaddrinfo() only if not cached or expired, returns its error code
+static int resolve(const string& host, const string& port, const struct addrinfo* hints,
+                   vector<resolved_addr>* addrs) {
+    char key[512];
+    snprintf(key, sizeof(key), "%s:%s/%d/%d/%d/%d", host.c_str(), port.c_str(),
+             hints->ai_family, hints->ai_socktype, hints->ai_protocol, hints->ai_flags);
+    double now = base::monotonic_time();
+    dns_l.lock();
+    map<string, resolved>::iterator it = dns_cache.find(key);
+    if (it != dns_cache.end() && now < it->second.expire_at) {
+        *addrs = it->second.addrs;
+        dns_l.unlock();
+        return 0;
+    }
+    dns_l.unlock();
+
+    struct addrinfo *result, *rp;
+    int r = getaddrinfo((host == "0.0.0.0") ? nullptr : host.c_str(), port.c_str(), hints, &result);
+    if (r != 0) {
+        return r;
+    }
+    addrs->clear();
+    for (rp = result; rp != nullptr; rp = rp->ai_next) {
+        resolved_addr a;
+        a.family = rp->ai_family;
+        a.socktype = rp->ai_socktype;
+        a.protocol = rp->ai_protocol;
+        a.addrlen = rp->ai_addrlen;
+        verify(a.addrlen <= sizeof(a.addr));
+        memcpy(&a.addr, rp->ai_addr, a.addrlen);
+        addrs->push_back(a);
+    }
+    freeaddrinfo(result);
+
+    dns_l.lock();
+    // drop whatever expired, so hosts no longer used do not pile up
+    it = dns_cache.begin();
+    while (it != dns_cache.end()) {
+        if (now >= it->second.expire_at) {
+            it = dns_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    resolved& entry = dns_cache[key];
+    entry.expire_at = now + dns_cache_ttl;
+    entry.addrs = *addrs;
+    dns_l.unlock();
+    return 0;
+}
+
 int open_socket(const char* addr, const struct addrinfo* hints,
                 std::function<bool(int, const struct sockaddr*, socklen_t)> filter /* =? */,
-                struct sockaddr** p_addr /* =? */, socklen_t* p_len /* =? */) {
+                struct sockaddr** p_addr /* =? */, socklen_t* p_len /* =? */,
+                size_t* next_addr /* =? */) {
 
     int sock = -1;
     string str_addr(addr);
@@ -44,18 +123,26 @@ int open_socket(const char* addr, const struct addrinfo* hints,
     string host = str_addr.substr(0, idx);
     string port = str_addr.substr(idx + 1);
 
-    struct addrinfo *result, *rp;
-    int r = getaddrinfo((host == "0.0.0.0") ? nullptr : host.c_str(), port.c_str(), hints, &result);
+    vector<resolved_addr> addrs;
+    int r = resolve(host, port, hints, &addrs);
     if (r != 0) {
         Log_error("getaddrinfo(): %s", gai_strerror(r));
         return -1;
     }
 
-    for (rp = result; rp != nullptr; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (next_addr != nullptr && *next_addr >= addrs.size()) {
+        // every address was tried already, the caller has seen why they failed
+        return -1;
+    }
+    vector<resolved_addr>::iterator rp = addrs.begin();
+    if (next_addr != nullptr) {
+        rp += *next_addr;
+    }
+    for (; rp != addrs.end(); ++rp) {
+        sock = socket(rp->family, rp->socktype, rp->protocol);
         if (sock == -1) {
             continue;
-        } else if (filter != nullptr && filter(sock, rp->ai_addr, rp->ai_addrlen) == false) {
+        } else if (filter != nullptr && filter(sock, (struct sockaddr *) &rp->addr, rp->addrlen) == false) {
             close(sock);
             sock = -1;
             continue;
@@ -64,32 +151,38 @@ int open_socket(const char* addr, const struct addrinfo* hints,
         }
     }
 
-    if (rp == nullptr) {
+    if (next_addr != nullptr) {
+        *next_addr = rp - addrs.begin() + 1;
+    }
+    if (rp == addrs.end()) {
         Log_error("open_socket(): failed to open proper socket %s", strerror(errno));
         sock = -1;
     } else if (p_addr != nullptr && p_len != nullptr) {
-        *p_addr = (struct sockaddr *) malloc(rp->ai_addrlen);
-        *p_len = rp->ai_addrlen;
-        memcpy(*p_addr, rp->ai_addr, *p_len);
+        *p_addr = (struct sockaddr *) malloc(rp->addrlen);
+        *p_len = rp->addrlen;
+        memcpy(*p_addr, &rp->addr, *p_len);
     }
 
-    freeaddrinfo(result);
     return sock;
 }
 
-int tcp_connect(const char* addr) {
+int tcp_connect(const char* addr, bool nonblocking /* =? */, size_t* next_addr /* =? */) {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM; // tcp
 
     return open_socket(addr, &hints,
-                        [] (int sock, const struct sockaddr* sock_addr, socklen_t sock_len) {
+                        [nonblocking] (int sock, const struct sockaddr* sock_addr, socklen_t sock_len) {
                             const int yes = 1;
                             verify(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == 0);
                             verify(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == 0);
+                            if (nonblocking) {
+                                verify(set_nonblocking(sock, true) != -1);
+                                return ::connect(sock, sock_addr, sock_len) == 0 || errno == EINPROGRESS;
+                            }
                             return ::connect(sock, sock_addr, sock_len) == 0;
-                        });
+                        }, nullptr, nullptr, next_addr);
 }
 
 int udp_connect(const char* addr, struct sockaddr** p_addr /* =? */, socklen_t* p_len /* =? */) {
@@ -115,4 +208,131 @@ int udp_bind(const char* addr) {
                         });
 }
 
+static socklen_t unix_sockaddr(const char* path, struct sockaddr_un* sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(sa->sun_path)) {
+        return 0;
+    }
+    memcpy(sa->sun_path, path, len);
+    if (path[0] == '@') {
+        // abstract namespace, the name is not nul terminated
+        sa->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    return sizeof(*sa);
+}
+
+int unix_connect(const char* path) {
+    struct sockaddr_un sa;
+    socklen_t len = unix_sockaddr(path, &sa);
+    if (len == 0) {
+        Log_error("unix_connect(): bad path: %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (::connect(sock, (struct sockaddr *) &sa, len) != 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+int unix_listen(const char* path) {
+    struct sockaddr_un sa;
+    socklen_t len = unix_sockaddr(path, &sa);
+    if (len == 0) {
+        Log_error("unix_listen(): bad path: %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (::bind(sock, (struct sockaddr *) &sa, len) != 0 || listen(sock, SOMAXCONN) != 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+const char* unix_path(const char* addr) {
+    static const char prefix[] = "unix:";
+    if (strncmp(addr, prefix, sizeof(prefix) - 1) != 0) {
+        return nullptr;
+    }
+    return addr + sizeof(prefix) - 1;
+}
+
+int send_fd(int sock, int fd) {
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    memset(ctrl, 0, sizeof(ctrl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t r;
+    do {
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (r == -1 && errno == EINTR);
+    return r == 1 ? 0 : -1;
+}
+
+int recv_fd(int sock) {
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    ssize_t r;
+    do {
+        r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r == -1 && errno == EINTR);
+    if (r != 1) {
+        if (r == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EBADMSG;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
 }
@@ -27,6 +27,7 @@ using base::v64;
 using base::NoCopy;
 using base::Lockable;
 using base::SpinLock;
+using base::CacheAligned;
 using base::Mutex;
 using base::ScopedLock;
 using base::CondVar;
@@ -41,13 +42,29 @@ using base::insert_into_map;
 
 int set_nonblocking(int fd, bool nonblocking);
 
+// name resolution is cached for a minute. with next_addr, resolved addresses
+// are tried from *next_addr on, which is set past the one used
 int open_socket(const char* addr, const struct addrinfo* hints,
                 std::function<bool(int, const struct sockaddr*, socklen_t)> filter = nullptr,
-                struct sockaddr** p_addr = nullptr, socklen_t* p_len = nullptr);
+                struct sockaddr** p_addr = nullptr, socklen_t* p_len = nullptr,
+                size_t* next_addr = nullptr);
 
-int tcp_connect(const char* addr);
+// if nonblocking, returns once the connect is on the way, check SO_ERROR when
+// writable, and if it failed, call again with next_addr to try the others
+int tcp_connect(const char* addr, bool nonblocking = false, size_t* next_addr = nullptr);
 int udp_connect(const char* addr, struct sockaddr** p_addr = nullptr, socklen_t* p_len = nullptr);
 
 int udp_bind(const char* addr);
 
+// AF_UNIX stream sockets, a path starting with '@' is in the abstract namespace
+int unix_connect(const char* path);
+int unix_listen(const char* path);
+
+// path of a "unix:/path" address, nullptr for other addresses
+const char* unix_path(const char* addr);
+
+// pass fd over a unix socket with SCM_RIGHTS, along with a single byte
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
+
 }
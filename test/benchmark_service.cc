@@ -54,3 +54,43 @@ void BenchmarkService::add_later(const rpc::i32& a, const rpc::i32& b, rpc::i32*
     // defer->reply() will cleanup all resource, including `defer` itself
     defer->reply();
 }
+
+void BenchmarkService::count_strings(const rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>& groups, rpc::i32* n) {
+    *n = 0;
+    for (auto& it : groups) {
+        *n += it.second.size();
+    }
+}
+
+void BenchmarkService::count_strings_later(const rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>& groups,
+                                           rpc::i32* n, rpc::DeferredReply* defer) {
+    count_strings(groups, n);
+    defer->reply();
+}
+
+void BenchmarkService::upload(rpc::i64* n_bytes, rpc::ServerStream* stream) {
+    *n_bytes = 0;
+    Marshal* frame;
+    while ((frame = stream->read_frame()) != nullptr) {
+        *n_bytes += frame->content_size();
+        delete frame;
+    }
+}
+
+void BenchmarkService::download(const rpc::i64& n_bytes, const rpc::i32& frame_size, rpc::i32* n_frames,
+                                rpc::ServerStream* stream) {
+    std::string payload(frame_size, 'x');
+    *n_frames = 0;
+    i64 n_left = n_bytes;
+    while (n_left > 0) {
+        Marshal m;
+        i64 n = std::min(n_left, (i64) frame_size);
+        m.write(payload.data(), n);
+        if (stream->write_frame(m) != 0) {
+            break;
+        }
+        n_left -= n;
+        (*n_frames)++;
+    }
+    stream->close_write();
+}
@@ -16,6 +16,14 @@ struct point3 {
     double z;
 };
 
+inline constexpr size_t marshal_fixed_size(const point3*) {
+    return 24;
+}
+
+inline constexpr size_t marshal_size(const point3&) {
+    return 24;
+}
+
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const point3& o) {
     m << o.x;
     m << o.y;
@@ -33,18 +41,24 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, point3& o) {
 class BenchmarkService: public rpc::Service {
 public:
     enum {
-        FAST_PRIME = 0x5b9365eb,
-        FAST_DOT_PROD = 0x4a92c615,
-        FAST_ADD = 0x484806bf,
-        FAST_NOP = 0x4f29b7a5,
-        PRIME = 0x1f96b90f,
-        DOT_PROD = 0x3a2fd47a,
-        ADD = 0x5135fabc,
-        NOP = 0x3823ed06,
-        SLEEP = 0x39d768e9,
-        ADD_LATER = 0x64e0a594,
-        LOSSY_NOP = 0x5323ea07,
-        FAST_LOSSY_NOP = 0x6223e760,
+        FAST_PRIME = 0x60d74456,
+        FAST_DOT_PROD = 0x30c3e230,
+        FAST_ADD = 0x4964b4e8,
+        FAST_NOP = 0x2074e609,
+        PRIME = 0x46a16f21,
+        DOT_PROD = 0x13015d45,
+        ADD = 0x5bf0f350,
+        NOP = 0x1ddabe0f,
+        SLEEP = 0x1b251f96,
+        PING = 0x2ff38679,
+        ADD_LATER = 0x35f5b44d,
+        COUNT_STRINGS = 0x645b88f5,
+        COUNT_STRINGS_LATER = 0x4b43cec1,
+        LOSSY_NOP = 0x4bcee972,
+        FAST_LOSSY_NOP = 0x29a97c65,
+        UDP_ECHO = 0x68851b1c,
+        UPLOAD = 0x45cfe93e,
+        DOWNLOAD = 0x40f2039c,
     };
     int __reg_to__(rpc::Server* svr) {
         int ret = 0;
@@ -75,9 +89,18 @@ public:
         if ((ret = svr->reg(SLEEP, this, &BenchmarkService::__sleep__wrapper__)) != 0) {
             goto err;
         }
+        if ((ret = svr->reg(PING, this, &BenchmarkService::__ping__wrapper__, rpc::ThreadPool::PRIORITY_HIGH)) != 0) {
+            goto err;
+        }
         if ((ret = svr->reg(ADD_LATER, this, &BenchmarkService::__add_later__wrapper__)) != 0) {
             goto err;
         }
+        if ((ret = svr->reg(COUNT_STRINGS, this, &BenchmarkService::__count_strings__wrapper__)) != 0) {
+            goto err;
+        }
+        if ((ret = svr->reg(COUNT_STRINGS_LATER, this, &BenchmarkService::__count_strings_later__wrapper__)) != 0) {
+            goto err;
+        }
         svr->enable_udp();
         if ((ret = svr->reg(LOSSY_NOP, this, &BenchmarkService::__lossy_nop__wrapper__)) != 0) {
             goto err;
@@ -85,6 +108,15 @@ public:
         if ((ret = svr->reg(FAST_LOSSY_NOP, this, &BenchmarkService::__fast_lossy_nop__wrapper__)) != 0) {
             goto err;
         }
+        if ((ret = svr->reg(UDP_ECHO, this, &BenchmarkService::__udp_echo__wrapper__)) != 0) {
+            goto err;
+        }
+        if ((ret = svr->reg(UPLOAD, this, &BenchmarkService::__upload__wrapper__)) != 0) {
+            goto err;
+        }
+        if ((ret = svr->reg(DOWNLOAD, this, &BenchmarkService::__download__wrapper__)) != 0) {
+            goto err;
+        }
         return 0;
     err:
         svr->unreg(FAST_PRIME);
@@ -96,13 +128,19 @@ public:
         svr->unreg(ADD);
         svr->unreg(NOP);
         svr->unreg(SLEEP);
+        svr->unreg(PING);
         svr->unreg(ADD_LATER);
+        svr->unreg(COUNT_STRINGS);
+        svr->unreg(COUNT_STRINGS_LATER);
         svr->unreg(LOSSY_NOP);
         svr->unreg(FAST_LOSSY_NOP);
+        svr->unreg(UDP_ECHO);
+        svr->unreg(UPLOAD);
+        svr->unreg(DOWNLOAD);
         return ret;
     }
     // these RPC handler functions need to be implemented by user
-    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
     virtual void fast_prime(const rpc::i32& n, rpc::i8* flag);
     virtual void fast_dot_prod(const point3& p1, const point3& p2, double* v);
     virtual void fast_add(const rpc::v32& a, const rpc::v32& b, rpc::v32* a_add_b);
@@ -112,16 +150,22 @@ public:
     virtual void add(const rpc::v32& a, const rpc::v32& b, rpc::v32* a_add_b);
     virtual void nop(const std::string&);
     virtual void sleep(const double& sec);
+    virtual void ping();
     virtual void add_later(const rpc::i32& a, const rpc::i32& b, rpc::i32* sum, rpc::DeferredReply* defer);
+    virtual void count_strings(const rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>& groups, rpc::i32* n);
+    virtual void count_strings_later(const rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>& groups, rpc::i32* n, rpc::DeferredReply* defer);
     virtual void lossy_nop(const rpc::i32& dummy, const rpc::i32& dummy2);
     virtual void fast_lossy_nop();
+    virtual void udp_echo(const std::string& str, std::string* echoed);
+    virtual void upload(rpc::i64* n_bytes, rpc::ServerStream* stream);
+    virtual void download(const rpc::i64& n_bytes, const rpc::i32& frame_size, rpc::i32* n_frames, rpc::ServerStream* stream);
 private:
     void __fast_prime__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         rpc::i32 in_0;
         req->m >> in_0;
         rpc::i8 out_0;
         this->fast_prime(in_0, &out_0);
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
         *sconn << out_0;
         sconn->end_reply();
         delete req;
@@ -134,7 +178,7 @@ private:
         req->m >> in_1;
         double out_0;
         this->fast_dot_prod(in_0, in_1, &out_0);
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
         *sconn << out_0;
         sconn->end_reply();
         delete req;
@@ -147,7 +191,7 @@ private:
         req->m >> in_1;
         rpc::v32 out_0;
         this->fast_add(in_0, in_1, &out_0);
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
         *sconn << out_0;
         sconn->end_reply();
         delete req;
@@ -157,80 +201,138 @@ private:
         std::string in_0;
         req->m >> in_0;
         this->fast_nop(in_0);
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of());
         sconn->end_reply();
         delete req;
         sconn->release();
     }
     void __prime__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             rpc::i32 in_0;
             req->m >> in_0;
             rpc::i8 out_0;
             this->prime(in_0, &out_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
             *sconn << out_0;
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __dot_prod__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             point3 in_0;
             req->m >> in_0;
             point3 in_1;
             req->m >> in_1;
             double out_0;
             this->dot_prod(in_0, in_1, &out_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
             *sconn << out_0;
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __add__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             rpc::v32 in_0;
             req->m >> in_0;
             rpc::v32 in_1;
             req->m >> in_1;
             rpc::v32 out_0;
             this->add(in_0, in_1, &out_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
             *sconn << out_0;
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __nop__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             std::string in_0;
             req->m >> in_0;
             this->nop(in_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __sleep__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             double in_0;
             req->m >> in_0;
             this->sleep(in_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __ping__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            this->ping();
+            sconn->begin_reply(req, 0, rpc::marshal_size_of());
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
     void __add_later__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         rpc::i32* in_0 = new rpc::i32;
@@ -249,8 +351,50 @@ private:
         rpc::DeferredReply* __defer__ = new rpc::DeferredReply(req, sconn, __marshal_reply__, __cleanup__);
         this->add_later(*in_0, *in_1, out_0, __defer__);
     }
+    void __count_strings__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            {
+                rpc::ArenaScope __arena__(&req->arena);
+                rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>> in_0;
+                req->m >> in_0;
+                rpc::i32 out_0;
+                this->count_strings(in_0, &out_0);
+                sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+                *sconn << out_0;
+                sconn->end_reply();
+            }
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __count_strings_later__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        rpc::ArenaScope __arena__(&req->arena);
+        rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>* in_0 = req->arena.create<rpc::arena_map<rpc::arena_string, rpc::arena_vector<rpc::arena_string>>>();
+        req->m >> *in_0;
+        rpc::i32* out_0 = req->arena.create<rpc::i32>();
+        auto __marshal_reply__ = [=] {
+            *sconn << *out_0;
+        };
+        auto __cleanup__ = [=] {
+            rpc::Arena::destroy(in_0);
+            rpc::Arena::destroy(out_0);
+        };
+        rpc::DeferredReply* __defer__ = new rpc::DeferredReply(req, sconn, __marshal_reply__, __cleanup__);
+        this->count_strings_later(*in_0, out_0, __defer__);
+    }
     void __lossy_nop__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             rpc::i32 in_0;
             req->m >> in_0;
             rpc::i32 in_1;
@@ -259,13 +403,107 @@ private:
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            delete req;
+            sconn->release();
+        }
     }
     void __fast_lossy_nop__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         this->fast_lossy_nop();
         delete req;
         sconn->release();
     }
+    void __udp_echo__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            std::string in_0;
+            req->m >> in_0;
+            std::string out_0;
+            this->udp_echo(in_0, &out_0);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __upload__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        rpc::ServerStream* __stream__ = sconn->open_stream(req->xid);
+        if (__stream__ == nullptr) {
+            sconn->begin_reply(req, EINVAL);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+            return;
+        }
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            rpc::i64 out_0;
+            this->upload(&out_0, __stream__);
+            sconn->close_stream(__stream__);
+            __stream__->release();
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->close_stream(__stream__);
+            __stream__->release();
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
+    void __download__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
+        rpc::ServerStream* __stream__ = sconn->open_stream(req->xid);
+        if (__stream__ == nullptr) {
+            sconn->begin_reply(req, EINVAL);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+            return;
+        }
+        auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
+            rpc::i64 in_0;
+            req->m >> in_0;
+            rpc::i32 in_1;
+            req->m >> in_1;
+            rpc::i32 out_0;
+            this->download(in_0, in_1, &out_0, __stream__);
+            sconn->close_stream(__stream__);
+            __stream__->release();
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
+            *sconn << out_0;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        };
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->close_stream(__stream__);
+            __stream__->release();
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
+    }
 };
 
 class BenchmarkProxy {
@@ -274,7 +512,7 @@ protected:
 public:
     BenchmarkProxy(rpc::Client* cl): __cl__(cl) { }
     rpc::Future* async_fast_prime(const rpc::i32& n, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_PRIME, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_PRIME, __fu_attr__, rpc::marshal_size_of(n));
         if (__fu__ != nullptr) {
             *__cl__ << n;
         }
@@ -294,7 +532,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_fast_dot_prod(const point3& p1, const point3& p2, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_DOT_PROD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_DOT_PROD, __fu_attr__, rpc::marshal_size_of(p1, p2));
         if (__fu__ != nullptr) {
             *__cl__ << p1;
             *__cl__ << p2;
@@ -315,7 +553,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_fast_add(const rpc::v32& a, const rpc::v32& b, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_ADD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_ADD, __fu_attr__, rpc::marshal_size_of(a, b));
         if (__fu__ != nullptr) {
             *__cl__ << a;
             *__cl__ << b;
@@ -336,7 +574,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_fast_nop(const std::string& in_0, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_NOP, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::FAST_NOP, __fu_attr__, rpc::marshal_size_of(in_0));
         if (__fu__ != nullptr) {
             *__cl__ << in_0;
         }
@@ -353,7 +591,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_prime(const rpc::i32& n, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::PRIME, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::PRIME, __fu_attr__, rpc::marshal_size_of(n));
         if (__fu__ != nullptr) {
             *__cl__ << n;
         }
@@ -373,7 +611,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_dot_prod(const point3& p1, const point3& p2, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::DOT_PROD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::DOT_PROD, __fu_attr__, rpc::marshal_size_of(p1, p2));
         if (__fu__ != nullptr) {
             *__cl__ << p1;
             *__cl__ << p2;
@@ -394,7 +632,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_add(const rpc::v32& a, const rpc::v32& b, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::ADD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::ADD, __fu_attr__, rpc::marshal_size_of(a, b));
         if (__fu__ != nullptr) {
             *__cl__ << a;
             *__cl__ << b;
@@ -415,7 +653,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_nop(const std::string& in_0, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::NOP, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::NOP, __fu_attr__, rpc::marshal_size_of(in_0));
         if (__fu__ != nullptr) {
             *__cl__ << in_0;
         }
@@ -432,7 +670,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_sleep(const double& sec, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::SLEEP, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::SLEEP, __fu_attr__, rpc::marshal_size_of(sec));
         if (__fu__ != nullptr) {
             *__cl__ << sec;
         }
@@ -448,8 +686,22 @@ public:
         __fu__->release();
         return __ret__;
     }
+    rpc::Future* async_ping(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::PING, __fu_attr__, rpc::marshal_size_of());
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 ping() {
+        rpc::Future* __fu__ = this->async_ping();
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        __fu__->release();
+        return __ret__;
+    }
     rpc::Future* async_add_later(const rpc::i32& a, const rpc::i32& b, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::ADD_LATER, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::ADD_LATER, __fu_attr__, rpc::marshal_size_of(a, b));
         if (__fu__ != nullptr) {
             *__cl__ << a;
             *__cl__ << b;
@@ -469,16 +721,130 @@ public:
         __fu__->release();
         return __ret__;
     }
+    rpc::Future* async_count_strings(const std::map<std::string, std::vector<std::string>>& groups, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::COUNT_STRINGS, __fu_attr__, rpc::marshal_size_of(groups));
+        if (__fu__ != nullptr) {
+            *__cl__ << groups;
+        }
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 count_strings(const std::map<std::string, std::vector<std::string>>& groups, rpc::i32* n) {
+        rpc::Future* __fu__ = this->async_count_strings(groups);
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *n;
+        }
+        __fu__->release();
+        return __ret__;
+    }
+    rpc::Future* async_count_strings_later(const std::map<std::string, std::vector<std::string>>& groups, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::COUNT_STRINGS_LATER, __fu_attr__, rpc::marshal_size_of(groups));
+        if (__fu__ != nullptr) {
+            *__cl__ << groups;
+        }
+        __cl__->end_request();
+        return __fu__;
+    }
+    rpc::i32 count_strings_later(const std::map<std::string, std::vector<std::string>>& groups, rpc::i32* n) {
+        rpc::Future* __fu__ = this->async_count_strings_later(groups);
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *n;
+        }
+        __fu__->release();
+        return __ret__;
+    }
     int lossy_nop(const rpc::i32& dummy, const rpc::i32& dummy2) /* UDP */ {
-        __cl__->begin_udp_request(BenchmarkService::LOSSY_NOP);
+        __cl__->begin_udp_request(BenchmarkService::LOSSY_NOP, rpc::marshal_size_of(dummy, dummy2));
         __cl__->udp_request() << dummy;
         __cl__->udp_request() << dummy2;
         return __cl__->end_udp_request();
     }
     int fast_lossy_nop() /* UDP */ {
-        __cl__->begin_udp_request(BenchmarkService::FAST_LOSSY_NOP);
+        __cl__->begin_udp_request(BenchmarkService::FAST_LOSSY_NOP, rpc::marshal_size_of());
         return __cl__->end_udp_request();
     }
+    rpc::Future* async_udp_echo(const std::string& str, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) /* UDP */ {
+        size_t __args_size__ = rpc::marshal_size_of(str);
+        rpc::Future* __fu__;
+        if (rpc::Client::udp_call_fits(__args_size__)) {
+            __fu__ = __cl__->begin_udp_call(BenchmarkService::UDP_ECHO, __fu_attr__, __args_size__);
+            if (__fu__ != nullptr) {
+                __cl__->udp_request() << str;
+            }
+            __cl__->end_udp_call();
+        } else {
+            __fu__ = __cl__->begin_request(BenchmarkService::UDP_ECHO, __fu_attr__, __args_size__);
+            if (__fu__ != nullptr) {
+                *__cl__ << str;
+            }
+            __cl__->end_request();
+        }
+        return __fu__;
+    }
+    rpc::i32 udp_echo(const std::string& str, std::string* echoed) {
+        rpc::Future* __fu__ = this->async_udp_echo(str);
+        if (__fu__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *echoed;
+        }
+        __fu__->release();
+        return __ret__;
+    }
+    rpc::ClientStream* open_upload(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::UPLOAD, __fu_attr__, rpc::marshal_size_of());
+        rpc::ClientStream* __st__ = nullptr;
+        if (__fu__ != nullptr) {
+            __st__ = __cl__->open_stream(__fu__);
+        }
+        __cl__->end_request();
+        return __st__;
+    }
+    rpc::i32 finish_upload(rpc::ClientStream* __st__, rpc::i64* n_bytes) {
+        if (__st__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::Future* __fu__ = __st__->finish();
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *n_bytes;
+        }
+        __st__->release();
+        return __ret__;
+    }
+    rpc::ClientStream* open_download(const rpc::i64& n_bytes, const rpc::i32& frame_size, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
+        rpc::Future* __fu__ = __cl__->begin_request(BenchmarkService::DOWNLOAD, __fu_attr__, rpc::marshal_size_of(n_bytes, frame_size));
+        rpc::ClientStream* __st__ = nullptr;
+        if (__fu__ != nullptr) {
+            *__cl__ << n_bytes;
+            *__cl__ << frame_size;
+            __st__ = __cl__->open_stream(__fu__);
+        }
+        __cl__->end_request();
+        return __st__;
+    }
+    rpc::i32 finish_download(rpc::ClientStream* __st__, rpc::i32* n_frames) {
+        if (__st__ == nullptr) {
+            return ENOTCONN;
+        }
+        rpc::Future* __fu__ = __st__->finish();
+        rpc::i32 __ret__ = __fu__->get_error_code();
+        if (__ret__ == 0) {
+            __fu__->get_reply() >> *n_frames;
+        }
+        __st__->release();
+        return __ret__;
+    }
 };
 
 } // namespace benchmark
@@ -508,6 +874,9 @@ inline void BenchmarkService::add(const rpc::v32& a, const rpc::v32& b, rpc::v32
     a_add_b->set(a.get() + b.get());
 }
 
+inline void BenchmarkService::ping() {
+}
+
 inline void BenchmarkService::fast_nop(const std::string& str) {
     nop(str);
 }
@@ -520,5 +889,9 @@ inline void BenchmarkService::fast_lossy_nop() {
     nop("");
 }
 
+inline void BenchmarkService::udp_echo(const std::string& str, std::string* echoed) {
+    *echoed = str;
+}
+
 } // namespace benchmark
 
@@ -5,18 +5,24 @@ from simplerpc.future import Future
 point3 = Marshal.reg_type('point3', [('x', 'double'), ('y', 'double'), ('z', 'double')])
 
 class BenchmarkService(object):
-    FAST_PRIME = 0x5b9365eb
-    FAST_DOT_PROD = 0x4a92c615
-    FAST_ADD = 0x484806bf
-    FAST_NOP = 0x4f29b7a5
-    PRIME = 0x1f96b90f
-    DOT_PROD = 0x3a2fd47a
-    ADD = 0x5135fabc
-    NOP = 0x3823ed06
-    SLEEP = 0x39d768e9
-    ADD_LATER = 0x64e0a594
-    LOSSY_NOP = 0x5323ea07
-    FAST_LOSSY_NOP = 0x6223e760
+    FAST_PRIME = 0x60d74456
+    FAST_DOT_PROD = 0x30c3e230
+    FAST_ADD = 0x4964b4e8
+    FAST_NOP = 0x2074e609
+    PRIME = 0x46a16f21
+    DOT_PROD = 0x13015d45
+    ADD = 0x5bf0f350
+    NOP = 0x1ddabe0f
+    SLEEP = 0x1b251f96
+    PING = 0x2ff38679
+    ADD_LATER = 0x35f5b44d
+    COUNT_STRINGS = 0x645b88f5
+    COUNT_STRINGS_LATER = 0x4b43cec1
+    LOSSY_NOP = 0x4bcee972
+    FAST_LOSSY_NOP = 0x29a97c65
+    UDP_ECHO = 0x68851b1c
+    UPLOAD = 0x45cfe93e
+    DOWNLOAD = 0x40f2039c
 
     __input_type_info__ = {
         'fast_prime': ['rpc::i32'],
@@ -28,9 +34,15 @@ class BenchmarkService(object):
         'add': ['rpc::v32','rpc::v32'],
         'nop': ['std::string'],
         'sleep': ['double'],
+        'ping': [],
         'add_later': ['rpc::i32','rpc::i32'],
+        'count_strings': ['std::map<std::string, std::vector<std::string>>'],
+        'count_strings_later': ['std::map<std::string, std::vector<std::string>>'],
         'lossy_nop': ['rpc::i32','rpc::i32'],
         'fast_lossy_nop': [],
+        'udp_echo': ['std::string'],
+        'upload': [],
+        'download': ['rpc::i64','rpc::i32'],
     }
 
     __output_type_info__ = {
@@ -43,9 +55,15 @@ class BenchmarkService(object):
         'add': ['rpc::v32'],
         'nop': [],
         'sleep': [],
+        'ping': [],
         'add_later': ['rpc::i32'],
+        'count_strings': ['rpc::i32'],
+        'count_strings_later': ['rpc::i32'],
         'lossy_nop': [],
         'fast_lossy_nop': [],
+        'udp_echo': ['std::string'],
+        'upload': ['rpc::i64'],
+        'download': ['rpc::i32'],
     }
 
     def __bind_helper__(self, func):
@@ -63,10 +81,14 @@ class BenchmarkService(object):
         server.__reg_func__(BenchmarkService.ADD, self.__bind_helper__(self.add), ['rpc::v32','rpc::v32'], ['rpc::v32'])
         server.__reg_func__(BenchmarkService.NOP, self.__bind_helper__(self.nop), ['std::string'], [])
         server.__reg_func__(BenchmarkService.SLEEP, self.__bind_helper__(self.sleep), ['double'], [])
+        server.__reg_func__(BenchmarkService.PING, self.__bind_helper__(self.ping), [], [])
         server.__reg_func__(BenchmarkService.ADD_LATER, self.__bind_helper__(self.add_later), ['rpc::i32','rpc::i32'], ['rpc::i32'])
+        server.__reg_func__(BenchmarkService.COUNT_STRINGS, self.__bind_helper__(self.count_strings), ['std::map<std::string, std::vector<std::string>>'], ['rpc::i32'])
+        server.__reg_func__(BenchmarkService.COUNT_STRINGS_LATER, self.__bind_helper__(self.count_strings_later), ['std::map<std::string, std::vector<std::string>>'], ['rpc::i32'])
         server.enable_udp()
         server.__reg_func__(BenchmarkService.LOSSY_NOP, self.__bind_helper__(self.lossy_nop), ['rpc::i32','rpc::i32'], [])
         server.__reg_func__(BenchmarkService.FAST_LOSSY_NOP, self.__bind_helper__(self.fast_lossy_nop), [], [])
+        server.__reg_func__(BenchmarkService.UDP_ECHO, self.__bind_helper__(self.udp_echo), ['std::string'], ['std::string'])
 
     def fast_prime(__self__, n):
         raise NotImplementedError('subclass BenchmarkService and implement your own fast_prime function')
@@ -95,15 +117,27 @@ class BenchmarkService(object):
     def sleep(__self__, sec):
         raise NotImplementedError('subclass BenchmarkService and implement your own sleep function')
 
+    def ping(__self__):
+        raise NotImplementedError('subclass BenchmarkService and implement your own ping function')
+
     def add_later(__self__, a, b):
         raise NotImplementedError('subclass BenchmarkService and implement your own add_later function')
 
+    def count_strings(__self__, groups):
+        raise NotImplementedError('subclass BenchmarkService and implement your own count_strings function')
+
+    def count_strings_later(__self__, groups):
+        raise NotImplementedError('subclass BenchmarkService and implement your own count_strings_later function')
+
     def lossy_nop(__self__, dummy, dummy2):
         raise NotImplementedError('subclass BenchmarkService and implement your own lossy_nop function')
 
     def fast_lossy_nop(__self__):
         raise NotImplementedError('subclass BenchmarkService and implement your own fast_lossy_nop function')
 
+    def udp_echo(__self__, str):
+        raise NotImplementedError('subclass BenchmarkService and implement your own udp_echo function')
+
 class BenchmarkProxy(object):
     def __init__(self, clnt):
         self.__clnt__ = clnt
@@ -135,9 +169,21 @@ class BenchmarkProxy(object):
     def async_sleep(__self__, sec):
         return __self__.__clnt__.async_call(BenchmarkService.SLEEP, [sec], BenchmarkService.__input_type_info__['sleep'], BenchmarkService.__output_type_info__['sleep'])
 
+    def async_ping(__self__):
+        return __self__.__clnt__.async_call(BenchmarkService.PING, [], BenchmarkService.__input_type_info__['ping'], BenchmarkService.__output_type_info__['ping'])
+
     def async_add_later(__self__, a, b):
         return __self__.__clnt__.async_call(BenchmarkService.ADD_LATER, [a, b], BenchmarkService.__input_type_info__['add_later'], BenchmarkService.__output_type_info__['add_later'])
 
+    def async_count_strings(__self__, groups):
+        return __self__.__clnt__.async_call(BenchmarkService.COUNT_STRINGS, [groups], BenchmarkService.__input_type_info__['count_strings'], BenchmarkService.__output_type_info__['count_strings'])
+
+    def async_count_strings_later(__self__, groups):
+        return __self__.__clnt__.async_call(BenchmarkService.COUNT_STRINGS_LATER, [groups], BenchmarkService.__input_type_info__['count_strings_later'], BenchmarkService.__output_type_info__['count_strings_later'])
+
+    def async_udp_echo(__self__, str):
+        return __self__.__clnt__.async_call(BenchmarkService.UDP_ECHO, [str], BenchmarkService.__input_type_info__['udp_echo'], BenchmarkService.__output_type_info__['udp_echo'])
+
     def sync_fast_prime(__self__, n):
         __result__ = __self__.__clnt__.sync_call(BenchmarkService.FAST_PRIME, [n], BenchmarkService.__input_type_info__['fast_prime'], BenchmarkService.__output_type_info__['fast_prime'])
         if __result__[0] != 0:
@@ -219,6 +265,15 @@ class BenchmarkProxy(object):
         elif len(__result__[1]) > 1:
             return __result__[1]
 
+    def sync_ping(__self__):
+        __result__ = __self__.__clnt__.sync_call(BenchmarkService.PING, [], BenchmarkService.__input_type_info__['ping'], BenchmarkService.__output_type_info__['ping'])
+        if __result__[0] != 0:
+            raise Exception("RPC returned non-zero error code %d: %s" % (__result__[0], os.strerror(__result__[0])))
+        if len(__result__[1]) == 1:
+            return __result__[1][0]
+        elif len(__result__[1]) > 1:
+            return __result__[1]
+
     def sync_add_later(__self__, a, b):
         __result__ = __self__.__clnt__.sync_call(BenchmarkService.ADD_LATER, [a, b], BenchmarkService.__input_type_info__['add_later'], BenchmarkService.__output_type_info__['add_later'])
         if __result__[0] != 0:
@@ -228,6 +283,33 @@ class BenchmarkProxy(object):
         elif len(__result__[1]) > 1:
             return __result__[1]
 
+    def sync_count_strings(__self__, groups):
+        __result__ = __self__.__clnt__.sync_call(BenchmarkService.COUNT_STRINGS, [groups], BenchmarkService.__input_type_info__['count_strings'], BenchmarkService.__output_type_info__['count_strings'])
+        if __result__[0] != 0:
+            raise Exception("RPC returned non-zero error code %d: %s" % (__result__[0], os.strerror(__result__[0])))
+        if len(__result__[1]) == 1:
+            return __result__[1][0]
+        elif len(__result__[1]) > 1:
+            return __result__[1]
+
+    def sync_count_strings_later(__self__, groups):
+        __result__ = __self__.__clnt__.sync_call(BenchmarkService.COUNT_STRINGS_LATER, [groups], BenchmarkService.__input_type_info__['count_strings_later'], BenchmarkService.__output_type_info__['count_strings_later'])
+        if __result__[0] != 0:
+            raise Exception("RPC returned non-zero error code %d: %s" % (__result__[0], os.strerror(__result__[0])))
+        if len(__result__[1]) == 1:
+            return __result__[1][0]
+        elif len(__result__[1]) > 1:
+            return __result__[1]
+
+    def sync_udp_echo(__self__, str):
+        __result__ = __self__.__clnt__.sync_call(BenchmarkService.UDP_ECHO, [str], BenchmarkService.__input_type_info__['udp_echo'], BenchmarkService.__output_type_info__['udp_echo'])
+        if __result__[0] != 0:
+            raise Exception("RPC returned non-zero error code %d: %s" % (__result__[0], os.strerror(__result__[0])))
+        if len(__result__[1]) == 1:
+            return __result__[1][0]
+        elif len(__result__[1]) > 1:
+            return __result__[1]
+
     def udp_lossy_nop(__self__, dummy, dummy2):
         return __self__.__clnt__.udp_call(BenchmarkService.LOSSY_NOP, [dummy, dummy2], BenchmarkService.__input_type_info__['lossy_nop'])
 
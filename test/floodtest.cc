@@ -82,20 +82,16 @@ static void* flood_loop(void* args) {
             Log::debug("server list empty, will retry later");
             sleep(1);
         } else {
-            vector<Future*> fu_list;
+            ScatterGather sg;
             for (auto& addr : nodes) {
-                Client* clnt = client_pool->get_client(addr);
-                FloodProxy proxy(clnt);
-                Future* fu = proxy.async_flood();
-                if (fu != nullptr) {
-                    fu_list.push_back(fu);
+                bool ok = sg.add(client_pool->get_client(addr), [] (Client* clnt, const FutureAttr& attr) {
+                    return FloodProxy(clnt).async_flood(attr);
+                });
+                if (ok) {
                     rpc_count++;
                 }
             }
-            for (auto& fu: fu_list) {
-                fu->wait();
-                Future::safe_release(fu);
-            }
+            sg.wait_all();
             if (tm.elapsed() > 0.4) {
                 Log::debug("RPC done: %d", rpc_count);
                 RLog::aggregate_qps("flood", rpc_count);
@@ -11,9 +11,9 @@ namespace floodtest {
 class FloodService: public rpc::Service {
 public:
     enum {
-        UPDATE_NODE_LIST = 0x43102c1b,
-        FLOOD = 0x4c64a660,
-        FLOOD_UDP = 0x632a2de2,
+        UPDATE_NODE_LIST = 0x173a2266,
+        FLOOD = 0x36004003,
+        FLOOD_UDP = 0x525eeb91,
     };
     int __reg_to__(rpc::Server* svr) {
         int ret = 0;
@@ -35,7 +35,7 @@ public:
         return ret;
     }
     // these RPC handler functions need to be implemented by user
-    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
     virtual void update_node_list(const std::vector<std::string>& nodes);
     virtual void flood();
     virtual void flood_udp();
@@ -44,14 +44,14 @@ private:
         std::vector<std::string> in_0;
         req->m >> in_0;
         this->update_node_list(in_0);
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of());
         sconn->end_reply();
         delete req;
         sconn->release();
     }
     void __flood__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         this->flood();
-        sconn->begin_reply(req);
+        sconn->begin_reply(req, 0, rpc::marshal_size_of());
         sconn->end_reply();
         delete req;
         sconn->release();
@@ -69,7 +69,7 @@ protected:
 public:
     FloodProxy(rpc::Client* cl): __cl__(cl) { }
     rpc::Future* async_update_node_list(const std::vector<std::string>& nodes, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(FloodService::UPDATE_NODE_LIST, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(FloodService::UPDATE_NODE_LIST, __fu_attr__, rpc::marshal_size_of(nodes));
         if (__fu__ != nullptr) {
             *__cl__ << nodes;
         }
@@ -86,7 +86,7 @@ public:
         return __ret__;
     }
     rpc::Future* async_flood(const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(FloodService::FLOOD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(FloodService::FLOOD, __fu_attr__, rpc::marshal_size_of());
         __cl__->end_request();
         return __fu__;
     }
@@ -100,7 +100,7 @@ public:
         return __ret__;
     }
     int flood_udp() /* UDP */ {
-        __cl__->begin_udp_request(FloodService::FLOOD_UDP);
+        __cl__->begin_udp_request(FloodService::FLOOD_UDP, rpc::marshal_size_of());
         return __cl__->end_udp_request();
     }
 };
@@ -3,9 +3,9 @@ from simplerpc.marshal import Marshal
 from simplerpc.future import Future
 
 class FloodService(object):
-    UPDATE_NODE_LIST = 0x43102c1b
-    FLOOD = 0x4c64a660
-    FLOOD_UDP = 0x632a2de2
+    UPDATE_NODE_LIST = 0x173a2266
+    FLOOD = 0x36004003
+    FLOOD_UDP = 0x525eeb91
 
     __input_type_info__ = {
         'update_node_list': ['std::vector<std::string>'],
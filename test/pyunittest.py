@@ -68,6 +68,17 @@ class TestMarshal(TestCase):
         m.write_obj(comp, "complex_struct")
         print m.read_obj("complex_struct")
 
+    def test_versioned_struct(self):
+        m = simplerpc.Marshal()
+        p2 = PersonV2(id=1, name="hello", email="world", phone=8848, tags=["a", "b"])
+        m.write_obj(p2, "PersonV2")
+        p1 = m.read_obj("PersonV1")
+        assert len(m) == 0
+        assert p1 == PersonV1(id=1, name="hello", email="world")
+        m.write_obj(p1, "PersonV1")
+        assert m.read_obj("PersonV2") == PersonV2(id=1, name="hello", email="world", phone=0, tags=[])
+        assert len(m) == 0
+
 class TestUtils(TestCase):
     def test_marshal_wrap(self):
         from simplerpc.server import MarshalWrap
@@ -5,10 +5,12 @@
 #include <semaphore.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
 
 #include "rpc/client.h"
 #include "rpc/server.h"
+#include "rpc/metrics.h"
 #include "benchmark_service.h"
 
 using namespace benchmark;
@@ -23,6 +25,10 @@ int seconds = 10;
 int outgoing_requests = 1000;
 int client_threads = 8;
 int worker_threads = 16;
+int compress_threshold = 0;
+int udp_batch = 0;
+bool busy_poll = false;
+bool latency = false;
 
 static string request_str;
 PollMgr* poll;
@@ -30,6 +36,10 @@ ThreadPool* thrpool;
 
 Counter req_counter;
 
+// round trips of latency mode, merged from each client thread
+Histogram rtt_hist;
+SpinLock rtt_hist_l;
+
 bool should_stop = false;
 
 pthread_mutex_t g_stop_mutex;
@@ -58,9 +68,19 @@ static void* stat_proc(void*) {
     return nullptr;
 }
 
+// cpu time of the whole process, to weigh throughput against (e.g. compression) cost
+static double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0 / 1000.0;
+}
+
 static void* client_proc(void*) {
     Client* cl = new Client(poll);
     verify(cl->connect(svr_addr) == 0);
+    if (compress_threshold > 0) {
+        verify(cl->enable_compression(compress_threshold) == 0);
+    }
     i32 rpc_id;
     if (fast_requests) {
         rpc_id = BenchmarkService::FAST_NOP;
@@ -99,6 +119,68 @@ static void* client_proc(void*) {
     return nullptr;
 }
 
+// one call at a time per thread, timing each round trip
+static void* latency_client_proc(void*) {
+    Client* cl = new Client(poll);
+    verify(cl->connect(svr_addr) == 0);
+    i32 rpc_id = fast_requests ? BenchmarkService::FAST_NOP : BenchmarkService::NOP;
+    Histogram hist;
+    while (!should_stop) {
+        double start = base::monotonic_time();
+        Future* fu = cl->begin_request(rpc_id);
+        *cl << request_str;
+        cl->end_request();
+        if (fu == nullptr || fu->get_error_code() != 0) {
+            Future::safe_release(fu);
+            break;
+        }
+        fu->release();
+        hist.record((i64) ((base::monotonic_time() - start) * 1000 * 1000 * 1000));
+        req_counter.next();
+    }
+    rtt_hist_l.lock();
+    rtt_hist.merge(hist);
+    rtt_hist_l.unlock();
+
+    cl->close_and_release();
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+// lossy_nop over udp, udp_batch datagrams per sendmmsg()
+static void* udp_client_proc(void*) {
+    Client* cl = new Client(poll);
+    verify(cl->connect(svr_addr) == 0);
+    BenchmarkProxy proxy(cl);
+    while (!should_stop) {
+        cl->begin_udp_batch();
+        for (int i = 0; i < udp_batch; i++) {
+            if (fast_requests) {
+                proxy.fast_lossy_nop();
+            } else {
+                proxy.lossy_nop(1987, 1989);
+            }
+        }
+        cl->end_udp_batch();
+        req_counter.next(udp_batch);
+    }
+
+    cl->close_and_release();
+    pthread_exit(nullptr);
+    return nullptr;
+}
+
+// counts udp requests that made it to the server
+class UdpCountingService: public BenchmarkService {
+public:
+    void lossy_nop(const i32& dummy, const i32& dummy2) {
+        req_counter.next();
+    }
+    void fast_lossy_nop() {
+        req_counter.next();
+    }
+};
+
 int main(int argc, char **argv) {
     signal(SIGPIPE, SIG_IGN);
     signal(SIGHUP, SIG_IGN);
@@ -112,15 +194,19 @@ int main(int argc, char **argv) {
         printf("                -b    byte_size         (client only)\n");
         printf("                -e    epoll_instances\n");
         printf("                -f    fast_requests     (client only)\n");
+        printf("                -l    latency, sync calls and their p50/p99 round trip (client only)\n");
         printf("                -n    seconds           (client only)\n");
         printf("                -o    outgoing_requests (clinet only)\n");
+        printf("                -p    busy polling, poll threads and waits spin\n");
         printf("                -t    client_threads    (client only)\n");
         printf("                -w    worker_threads    (server only)\n");
+        printf("                -u    udp_batch         (lossy_nop over udp, datagrams per sendmmsg)\n");
+        printf("                -z    compress_threshold (client only)\n");
         exit(1);
     }
 
     char ch = 0;
-    while ((ch = getopt(argc, argv, "c:s:b:e:fn:o:t:w:"))!= -1) {
+    while ((ch = getopt(argc, argv, "c:s:b:e:fln:o:pt:u:w:z:"))!= -1) {
         switch (ch) {
         case 'c':
             is_client = true;
@@ -139,18 +225,30 @@ int main(int argc, char **argv) {
         case 'f':
             fast_requests = true;
             break;
+        case 'l':
+            latency = true;
+            break;
         case 'n':
             seconds = atoi(optarg);
             break;
         case 'o':
             outgoing_requests = atoi(optarg);
             break;
+        case 'p':
+            busy_poll = true;
+            break;
         case 't':
             client_threads = atoi(optarg);
             break;
+        case 'u':
+            udp_batch = atoi(optarg);
+            break;
         case 'w':
             worker_threads = atoi(optarg);
             break;
+        case 'z':
+            compress_threshold = atoi(optarg);
+            break;
         default:
             break;
         }
@@ -163,22 +261,32 @@ int main(int argc, char **argv) {
         Log::info("packet byte size:        %d", byte_size);
     }
     Log::info("epoll instances:         %d", epoll_instances);
+    Log::info("busy polling:            %s", busy_poll ? "true" : "false");
     if (is_client) {
         Log::info("fast reqeust:            %s", fast_requests ? "true" : "false");
         Log::info("running seconds:         %d", seconds);
         Log::info("outgoing requests:       %d", outgoing_requests);
         Log::info("client threads:          %d", client_threads);
+        Log::info("compress threshold:      %d", compress_threshold);
+        Log::info("udp batch:               %d", udp_batch);
+        Log::info("latency:                 %s", latency ? "true" : "false");
     } else {
         Log::info("worker threads:          %d", worker_threads);
     }
 
     request_str = string(byte_size, 'x');
     poll = new PollMgr(epoll_instances);
+    if (busy_poll) {
+        poll->set_busy_poll(true);
+    }
     thrpool = new ThreadPool(worker_threads);
     if (is_server) {
-        BenchmarkService svc;
+        UdpCountingService svc;
         Server svr(poll, thrpool);
         svr.reg(&svc);
+        if (udp_batch > 0) {
+            svr.enable_udp();
+        }
         verify(svr.start(svr_addr) == 0);
 
         Pthread_mutex_init(&g_stop_mutex, nullptr);
@@ -198,11 +306,21 @@ int main(int argc, char **argv) {
             Pthread_cond_wait(&g_stop_cond, &g_stop_mutex);
         }
         Pthread_mutex_unlock(&g_stop_mutex);
+        Log::info("server cpu time: %.2lf sec", cpu_seconds());
+        if (udp_batch > 0) {
+            Log::info("udp requests received: %ld", req_counter.peek_next());
+        }
 
     } else {
         pthread_t* client_th = new pthread_t[client_threads];
         for (int i = 0; i < client_threads; i++) {
-            Pthread_create(&client_th[i], nullptr, client_proc, nullptr);
+            void* (*proc)(void*) = client_proc;
+            if (udp_batch > 0) {
+                proc = udp_client_proc;
+            } else if (latency) {
+                proc = latency_client_proc;
+            }
+            Pthread_create(&client_th[i], nullptr, proc, nullptr);
         }
         pthread_t stat_th;
         Pthread_create(&stat_th, nullptr, stat_proc, nullptr);
@@ -211,6 +329,17 @@ int main(int argc, char **argv) {
             Pthread_join(client_th[i], nullptr);
         }
         delete[] client_th;
+
+        i64 n_requests = req_counter.peek_next();
+        double cpu_sec = cpu_seconds();
+        Log::info("requests: %ld, payload: %.2lf MB/s, client cpu time: %.2lf sec (%.2lf us per request)",
+                  n_requests, (double) n_requests * byte_size / seconds / 1024 / 1024,
+                  cpu_sec, cpu_sec * 1000 * 1000 / std::max(n_requests, (i64) 1));
+        if (latency) {
+            Log::info("round trip: p50 %.1lf us, p99 %.1lf us, max %.1lf us (%s polling)",
+                      rtt_hist.percentile(50) / 1000.0, rtt_hist.percentile(99) / 1000.0,
+                      rtt_hist.max() / 1000.0, busy_poll ? "busy" : "blocking");
+        }
     }
 
     poll->release();
@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(admission, max_queued) {
+    ThreadPool* thrpool = new ThreadPool(1);
+    thrpool->set_max_queued(4);
+
+    // keep the only worker busy
+    volatile bool blocked = true;
+    EXPECT_EQ(thrpool->run_async([&blocked] {
+        while (blocked) {
+            usleep(1000);
+        }
+    }), 0);
+    while (thrpool->queued() > 0) {
+        usleep(1000);
+    }
+
+    SpinLock order_l;
+    vector<int> order;
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(thrpool->run_async([i, &order, &order_l] {
+            ScopedLock sl(order_l);
+            order.push_back(i);
+        }), 0);
+    }
+    EXPECT_EQ(thrpool->run_async([] { }), EBUSY);
+    EXPECT_EQ(thrpool->queued(), 4);
+
+    // high priority bypasses the limit, and runs first
+    EXPECT_EQ(thrpool->run_async([&order, &order_l] {
+        ScopedLock sl(order_l);
+        order.push_back(-1);
+    }, -1, ThreadPool::PRIORITY_HIGH), 0);
+
+    usleep(10 * 1000);
+    blocked = false;
+    while (thrpool->queued() > 0) {
+        usleep(1000);
+    }
+    usleep(10 * 1000);
+    order_l.lock();
+    EXPECT_EQ(order.size(), 5u);
+    EXPECT_EQ(order[0], -1);
+    order_l.unlock();
+
+    ThreadPool::QueueStats st = thrpool->stats();
+    Log::info("started=%ld rejected=%ld total_wait=%.3lf max_wait=%.3lf",
+              st.started, st.rejected, st.total_wait, st.max_wait);
+    EXPECT_EQ(st.queued, 0);
+    EXPECT_EQ(st.started, 6);
+    EXPECT_EQ(st.rejected, 1);
+    EXPECT_GT(st.max_wait, 0.005);
+    EXPECT_EQ(thrpool->stats().max_wait, 0.0);
+
+    thrpool->release();
+}
+
+TEST(admission, queue_delay) {
+    ThreadPool* thrpool = new ThreadPool(1);
+    thrpool->set_queue_delay_target(0.005, 0.02);
+
+    // each job takes 10ms, later ones keep waiting way longer than 5ms
+    for (int i = 0; i < 20; i++) {
+        EXPECT_EQ(thrpool->run_async([] {
+            usleep(10 * 1000);
+        }), 0);
+    }
+    Timer t;
+    t.start();
+    while (!thrpool->stats().overloaded && t.elapsed() < 1.0) {
+        usleep(1000);
+    }
+    EXPECT_TRUE(thrpool->stats().overloaded);
+    EXPECT_EQ(thrpool->run_async([] { }), EBUSY);
+    EXPECT_EQ(thrpool->run_async([] { }, -1, ThreadPool::PRIORITY_HIGH), 0);
+
+    // recovers once the backlog is gone
+    while (thrpool->queued() > 0) {
+        usleep(1000);
+    }
+    // the last job still runs for up to 10ms, then the worker finds nothing left
+    t.reset();
+    t.start();
+    while (thrpool->stats().overloaded && t.elapsed() < 1.0) {
+        usleep(1000);
+    }
+    EXPECT_FALSE(thrpool->stats().overloaded);
+    EXPECT_EQ(thrpool->run_async([] { }), 0);
+
+    thrpool->release();
+}
+
+TEST(admission, rpc) {
+    ThreadPool* thrpool = new ThreadPool(1);
+    thrpool->set_max_queued(2);
+    Server* svr = new Server(nullptr, thrpool);
+    svr->set_priority(BenchmarkService::ADD, ThreadPool::PRIORITY_HIGH);
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    BenchmarkProxy* clnt = new BenchmarkProxy(cl);
+
+    // one running, two queued
+    FutureGroup fg;
+    fg.add(clnt->async_sleep(0.2));
+    while (thrpool->stats().started < 1) {
+        usleep(1000);
+    }
+    fg.add(clnt->async_sleep(0.1));
+    fg.add(clnt->async_sleep(0.1));
+    while (thrpool->queued() < 2) {
+        usleep(1000);
+    }
+
+    // bulk work is turned down right away
+    i8 flag = 0;
+    Timer t;
+    t.start();
+    EXPECT_EQ(clnt->prime(1987, &flag), EBUSY);
+    t.stop();
+    EXPECT_LT(t.elapsed(), 0.1);
+
+    // health checks skip the queue
+    v32 sum;
+    EXPECT_EQ(clnt->add(1, 2, &sum), 0);
+    EXPECT_EQ(sum.get(), 3);
+
+    fg.wait_all();
+    EXPECT_EQ(clnt->prime(1987, &flag), 0);
+    EXPECT_EQ(flag, 1);
+    EXPECT_EQ(thrpool->stats().rejected, 1);
+
+    delete clnt;
+    cl->close_and_release();
+    delete svr;
+    thrpool->release();
+    clnt_poll->release();
+}
+
+TEST(admission, high_priority_preempts) {
+    ThreadPool* thrpool = new ThreadPool(2);
+
+    // worker of channel 0 is stuck, worker of channel 1 is busy for a while
+    volatile bool blocked = true;
+    EXPECT_EQ(thrpool->run_async([&blocked] {
+        while (blocked) {
+            usleep(1000);
+        }
+    }, 0), 0);
+    EXPECT_EQ(thrpool->run_async([] {
+        usleep(20 * 1000);
+    }, 1), 0);
+    while (thrpool->queued() > 0) {
+        usleep(1000);
+    }
+
+    SpinLock order_l;
+    vector<int> order;
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(thrpool->run_async([i, &order, &order_l] {
+            ScopedLock sl(order_l);
+            order.push_back(i);
+        }, 1, i % 2 == 0 ? ThreadPool::PRIORITY_LOW : ThreadPool::PRIORITY_NORMAL), 0);
+    }
+    // queued behind the stuck worker, still goes before the other worker's own jobs
+    EXPECT_EQ(thrpool->run_async([&order, &order_l] {
+        ScopedLock sl(order_l);
+        order.push_back(-1);
+    }, 0, ThreadPool::PRIORITY_HIGH), 0);
+
+    Timer t;
+    t.start();
+    while (thrpool->queued() > 0 && t.elapsed() < 1.0) {
+        usleep(1000);
+    }
+    usleep(10 * 1000);
+    order_l.lock();
+    EXPECT_EQ(order.size(), 5u);
+    if (order.size() == 5u) {
+        // high, then normal, then low
+        EXPECT_EQ(order[0], -1);
+        EXPECT_EQ(order[1], 1);
+        EXPECT_EQ(order[2], 3);
+        EXPECT_EQ(order[3], 0);
+        EXPECT_EQ(order[4], 2);
+    }
+    order_l.unlock();
+
+    blocked = false;
+    thrpool->release();
+}
+
+TEST(admission, rpc_priority) {
+    ThreadPool* thrpool = new ThreadPool(1);
+    Server* svr = new Server(nullptr, thrpool);
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    BenchmarkProxy* clnt = new BenchmarkProxy(cl);
+
+    // bulk work piling up
+    FutureGroup fg;
+    for (int i = 0; i < 10; i++) {
+        fg.add(clnt->async_sleep(0.05));
+    }
+    while (thrpool->stats().started < 1) {
+        usleep(1000);
+    }
+
+    // 'high' ping only waits for the running sleep
+    Timer t;
+    t.start();
+    EXPECT_EQ(clnt->ping(), 0);
+    t.stop();
+    Log::info("ping took %.3lf sec behind 10 sleep(0.05)", t.elapsed());
+    EXPECT_LT(t.elapsed(), 0.2);
+    fg.wait_all();
+
+    delete clnt;
+    cl->close_and_release();
+    delete svr;
+    thrpool->release();
+    clnt_poll->release();
+}
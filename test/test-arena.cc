@@ -0,0 +1,97 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(arena, allocate) {
+    Arena arena;
+    EXPECT_EQ(arena.bytes_allocated(), 0u);
+    char* p1 = (char *) arena.allocate(10, 1);
+    i64* p2 = (i64 *) arena.allocate(sizeof(i64), alignof(i64));
+    EXPECT_EQ((uintptr_t) p2 % alignof(i64), 0u);
+    EXPECT_TRUE(p1 + 10 <= (char *) p2);
+    EXPECT_EQ(arena.bytes_allocated(), Arena::min_block_size);
+
+    // larger than a block
+    arena.allocate(Arena::min_block_size * 3);
+    EXPECT_GT(arena.bytes_allocated(), Arena::min_block_size * 3);
+
+    arena.reset();
+    EXPECT_EQ(arena.bytes_allocated(), 0u);
+}
+
+TEST(arena, unmarshal_containers) {
+    map<string, vector<string>> groups;
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 10; j++) {
+            groups["group-" + std::to_string(i)].push_back("a string long enough to skip small string optimization");
+        }
+    }
+    Marshal m;
+    m << groups;
+
+    Arena arena;
+    {
+        ArenaScope scope(&arena);
+        arena_map<arena_string, arena_vector<arena_string>> arena_groups;
+        m >> arena_groups;
+        EXPECT_EQ(arena_groups.size(), groups.size());
+        EXPECT_EQ(arena_groups["group-42"].size(), 10u);
+        EXPECT_EQ(arena_groups["group-42"][0].get_allocator().arena(), &arena);
+        EXPECT_TRUE(arena_groups["group-42"][0] == groups["group-42"][0].c_str());
+
+        // marshals back to the same bytes
+        m << arena_groups;
+        map<string, vector<string>> groups2;
+        m >> groups2;
+        EXPECT_TRUE(groups2 == groups);
+    }
+    EXPECT_EQ(Arena::current(), (Arena *) nullptr);
+    EXPECT_GT(arena.bytes_allocated(), 0u);
+
+    // outside of any scope, falls back to heap
+    arena_string s("heap allocated string, not in any arena at all");
+    EXPECT_EQ(s.get_allocator().arena(), (Arena *) nullptr);
+}
+
+TEST(arena, rpc) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    ClientPool* clnt_pool = new ClientPool(clnt_poll);
+    BenchmarkProxy* clnt = new BenchmarkProxy(clnt_pool->get_client(svr_addr));
+
+    map<string, vector<string>> groups;
+    for (int i = 0; i < 100; i++) {
+        groups[std::to_string(i)] = vector<string>(i, "x");
+    }
+    i32 n = 0;
+    EXPECT_EQ(clnt->count_strings(groups, &n), 0);
+    EXPECT_EQ(n, 99 * 100 / 2);
+    n = 0;
+    EXPECT_EQ(clnt->count_strings_later(groups, &n), 0);
+    EXPECT_EQ(n, 99 * 100 / 2);
+
+    Timer t;
+    const int n_rounds = 1000;
+    t.start();
+    for (int i = 0; i < n_rounds; i++) {
+        clnt->count_strings(groups, &n);
+    }
+    t.stop();
+    Log::info("count_strings (arena) qps: %.0lf", n_rounds / t.elapsed());
+
+    delete clnt;
+    delete clnt_pool;
+    delete svr;
+    clnt_poll->release();
+}
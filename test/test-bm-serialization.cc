@@ -31,3 +31,56 @@ TEST(bm_serialization, person) {
     LOG_INFO("elapsed = %.3lf sec", elapsed);
     LOG_INFO("qps = %.3lf Mop/s", n_rounds / elapsed / 1000.0 / 1000.0);
 }
+
+TEST(bm_serialization, person_versioned) {
+    PersonV1 person;
+    person.id = 1;
+    person.name = "hello world";
+    person.email = "big boss";
+
+    Marshal m;
+
+    struct timeval time_begin, time_end;
+
+    const int n_rounds = 1000 * 1000;
+    gettimeofday(&time_begin, nullptr);
+    for (int i = 0; i < n_rounds; i++) {
+        m << person;
+        m >> person;
+    }
+    gettimeofday(&time_end, nullptr);
+
+    double elapsed = time_end.tv_sec - time_begin.tv_sec + (time_end.tv_usec - time_begin.tv_usec) / 1000.0 / 1000.0;
+    LOG_INFO << "rounds = " << n_rounds;
+    LOG_INFO("elapsed = %.3lf sec", elapsed);
+    LOG_INFO("qps = %.3lf Mop/s", n_rounds / elapsed / 1000.0 / 1000.0);
+}
+
+TEST(bm_serialization, person_versioned_skip_fields) {
+    PersonV2 person2;
+    person2.id = 1;
+    person2.name = "hello world";
+    person2.email = "big boss";
+    person2.phone = 1987;
+    person2.tags.push_back("simple");
+    person2.tags.push_back("rpc");
+    PersonV1 person1;
+
+    Marshal m;
+
+    struct timeval time_begin, time_end;
+
+    // newer writer, older reader
+    const int n_rounds = 1000 * 1000;
+    gettimeofday(&time_begin, nullptr);
+    for (int i = 0; i < n_rounds; i++) {
+        m << person2;
+        m >> person1;
+    }
+    gettimeofday(&time_end, nullptr);
+
+    double elapsed = time_end.tv_sec - time_begin.tv_sec + (time_end.tv_usec - time_begin.tv_usec) / 1000.0 / 1000.0;
+    LOG_INFO << "rounds = " << n_rounds;
+    LOG_INFO("elapsed = %.3lf sec", elapsed);
+    LOG_INFO("qps = %.3lf Mop/s", n_rounds / elapsed / 1000.0 / 1000.0);
+}
@@ -0,0 +1,205 @@
+#include <string.h>
+
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+static bool roundtrip(const string& src) {
+    string block(lz_compress_bound(src.size()), '\0');
+    size_t block_size = lz_compress(src.data(), src.size(), &block[0], block.size());
+    if (block_size == 0) {
+        return false;
+    }
+    string dst(src.size(), '\0');
+    return lz_decompress(block.data(), block_size, &dst[0], dst.size()) == (ssize_t) src.size() && dst == src;
+}
+
+TEST(compress, lz_roundtrip) {
+    EXPECT_TRUE(roundtrip(""));
+    EXPECT_TRUE(roundtrip("a"));
+    EXPECT_TRUE(roundtrip("hello, world"));
+    EXPECT_TRUE(roundtrip(string(100000, 'x')));
+
+    string text;
+    for (int i = 0; i < 10000; i++) {
+        text += "request " + std::to_string(i) + " from rack " + std::to_string(i % 7) + "; ";
+    }
+    EXPECT_TRUE(roundtrip(text));
+    string block(lz_compress_bound(text.size()), '\0');
+    size_t block_size = lz_compress(text.data(), text.size(), &block[0], block.size());
+    Log::info("compressed %ld bytes of text into %ld bytes", text.size(), block_size);
+    EXPECT_LT(block_size, text.size() / 3);
+
+    string random(100000, '\0');
+    for (size_t i = 0; i < random.size(); i++) {
+        random[i] = (char) rand();
+    }
+    EXPECT_TRUE(roundtrip(random));
+
+    // dst too small
+    EXPECT_EQ(lz_compress(random.data(), random.size(), &block[0], 100), 0u);
+}
+
+TEST(compress, lz_corrupted) {
+    string src(10000, 'x');
+    string block(lz_compress_bound(src.size()), '\0');
+    size_t block_size = lz_compress(src.data(), src.size(), &block[0], block.size());
+    string dst(src.size(), '\0');
+
+    // truncated
+    EXPECT_EQ(lz_decompress(block.data(), block_size - 1, &dst[0], dst.size()), -1);
+    // output too small
+    EXPECT_EQ(lz_decompress(block.data(), block_size, &dst[0], dst.size() - 1), -1);
+    // match pointing before the start
+    const char bad[] = { 0x10, 'x', 0x05, 0x00 };
+    EXPECT_EQ(lz_decompress(bad, sizeof(bad), &dst[0], dst.size()), -1);
+}
+
+TEST(compress, write_packet) {
+    Marshal small;
+    small << string(10, 'x');
+    Marshal out;
+    write_packet(&out, small, 1024);
+    i32 size;
+    out >> size;
+    EXPECT_EQ(size, 11);
+    out.discard(size);
+
+    Marshal large;
+    large << string(100000, 'x') << v64(1987);
+    size_t raw_size = large.content_size();
+    write_packet(&out, large, 1024);
+    out >> size;
+    EXPECT_TRUE(size & PACKET_COMPRESSED);
+    EXPECT_LT(size & PACKET_SIZE_MASK, 1024);
+    Marshal unpacked;
+    EXPECT_EQ(read_compressed_packet(out, size & PACKET_SIZE_MASK, &unpacked), (ssize_t) raw_size);
+    EXPECT_TRUE(out.empty());
+    string s;
+    v64 v;
+    unpacked >> s >> v;
+    EXPECT_TRUE(s == string(100000, 'x'));
+    EXPECT_EQ(v.get(), 1987);
+}
+
+TEST(compress, bad_packet) {
+    // shorter than its header
+    Marshal m;
+    m << v32(100) << string(10, 'x');
+    Marshal unpacked;
+    EXPECT_EQ(read_compressed_packet(m, 0, &unpacked), -1);
+
+    // ends in the middle of the raw size
+    Marshal m1;
+    m1 << (i8) 0xF0;
+    EXPECT_EQ(read_compressed_packet(m1, m1.content_size(), &unpacked), -1);
+
+    // raw size longer than an i32
+    Marshal m3;
+    m3 << (i8) 0xFE << string(16, 'x');
+    EXPECT_EQ(read_compressed_packet(m3, m3.content_size(), &unpacked), -1);
+
+    // expands more than the lz format can
+    Marshal m2;
+    m2 << v32(1024 * 1024 * 1024 - 1) << i32(1987);
+    EXPECT_EQ(read_compressed_packet(m2, m2.content_size(), &unpacked), -1);
+    EXPECT_TRUE(unpacked.empty());
+
+    // not negotiated, the server drops the connection and carries on
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1988";
+    EXPECT_EQ(svr->start(svr_addr), 0);
+    int sock = tcp_connect(svr_addr);
+    EXPECT_NEQ(sock, -1);
+    i32 packet[] = { 5 | PACKET_COMPRESSED, 1987, 0 };
+    EXPECT_EQ(write(sock, packet, sizeof(i32) + 5), (ssize_t) (sizeof(i32) + 5));
+    char c;
+    EXPECT_EQ(read(sock, &c, 1), 0);
+    close(sock);
+
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    BenchmarkProxy proxy(cl);
+    i8 flag = 0;
+    EXPECT_EQ(proxy.prime(1987, &flag), 0);
+    cl->close_and_release();
+    delete svr;
+    poll->release();
+}
+
+TEST(compress, rpc) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    EXPECT_EQ(cl->enable_compression(4096), 0);
+    BenchmarkProxy* clnt = new BenchmarkProxy(cl);
+
+    // small requests are left alone
+    i8 flag = 0;
+    EXPECT_EQ(clnt->prime(1987, &flag), 0);
+    EXPECT_EQ(flag, 1);
+
+    map<string, vector<string>> groups;
+    for (int i = 0; i < 1000; i++) {
+        groups[std::to_string(i)] = vector<string>(i % 10, "some highly compressible text");
+    }
+    i32 n = 0;
+    EXPECT_EQ(clnt->count_strings(groups, &n), 0);
+    EXPECT_EQ(n, 4500);
+
+    string payload(1024 * 1024, 'x');
+    const int n_rounds = 100;
+    Timer t;
+    t.start();
+    for (int i = 0; i < n_rounds; i++) {
+        EXPECT_EQ(clnt->nop(payload), 0);
+    }
+    t.stop();
+    Log::info("nop with compressed 1MB payload: %.2lf MB/s", n_rounds / t.elapsed());
+
+    // stream frames are compressed too, in both directions
+    ClientStream* st = clnt->open_upload();
+    for (int i = 0; i < 16; i++) {
+        Marshal m;
+        m.write(payload.data(), payload.size());
+        EXPECT_EQ(st->write_frame(m), 0);
+    }
+    i64 n_uploaded = 0;
+    EXPECT_EQ(clnt->finish_upload(st, &n_uploaded), 0);
+    EXPECT_EQ(n_uploaded, 16 * (i64) payload.size());
+
+    st = clnt->open_download(16 * payload.size(), payload.size());
+    i64 n_downloaded = 0;
+    Marshal* frame;
+    while ((frame = st->read_frame()) != nullptr) {
+        string s(frame->content_size(), '\0');
+        frame->read(&s[0], s.size());
+        EXPECT_TRUE(s == payload);
+        n_downloaded += s.size();
+        delete frame;
+    }
+    i32 n_frames = 0;
+    EXPECT_EQ(clnt->finish_download(st, &n_frames), 0);
+    EXPECT_EQ(n_downloaded, 16 * (i64) payload.size());
+    EXPECT_EQ(n_frames, 16);
+
+    delete clnt;
+    cl->close_and_release();
+    delete svr;
+    clnt_poll->release();
+}
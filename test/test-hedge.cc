@@ -0,0 +1,87 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+
+static const i32 REPLICA = 0x7e1a7003;
+
+static void reg_replica(Server* svr, volatile bool* slow) {
+    svr->reg(REPLICA, [slow] (Request* req, ServerConnection* sconn) {
+        sconn->run_async([req, sconn, slow] {
+            if (*slow) {
+                usleep(50 * 1000);
+            }
+            sconn->begin_reply(req);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        });
+    });
+}
+
+static Future* call_replica(Client* cl, const FutureAttr& attr) {
+    Future* fu = cl->begin_request(REPLICA, attr);
+    cl->end_request();
+    return fu;
+}
+
+TEST(hedge, slow_replica) {
+    volatile bool a_slow = false, b_slow = false;
+    Server* a = new Server;
+    Server* b = new Server;
+    reg_replica(a, &a_slow);
+    reg_replica(b, &b_slow);
+    a->start("127.0.0.1:9001");
+    b->start("127.0.0.1:9002");
+    vector<string> addrs = {"127.0.0.1:9001", "127.0.0.1:9002"};
+
+    ClientPool* pool = new ClientPool;
+    pool->set_hedging(95, 0.1);
+
+    // learn the latency first, nothing hedged meanwhile
+    for (int i = 0; i < 256; i++) {
+        Future* fu = pool->hedged_call(addrs, REPLICA, call_replica);
+        EXPECT_EQ(fu->get_error_code(), 0);
+        fu->release();
+    }
+    EXPECT_EQ(pool->n_hedged(), 0);
+
+    // a stalls, b answers the hedged calls, at most 10% of the calls plus
+    // a burst of 10 saved up during the warmup
+    a_slow = true;
+    const int n_calls = 50;
+    double slowest = 0.0;
+    Timer t;
+    t.start();
+    for (int i = 0; i < n_calls; i++) {
+        Timer one;
+        one.start();
+        Future* fu = pool->hedged_call(addrs, REPLICA, call_replica);
+        one.stop();
+        EXPECT_EQ(fu->get_error_code(), 0);
+        fu->release();
+        slowest = std::max(slowest, one.elapsed());
+    }
+    t.stop();
+    i64 n_hedged = pool->n_hedged();
+    Log::info("%d calls, %ld hedged, took %.3lf sec, slowest %.3lf sec", n_calls, n_hedged, t.elapsed(), slowest);
+    EXPECT_GT(n_hedged, 0);
+    EXPECT_LE(n_hedged, 10 + n_calls / 10);
+    // unhedged, every call would wait out the slow replica
+    EXPECT_LT(t.elapsed(), n_calls * 0.05);
+
+    // hedges cost nothing when there is no other client to go to
+    pool->set_hedging(95, 1.0);
+    vector<string> only_a = {"127.0.0.1:9001"};
+    Future* fu = pool->hedged_call(only_a, REPLICA, call_replica);
+    EXPECT_EQ(fu->get_error_code(), 0);
+    fu->release();
+    EXPECT_EQ(pool->n_hedged(), n_hedged);
+
+    delete pool;
+    delete a;
+    delete b;
+}
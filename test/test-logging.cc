@@ -0,0 +1,171 @@
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "base/all.h"
+
+using namespace base;
+using namespace std;
+
+static string read_all(FILE* fp) {
+    string s;
+    rewind(fp);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        s.append(buf, n);
+    }
+    return s;
+}
+
+static int count_lines(const string& s, const char* marker) {
+    int n = 0;
+    for (size_t pos = s.find(marker); pos != string::npos; pos = s.find(marker, pos + 1)) {
+        n++;
+    }
+    return n;
+}
+
+TEST(logging, deferred_format) {
+    FILE* fp = tmpfile();
+    Log::set_output(fp);
+
+    // arguments are copied, not referenced
+    char name[16];
+    strcpy(name, "alice");
+    Log::info("%d %5.2f %s %c %lu %lld %x %% %-6s| %*d %.*s %p %zu", -42, 3.14159, name, 'z',
+              123456789012UL, -9876543210LL, 0xbeef, "left", 5, 7, 3, "abcdef", (void *) 0x1234, (size_t) 99);
+    strcpy(name, "bob");
+
+    // not a literal, gets copied too
+    string fmt = "dynamic %s %g";
+    Log::info(fmt.c_str(), name, 2.5);
+    fmt = "overwritten %s %g";
+
+    LOG_INFO << "streamed " << 17 << ' ' << 0.5;
+
+    Log::flush();
+    Log::set_output(nullptr);
+    string out = read_all(fp);
+    fclose(fp);
+    Log::info("%s", out.c_str());
+
+    char expected[256];
+    snprintf(expected, sizeof(expected), "| %d %5.2f %s %c %lu %lld %x %% %-6s| %*d %.*s %p %zu\n", -42, 3.14159, "alice",
+             'z', 123456789012UL, -9876543210LL, 0xbeef, "left", 5, 7, 3, "abcdef", (void *) 0x1234, (size_t) 99);
+    EXPECT_NEQ(out.find(expected), string::npos);
+    EXPECT_NEQ(out.find("| dynamic bob 2.5\n"), string::npos);
+    EXPECT_NEQ(out.find("| streamed 17 0.5\n"), string::npos);
+    EXPECT_EQ(count_lines(out, "\n"), 3);
+}
+
+TEST(logging, unterminated_string) {
+    // bytes right before a page that cannot be read, reading past them crashes
+    long page = sysconf(_SC_PAGESIZE);
+    char* mem = (char *) mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    EXPECT_TRUE(mem != MAP_FAILED);
+    EXPECT_EQ(mprotect(mem + page, page, PROT_NONE), 0);
+    char* buf = mem + page - 4;
+    memcpy(buf, "abcd", 4);
+
+    FILE* fp = tmpfile();
+    Log::set_output(fp);
+    Log::info("[%.*s] [%.4s] [%6.2s] [%.*s]", 4, buf, buf, buf, 2, buf + 2);
+    Log::flush();
+    Log::set_output(nullptr);
+    string out = read_all(fp);
+    fclose(fp);
+    munmap(mem, 2 * page);
+
+    EXPECT_NEQ(out.find("| [abcd] [abcd] [    ab] [cd]\n"), string::npos);
+}
+
+static const int n_flood = 10000;
+
+static void* flood(void*) {
+    for (int i = 0; i < n_flood; i++) {
+        Log::info("flood line %d", i);
+    }
+    return nullptr;
+}
+
+TEST(logging, drop_when_full) {
+    FILE* fp = tmpfile();
+    Log::set_output(fp);
+    uint64_t dropped_before = Log::dropped();
+
+    // a 4kb ring cannot take 10000 lines in one go
+    Log::set_buffer_size(4096);
+    pthread_t th;
+    Pthread_create(&th, nullptr, flood, nullptr);
+    Pthread_join(th, nullptr);
+    Log::set_buffer_size(128 * 1024);
+
+    Log::flush();
+    Log::set_output(nullptr);
+    string out = read_all(fp);
+    fclose(fp);
+
+    int n_written = count_lines(out, "flood line");
+    uint64_t n_dropped = Log::dropped() - dropped_before;
+    Log::info("written=%d dropped=%lu", n_written, n_dropped);
+    EXPECT_GT(n_dropped, 0u);
+    EXPECT_EQ(n_written + n_dropped, (uint64_t) n_flood);
+    EXPECT_NEQ(out.find("log lines, ring buffers were full"), string::npos);
+}
+
+static const int n_bench_threads = 4;
+static const int n_bench_lines = 100 * 1000;
+
+static void* bench_log(void*) {
+    for (int i = 0; i < n_bench_lines; i++) {
+        Log::info("benchmark line %d of %s, value=%.3f", i, "some handler", i * 0.5);
+    }
+    return nullptr;
+}
+
+static double run_bench() {
+    Timer t;
+    t.start();
+    pthread_t th[n_bench_threads];
+    for (int i = 0; i < n_bench_threads; i++) {
+        Pthread_create(&th[i], nullptr, bench_log, nullptr);
+    }
+    for (int i = 0; i < n_bench_threads; i++) {
+        Pthread_join(th[i], nullptr);
+    }
+    t.stop();
+    return t.elapsed();
+}
+
+TEST(logging, benchmark) {
+    FILE* fp = fopen("/dev/null", "w");
+    Log::set_output(fp);
+
+    Log::set_async(false);
+    double sync_elapsed = run_bench();
+    Log::set_async(true);
+    uint64_t dropped_before = Log::dropped();
+    double async_elapsed = run_bench();
+    Timer t;
+    t.start();
+    Log::flush();
+    t.stop();
+    uint64_t n_dropped = Log::dropped() - dropped_before;
+
+    Log::set_output(nullptr);
+    fclose(fp);
+
+    int n_lines = n_bench_threads * n_bench_lines;
+    Log::info("%d threads, sync: %.3lf sec, %.3lf M lines/s", n_bench_threads, sync_elapsed,
+              n_lines / sync_elapsed / 1000.0 / 1000.0);
+    Log::info("%d threads, async: %.3lf sec, %.3lf M lines/s, %lu dropped, %.3lf sec to flush the rest",
+              n_bench_threads, async_elapsed, n_lines / async_elapsed / 1000.0 / 1000.0, n_dropped, t.elapsed());
+    // lines that made it out, when the flusher gets enough cpu to keep up
+    Log::info("%d threads, async: %.3lf M lines/s written", n_bench_threads,
+              (n_lines - n_dropped) / (async_elapsed + t.elapsed()) / 1000.0 / 1000.0);
+}
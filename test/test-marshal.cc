@@ -5,9 +5,11 @@
 
 #include "base/all.h"
 #include "rpc/marshal.h"
+#include "test_service.h"
 
 using namespace rpc;
 using namespace std;
+using namespace test;
 
 TEST(marshal, uint_types) {
     Marshal m;
@@ -213,3 +215,79 @@ TEST(marshal_regression, update_tail_when_marshal_is_full_read) {
     m->write_to_fd(null_fd);
     delete m;
 }
+
+TEST(marshal, marshal_size) {
+    Marshal m;
+    i32 a = 1987;
+    v64 b = 1LL << 40;
+    string s(300, 'x');
+    vector<double> vd(100, 1.0);
+    map<string, vector<string>> ms;
+    ms["hello"] = vector<string>(10, "world");
+    ms["empty"];
+    list<pair<i16, v32>> lp(7, make_pair((i16) 3, v32(8848)));
+    m << a << b << s << vd << ms << lp;
+    EXPECT_EQ(marshal_size_of(a, b, s, vd, ms, lp), m.content_size());
+
+    static_assert(marshal_fixed_size((const pair<i32, double>*) nullptr) == 12, "pair of fixed size types");
+    static_assert(marshal_fixed_size((const string*) nullptr) == 0, "string has no fixed size");
+
+    // types that marshal_size knows nothing about
+    struct unknown { };
+    EXPECT_EQ(marshal_size(unknown()), marshal_size_unknown);
+    EXPECT_EQ(marshal_size_of(a, vector<unknown>(1)), marshal_size_unknown);
+}
+
+TEST(marshal, reserve) {
+    const size_t n = 100000;
+    Marshal* m = marshal_with_size(5);
+    m->reserve(n);
+    string s(n - 10, 'y');
+    *m << s;
+    string s2;
+    string prefix(5, '\0');
+    EXPECT_EQ(m->read(&prefix[0], 5), 5u);
+    *m >> s2;
+    EXPECT_EQ(s, s2);
+    EXPECT_TRUE(m->empty());
+
+    // reserve on an empty tail
+    m->reserve(n);
+    *m << s;
+    *m >> s2;
+    EXPECT_EQ(s, s2);
+    EXPECT_TRUE(m->empty());
+    delete m;
+}
+
+TEST(marshal, versioned_struct) {
+    PersonV2 p2;
+    p2.id = 1;
+    p2.name = "hello";
+    p2.email = "world";
+    p2.phone = 8848;
+    p2.tags.push_back("x");
+
+    Marshal m;
+    m << p2 << rpc::i32(1987);
+    EXPECT_EQ(m.content_size(), marshal_size(p2) + sizeof(rpc::i32));
+
+    // trailing fields are skipped
+    PersonV1 p1;
+    rpc::i32 after;
+    m >> p1 >> after;
+    EXPECT_EQ(p1.id, 1);
+    EXPECT_EQ(p1.name, "hello");
+    EXPECT_EQ(p1.email, "world");
+    EXPECT_EQ(after, 1987);
+    EXPECT_TRUE(m.empty());
+
+    // missing fields are reset
+    m << p1;
+    m >> p2;
+    EXPECT_EQ(p2.id, 1);
+    EXPECT_EQ(p2.name, "hello");
+    EXPECT_EQ(p2.phone.get(), 0);
+    EXPECT_TRUE(p2.tags.empty());
+    EXPECT_TRUE(m.empty());
+}
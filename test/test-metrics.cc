@@ -0,0 +1,249 @@
+#include <unistd.h>
+
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "rpc/introspect_service.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(metrics, histogram) {
+    Histogram h;
+    EXPECT_EQ(h.percentile(50), 0);
+    for (i64 i = 1; i <= 1000; i++) {
+        h.record(i * 1000);
+    }
+    EXPECT_EQ(h.count(), 1000);
+    EXPECT_EQ(h.max(), 1000 * 1000);
+    EXPECT_EQ(h.mean(), 500500);
+    // within a bucket width
+    EXPECT_GE(h.percentile(50), 500 * 1000);
+    EXPECT_LT(h.percentile(50), 500 * 1000 * 1.125);
+    EXPECT_GE(h.percentile(99), 990 * 1000);
+    EXPECT_LE(h.percentile(99), 1000 * 1000);
+    EXPECT_EQ(h.percentile(100), 1000 * 1000);
+
+    // small values are exact, huge ones clamped
+    Histogram small;
+    small.record(3);
+    EXPECT_EQ(small.percentile(50), 3);
+    small.record(1LL << 50);
+    EXPECT_EQ(small.max(), 1LL << 50);
+    EXPECT_EQ(small.percentile(100), 1LL << 50);
+
+    h.merge(small);
+    EXPECT_EQ(h.count(), 1002);
+
+    // what came after an earlier copy
+    Histogram later = h;
+    for (i64 i = 1; i <= 100; i++) {
+        later.record(5 * 1000 * 1000);
+    }
+    later.subtract(h);
+    EXPECT_EQ(later.count(), 100);
+    EXPECT_EQ(later.sum(), 100 * 5 * 1000 * 1000);
+    EXPECT_GE(later.percentile(50), 5 * 1000 * 1000);
+    EXPECT_LT(later.percentile(50), 5 * 1000 * 1000 * 1.125);
+}
+
+struct recorder_args {
+    RpcMetrics* metrics;
+    int n;
+};
+
+static void* record_calls(void* arg) {
+    recorder_args* args = (recorder_args *) arg;
+    for (int i = 0; i < args->n; i++) {
+        i64 phase_ns[2] = { 100, 1000 + i };
+        args->metrics->record_start(1987);
+        args->metrics->record_call(1987, i % 10 == 0 ? EBUSY : 0, 10, 20, phase_ns, 2);
+    }
+    return nullptr;
+}
+
+TEST(metrics, threads) {
+    RpcMetrics metrics;
+    recorder_args args;
+    args.metrics = &metrics;
+    args.n = 100000;
+    const int n_threads = 4;
+    pthread_t th[n_threads];
+    for (int i = 0; i < n_threads; i++) {
+        Pthread_create(&th[i], nullptr, record_calls, &args);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        Pthread_join(th[i], nullptr);
+    }
+
+    // threads are gone, what they recorded is not
+    map<i32, RpcMetrics::Stats> stats;
+    metrics.snapshot(&stats);
+    EXPECT_EQ(stats.size(), 1u);
+    const RpcMetrics::Stats& st = stats[1987];
+    EXPECT_EQ(st.count, n_threads * args.n);
+    EXPECT_EQ(st.in_flight(), 0);
+    EXPECT_EQ(st.bytes_in, 10 * st.count);
+    EXPECT_EQ(st.bytes_out, 20 * st.count);
+    EXPECT_EQ(st.errors.size(), 1u);
+    EXPECT_EQ(st.errors.at(EBUSY), st.count / 10);
+    EXPECT_EQ(st.phases[0].percentile(50), 100);
+    EXPECT_EQ(st.phases[1].max(), 1000 + args.n - 1);
+
+    metrics.reset();
+    metrics.snapshot(&stats);
+    EXPECT_EQ(stats.size(), 0u);
+}
+
+TEST(metrics, started) {
+    RpcMetrics metrics;
+    // more rpc_ids than counted without a lock
+    const int n_rpcs = 100;
+    for (i32 rpc_id = 1; rpc_id <= n_rpcs; rpc_id++) {
+        metrics.record_start(rpc_id);
+        metrics.record_start(rpc_id);
+        i64 rtt_ns = 1000;
+        metrics.record_call(rpc_id, 0, 10, 20, &rtt_ns, 1);
+    }
+    map<i32, RpcMetrics::Stats> stats;
+    metrics.snapshot(&stats);
+    EXPECT_EQ(stats.size(), (size_t) n_rpcs);
+    for (auto& it: stats) {
+        EXPECT_EQ(it.second.started, 2);
+        EXPECT_EQ(it.second.in_flight(), 1);
+        EXPECT_EQ(it.second.phases[0].count(), 1);
+        EXPECT_EQ(it.second.phases[1].count(), 0);
+    }
+    RpcMetrics::Stats st;
+    metrics.snapshot(n_rpcs, &st);
+    EXPECT_EQ(st.started, 2);
+    EXPECT_EQ(st.count, 1);
+
+    metrics.reset();
+    metrics.snapshot(&stats);
+    EXPECT_EQ(stats.size(), 0u);
+}
+
+TEST(metrics, introspect) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    BenchmarkProxy* clnt = new BenchmarkProxy(cl);
+
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(clnt->sleep(0.02), 0);
+    }
+    string payload(1000, 'x');
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(clnt->nop(payload), 0);
+    }
+    // no such rpc
+    Future* fu = cl->begin_request(1987);
+    cl->end_request();
+    EXPECT_EQ(fu->get_error_code(), ENOENT);
+    fu->release();
+
+    IntrospectProxy introspect(cl);
+    vector<rpc_stats> rpcs;
+    EXPECT_EQ(introspect.metrics(&rpcs), 0);
+    map<i32, rpc_stats> by_id;
+    for (auto& rs: rpcs) {
+        by_id[rs.rpc_id] = rs;
+    }
+
+    EXPECT_TRUE(by_id.find(BenchmarkService::SLEEP) != by_id.end());
+    const rpc_stats& sleep = by_id[BenchmarkService::SLEEP];
+    Log::info("sleep(0.02): queue p50=%ldns handler p50=%ldns serialize p50=%ldns write p50=%ldns",
+              sleep.queue_wait.p50, sleep.handler.p50, sleep.serialize.p50, sleep.write.p50);
+    EXPECT_EQ(sleep.n_requests, 10);
+    EXPECT_EQ(sleep.handler.count, 10);
+    EXPECT_GE(sleep.handler.p50, 20 * 1000 * 1000);
+    EXPECT_LT(sleep.handler.p50, 40 * 1000 * 1000);
+    EXPECT_LT(sleep.queue_wait.p50, 10 * 1000 * 1000);
+    EXPECT_EQ(sleep.write.count, 10);
+
+    const rpc_stats& nop = by_id[BenchmarkService::NOP];
+    EXPECT_EQ(nop.n_requests, 100);
+    EXPECT_GT(nop.bytes_in, 100 * (i64) payload.size());
+    EXPECT_GT(nop.bytes_out, 0);
+    EXPECT_TRUE(nop.error_codes.empty());
+
+    rpc_stats& missing = by_id[1987];
+    EXPECT_EQ(missing.n_requests, 1);
+    EXPECT_EQ(missing.error_codes.size(), 1u);
+    EXPECT_EQ(missing.error_codes[ENOENT], 1);
+
+    thread_pool_stats tp;
+    EXPECT_EQ(introspect.thread_pool(&tp), 0);
+    EXPECT_GE(tp.started, 110);
+    EXPECT_EQ(tp.rejected, 0);
+
+    delete clnt;
+    cl->close_and_release();
+    delete svr;
+    clnt_poll->release();
+}
+
+TEST(metrics, client) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+    BenchmarkProxy* clnt = new BenchmarkProxy(cl);
+
+    map<i32, RpcMetrics::Stats> stats;
+    {
+        FutureGroup fg;
+        for (int i = 0; i < 5; i++) {
+            fg.add(clnt->async_sleep(0.05));
+        }
+        cl->metrics()->snapshot(&stats);
+        EXPECT_EQ(stats[BenchmarkService::SLEEP].in_flight(), 5);
+        fg.wait_all();
+    }
+    Future* fu = cl->begin_request(1987);
+    cl->end_request();
+    EXPECT_EQ(fu->get_error_code(), ENOENT);
+    fu->release();
+
+    cl->metrics()->snapshot(&stats);
+    const RpcMetrics::Stats& sleep = stats[BenchmarkService::SLEEP];
+    EXPECT_EQ(sleep.count, 5);
+    EXPECT_EQ(sleep.in_flight(), 0);
+    EXPECT_TRUE(sleep.errors.empty());
+    EXPECT_GT(sleep.bytes_out, 5 * (i64) sizeof(double));
+    EXPECT_GT(sleep.bytes_in, 0);
+    EXPECT_GE(sleep.phases[0].percentile(50), 50 * 1000 * 1000);
+    EXPECT_EQ(stats[1987].errors[ENOENT], 1);
+
+    // round trip covers what the server spent on it
+    map<i32, RpcMetrics::Stats> svr_stats;
+    svr->metrics()->snapshot(&svr_stats);
+    EXPECT_GE(sleep.phases[0].max(), svr_stats[BenchmarkService::SLEEP].phases[Server::PHASE_HANDLER].max());
+    Log::info("sleep(0.05) round trip p50=%ldns, server handler p50=%ldns",
+              sleep.phases[0].percentile(50), svr_stats[BenchmarkService::SLEEP].phases[Server::PHASE_HANDLER].percentile(50));
+
+    // calls that never get a reply count as ENOTCONN
+    fu = clnt->async_sleep(0.2);
+    cl->close_and_release();
+    EXPECT_EQ(fu->get_error_code(), ENOTCONN);
+    fu->release();
+
+    delete clnt;
+    delete svr;
+    clnt_poll->release();
+}
@@ -0,0 +1,81 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(pool, least_loaded) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:1987");
+
+    ClientPool* pool = new ClientPool(nullptr, 2);
+    Client* busy = pool->get_client("127.0.0.1:1987");
+    EXPECT_TRUE(busy != nullptr);
+    EXPECT_EQ(busy->n_pending(), 0u);
+
+    BenchmarkProxy proxy(busy);
+    vector<Future*> sleeping;
+    for (int i = 0; i < 3; i++) {
+        sleeping.push_back(proxy.async_sleep(0.2));
+    }
+    EXPECT_EQ(busy->n_pending(), 3u);
+
+    // with 2 connections both are compared every time
+    for (int i = 0; i < 100; i++) {
+        Client* cl = pool->get_client("127.0.0.1:1987");
+        EXPECT_NEQ(cl, busy);
+        EXPECT_EQ(cl->n_pending(), 0u);
+    }
+
+    for (auto& fu : sleeping) {
+        EXPECT_EQ(fu->get_error_code(), 0);
+        fu->release();
+    }
+    EXPECT_EQ(busy->n_pending(), 0u);
+
+    delete pool;
+    delete svr;
+}
+
+TEST(pool, reconnect) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:1987");
+
+    ClientPool* pool = new ClientPool(nullptr, 2);
+    Client* cl = pool->get_client("127.0.0.1:1987");
+    EXPECT_EQ(BenchmarkProxy(cl).ping(), 0);
+
+    // connections go away with the server
+    delete svr;
+    for (int i = 0; i < 100 && !cl->closed(); i++) {
+        usleep(10 * 1000);
+    }
+    EXPECT_TRUE(cl->closed());
+
+    // connects asynchronously, calls fail once connecting does
+    Client* refused = pool->get_client("127.0.0.1:1987");
+    EXPECT_TRUE(refused == nullptr || BenchmarkProxy(refused).ping() == ENOTCONN);
+
+    svr = new Server;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:1987");
+    // let refused connects get noticed
+    usleep(100 * 1000);
+    for (int i = 0; i < 10; i++) {
+        Client* fresh = pool->get_client("127.0.0.1:1987");
+        EXPECT_TRUE(fresh != nullptr);
+        EXPECT_FALSE(fresh->closed());
+        EXPECT_EQ(BenchmarkProxy(fresh).ping(), 0);
+    }
+
+    delete pool;
+    delete svr;
+}
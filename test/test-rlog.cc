@@ -1,4 +1,5 @@
 #include <string>
+#include <algorithm>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -50,3 +51,140 @@ TEST(integration, rlog) {
     delete server;
     delete ls;
 }
+
+class CountingRLogService: public RLogServiceImpl, public CacheAligned {
+public:
+    SpinLock l;
+    int n_batches;
+    vector<i64> msg_ids;
+    double delay;
+
+    CountingRLogService(): n_batches(0), delay(0.0) { }
+
+    void log_batch(const std::string& source, const std::vector<log_entry>& entries) {
+        if (delay > 0) {
+            usleep(delay * 1000 * 1000);
+        }
+        l.lock();
+        n_batches++;
+        for (auto& e: entries) {
+            msg_ids.push_back(e.msg_id);
+        }
+        l.unlock();
+        RLogServiceImpl::log_batch(source, entries);
+    }
+};
+
+static void* log_100(void*) {
+    for (int i = 0; i < 100; i++) {
+        RLog::info("batched message %d", i);
+    }
+    return nullptr;
+}
+
+TEST(rlog, batched) {
+    CountingRLogService* ls = new CountingRLogService;
+    Server* server = new Server;
+    server->reg(ls);
+    EXPECT_EQ(server->start("0.0.0.0:8848"), 0);
+
+    RLog::init("batched_client", "127.0.0.1:8848");
+    i64 dropped_before = RLog::dropped();
+    pthread_t th[4];
+    for (int i = 0; i < 4; i++) {
+        Pthread_create(&th[i], nullptr, log_100, nullptr);
+    }
+    for (int i = 0; i < 4; i++) {
+        Pthread_join(th[i], nullptr);
+    }
+    RLog::finalize();
+
+    ls->l.lock();
+    Log::info("400 messages in %d batches", ls->n_batches);
+    EXPECT_EQ(RLog::dropped(), dropped_before);
+    EXPECT_EQ(ls->msg_ids.size(), 400u);
+    EXPECT_LT(ls->n_batches, 100);
+    sort(ls->msg_ids.begin(), ls->msg_ids.end());
+    for (size_t i = 0; i < ls->msg_ids.size(); i++) {
+        EXPECT_EQ(ls->msg_ids[i], (i64) i);
+    }
+    ls->l.unlock();
+
+    delete server;
+    delete ls;
+}
+
+TEST(rlog, drop_when_server_slow) {
+    CountingRLogService* ls = new CountingRLogService;
+    ls->delay = 0.01;
+    Server* server = new Server;
+    server->reg(ls);
+    EXPECT_EQ(server->start("0.0.0.0:8848"), 0);
+
+    RLog::set_batching(16, 0.001, 4096);
+    RLog::init("slow_server_client", "127.0.0.1:8848");
+    i64 dropped_before = RLog::dropped();
+    const int n_msgs = 5000;
+    for (int i = 0; i < n_msgs; i++) {
+        RLog::info("flooding message %d", i);
+    }
+    RLog::finalize();
+    RLog::set_batching(256, 0.05, 1024 * 1024);
+
+    ls->l.lock();
+    i64 n_dropped = RLog::dropped() - dropped_before;
+    Log::info("%d messages: %d shipped in %d batches, %ld dropped",
+              n_msgs, (int) ls->msg_ids.size(), ls->n_batches, n_dropped);
+    EXPECT_GT(n_dropped, 0);
+    EXPECT_EQ((i64) ls->msg_ids.size() + n_dropped, n_msgs);
+    ls->l.unlock();
+
+    delete server;
+    delete ls;
+}
+
+TEST(rlog, reorder_ring) {
+    reorder_ring ring;
+    vector<i64> printed;
+
+    // far enough ahead that the ring has to grow
+    for (i64 id = 200; id >= 1; id--) {
+        EXPECT_TRUE(ring.insert(id, 3, "msg"));
+        EXPECT_TRUE(ring.next_ready() == nullptr);
+    }
+    // RLog numbers messages from 0
+    EXPECT_TRUE(ring.insert(0, 3, "first"));
+    log_piece* p;
+    while ((p = ring.next_ready()) != nullptr) {
+        printed.push_back(p->msg_id);
+        ring.pop(p);
+    }
+    EXPECT_EQ(printed.size(), 201u);
+    for (size_t i = 0; i < printed.size(); i++) {
+        EXPECT_EQ(printed[i], (i64) i);
+    }
+    EXPECT_EQ(ring.done(), 200);
+
+    // duplicates and absurd gaps are not held back
+    EXPECT_FALSE(ring.insert(100, 3, "dup"));
+    EXPECT_FALSE(ring.insert(200 + reorder_ring::max_ahead + 1, 3, "far"));
+}
+
+TEST(rlog, qps_counter) {
+    qps_counter qc;
+    double now = 1000.0;
+    // 100 per 100ms for 10 seconds
+    for (int i = 0; i < 100; i++) {
+        qc.add(now, 100);
+        now += 0.1;
+    }
+    now -= 0.1;
+    EXPECT_EQ(qc.qps(now, 1), 1000.0);
+    EXPECT_EQ(qc.qps(now, 5), 1000.0);
+    EXPECT_EQ(qc.qps(now, 60), 10000.0 / 60);
+
+    // older buckets get reused
+    qc.add(now + 120, 7);
+    EXPECT_EQ(qc.qps(now + 120, 1), 7.0);
+    EXPECT_EQ(qc.qps(now + 120, 60), 7.0 / 60);
+}
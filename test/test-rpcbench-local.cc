@@ -1,6 +1,7 @@
 #include "base/all.h"
 #include "rpc/client.h"
 #include "rpc/server.h"
+#include "rpc/metrics.h"
 #include "benchmark_service.h"
 
 using namespace base;
@@ -8,19 +9,15 @@ using namespace std;
 using namespace rpc;
 using namespace benchmark;
 
-TEST(integration, rpc_bench_local) {
+static void rpc_bench(const char* svc_addr) {
     PollMgr* poll = new PollMgr;
     ThreadPool* thrpool = new ThreadPool;
 
     // start the server
-    int svc_port = 1987;
-    EXPECT_NEQ(svc_port, -1);
     Server* svr = new Server(poll, thrpool);
     BenchmarkService bench_svc;
     svr->reg(&bench_svc);
-    char svc_addr[100];
-    sprintf(svc_addr, "127.0.0.1:%d", svc_port);
-    svr->start(svc_addr);
+    verify(svr->start(svc_addr) == 0);
 
     // start the client
     ClientPool* clnt_pool = new ClientPool(poll);
@@ -36,7 +33,7 @@ TEST(integration, rpc_bench_local) {
         clnt->fast_prime(i + 1987, &flag);
     }
     timer.stop();
-    Log::debug("fast_prime, sync: %.0lf", n_prime / timer.elapsed());
+    Log::debug("%s fast_prime, sync: %.0lf", svc_addr, n_prime / timer.elapsed());
 
     timer.start();
     for (int i = 0; i < n_prime; i++) {
@@ -44,7 +41,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("fast_prime, async: %.0lf", n_prime / timer.elapsed());
+    Log::debug("%s fast_prime, async: %.0lf", svc_addr, n_prime / timer.elapsed());
 
 
     timer.start();
@@ -53,7 +50,7 @@ TEST(integration, rpc_bench_local) {
         clnt->prime(i + 1987, &flag);
     }
     timer.stop();
-    Log::debug("prime, sync: %.0lf", n_prime / timer.elapsed());
+    Log::debug("%s prime, sync: %.0lf", svc_addr, n_prime / timer.elapsed());
 
     fu_group = new FutureGroup;
     timer.start();
@@ -62,7 +59,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("prime, async: %.0lf", n_prime / timer.elapsed());
+    Log::debug("%s prime, async: %.0lf", svc_addr, n_prime / timer.elapsed());
 
 
     const int n_dot_prod = 100000;
@@ -80,7 +77,7 @@ TEST(integration, rpc_bench_local) {
         clnt->fast_dot_prod(a, b, &v);
     }
     timer.stop();
-    Log::debug("fast_dot_prod, sync: %.0lf", n_dot_prod / timer.elapsed());
+    Log::debug("%s fast_dot_prod, sync: %.0lf", svc_addr, n_dot_prod / timer.elapsed());
 
     fu_group = new FutureGroup;
     timer.start();
@@ -97,7 +94,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("fast_dot_prod, async: %.0lf", n_dot_prod / timer.elapsed());
+    Log::debug("%s fast_dot_prod, async: %.0lf", svc_addr, n_dot_prod / timer.elapsed());
 
 
     timer.start();
@@ -114,7 +111,7 @@ TEST(integration, rpc_bench_local) {
         clnt->dot_prod(a, b, &v);
     }
     timer.stop();
-    Log::debug("dot_prod, sync: %.0lf", n_dot_prod / timer.elapsed());
+    Log::debug("%s dot_prod, sync: %.0lf", svc_addr, n_dot_prod / timer.elapsed());
 
     fu_group = new FutureGroup;
     timer.start();
@@ -131,7 +128,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("dot_prod, async: %.0lf", n_dot_prod / timer.elapsed());
+    Log::debug("%s dot_prod, async: %.0lf", svc_addr, n_dot_prod / timer.elapsed());
 
 
     const int n_add = 100000;
@@ -141,7 +138,7 @@ TEST(integration, rpc_bench_local) {
         clnt->fast_add(i, 1987, &i_add_1987);
     }
     timer.stop();
-    Log::debug("fast_add, sync: %.0lf", n_add / timer.elapsed());
+    Log::debug("%s fast_add, sync: %.0lf", svc_addr, n_add / timer.elapsed());
 
     fu_group = new FutureGroup;
     timer.start();
@@ -150,7 +147,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("fast_add, async: %.0lf", n_add / timer.elapsed());
+    Log::debug("%s fast_add, async: %.0lf", svc_addr, n_add / timer.elapsed());
 
 
     timer.start();
@@ -159,7 +156,7 @@ TEST(integration, rpc_bench_local) {
         clnt->add(i, 1987, &i_add_1987);
     }
     timer.stop();
-    Log::debug("add, sync: %.0lf", n_add / timer.elapsed());
+    Log::debug("%s add, sync: %.0lf", svc_addr, n_add / timer.elapsed());
 
     fu_group = new FutureGroup;
     timer.start();
@@ -168,7 +165,7 @@ TEST(integration, rpc_bench_local) {
     }
     delete fu_group;
     timer.stop();
-    Log::debug("add, async: %.0lf", n_add / timer.elapsed());
+    Log::debug("%s add, async: %.0lf", svc_addr, n_add / timer.elapsed());
 
     delete clnt;
     delete clnt_pool;
@@ -177,3 +174,46 @@ TEST(integration, rpc_bench_local) {
     thrpool->release();
     poll->release();
 }
+
+TEST(integration, rpc_bench_local) {
+    rpc_bench("127.0.0.1:1987");
+}
+
+// same host through shared memory, no sockets in the way
+TEST(integration, rpc_bench_local_shm) {
+    rpc_bench("shm://rpcbench");
+}
+
+// round trips of sync calls, one at a time
+static void rpc_latency(const char* svc_addr, bool busy_poll) {
+    PollMgr* poll = new PollMgr;
+    poll->set_busy_poll(busy_poll);
+    Server* svr = new Server(poll);
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    verify(svr->start(svc_addr) == 0);
+
+    Client* cl = new Client(poll);
+    verify(cl->connect(svc_addr) == 0);
+    BenchmarkProxy proxy(cl);
+
+    const int n_calls = 10000;
+    Histogram hist;
+    for (int i = 0; i < n_calls; i++) {
+        v32 sum;
+        double start = monotonic_time();
+        verify(proxy.fast_add(i, 1987, &sum) == 0 && sum.get() == i + 1987);
+        hist.record((i64) ((monotonic_time() - start) * 1000 * 1000 * 1000));
+    }
+    Log::debug("%s fast_add, %s polling: p50 %.1lf us, p99 %.1lf us", svc_addr,
+               busy_poll ? "busy" : "blocking", hist.percentile(50) / 1000.0, hist.percentile(99) / 1000.0);
+
+    cl->close_and_release();
+    delete svr;
+    poll->release();
+}
+
+TEST(integration, rpc_latency_local) {
+    rpc_latency("127.0.0.1:1987", false);
+    rpc_latency("127.0.0.1:1987", true);
+}
@@ -0,0 +1,127 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+static const int n_servers = 4;
+
+static ScatterGather::call_t sleep_call(double sec) {
+    return [sec] (Client* cl, const FutureAttr& attr) {
+        return BenchmarkProxy(cl).async_sleep(sec, attr);
+    };
+}
+
+TEST(scatter, quorum) {
+    Server* svrs[n_servers];
+    BenchmarkService bench_svc;
+    char addrs[n_servers][32];
+    for (int i = 0; i < n_servers; i++) {
+        svrs[i] = new Server;
+        svrs[i]->reg(&bench_svc);
+        snprintf(addrs[i], sizeof(addrs[i]), "127.0.0.1:%d", 9001 + i);
+        svrs[i]->start(addrs[i]);
+    }
+    ClientPool* pool = new ClientPool;
+
+    // 2 fast and 2 slow servers, a quorum of 2 does not wait for the slow
+    {
+        ScatterGather sg;
+        for (int i = 0; i < n_servers; i++) {
+            EXPECT_TRUE(sg.add(pool->get_client(addrs[i]), sleep_call(i < 2 ? 0.01 : 1.0)));
+        }
+        Timer t;
+        t.start();
+        EXPECT_EQ(sg.wait(2), 2);
+        t.stop();
+        EXPECT_LT(t.elapsed(), 0.5);
+        EXPECT_EQ(sg.succeeded().size(), 2u);
+
+        // stragglers fail right away
+        sg.cancel_rest();
+        EXPECT_EQ(sg.wait_all(), 2);
+        Log::info("quorum of 2 out of %d: %.3lf sec", n_servers, t.elapsed());
+    }
+
+    // times out with what came back so far
+    {
+        ScatterGather sg;
+        for (int i = 0; i < n_servers; i++) {
+            sg.add(pool->get_client(addrs[i]), sleep_call(i == 0 ? 0.01 : 1.0));
+        }
+        Timer t;
+        t.start();
+        EXPECT_EQ(sg.wait(n_servers, 0.1), 1);
+        t.stop();
+        EXPECT_GE(t.elapsed(), 0.09);
+        EXPECT_LT(t.elapsed(), 0.5);
+        // destructor cancels the rest
+    }
+
+    // cannot reach a quorum once too many failed
+    {
+        ScatterGather sg;
+        EXPECT_FALSE(sg.add(nullptr, sleep_call(0.0)));
+        for (int i = 0; i < 2; i++) {
+            sg.add(pool->get_client(addrs[i]), [] (Client* cl, const FutureAttr& attr) {
+                Future* fu = BenchmarkProxy(cl).async_sleep(1.0, attr);
+                cl->cancel(fu);
+                return fu;
+            });
+        }
+        EXPECT_EQ(sg.wait(1), 0);
+        EXPECT_EQ(sg.succeeded().size(), 0u);
+    }
+
+    // all of them
+    {
+        ScatterGather sg;
+        for (int i = 0; i < n_servers; i++) {
+            sg.add(pool->get_client(addrs[i]), [] (Client* cl, const FutureAttr& attr) {
+                return BenchmarkProxy(cl).async_add(1, 2, attr);
+            });
+        }
+        EXPECT_EQ(sg.wait_all(), n_servers);
+        for (auto& fu : sg.succeeded()) {
+            v32 sum;
+            fu->get_reply() >> sum;
+            EXPECT_EQ(sum.get(), 3);
+        }
+    }
+
+    delete pool;
+    for (int i = 0; i < n_servers; i++) {
+        delete svrs[i];
+    }
+}
+
+TEST(scatter, cancel) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:9001");
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect("127.0.0.1:9001"), 0);
+    BenchmarkProxy proxy(cl);
+
+    Future* fu = proxy.async_sleep(0.1);
+    EXPECT_EQ(cl->n_pending(), 1u);
+    EXPECT_TRUE(cl->cancel(fu));
+    EXPECT_EQ(cl->n_pending(), 0u);
+    EXPECT_EQ(fu->get_error_code(), ECANCELED);
+    EXPECT_FALSE(cl->cancel(fu));
+    fu->release();
+
+    // the late reply is dropped, the connection keeps working
+    usleep(150 * 1000);
+    EXPECT_EQ(proxy.ping(), 0);
+
+    cl->close_and_release();
+    poll->release();
+    delete svr;
+}
@@ -0,0 +1,156 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "rpc/shm.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(shm, calls) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    EXPECT_EQ(svr->start("shm://test-shm"), 0);
+
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect("shm://test-shm"), 0);
+    BenchmarkProxy proxy(cl);
+
+    v32 sum;
+    EXPECT_EQ(proxy.add(1, 2, &sum), 0);
+    EXPECT_EQ(sum.get(), 3);
+
+    // more than fits in the rings at once
+    const int n_async = 100000;
+    FutureGroup* fu_group = new FutureGroup;
+    for (int i = 0; i < n_async; i++) {
+        fu_group->add(proxy.async_fast_add(i, 1987));
+    }
+    delete fu_group;
+
+    // a single packet larger than a ring
+    string big(3 * ShmChannel::ring_size_s + 17, 'x');
+    EXPECT_EQ(proxy.nop(big), 0);
+
+    const i32 frame_size = 64 * 1024;
+    const i64 n_bytes = 16 * 1024 * 1024;
+    ClientStream* st = proxy.open_download(n_bytes, frame_size);
+    EXPECT_TRUE(st != nullptr);
+    i64 n_downloaded = 0;
+    Marshal* frame;
+    while ((frame = st->read_frame()) != nullptr) {
+        n_downloaded += frame->content_size();
+        delete frame;
+    }
+    i32 n_frames = 0;
+    EXPECT_EQ(proxy.finish_download(st, &n_frames), 0);
+    EXPECT_EQ(n_downloaded, n_bytes);
+
+    ShmChannel::set_spin(0.001);
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(proxy.fast_add(i, 1, &sum), 0);
+        EXPECT_EQ(sum.get(), i + 1);
+    }
+    ShmChannel::set_spin(0.0);
+
+    // the doorbell socket tells when the server is gone
+    delete svr;
+    for (int i = 0; i < 100 && !cl->closed(); i++) {
+        usleep(10 * 1000);
+    }
+    EXPECT_TRUE(cl->closed());
+    EXPECT_EQ(proxy.ping(), ENOTCONN);
+    cl->close_and_release();
+
+    poll->release();
+}
+
+// appends n fast_add requests
+static void add_requests(Marshal* m, int n) {
+    for (int i = 0; i < n; i++) {
+        v64 xid = 1;
+        i32 rpc_id = BenchmarkService::FAST_ADD;
+        v32 a = 1, b = 2;
+        i32 size = marshal_size_of(xid, rpc_id, a, b);
+        *m << size << xid << rpc_id << a << b;
+    }
+}
+
+TEST(shm, watermarks) {
+    Server* svr = new Server;
+    const size_t high = 64 * 1024;
+    svr->set_output_watermarks(high, high / 4);
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    EXPECT_EQ(svr->start("shm://test-shm-watermark"), 0);
+
+    // a raw channel, to hold back reading replies
+    ShmChannel* ch = ShmChannel::connect("test-shm-watermark");
+    EXPECT_TRUE(ch != nullptr);
+
+    // keep pipelining till the server stops taking requests
+    const int batch = 4096;
+    int n_requests = 0;
+    Marshal out;
+    Timer t;
+    t.start();
+    while (t.elapsed() < 0.5) {
+        if (out.content_size() < ShmChannel::ring_size_s) {
+            add_requests(&out, batch);
+            n_requests += batch;
+        }
+        if (ch->write_from(&out) > 0) {
+            t.reset();
+            t.start();
+        } else {
+            usleep(10 * 1000);
+        }
+    }
+    size_t buffered = svr->output_buffer_size();
+    Log::info("server stopped reading, %ld bytes of replies buffered", buffered);
+    // replies keep going into the ring while paused, till below the low watermark
+    EXPECT_GT(buffered, high / 4);
+
+    // reading replies makes room, the doorbell has to get the server going again
+    Marshal in;
+    int n_replies = 0;
+    t.reset();
+    t.start();
+    while (n_replies < n_requests && t.elapsed() < 10.0) {
+        ch->write_from(&out);
+        if (ch->read_into(&in) == 0) {
+            usleep(1000);
+        }
+        i32 packet_size;
+        while (in.peek(&packet_size, sizeof(i32)) == sizeof(i32) && in.content_size() >= packet_size + sizeof(i32)) {
+            in.discard(sizeof(i32) + packet_size);
+            n_replies++;
+        }
+    }
+    EXPECT_EQ(n_replies, n_requests);
+    EXPECT_EQ(svr->output_buffer_size(), 0u);
+
+    ::close(ch->fd());
+    delete ch;
+    delete svr;
+}
+
+TEST(shm, bad_addr) {
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect("shm://nobody-listens"), ENOTCONN);
+    cl->close_and_release();
+
+    Server* svr = new Server;
+    EXPECT_EQ(svr->start("shm://test-shm"), 0);
+    Server* svr2 = new Server;
+    EXPECT_EQ(svr2->start("shm://test-shm"), EINVAL);
+    delete svr2;
+    delete svr;
+
+    poll->release();
+}
@@ -0,0 +1,121 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(stream, upload_download) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    PollMgr* clnt_poll = new PollMgr;
+    ClientPool* clnt_pool = new ClientPool(clnt_poll);
+    BenchmarkProxy* clnt = new BenchmarkProxy(clnt_pool->get_client(svr_addr));
+
+    // much larger than the flow control window, in frames of 64kb
+    const i32 frame_size = 64 * 1024;
+    const i64 n_bytes = 64 * 1024 * 1024;
+    string payload(frame_size, 'x');
+
+    Timer t;
+    t.start();
+    ClientStream* st = clnt->open_upload();
+    EXPECT_TRUE(st != nullptr);
+    for (i64 n_left = n_bytes; n_left > 0; n_left -= frame_size) {
+        Marshal m;
+        m.write(payload.data(), payload.size());
+        EXPECT_EQ(st->write_frame(m), 0);
+    }
+    i64 n_uploaded = 0;
+    EXPECT_EQ(clnt->finish_upload(st, &n_uploaded), 0);
+    t.stop();
+    EXPECT_EQ(n_uploaded, n_bytes);
+    Log::info("stream upload: %.2lf MB/s", n_bytes / t.elapsed() / 1024 / 1024);
+
+    t.reset();
+    t.start();
+    st = clnt->open_download(n_bytes, frame_size);
+    EXPECT_TRUE(st != nullptr);
+    i64 n_downloaded = 0;
+    i32 n_received = 0;
+    Marshal* frame;
+    while ((frame = st->read_frame()) != nullptr) {
+        n_downloaded += frame->content_size();
+        n_received++;
+        delete frame;
+    }
+    i32 n_frames = 0;
+    EXPECT_EQ(clnt->finish_download(st, &n_frames), 0);
+    t.stop();
+    EXPECT_EQ(n_downloaded, n_bytes);
+    EXPECT_EQ(n_frames, n_received);
+    Log::info("stream download: %.2lf MB/s", n_bytes / t.elapsed() / 1024 / 1024);
+
+    // reader gives up early, finish() drains the rest
+    st = clnt->open_download(n_bytes, frame_size);
+    frame = st->read_frame();
+    EXPECT_TRUE(frame != nullptr);
+    delete frame;
+    n_frames = 0;
+    EXPECT_EQ(clnt->finish_download(st, &n_frames), 0);
+    EXPECT_GT(n_frames, 0);
+
+    delete clnt;
+    delete clnt_pool;
+    delete svr;
+    clnt_poll->release();
+}
+
+TEST(stream, reused_xid) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    // two uploads with the same xid, the second one is turned down
+    int sock = tcp_connect(svr_addr);
+    EXPECT_NEQ(sock, -1);
+    Marshal m;
+    for (int i = 0; i < 2; i++) {
+        v64 xid = 7;
+        i32 rpc_id = BenchmarkService::UPLOAD;
+        i32 size = marshal_size_of(xid, rpc_id);
+        m << size << xid << rpc_id;
+    }
+    while (!m.empty()) {
+        EXPECT_GT(m.write_to_fd(sock), 0u);
+    }
+
+    set_nonblocking(sock, true);
+    Marshal in;
+    i32 error_code = 0;
+    Timer t;
+    t.start();
+    while (error_code == 0 && t.elapsed() < 10.0) {
+        i32 packet_size;
+        if (in.peek(&packet_size, sizeof(i32)) == sizeof(i32) && in.content_size() >= packet_size + sizeof(i32)) {
+            v64 xid;
+            v32 v_error_code;
+            in >> packet_size >> xid >> v_error_code;
+            in.discard(packet_size - xid.val_size() - v_error_code.val_size());
+            EXPECT_EQ(xid.get(), 7);
+            if (v_error_code.get() != STREAM_REPLY_CREDIT) {
+                error_code = v_error_code.get();
+            }
+        } else if (in.read_from_fd(sock) == 0) {
+            usleep(10 * 1000);
+        }
+    }
+    EXPECT_EQ(error_code, EINVAL);
+
+    ::close(sock);
+    delete svr;
+}
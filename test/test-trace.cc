@@ -0,0 +1,170 @@
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "rpc/introspect_service.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(trace, context) {
+    EXPECT_FALSE(current_trace().traced());
+
+    TraceContext root = TraceContext::start();
+    EXPECT_TRUE(root.traced());
+    EXPECT_TRUE(root.sampled);
+    EXPECT_EQ(root.parent_span_id, 0);
+    EXPECT_FALSE(TraceContext::start(0.0).sampled);
+
+    TraceContext child = root.child();
+    EXPECT_EQ(child.trace_id, root.trace_id);
+    EXPECT_EQ(child.parent_span_id, root.span_id);
+    EXPECT_NEQ(child.span_id, root.span_id);
+
+    {
+        TraceScope ts(root);
+        EXPECT_EQ(current_trace().span_id, root.span_id);
+        {
+            TraceScope ts2(child);
+            EXPECT_EQ(current_trace().span_id, child.span_id);
+        }
+        EXPECT_EQ(current_trace().span_id, root.span_id);
+    }
+    EXPECT_FALSE(current_trace().traced());
+}
+
+TEST(trace, span_buffer) {
+    SpanBuffer spans(4);
+    EXPECT_EQ(spans.to_json(), "[]");
+
+    for (int i = 1; i <= 6; i++) {
+        Span sp;
+        sp.trace_id = 0xabc;
+        sp.span_id = i;
+        sp.parent_span_id = 0;
+        sp.rpc_id = 0x1234;
+        sp.error_code = 0;
+        sp.start_us = 0;
+        sp.duration_ns = i * 1000;
+        spans.record(sp);
+    }
+
+    // only the latest 4, oldest first
+    vector<Span> latest;
+    spans.snapshot(&latest);
+    EXPECT_EQ(latest.size(), 4u);
+    for (size_t i = 0; i < latest.size(); i++) {
+        EXPECT_EQ(latest[i].span_id, (i64) i + 3);
+    }
+
+    string json = spans.to_json();
+    Log::info("%s", json.c_str());
+    EXPECT_NEQ(json.find("\"trace_id\":\"0000000000000abc\""), string::npos);
+    EXPECT_NEQ(json.find("\"duration_ns\":6000}]"), string::npos);
+    EXPECT_EQ(json.find("\"duration_ns\":2000"), string::npos);
+}
+
+static const i32 RELAY = 0x7e1a7000;
+
+static Span* find_span(vector<Span>& spans, i32 rpc_id) {
+    for (auto& sp: spans) {
+        if (sp.rpc_id == rpc_id) {
+            return &sp;
+        }
+    }
+    return nullptr;
+}
+
+TEST(trace, propagate) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+
+    // calls add() on the same server, from a thread of its own
+    PollMgr* relay_poll = new PollMgr;
+    Client* relay_cl = new Client(relay_poll);
+    BenchmarkProxy* relay_clnt = new BenchmarkProxy(relay_cl);
+    svr->reg(RELAY, [relay_clnt] (Request* req, ServerConnection* sconn) {
+        sconn->run_async([req, sconn, relay_clnt] {
+            TraceScope ts(req->trace);
+            v32 sum;
+            i32 err = relay_clnt->add(1, 2, &sum);
+            sconn->begin_reply(req, err);
+            *sconn << sum;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        });
+    });
+    svr->start(svr_addr);
+    EXPECT_EQ(relay_cl->connect(svr_addr), 0);
+
+    PollMgr* clnt_poll = new PollMgr;
+    Client* cl = new Client(clnt_poll);
+    EXPECT_EQ(cl->connect(svr_addr), 0);
+
+    // untraced calls leave no span
+    Future* fu = cl->begin_request(RELAY);
+    cl->end_request();
+    EXPECT_EQ(fu->get_error_code(), 0);
+    fu->release();
+    vector<Span> spans;
+    svr->spans()->snapshot(&spans);
+    EXPECT_EQ(spans.size(), 0u);
+
+    // not sampled, still propagated but not recorded
+    {
+        TraceScope ts(TraceContext::start(0.0));
+        fu = cl->begin_request(RELAY);
+        cl->end_request();
+        EXPECT_EQ(fu->get_error_code(), 0);
+        fu->release();
+    }
+    svr->spans()->snapshot(&spans);
+    EXPECT_EQ(spans.size(), 0u);
+
+    TraceContext root = TraceContext::start();
+    {
+        TraceScope ts(root);
+        fu = cl->begin_request(RELAY);
+        cl->end_request();
+        EXPECT_EQ(fu->get_error_code(), 0);
+        v32 sum;
+        fu->get_reply() >> sum;
+        EXPECT_EQ(sum.get(), 3);
+        fu->release();
+    }
+
+    svr->spans()->snapshot(&spans);
+    EXPECT_EQ(spans.size(), 2u);
+    Span* relay_span = find_span(spans, RELAY);
+    Span* add_span = find_span(spans, BenchmarkService::ADD);
+    EXPECT_TRUE(relay_span != nullptr);
+    EXPECT_TRUE(add_span != nullptr);
+    if (relay_span != nullptr && add_span != nullptr) {
+        EXPECT_EQ(relay_span->trace_id, root.trace_id);
+        EXPECT_EQ(relay_span->parent_span_id, root.span_id);
+        EXPECT_EQ(add_span->trace_id, root.trace_id);
+        EXPECT_EQ(add_span->parent_span_id, relay_span->span_id);
+        EXPECT_GE(relay_span->duration_ns, add_span->duration_ns);
+    }
+
+    // exported through the built-in service
+    IntrospectProxy introspect(cl);
+    string json;
+    EXPECT_EQ(introspect.traces(&json), 0);
+    Log::info("%s", json.c_str());
+    char trace_id[32];
+    snprintf(trace_id, sizeof(trace_id), "%016lx", (uint64_t) root.trace_id);
+    EXPECT_NEQ(json.find(trace_id), string::npos);
+
+    delete relay_clnt;
+    relay_cl->close_and_release();
+    cl->close_and_release();
+    delete svr;
+    relay_poll->release();
+    clnt_poll->release();
+}
@@ -63,3 +63,257 @@ TEST(udp, simple_rpc) {
     poll->release();
     delete svr;
 }
+
+class CountingLossyService: public BenchmarkService {
+public:
+    Counter received;
+
+    void lossy_nop(const i32& dummy, const i32& dummy2) {
+        received.next();
+    }
+};
+
+static i64 wait_received(CountingLossyService* svc, i64 n) {
+    for (int i = 0; i < 200 && svc->received.peek_next() < n; i++) {
+        usleep(10 * 1000);
+    }
+    return svc->received.peek_next();
+}
+
+TEST(udp, batched_rpc) {
+    Server* svr = new Server;
+    CountingLossyService svc;
+    svr->reg(&svc);
+    svr->enable_udp();
+    svr->start("127.0.0.1:8848");
+    PollMgr* poll = new PollMgr;
+    Client* clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    BenchmarkProxy proxy(clnt);
+
+    // one sendmmsg() per 64 datagrams, several datagrams per recvmmsg()
+    const int n_batched = 256;
+    clnt->begin_udp_batch();
+    for (int i = 0; i < n_batched; i++) {
+        EXPECT_EQ(proxy.lossy_nop(1987, 1989), 0);
+    }
+    EXPECT_EQ(clnt->end_udp_batch(), 0);
+    i64 n_received = wait_received(&svc, n_batched);
+    Log::info("batched: sent %d, received %ld", n_batched, n_received);
+    EXPECT_GT(n_received, 0);
+    EXPECT_LE(n_received, n_batched);
+
+    // too large for a datagram, rejected without holding up the rest of the batch
+    svc.received.reset();
+    clnt->begin_udp_batch();
+    proxy.lossy_nop(1, 2);
+    clnt->begin_udp_request(BenchmarkService::LOSSY_NOP);
+    clnt->udp_request() << string(UdpBuffer::max_udp_packet_size_s, 'x');
+    EXPECT_EQ(clnt->end_udp_request(), E2BIG);
+    proxy.lossy_nop(3, 4);
+    EXPECT_EQ(clnt->end_udp_batch(), 0);
+    EXPECT_EQ(wait_received(&svc, 2), 2);
+
+    clnt->close_and_release();
+    poll->release();
+    delete svr;
+}
+
+TEST(udp, batched_benchmark) {
+    Server* svr = new Server;
+    CountingLossyService svc;
+    svr->reg(&svc);
+    svr->enable_udp();
+    svr->start("127.0.0.1:8848");
+    PollMgr* poll = new PollMgr;
+    Client* clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    BenchmarkProxy proxy(clnt);
+
+    const int n_rpc = 200 * 1000;
+    for (int batch: {1, (int) Client::max_udp_batch_s}) {
+        Timer timer;
+        timer.start();
+        for (int i = 0; i < n_rpc; i += batch) {
+            clnt->begin_udp_batch();
+            for (int j = 0; j < batch; j++) {
+                proxy.lossy_nop(1987, 1989);
+            }
+            clnt->end_udp_batch();
+        }
+        timer.stop();
+        char action[64];
+        snprintf(action, sizeof(action), "client UDP RPCs, %d per batch", batch);
+        report_qps(action, n_rpc, timer.elapsed());
+        usleep(100 * 1000);
+        Log::info("server received %ld", svc.received.peek_next());
+        svc.received.reset();
+    }
+
+    clnt->close_and_release();
+    poll->release();
+    delete svr;
+}
+
+TEST(udp, call_with_reply) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:8848");
+    PollMgr* poll = new PollMgr;
+    Client* clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    BenchmarkProxy proxy(clnt);
+
+    string echoed;
+    EXPECT_EQ(proxy.udp_echo("hello", &echoed), 0);
+    EXPECT_EQ(echoed, "hello");
+
+    // too large for a datagram, goes over tcp
+    string large(UdpBuffer::max_udp_packet_size_s, 'x');
+    EXPECT_FALSE(Client::udp_call_fits(marshal_size(large)));
+    EXPECT_EQ(proxy.udp_echo(large, &echoed), 0);
+    EXPECT_EQ(echoed, large);
+
+    const int n_calls = 10000;
+    Timer timer;
+    timer.start();
+    for (int i = 0; i < n_calls; i++) {
+        proxy.udp_echo("hello", &echoed);
+    }
+    timer.stop();
+    report_qps("sync UDP calls", n_calls, timer.elapsed());
+
+    clnt->close_and_release();
+    poll->release();
+    delete svr;
+}
+
+struct udp_sender {
+    BenchmarkProxy* proxy;
+    int n_calls;
+    int n_mismatch;
+};
+
+static void* udp_send_from_thread(void* arg) {
+    udp_sender* s = (udp_sender *) arg;
+    char msg[32];
+    string echoed;
+    for (int i = 0; i < s->n_calls; i++) {
+        snprintf(msg, sizeof(msg), "%p-%d", arg, i);
+        s->proxy->lossy_nop(i, i + 1);
+        if (s->proxy->udp_echo(msg, &echoed) != 0 || echoed != msg) {
+            s->n_mismatch++;
+        }
+    }
+    return nullptr;
+}
+
+// returns the number of wrong replies
+static int udp_send_from_threads(BenchmarkProxy* proxy, int n_threads, int n_calls, double* elapsed) {
+    vector<pthread_t> th(n_threads);
+    vector<udp_sender> senders(n_threads);
+    Timer timer;
+    timer.start();
+    for (int i = 0; i < n_threads; i++) {
+        senders[i].proxy = proxy;
+        senders[i].n_calls = n_calls;
+        senders[i].n_mismatch = 0;
+        Pthread_create(&th[i], nullptr, udp_send_from_thread, &senders[i]);
+    }
+    int n_mismatch = 0;
+    for (int i = 0; i < n_threads; i++) {
+        Pthread_join(th[i], nullptr);
+        n_mismatch += senders[i].n_mismatch;
+    }
+    timer.stop();
+    *elapsed = timer.elapsed();
+    return n_mismatch;
+}
+
+TEST(udp, threads_share_client) {
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    svr->start("127.0.0.1:8848");
+    PollMgr* poll = new PollMgr;
+    Client* clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    BenchmarkProxy proxy(clnt);
+
+    // each thread encodes into a buffer of its own, datagrams never mix
+    const int n_calls = 5000;
+    double elapsed;
+    EXPECT_EQ(udp_send_from_threads(&proxy, 1, n_calls, &elapsed), 0);
+    report_qps("UDP calls, 1 thread", n_calls, elapsed);
+    const int n_threads = 4;
+    EXPECT_EQ(udp_send_from_threads(&proxy, n_threads, n_calls, &elapsed), 0);
+    report_qps("UDP calls, 4 threads", n_threads * n_calls, elapsed);
+
+    clnt->close_and_release();
+    poll->release();
+    delete svr;
+}
+
+static const i32 SLOW_ID = 0x7e1a7001;
+
+TEST(udp, retransmit) {
+    Server* svr = new Server;
+    svr->enable_udp();
+    Counter n_handled;
+    // replies after a few retransmissions went out
+    svr->reg(SLOW_ID, [&n_handled] (Request* req, ServerConnection* sconn) {
+        n_handled.next();
+        sconn->run_async([req, sconn] {
+            usleep(50 * 1000);
+            sconn->begin_reply(req);
+            *sconn << req->xid;
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        });
+    });
+    svr->start("127.0.0.1:8848");
+    PollMgr* poll = new PollMgr;
+    Client* clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    clnt->set_udp_retransmit(0.01, 5);
+
+    Future* fu = clnt->begin_udp_call(SLOW_ID);
+    clnt->end_udp_call();
+    EXPECT_EQ(fu->get_error_code(), 0);
+    i64 xid;
+    fu->get_reply() >> xid;
+    fu->release();
+    // duplicates were not handled again
+    EXPECT_EQ(n_handled.peek_next(), 1);
+
+    // no handler
+    fu = clnt->begin_udp_call(0x7e1a7002);
+    clnt->end_udp_call();
+    EXPECT_EQ(fu->get_error_code(), ENOENT);
+    fu->release();
+
+    clnt->close_and_release();
+    delete svr;
+
+    // nobody answers, the server does not take udp
+    svr = new Server;
+    svr->start("127.0.0.1:8848");
+    clnt = new Client(poll);
+    clnt->connect("127.0.0.1:8848");
+    clnt->set_udp_retransmit(0.01, 3);
+    Timer timer;
+    timer.start();
+    fu = clnt->begin_udp_call(SLOW_ID);
+    clnt->end_udp_call();
+    EXPECT_EQ(fu->get_error_code(), ETIMEDOUT);
+    fu->release();
+    timer.stop();
+    Log::info("timed out after %.3lf sec", timer.elapsed());
+    EXPECT_GE(timer.elapsed(), 0.06);
+
+    clnt->close_and_release();
+    poll->release();
+    delete svr;
+}
@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+static const i32 FSTAT = 0x7e1a7004;
+
+static string test_addr() {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "unix:/tmp/simplerpc-test-%d.sock", getpid());
+    return buf;
+}
+
+// replies the size of the file passed, and a pipe with that many bytes in it
+static void reg_fstat(Server* svr) {
+    svr->reg(FSTAT, [] (Request* req, ServerConnection* sconn) {
+        FileDesc fd;
+        req->m >> fd;
+        i64 size = -1;
+        struct stat st;
+        if (fd.get() != -1 && fstat(fd.get(), &st) == 0) {
+            size = st.st_size;
+        }
+        int p[2];
+        verify(pipe(p) == 0);
+        string data(std::max<i64>(size, 0), 'x');
+        verify(write(p[1], data.data(), data.size()) == (ssize_t) data.size());
+        close(p[1]);
+        FileDesc rd(p[0]);
+
+        sconn->begin_reply(req);
+        *sconn << size << rd;
+        sconn->end_reply();
+        delete req;
+        sconn->release();
+    });
+}
+
+static i64 call_fstat(Client* cl, int fd, FileDesc* reply_fd) {
+    FileDesc arg(dup(fd));
+    Future* fu = cl->begin_request(FSTAT);
+    *cl << arg;
+    cl->end_request();
+    verify(fu != nullptr && fu->get_error_code() == 0);
+    i64 size;
+    fu->get_reply() >> size >> *reply_fd;
+    fu->release();
+    return size;
+}
+
+TEST(unix, calls) {
+    string addr = test_addr();
+    Server* svr = new Server;
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    EXPECT_EQ(svr->start(addr.c_str()), 0);
+
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect(addr.c_str()), 0);
+    BenchmarkProxy proxy(cl);
+    v32 sum;
+    EXPECT_EQ(proxy.add(1, 2, &sum), 0);
+    EXPECT_EQ(sum.get(), 3);
+    string big(4 * 1024 * 1024, 'x');
+    EXPECT_EQ(proxy.nop(big), 0);
+    cl->close_and_release();
+
+    ClientPool* pool = new ClientPool(poll);
+    BenchmarkProxy pooled(pool->get_client(addr));
+    EXPECT_EQ(pooled.add(3, 4, &sum), 0);
+    EXPECT_EQ(sum.get(), 7);
+    delete pool;
+
+    // the socket file goes away with the server
+    delete svr;
+    struct stat st;
+    EXPECT_NEQ(stat(addr.c_str() + strlen("unix:"), &st), 0);
+
+    poll->release();
+}
+
+TEST(unix, stale_socket) {
+    string addr = test_addr();
+    const char* path = addr.c_str() + strlen("unix:");
+
+    // a live server keeps its socket
+    Server* svr = new Server;
+    EXPECT_EQ(svr->start(addr.c_str()), 0);
+    Server* svr2 = new Server;
+    EXPECT_EQ(svr2->start(addr.c_str()), EADDRINUSE);
+    delete svr2;
+    delete svr;
+
+    // a socket nobody listens on is taken over
+    int sock = unix_listen(path);
+    EXPECT_NEQ(sock, -1);
+    close(sock);
+    struct stat st;
+    EXPECT_EQ(stat(path, &st), 0);
+    svr = new Server;
+    EXPECT_EQ(svr->start(addr.c_str()), 0);
+    delete svr;
+}
+
+TEST(unix, pass_fd) {
+    string addr = test_addr();
+    Server* svr = new Server;
+    reg_fstat(svr);
+    EXPECT_EQ(svr->start(addr.c_str()), 0);
+
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect(addr.c_str()), 0);
+
+    char path[] = "/tmp/simplerpc-test-XXXXXX";
+    int fd = mkstemp(path);
+    EXPECT_NEQ(fd, -1);
+    unlink(path);
+    EXPECT_EQ(ftruncate(fd, 1987), 0);
+
+    for (int i = 0; i < 100; i++) {
+        FileDesc rd;
+        EXPECT_EQ(call_fstat(cl, fd, &rd), 1987);
+        EXPECT_NEQ(rd.get(), -1);
+        char buf[4096];
+        ssize_t n = 0, r;
+        while ((r = read(rd.get(), buf, sizeof(buf))) > 0) {
+            n += r;
+        }
+        EXPECT_EQ(n, 1987);
+    }
+    cl->close_and_release();
+    delete svr;
+
+    // fds are dropped on tcp, the peer sees -1
+    svr = new Server;
+    reg_fstat(svr);
+    EXPECT_EQ(svr->start("127.0.0.1:8849"), 0);
+    cl = new Client(poll);
+    EXPECT_EQ(cl->connect("127.0.0.1:8849"), 0);
+    FileDesc rd;
+    EXPECT_EQ(call_fstat(cl, fd, &rd), -1);
+    EXPECT_EQ(rd.get(), -1);
+    cl->close_and_release();
+    delete svr;
+
+    close(fd);
+    poll->release();
+}
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "base/all.h"
+#include "rpc/client.h"
+#include "rpc/server.h"
+#include "benchmark_service.h"
+
+using namespace base;
+using namespace std;
+using namespace rpc;
+using namespace benchmark;
+
+TEST(watermark, server_stops_reading) {
+    Server* svr = new Server;
+    const size_t high = 64 * 1024;
+    svr->set_output_watermarks(high, high / 4);
+    BenchmarkService bench_svc;
+    svr->reg(&bench_svc);
+    const char* svr_addr = "127.0.0.1:1987";
+    svr->start(svr_addr);
+
+    int sock = tcp_connect(svr_addr);
+    EXPECT_NEQ(sock, -1);
+    int buf_size = 16 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    set_nonblocking(sock, true);
+
+    // a batch of identical fast_add requests
+    Marshal m;
+    const int batch = 4096;
+    for (int i = 0; i < batch; i++) {
+        v64 xid = 1;
+        i32 rpc_id = BenchmarkService::FAST_ADD;
+        v32 a = 1, b = 2;
+        i32 size = marshal_size_of(xid, rpc_id, a, b);
+        m << size << xid << rpc_id << a << b;
+    }
+    string reqs(m.content_size(), '\0');
+    m.read(&reqs[0], reqs.size());
+    const size_t req_size = reqs.size() / batch;
+
+    // keep pipelining without reading any reply, till the server stops taking requests
+    size_t n_sent = 0;
+    Timer t;
+    t.start();
+    for (;;) {
+        size_t off = n_sent % reqs.size();
+        ssize_t r = ::send(sock, reqs.data() + off, reqs.size() - off, 0);
+        if (r > 0) {
+            n_sent += r;
+            t.reset();
+            t.start();
+        } else {
+            EXPECT_TRUE(errno == EAGAIN || errno == EWOULDBLOCK);
+            if (t.elapsed() > 0.5) {
+                break;
+            }
+            usleep(10 * 1000);
+        }
+        // way more than socket buffers can hold, server is not holding back
+        EXPECT_LT(n_sent, 256u * 1024 * 1024);
+        if (n_sent >= 256u * 1024 * 1024) {
+            break;
+        }
+    }
+    size_t buffered = svr->output_buffer_size();
+    Log::info("server stopped reading after %ld requests, %ld bytes of replies buffered", n_sent / req_size, buffered);
+    EXPECT_GT(buffered, high);
+    EXPECT_LT(buffered, 16u * 1024 * 1024);
+
+    // finish sending whole requests, and read all replies
+    size_t n_to_send = (n_sent + req_size - 1) / req_size * req_size;
+    size_t n_replies = 0;
+    Marshal in;
+    t.reset();
+    t.start();
+    while ((n_sent < n_to_send || n_replies < n_to_send / req_size) && t.elapsed() < 10.0) {
+        if (n_sent < n_to_send) {
+            size_t off = n_sent % reqs.size();
+            ssize_t r = ::send(sock, reqs.data() + off, n_to_send - n_sent, 0);
+            if (r > 0) {
+                n_sent += r;
+            }
+        }
+        in.read_from_fd(sock);
+        i32 packet_size;
+        while (in.peek(&packet_size, sizeof(i32)) == sizeof(i32) && in.content_size() >= packet_size + sizeof(i32)) {
+            in.discard(sizeof(i32) + packet_size);
+            n_replies++;
+        }
+    }
+    EXPECT_EQ(n_replies, n_to_send / req_size);
+    EXPECT_EQ(svr->output_buffer_size(), 0u);
+
+    ::close(sock);
+    delete svr;
+}
+
+struct request_sender {
+    Client* cl;
+    int n_requests;
+    string payload;
+    Counter n_started;
+};
+
+static void* send_requests(void* arg) {
+    request_sender* sender = (request_sender *) arg;
+    for (int i = 0; i < sender->n_requests; i++) {
+        Future* fu = sender->cl->begin_request(BenchmarkService::NOP);
+        *sender->cl << sender->payload;
+        sender->cl->end_request();
+        Future::safe_release(fu);
+        sender->n_started.next();
+    }
+    return nullptr;
+}
+
+TEST(watermark, client_blocks) {
+    // a server that does not read, till accept() is called
+    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    int buf_size = 16 * 1024;
+    setsockopt(listen_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(1987);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    EXPECT_EQ(::bind(listen_sock, (struct sockaddr *) &sin, sizeof(sin)), 0);
+    EXPECT_EQ(listen(listen_sock, 1), 0);
+
+    PollMgr* poll = new PollMgr;
+    Client* cl = new Client(poll);
+    EXPECT_EQ(cl->connect("127.0.0.1:1987"), 0);
+    setsockopt(cl->fd(), SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    const size_t high = 256 * 1024;
+    cl->set_output_watermarks(high, high / 4);
+
+    request_sender sender;
+    sender.cl = cl;
+    sender.n_requests = 256;
+    sender.payload = string(64 * 1024, 'x');
+    pthread_t th;
+    Pthread_create(&th, nullptr, send_requests, &sender);
+
+    // wait till begin_request() gets stuck
+    i64 last = -1;
+    while (sender.n_started.peek_next() != last) {
+        last = sender.n_started.peek_next();
+        usleep(200 * 1000);
+    }
+    size_t buffered = cl->output_buffer_size();
+    Log::info("client blocked after %ld requests, %ld bytes buffered", last, buffered);
+    EXPECT_LT(last, sender.n_requests);
+    // blocked till drained to low watermark
+    EXPECT_GT(buffered, high / 4);
+    EXPECT_LT(buffered, high + 2 * sender.payload.size());
+
+    // start reading, all requests go through
+    int sock = accept(listen_sock, nullptr, nullptr);
+    EXPECT_NEQ(sock, -1);
+    size_t n_read = 0;
+    char buf[64 * 1024];
+    while (n_read < sender.n_requests * sender.payload.size()) {
+        ssize_t r = ::read(sock, buf, sizeof(buf));
+        if (r <= 0) {
+            break;
+        }
+        n_read += r;
+    }
+    Pthread_join(th, nullptr);
+    EXPECT_EQ(sender.n_started.peek_next(), sender.n_requests);
+    EXPECT_GE(n_read, sender.n_requests * sender.payload.size());
+
+    cl->close_and_release();
+    poll->release();
+    ::close(sock);
+    ::close(listen_sock);
+}
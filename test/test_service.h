@@ -11,6 +11,10 @@ namespace test {
 struct empty_struct {
 };
 
+inline size_t marshal_size(const empty_struct& o) {
+    return rpc::marshal_size_of();
+}
+
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const empty_struct& o) {
     return m;
 }
@@ -25,6 +29,10 @@ struct Person {
     std::string email;
 };
 
+inline size_t marshal_size(const Person& o) {
+    return rpc::marshal_size_of(o.id, o.name, o.email);
+}
+
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const Person& o) {
     m << o.id;
     m << o.name;
@@ -39,12 +47,56 @@ inline rpc::Marshal& operator >>(rpc::Marshal& m, Person& o) {
     return m;
 }
 
+// versioned, new fields may only be appended, see rpc::marshal_versioned()
+struct PersonV1 {
+    rpc::i32 id; // field 1
+    std::string name; // field 2
+    std::string email; // field 3
+};
+
+inline size_t marshal_size(const PersonV1& o) {
+    return rpc::marshal_size_versioned(o.id, o.name, o.email);
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const PersonV1& o) {
+    return rpc::marshal_versioned(m, o.id, o.name, o.email);
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, PersonV1& o) {
+    return rpc::unmarshal_versioned(m, o.id, o.name, o.email);
+}
+
+// versioned, new fields may only be appended, see rpc::marshal_versioned()
+struct PersonV2 {
+    rpc::i32 id; // field 1
+    std::string name; // field 2
+    std::string email; // field 3
+    rpc::v64 phone; // field 4
+    std::vector<std::string> tags; // field 5
+};
+
+inline size_t marshal_size(const PersonV2& o) {
+    return rpc::marshal_size_versioned(o.id, o.name, o.email, o.phone, o.tags);
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const PersonV2& o) {
+    return rpc::marshal_versioned(m, o.id, o.name, o.email, o.phone, o.tags);
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, PersonV2& o) {
+    return rpc::unmarshal_versioned(m, o.id, o.name, o.email, o.phone, o.tags);
+}
+
 struct complex_struct {
     std::map<std::pair<std::string, std::string>, std::vector<std::vector<std::pair<std::string, std::string>>>> d;
     std::set<std::string> s;
     empty_struct e;
 };
 
+inline size_t marshal_size(const complex_struct& o) {
+    return rpc::marshal_size_of(o.d, o.s, o.e);
+}
+
 inline rpc::Marshal& operator <<(rpc::Marshal& m, const complex_struct& o) {
     m << o.d;
     m << o.s;
@@ -70,7 +122,7 @@ public:
         return ret;
     }
     // these RPC handler functions need to be implemented by user
-    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
 private:
 };
 
@@ -84,7 +136,7 @@ public:
 class MathService: public rpc::Service {
 public:
     enum {
-        GCD = 0x29b25705,
+        GCD = 0x562a9536,
     };
     int __reg_to__(rpc::Server* svr) {
         int ret = 0;
@@ -97,24 +149,32 @@ public:
         return ret;
     }
     // these RPC handler functions need to be implemented by user
-    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job
+    // for 'raw' handlers, remember to reply req, delete req, and sconn->release(); use sconn->run_async for heavy job, and reply its error code if it fails
     virtual void gcd(const rpc::i64& a, const rpc::i64&, rpc::i64* g);
 private:
     void __gcd__wrapper__(rpc::Request* req, rpc::ServerConnection* sconn) {
         auto f = [=] {
+            req->start_time = base::monotonic_time();
+            rpc::TraceScope __trace__(req->trace);
             rpc::i64 in_0;
             req->m >> in_0;
             rpc::i64 in_1;
             req->m >> in_1;
             rpc::i64 out_0;
             this->gcd(in_0, in_1, &out_0);
-            sconn->begin_reply(req);
+            sconn->begin_reply(req, 0, rpc::marshal_size_of(out_0));
             *sconn << out_0;
             sconn->end_reply();
             delete req;
             sconn->release();
         };
-        sconn->run_async(f);
+        int __ret__ = sconn->run_async(f, -1, req->priority);
+        if (__ret__ != 0) {
+            sconn->begin_reply(req, __ret__);
+            sconn->end_reply();
+            delete req;
+            sconn->release();
+        }
     }
 };
 
@@ -124,7 +184,7 @@ protected:
 public:
     MathProxy(rpc::Client* cl): __cl__(cl) { }
     rpc::Future* async_gcd(const rpc::i64& a, const rpc::i64& in_1, const rpc::FutureAttr& __fu_attr__ = rpc::FutureAttr()) {
-        rpc::Future* __fu__ = __cl__->begin_request(MathService::GCD, __fu_attr__);
+        rpc::Future* __fu__ = __cl__->begin_request(MathService::GCD, __fu_attr__, rpc::marshal_size_of(a, in_1));
         if (__fu__ != nullptr) {
             *__cl__ << a;
             *__cl__ << in_1;
@@ -6,6 +6,10 @@ empty_struct = Marshal.reg_type('empty_struct', [])
 
 Person = Marshal.reg_type('Person', [('id', 'rpc::i32'), ('name', 'std::string'), ('email', 'std::string')])
 
+PersonV1 = Marshal.reg_type('PersonV1', [('id', 'rpc::i32'), ('name', 'std::string'), ('email', 'std::string')], versioned=True)
+
+PersonV2 = Marshal.reg_type('PersonV2', [('id', 'rpc::i32'), ('name', 'std::string'), ('email', 'std::string'), ('phone', 'rpc::v64'), ('tags', 'std::vector<std::string>')], versioned=True)
+
 complex_struct = Marshal.reg_type('complex_struct', [('d', 'std::map<std::pair<std::string, std::string>, std::vector<std::vector<std::pair<std::string, std::string>>>>'), ('s', 'std::set<std::string>'), ('e', 'empty_struct')])
 
 class EmptyService(object):
@@ -29,7 +33,7 @@ class EmptyProxy(object):
         self.__clnt__ = clnt
 
 class MathService(object):
-    GCD = 0x29b25705
+    GCD = 0x562a9536
 
     __input_type_info__ = {
         'gcd': ['rpc::i64','rpc::i64'],